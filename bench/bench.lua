@@ -0,0 +1,147 @@
+-- Lua level benchmarks for pb.encode()/pb.decode().
+--
+-- usage: cd bench && lua bench.lua [result.json [pattern]]
+--
+-- Results are printed to stderr and saved as JSON (default
+-- "bench_lua.json"), compare two runs with compare.lua.  BENCH_TIME sets
+-- the minimal seconds spent on each case.
+package.path = "../?.lua;./?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+local bench = require "benchlib"
+
+local output = arg[1] or "bench_lua.json"
+local pattern = arg[2]
+
+pb.loadfile "../test/addressbook.pb"
+pb.loadfile "bench.pb"
+
+------------------------------------------------------------
+
+local function addressbook(n)
+   local book = { person = {} }
+   for i = 1, n do
+      book.person[i] = {
+         name = "Person Name "..i,
+         id = i * 7919,
+         email = "person"..i.."@example.com",
+         phone = {
+            { number = "+1-555-"..(1000000+i), type = "MOBILE" },
+            { number = "+1-555-"..(2000000+i), type = "WORK" },
+         },
+      }
+   end
+   return book
+end
+
+local function wide()
+   return {
+      i32_1 = 1, i32_2 = -123456, i64_1 = 1234567890123, i64_2 = -1,
+      u32_1 = 42, u32_2 = 4000000000, u64_1 = 1099511627776,
+      s32_1 = -64, s64_1 = -1234567890123,
+      flag_1 = true, flag_2 = false, flag_3 = true,
+      d_1 = 3.141592653589793, d_2 = -2.5e-300, d_3 = 1e100,
+      f_1 = 0.5, x32_1 = 0xDEADBEEF, x64_1 = 0x7FFFFFFFFFFF,
+      sx32_1 = -2, sx64_1 = -3,
+      str_1 = "short", str_2 = ("medium string "):rep(4),
+      str_3 = ("x"):rep(256), str_4 = "", str_5 = "utf8 \226\156\147",
+      blob_1 = ("\0\1\2\3\255"):rep(20),
+      kind_1 = "KIND_SMALL", kind_2 = "KIND_LARGE",
+      i32_3 = 300, i32_4 = 16384, i64_3 = 1, u32_3 = 127,
+   }
+end
+
+local function deep(depth)
+   local root = { level = 1, name = "level 1" }
+   local cur = root
+   for i = 2, depth do
+      cur.child = { level = i, name = "level "..i }
+      cur = cur.child
+   end
+   return root
+end
+
+local function packed(n)
+   local t = { ints = {}, zigzag = {}, reals = {}, fixed = {},
+               flags = {}, bigs = {} }
+   local seed = 12345
+   local function rand(m)
+      seed = (seed * 1103515245 + 12345) % 2147483648
+      return seed % m
+   end
+   for i = 1, n do
+      t.ints[i] = rand(1000)
+      t.zigzag[i] = rand(100000) - 50000
+      t.reals[i] = rand(1000000) / 1000
+      t.fixed[i] = rand(2147483647)
+      t.flags[i] = rand(2) == 1
+      t.bigs[i] = rand(2147483647) * 65536
+   end
+   return t
+end
+
+local function config(n)
+   local t = { labels = {}, nodes = {} }
+   for i = 1, n do
+      t.labels["label."..i] = "value "..i
+      t.nodes["node."..i] = { level = i, name = "node "..i }
+   end
+   return t
+end
+
+------------------------------------------------------------
+
+local cases = {}
+
+local function case(name, typename, value)
+   cases[#cases+1] = { name = name, type = typename, value = value }
+end
+
+case("addressbook.1", "tutorial.AddressBook", addressbook(1))
+case("addressbook.100", "tutorial.AddressBook", addressbook(100))
+case("descriptor", "google.protobuf.FileDescriptorSet",
+     pb.decode(assert(pbio.read "../test/descriptor.pb"),
+               "google.protobuf.FileDescriptorSet"))
+case("synthetic.wide", "bench.Wide", wide())
+case("synthetic.deep32", "bench.Deep", deep(32))
+case("synthetic.packed1k", "bench.Packed", packed(1000))
+case("synthetic.map1k", "bench.Config", config(1000))
+
+local function nop() end
+local sax = { field = nop }
+local results = {}
+for _, c in ipairs(cases) do
+   local data = pb.encode(c.value, c.type)
+   local ptype = pb.type(c.type)
+   if not pattern or c.name:match(pattern) then
+      results[#results+1] = bench.measure(c.name..".encode", #data,
+         function() pb.encode(c.value, ptype) end)
+      results[#results+1] = bench.measure(c.name..".decode", #data,
+         function() pb.decode(data, ptype) end)
+      local into
+      results[#results+1] = bench.measure(c.name..".decode_into", #data,
+         function() into = pb.decode_into(into, data, ptype) end)
+      results[#results+1] = bench.measure(c.name..".parse", #data,
+         function() pb.parse(data, ptype, sax) end)
+      local json = pb.tojson(data, ptype)
+      results[#results+1] = bench.measure(c.name..".tojson", #data,
+         function() pb.tojson(data, ptype) end)
+      results[#results+1] = bench.measure(c.name..".fromjson", #json,
+         function() pb.fromjson(json, ptype) end)
+      results[#results+1] = bench.measure(c.name..".decode_arena", #data,
+         function() pb.decode_arena(data, ptype) end)
+      results[#results+1] = bench.measure(c.name..".index", #data,
+         function() pb.index(data, ptype) end)
+      results[#results+1] = bench.measure(c.name..".decode_task", #data,
+         function() pb.decode_task(data, ptype):finish(nop) end)
+      results[#results+1] = bench.measure(c.name..".encode_task", #data,
+         function() pb.encode_task(c.value, ptype):finish(nop) end)
+   end
+end
+
+bench.writefile(output, bench.tojson {
+   suite = "lua",
+   lua = _VERSION,
+   results = results,
+}.."\n")
@@ -0,0 +1,283 @@
+/* micro benchmarks for the wire format primitives in pb.c.
+ *
+ * usage: bench_wire [result.json]
+ *
+ * It includes pb.c directly to reach its static functions, results are
+ * printed to stderr and saved as JSON (default "bench_wire.json") in
+ * the same format as bench.lua, so compare.lua works on both. */
+#define _POSIX_C_SOURCE 199309L
+#include "../pb.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NVALUES  4096
+#define MIN_TIME 0.5
+
+typedef struct Result {
+    const char *name;
+    double ns_per_op;
+    double mb_per_s;
+    double gc_bytes_per_op;
+    double bytes_per_op;
+    long iterations;
+} Result;
+
+static Result results[64];
+static int nresults = 0;
+static volatile uint64_t sink;
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    uint64_t x = rng_state;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return rng_state = x;
+}
+
+/* value distributions */
+
+static uint64_t dist_small(void) { return rng() & 0x7F; }
+static uint64_t dist_large(void) { return rng(); }
+
+static uint64_t dist_mixed(void) {
+    /* roughly what real messages carry: mostly small tags, lengths and
+     * counters, some ids and hashes, a few negative int32/int64 */
+    unsigned r = (unsigned)(rng() % 100);
+    if (r < 50) return rng() & 0x7F;
+    if (r < 80) return rng() & 0x3FFF;
+    if (r < 95) return rng() & 0xFFFFFFFF;
+    return (uint64_t)-(int64_t)(rng() & 0xFFFF);
+}
+
+typedef struct Dist {
+    const char *name;
+    uint64_t (*gen)(void);
+} Dist;
+
+static const Dist dists[] = {
+    { "small", dist_small },
+    { "mixed", dist_mixed },
+    { "large", dist_large },
+};
+
+/* benchmark driver */
+
+typedef struct Case {
+    lua_State *L;
+    pb_Buffer *buf;
+    uint64_t values[NVALUES];
+    const char *data; /* pre-encoded values */
+    size_t len;
+    size_t target; /* prepbuffer target size */
+} Case;
+
+typedef size_t Bench(Case *c); /* returns bytes processed */
+
+static void run(const char *name, Case *c, Bench *f, long ops_per_call) {
+    Result *r = &results[nresults++];
+    double start, elapsed = 0.0;
+    long i, n = 1;
+    size_t bytes = f(c); /* warm up */
+    int kb, b;
+    for (;;) {
+        lua_gc(c->L, LUA_GCCOLLECT, 0);
+        start = now();
+        for (i = 0; i < n; ++i) f(c);
+        elapsed = now() - start;
+        if (elapsed >= MIN_TIME) break;
+        n = elapsed <= 0.0 ? n * 10 : (long)(n * MIN_TIME * 1.2 / elapsed) + 1;
+    }
+    lua_gc(c->L, LUA_GCCOLLECT, 0);
+    lua_gc(c->L, LUA_GCSTOP, 0);
+    kb = lua_gc(c->L, LUA_GCCOUNT, 0);
+    b = lua_gc(c->L, LUA_GCCOUNTB, 0);
+    for (i = 0; i < 100; ++i) f(c);
+    r->gc_bytes_per_op = ((lua_gc(c->L, LUA_GCCOUNT, 0) - kb) * 1024.0
+            + (lua_gc(c->L, LUA_GCCOUNTB, 0) - b)) / (100.0 * ops_per_call);
+    lua_gc(c->L, LUA_GCRESTART, 0);
+    r->name = name;
+    r->iterations = n * ops_per_call;
+    r->bytes_per_op = (double)bytes / ops_per_call;
+    r->ns_per_op = elapsed * 1e9 / ((double)n * ops_per_call);
+    r->mb_per_s = (double)bytes * n / elapsed / 1e6;
+    fprintf(stderr, "%-36s %12.2f ns/op %10.2f MB/s %12.1f B/op\n",
+            name, r->ns_per_op, r->mb_per_s, r->gc_bytes_per_op);
+}
+
+static size_t bench_addvarint(Case *c) {
+    size_t used;
+    int i;
+    c->buf->used = 0;
+    for (i = 0; i < NVALUES; ++i)
+        pb_addvarint(c->buf, c->values[i]);
+    used = c->buf->used;
+    return used;
+}
+
+static size_t bench_readvarint(Case *c) {
+    pb_Decoder dec;
+    uint64_t n, sum = 0;
+    dec.s = dec.p = c->data;
+    dec.len = c->len;
+    dec.end = c->data + c->len;
+    while (pb_readvarint(&dec, &n))
+        sum += n;
+    sink = sum;
+    return c->len;
+}
+
+static size_t bench_addfixed32(Case *c) {
+    int i;
+    c->buf->used = 0;
+    for (i = 0; i < NVALUES; ++i)
+        pb_addfixed32(c->buf, (uint32_t)c->values[i]);
+    return c->buf->used;
+}
+
+static size_t bench_addfixed64(Case *c) {
+    int i;
+    c->buf->used = 0;
+    for (i = 0; i < NVALUES; ++i)
+        pb_addfixed64(c->buf, c->values[i]);
+    return c->buf->used;
+}
+
+static size_t bench_readfixed32(Case *c) {
+    pb_Decoder dec;
+    uint32_t n, sum = 0;
+    dec.s = dec.p = c->data;
+    dec.len = c->len;
+    dec.end = c->data + c->len;
+    while (pb_readfixed32(&dec, &n))
+        sum += n;
+    sink = sum;
+    return c->len;
+}
+
+static size_t bench_readfixed64(Case *c) {
+    pb_Decoder dec;
+    uint64_t n, sum = 0;
+    dec.s = dec.p = c->data;
+    dec.len = c->len;
+    dec.end = c->data + c->len;
+    while (pb_readfixed64(&dec, &n))
+        sum += n;
+    sink = sum;
+    return c->len;
+}
+
+static size_t bench_prepbuffer(Case *c) {
+    /* grow a fresh buffer to target size in 64 bytes steps */
+    size_t used;
+    pb_resetbuffer(c->buf);
+    while (pb_bufferlen(c->buf) < c->target) {
+        pb_prepbuffer(c->buf, 64);
+        memset(&c->buf->buf[c->buf->used], 0, 64);
+        c->buf->used += 64;
+    }
+    used = pb_bufferlen(c->buf);
+    return used;
+}
+
+static void encode_values(Case *c, int fixed) {
+    int i;
+    c->buf->used = 0;
+    for (i = 0; i < NVALUES; ++i) {
+        if (fixed == 4)      pb_addfixed32(c->buf, (uint32_t)c->values[i]);
+        else if (fixed == 8) pb_addfixed64(c->buf, c->values[i]);
+        else                 pb_addvarint(c->buf, c->values[i]);
+    }
+    lua_pushlstring(c->L, c->buf->buf, c->buf->used);
+    lua_rawsetp(c->L, LUA_REGISTRYINDEX, c);
+    lua_rawgetp(c->L, LUA_REGISTRYINDEX, c);
+    c->data = lua_tolstring(c->L, -1, &c->len);
+    lua_pop(c->L, 1);
+}
+
+static void write_json(const char *fname) {
+    FILE *fp = fopen(fname, "w");
+    int i;
+    if (fp == NULL) {
+        perror(fname);
+        return;
+    }
+    fprintf(fp, "{\n  \"results\": [");
+    for (i = 0; i < nresults; ++i) {
+        Result *r = &results[i];
+        fprintf(fp, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(fp, "      \"bytes_per_op\": %.6g,\n", r->bytes_per_op);
+        fprintf(fp, "      \"gc_bytes_per_op\": %.6g,\n", r->gc_bytes_per_op);
+        fprintf(fp, "      \"iterations\": %ld,\n", r->iterations);
+        fprintf(fp, "      \"mb_per_s\": %.6g,\n", r->mb_per_s);
+        fprintf(fp, "      \"name\": \"%s\",\n", r->name);
+        fprintf(fp, "      \"ns_per_op\": %.6g\n    }", r->ns_per_op);
+    }
+    fprintf(fp, "\n  ],\n  \"suite\": \"wire\"\n}\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv) {
+    static char names[64][64];
+    static const size_t targets[] = { 4096, 65536, 1048576 };
+    static Case c;
+    const char *output = argc > 1 ? argv[1] : "bench_wire.json";
+    int i, j, nnames = 0;
+
+    c.L = luaL_newstate();
+    c.buf = (pb_Buffer*)lua_newuserdata(c.L, sizeof(pb_Buffer));
+    pb_initbuffer(c.buf, c.L);
+    lua_rawsetp(c.L, LUA_REGISTRYINDEX, &c.buf);
+
+    for (i = 0; i < (int)(sizeof(dists)/sizeof(dists[0])); ++i) {
+        for (j = 0; j < NVALUES; ++j)
+            c.values[j] = dists[i].gen();
+        encode_values(&c, 0);
+        sprintf(names[nnames], "addvarint.%s", dists[i].name);
+        run(names[nnames++], &c, bench_addvarint, NVALUES);
+        sprintf(names[nnames], "readvarint.%s", dists[i].name);
+        run(names[nnames++], &c, bench_readvarint, NVALUES);
+    }
+
+    for (j = 0; j < NVALUES; ++j)
+        c.values[j] = dist_large();
+    run("addfixed32", &c, bench_addfixed32, NVALUES);
+    run("addfixed64", &c, bench_addfixed64, NVALUES);
+    encode_values(&c, 4);
+    run("readfixed32", &c, bench_readfixed32, NVALUES);
+    encode_values(&c, 8);
+    run("readfixed64", &c, bench_readfixed64, NVALUES);
+
+    for (i = 0; i < (int)(sizeof(targets)/sizeof(targets[0])); ++i) {
+        c.target = targets[i];
+        sprintf(names[nnames], "prepbuffer.grow%luk",
+                (unsigned long)(targets[i] / 1024));
+        run(names[nnames++], &c, bench_prepbuffer, 1);
+    }
+    c.buf->segsize = PB_SEGSIZE; /* same sizes as a chunked buffer */
+    for (i = 0; i < (int)(sizeof(targets)/sizeof(targets[0])); ++i) {
+        c.target = targets[i];
+        sprintf(names[nnames], "prepbuffer.chunked%luk",
+                (unsigned long)(targets[i] / 1024));
+        run(names[nnames++], &c, bench_prepbuffer, 1);
+    }
+    c.buf->segsize = 0;
+    pb_resetbuffer(c.buf);
+
+    write_json(output);
+    lua_close(c.L);
+    return 0;
+}
+
+/* cc: flags+='-O3 -I..' output='bench_wire.exe' libs+='-llua53' */
@@ -0,0 +1,175 @@
+-- shared helpers for bench scripts: timing, allocation counting and
+-- a tiny JSON reader/writer for result files.
+local M = {}
+
+local clock = os.clock
+local collectgarbage = collectgarbage
+local floor = math.floor
+
+M.min_time = tonumber(os.getenv "BENCH_TIME") or 0.5
+M.alloc_iters = tonumber(os.getenv "BENCH_ALLOC_ITERS") or 100
+
+-- run f() until at least min_time seconds elapsed, then count the
+-- garbage produced by alloc_iters calls with the collector stopped.
+function M.measure(name, nbytes, f)
+   f() -- warm up
+   local n, elapsed = 1, 0
+   while true do
+      collectgarbage "collect"
+      local start = clock()
+      for _ = 1, n do f() end
+      elapsed = clock() - start
+      if elapsed >= M.min_time then break end
+      if elapsed <= 0 then
+         n = n * 10
+      else
+         n = floor(n * M.min_time * 1.2 / elapsed) + 1
+      end
+   end
+
+   collectgarbage "collect"
+   collectgarbage "stop"
+   local before = collectgarbage "count"
+   for _ = 1, M.alloc_iters do f() end
+   local after = collectgarbage "count"
+   collectgarbage "restart"
+   collectgarbage "collect"
+
+   local r = {
+      name = name,
+      iterations = n,
+      bytes_per_op = nbytes,
+      ns_per_op = elapsed * 1e9 / n,
+      mb_per_s = nbytes * n / elapsed / 1e6,
+      gc_bytes_per_op = (after - before) * 1024 / M.alloc_iters,
+   }
+   io.stderr:write(("%-36s %12.1f ns/op %10.2f MB/s %12.1f B/op\n")
+      :format(name, r.ns_per_op, r.mb_per_s, r.gc_bytes_per_op))
+   return r
+end
+
+------------------------------------------------------------
+
+local function encode_string(s)
+   return '"'..s:gsub('[%c"\\]', function(c)
+      if c == '"' or c == '\\' then return '\\'..c end
+      return ("\\u%04x"):format(c:byte())
+   end)..'"'
+end
+
+local function encode_value(v, out, indent)
+   local tv = type(v)
+   if tv == "table" then
+      local inner = indent.."  "
+      if #v > 0 or next(v) == nil then
+         out[#out+1] = "["
+         for i, e in ipairs(v) do
+            out[#out+1] = (i > 1 and ",\n" or "\n")..inner
+            encode_value(e, out, inner)
+         end
+         out[#out+1] = (#v > 0 and "\n"..indent or "").."]"
+      else
+         local keys = {}
+         for k in pairs(v) do keys[#keys+1] = tostring(k) end
+         table.sort(keys)
+         out[#out+1] = "{"
+         for i, k in ipairs(keys) do
+            out[#out+1] = (i > 1 and ",\n" or "\n")..inner
+               ..encode_string(k)..": "
+            encode_value(v[k], out, inner)
+         end
+         out[#out+1] = "\n"..indent.."}"
+      end
+   elseif tv == "string" then
+      out[#out+1] = encode_string(v)
+   elseif tv == "number" then
+      local int = v == floor(v) and v > -1e15 and v < 1e15
+      out[#out+1] = int and ("%d"):format(v) or ("%.6g"):format(v)
+   else
+      out[#out+1] = tostring(v)
+   end
+end
+
+function M.tojson(v)
+   local out = {}
+   encode_value(v, out, "")
+   return table.concat(out)
+end
+
+function M.fromjson(s)
+   local pos = 1
+   local function ws() pos = s:find("[^ \t\r\n]", pos) or #s+1 end
+   local value
+   local function str()
+      local buf = {}
+      pos = pos + 1
+      while true do
+         local c = s:sub(pos, pos)
+         if c == '"' then pos = pos + 1; break
+         elseif c == "\\" then
+            local e = s:sub(pos+1, pos+1)
+            if e == "u" then
+               buf[#buf+1] = string.char(tonumber(s:sub(pos+2, pos+5), 16) % 256)
+               pos = pos + 6
+            else
+               buf[#buf+1] = ({ n="\n", t="\t", r="\r" })[e] or e
+               pos = pos + 2
+            end
+         elseif c == "" then error "unterminated string"
+         else buf[#buf+1] = c; pos = pos + 1 end
+      end
+      return table.concat(buf)
+   end
+   function value()
+      ws()
+      local c = s:sub(pos, pos)
+      if c == "{" then
+         local t = {}
+         pos = pos + 1; ws()
+         if s:sub(pos, pos) == "}" then pos = pos + 1 return t end
+         repeat
+            ws(); local k = str(); ws()
+            assert(s:sub(pos, pos) == ":", "':' expected"); pos = pos + 1
+            t[k] = value(); ws()
+            c = s:sub(pos, pos); pos = pos + 1
+         until c ~= ","
+         assert(c == "}", "'}' expected")
+         return t
+      elseif c == "[" then
+         local t = {}
+         pos = pos + 1; ws()
+         if s:sub(pos, pos) == "]" then pos = pos + 1 return t end
+         repeat
+            t[#t+1] = value(); ws()
+            c = s:sub(pos, pos); pos = pos + 1
+         until c ~= ","
+         assert(c == "]", "']' expected")
+         return t
+      elseif c == '"' then
+         return str()
+      end
+      local lit = s:match("^[%w%.%+%-]+", pos)
+      assert(lit, "unexpected character at "..pos)
+      pos = pos + #lit
+      if lit == "true" then return true
+      elseif lit == "false" then return false
+      elseif lit == "null" then return nil end
+      return assert(tonumber(lit), "invalid number: "..lit)
+   end
+   return value()
+end
+
+function M.readfile(name)
+   local fp = assert(io.open(name, "rb"))
+   local s = fp:read "*a"
+   fp:close()
+   return s
+end
+
+function M.writefile(name, s)
+   local fp = assert(io.open(name, "wb"))
+   fp:write(s)
+   fp:close()
+end
+
+return M
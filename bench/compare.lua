@@ -0,0 +1,37 @@
+-- compare two bench result files.
+--
+-- usage: lua compare.lua old.json new.json
+--
+-- prints per case ns/op and allocation change, negative numbers mean
+-- the new run is faster (or allocates less).
+package.path = "./?.lua;"..package.path
+local bench = require "benchlib"
+
+local old = bench.fromjson(bench.readfile(assert(arg[1], "old result expected")))
+local new = bench.fromjson(bench.readfile(assert(arg[2], "new result expected")))
+
+local function index(r)
+   local t = {}
+   for _, v in ipairs(r.results) do t[v.name] = v end
+   return t
+end
+
+local function delta(a, b)
+   if a == 0 then return b == 0 and "=" or "new" end
+   return ("%+.1f%%"):format((b - a) * 100 / a)
+end
+
+local oldr = index(old)
+print(("%-36s %12s %12s %8s %12s %12s %8s"):format("case",
+   "old ns/op", "new ns/op", "time", "old B/op", "new B/op", "alloc"))
+for _, n in ipairs(new.results) do
+   local o = oldr[n.name]
+   if o then
+      print(("%-36s %12.1f %12.1f %8s %12.1f %12.1f %8s"):format(n.name,
+         o.ns_per_op, n.ns_per_op, delta(o.ns_per_op, n.ns_per_op),
+         o.gc_bytes_per_op, n.gc_bytes_per_op,
+         delta(o.gc_bytes_per_op, n.gc_bytes_per_op)))
+   else
+      print(("%-36s %12s %12.1f %8s"):format(n.name, "-", n.ns_per_op, "new"))
+   end
+end
@@ -3,12 +3,26 @@
 # define _CRT_SECURE_NO_WARNINGS
 #endif
 
+/* syscall() and friends stay declared even when an includer asked for
+ * a strict _POSIX_C_SOURCE */
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
 #define LUA_LIB
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdint.h>
 #include <string.h>
 
+/* C codecs made by protoc-gen-lua include this file with PB_CODEGEN
+ * defined, its own modules are private to them then */
+#ifdef PB_CODEGEN
+# define PB_API static
+#else
+# define PB_API LUALIB_API
+#endif
+
 
 /* Lua utils */
 
@@ -24,7 +38,7 @@
 
 static int relindex(int idx, int offset) {
     if (idx < 0 && idx > LUA_REGISTRYINDEX)
-        return idx + offset;
+        return idx - offset;
     return idx;
 }
 
@@ -44,6 +58,28 @@ static lua_Integer lua_tointegerx(lua_State *L, int idx, int *isint) {
     if (isint) *isint = (i != 0 || lua_type(L, idx) == LUA_TNUMBER);
     return i;
 }
+
+static const char *luaL_tolstring(lua_State *L, int idx, size_t *len) {
+    if (!luaL_callmeta(L, idx, "__tostring")) {
+        switch (lua_type(L, idx)) {
+        case LUA_TNUMBER: case LUA_TSTRING:
+            lua_pushvalue(L, idx); break;
+        case LUA_TBOOLEAN:
+            lua_pushstring(L, lua_toboolean(L, idx) ? "true" : "false");
+            break;
+        case LUA_TNIL:
+            lua_pushliteral(L, "nil"); break;
+        default:
+            lua_pushfstring(L, "%s: %p", luaL_typename(L, idx),
+                    lua_topointer(L, idx));
+        }
+    }
+    return lua_tolstring(L, -1, len);
+}
+
+# define lua_rawlen lua_objlen
+# define lua_absindex(L,i) ((i) > 0 || (i) <= LUA_REGISTRYINDEX ? \
+                            (i) : lua_gettop(L) + (i) + 1)
 #endif
 
 static int typeerror(lua_State *L, int idx, const char *type) {
@@ -199,13 +235,13 @@ static int Lconv_fromsint64(lua_State *L) {
 
 static int Lconv_tosint32(lua_State *L) {
     uint32_t n = (uint32_t)luaL_checkinteger(L, 1);
-    lua_pushinteger(L, (n << 1) ^ (n >> 31));
+    lua_pushinteger(L, (n << 1) ^ -(n >> 31));
     return 1;
 }
 
 static int Lconv_tosint64(lua_State *L) {
     uint64_t n = (uint64_t)luaL_checkinteger(L, 1);
-    lua_pushinteger(L, (n << 1) ^ (n >> 63));
+    lua_pushinteger(L, (n << 1) ^ -(n >> 63));
     return 1;
 }
 
@@ -237,7 +273,7 @@ static int Lconv_todouble(lua_State *L) {
     return 1;
 }
 
-LUALIB_API int luaopen_pb_conv(lua_State *L) {
+PB_API int luaopen_pb_conv(lua_State *L) {
     luaL_Reg libs[] = {
         { "toint32", Lconv_touint32 },
 #define ENTRY(name) { #name, Lconv_##name }
@@ -259,34 +295,329 @@ LUALIB_API int luaopen_pb_conv(lua_State *L) {
 }
 
 
+/* statistics */
+
+#ifdef PB_STATS
+# define PB_STATFIELDS(X) \
+    X(buffer_grow)        \
+    X(buffer_copy)        \
+    X(buffer_result)      \
+    X(decoder_source)     \
+    X(decoder_bytes)      \
+
+#endif
+
+#include <time.h>
+#ifndef _WIN32
+# include <sys/time.h>
+#endif
+
+/* per state, installed as the allocator's userdata while enabled, so
+ * counters are neither shared between states nor raced by threads */
+typedef struct pb_AllocStats {
+    lua_Alloc f;
+    void *ud;
+    size_t bytes;
+    size_t count;
+#ifdef PB_STATS
+#define X(name) uint64_t name;
+    PB_STATFIELDS(X)
+#undef  X
+#endif
+} pb_AllocStats;
+
+static void *stats_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+static pb_AllocStats *stats_getalloc(lua_State *L) {
+    void *ud;
+    return lua_getallocf(L, &ud) == stats_alloc ? (pb_AllocStats*)ud : NULL;
+}
+
+#ifdef PB_STATS
+# define pb_addstat(L, name, n) do { \
+    pb_AllocStats *s_ = stats_getalloc(L); \
+    if (s_ != NULL) s_->name += (n); } while (0)
+#else
+# define pb_addstat(L, name, n) ((void)0)
+#endif
+
+static const char pb_statstype[] = "pb.Stats";
+
+static void *stats_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    pb_AllocStats *s = (pb_AllocStats*)ud;
+    void *newptr = s->f(s->ud, ptr, osize, nsize);
+    if (newptr != NULL) {
+        if (ptr == NULL) /* osize is object type for new blocks */
+            s->bytes += nsize, ++s->count;
+        else if (nsize > osize)
+            s->bytes += nsize - osize, ++s->count;
+    }
+    return newptr;
+}
+
+static void stats_uninstall(lua_State *L, pb_AllocStats *s) {
+    lua_setallocf(L, s->f, s->ud);
+    s->f(s->ud, s, sizeof(pb_AllocStats), 0);
+}
+
+static int Lstats_gc(lua_State *L) {
+    /* the anchor dies on lua_close(), restore allocator before the
+     * state frees itself */
+    pb_AllocStats **ps = (pb_AllocStats**)lua_touserdata(L, 1);
+    if (*ps != NULL && stats_getalloc(L) == *ps)
+        stats_uninstall(L, *ps);
+    *ps = NULL;
+    return 0;
+}
+
+static int Lstats_enable(lua_State *L) {
+    int enable = lua_toboolean(L, 1);
+    pb_AllocStats *s = stats_getalloc(L);
+    if (enable && s == NULL) {
+        void *ud;
+        lua_Alloc f = lua_getallocf(L, &ud);
+        pb_AllocStats **ps = (pb_AllocStats**)
+            lua_newuserdata(L, sizeof(pb_AllocStats*));
+        *ps = NULL;
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, Lstats_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_statstype);
+        s = (pb_AllocStats*)f(ud, NULL, 0, sizeof(pb_AllocStats));
+        if (s == NULL) return luaL_error(L, "not enough memory");
+        memset(s, 0, sizeof(pb_AllocStats));
+        s->f = f, s->ud = ud;
+        *ps = s;
+        lua_setallocf(L, stats_alloc, s);
+    }
+    else if (!enable && s != NULL) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, pb_statstype);
+        *(pb_AllocStats**)lua_touserdata(L, -1) = NULL;
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_statstype);
+        stats_uninstall(L, s);
+    }
+    lua_pushboolean(L, enable);
+    return 1;
+}
+
+static int Lstats_clock(lua_State *L) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushnumber(L, (lua_Number)ts.tv_sec + ts.tv_nsec * 1e-9);
+#elif !defined(_WIN32)
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    lua_pushnumber(L, (lua_Number)tv.tv_sec + tv.tv_usec * 1e-6);
+#else
+    lua_pushnumber(L, (lua_Number)clock() / CLOCKS_PER_SEC);
+#endif
+    return 1;
+}
+
+static int Lstats_allocated(lua_State *L) {
+    pb_AllocStats *s = stats_getalloc(L);
+    lua_pushnumber(L, s ? (lua_Number)s->bytes : 0);
+    lua_pushnumber(L, s ? (lua_Number)s->count : 0);
+    return 2;
+}
+
+static int Lstats_counters(lua_State *L) {
+#ifdef PB_STATS
+    pb_AllocStats *s = stats_getalloc(L);
+#endif
+    lua_newtable(L);
+#ifdef PB_STATS
+#define X(name) lua_pushinteger(L, (lua_Integer)(s ? s->name : 0)); \
+                lua_setfield(L, -2, #name);
+    PB_STATFIELDS(X)
+#undef  X
+#endif
+    return 1;
+}
+
+static int Lstats_reset(lua_State *L) {
+    pb_AllocStats *s = stats_getalloc(L);
+    if (s != NULL) {
+        void *ud = s->ud;
+        lua_Alloc f = s->f;
+        memset(s, 0, sizeof(pb_AllocStats));
+        s->f = f, s->ud = ud;
+    }
+    return 0;
+}
+
+PB_API int luaopen_pb_stats(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lstats_##name }
+        ENTRY(enable),
+        ENTRY(clock),
+        ENTRY(allocated),
+        ENTRY(counters),
+        ENTRY(reset),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_newlib(L, libs);
+#ifdef PB_STATS
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif
+    lua_setfield(L, -2, "compiled");
+    return 1;
+}
+
+
 /* protobuf encode buffer */
 
+#ifndef PB_SEGSIZE
+# define PB_SEGSIZE 65536 /* default segment size of chunked buffers */
+#endif
+#ifndef PB_REFSIZE
+# define PB_REFSIZE 512   /* strings referenced instead of copied */
+#endif
+
+typedef struct pb_Slice {
+    const char *p;
+    size_t len;
+} pb_Slice;
+
+/* a chunked buffer (segsize != 0) keeps written bytes as a list of
+ * slices (full segments and referenced strings) followed by the
+ * current segment in buf, everything anchored in a registry table */
 typedef struct pb_Buffer {
     size_t used;
     size_t size;
     lua_State *L;
     char *buf;
+    size_t segsize;
+    size_t sealed;
+    size_t nslices, slicecap;
+    pb_Slice *slices;
     char init_buff[LUAL_BUFFERSIZE];
 } pb_Buffer;
 
-#define pb_addchar(buf, ch) ((buf)->buf[(buf)->used++] = (ch))
+#define pb_addchar(b, ch)   ((b)->buf[(b)->used++] = (ch))
+#define pb_bufferlen(b)     ((b)->sealed + (b)->used)
 
 static void pb_initbuffer(pb_Buffer *buf, lua_State *L) {
     buf->used = 0;
     buf->size = LUAL_BUFFERSIZE;
     buf->L = L;
     buf->buf = buf->init_buff;
+    buf->segsize = 0;
+    buf->sealed = 0;
+    buf->nslices = buf->slicecap = 0;
+    buf->slices = NULL;
 }
 
 static void pb_resetbuffer(pb_Buffer *buf) {
-    if (buf->buf != buf->init_buff) {
+    size_t segsize = buf->segsize;
+    if (buf->buf != buf->init_buff || segsize != 0) {
         lua_pushnil(buf->L);
         lua_rawsetp(buf->L, LUA_REGISTRYINDEX, buf);
     }
     pb_initbuffer(buf, buf->L);
+    buf->segsize = segsize;
+}
+
+static void pb_anchor(pb_Buffer *buf, int idx) {
+    lua_State *L = buf->L;
+    idx = lua_absindex(L, idx);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, buf);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, buf);
+    }
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+}
+
+static void pb_addslice(pb_Buffer *buf, const char *p, size_t len) {
+    if (buf->nslices == buf->slicecap) {
+        size_t newcap = buf->slicecap ? buf->slicecap * 2 : 16;
+        pb_Slice *slices = (pb_Slice*)lua_newuserdata(buf->L,
+                newcap * sizeof(pb_Slice));
+        if (buf->nslices)
+            memcpy(slices, buf->slices, buf->nslices * sizeof(pb_Slice));
+        pb_anchor(buf, -1);
+        lua_pop(buf->L, 1);
+        buf->slices = slices;
+        buf->slicecap = newcap;
+    }
+    buf->slices[buf->nslices].p = p;
+    buf->slices[buf->nslices].len = len;
+    ++buf->nslices;
+    buf->sealed += len;
+}
+
+/* move written bytes of current segment to slices, the rest of the
+ * segment is still used for new bytes */
+static void pb_sealsegment(pb_Buffer *buf) {
+    if (buf->used != 0) {
+        pb_addslice(buf, buf->buf, buf->used);
+        buf->buf += buf->used;
+        buf->size -= buf->used;
+        buf->used = 0;
+    }
+}
+
+static void pb_newsegment(pb_Buffer *buf, size_t need) {
+    size_t size = need > buf->segsize ? need : buf->segsize;
+    pb_sealsegment(buf);
+    buf->buf = (char*)lua_newuserdata(buf->L, size);
+    pb_anchor(buf, -1);
+    lua_pop(buf->L, 1);
+    buf->size = size;
+    pb_addstat(buf->L, buffer_grow, 1);
+}
+
+/* reference string at idx, it's not copied */
+static void pb_addref(pb_Buffer *buf, int idx) {
+    size_t len;
+    const char *s = lua_tolstring(buf->L, idx, &len);
+    pb_sealsegment(buf);
+    pb_addslice(buf, s, len);
+    pb_anchor(buf, idx);
+}
+
+/* join a chunked buffer into one segment */
+static void pb_flatbuffer(pb_Buffer *buf) {
+    lua_State *L = buf->L;
+    size_t i, len = pb_bufferlen(buf), off = 0;
+    char *p;
+    if (buf->nslices == 0) return;
+    p = (char*)lua_newuserdata(L, len > buf->segsize ? len : buf->segsize);
+    for (i = 0; i < buf->nslices; ++i) {
+        memcpy(p + off, buf->slices[i].p, buf->slices[i].len);
+        off += buf->slices[i].len;
+    }
+    memcpy(p + off, buf->buf, buf->used);
+    pb_addstat(buf->L, buffer_copy, len);
+    lua_newtable(L);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, buf);
+    lua_pop(L, 1);
+    buf->size = len > buf->segsize ? len : buf->segsize;
+    buf->buf = p;
+    buf->used = len;
+    buf->sealed = 0;
+    buf->nslices = buf->slicecap = 0;
+    buf->slices = NULL;
 }
 
 static void pb_prepbuffer(pb_Buffer *buf, size_t need) {
+    if (buf->segsize != 0 && buf->used + need > buf->size) {
+        pb_newsegment(buf, need);
+        return;
+    }
     need += buf->used;
     if (need > buf->size) {
         void *newud;
@@ -295,6 +626,8 @@ static void pb_prepbuffer(pb_Buffer *buf, size_t need) {
             newsize *= 2;
         newud = lua_newuserdata(buf->L, newsize);
         memcpy(newud, buf->buf, buf->used);
+        pb_addstat(buf->L, buffer_grow, 1);
+        pb_addstat(buf->L, buffer_copy, buf->used);
         lua_rawsetp(buf->L, LUA_REGISTRYINDEX, buf);
         buf->buf = newud;
         buf->size = newsize;
@@ -338,12 +671,29 @@ static const char pb_buftype[] = "pb.Buffer";
 static const char *pb_tolbuffer(lua_State *L, int idx, size_t *plen) {
     if (lua_type(L, idx) == LUA_TUSERDATA) {
         pb_Buffer *buf = check_buffer(L, idx);
+        pb_flatbuffer(buf);
         if (plen) *plen = buf->used;
         return buf->buf;
     }
     return luaL_checklstring(L, idx, plen);
 }
 
+/* add the string or buffer at idx, big strings in chunked buffers are
+ * referenced */
+static void pb_addvalue(pb_Buffer *buf, lua_State *L, int idx, int withlen) {
+    size_t len;
+    const char *s = pb_tolbuffer(L, idx, &len);
+    if (withlen) pb_addvarint(buf, len);
+    if (buf->segsize != 0 && len >= PB_REFSIZE
+            && lua_type(L, idx) == LUA_TSTRING) {
+        pb_addref(buf, idx);
+        return;
+    }
+    pb_prepbuffer(buf, len);
+    memcpy(&buf->buf[buf->used], s, len);
+    buf->used += len;
+}
+
 static int Lbuf_tostring(lua_State *L) {
     pb_Buffer *buf = (pb_Buffer*)testudata(L, 1, pb_buftype);
     if (buf != NULL)
@@ -369,6 +719,17 @@ static int Lbuf_new(lua_State *L) {
     return 1;
 }
 
+static int Lbuf_chunked(lua_State *L) {
+    lua_Integer segsize = luaL_optinteger(L, 1, PB_SEGSIZE);
+    pb_Buffer *buf = (pb_Buffer*)lua_newuserdata(L, sizeof(pb_Buffer));
+    luaL_argcheck(L, segsize > 0, 1, "segment size must be positive");
+    pb_initbuffer(buf, L);
+    buf->segsize = (size_t)segsize;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_buftype);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
 static int Lbuf_reset(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     pb_resetbuffer(buf);
@@ -377,7 +738,7 @@ static int Lbuf_reset(lua_State *L) {
 
 static int Lbuf_len(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
-    lua_pushinteger(L, (lua_Integer)buf->used);
+    lua_pushinteger(L, (lua_Integer)pb_bufferlen(buf));
     return 1;
 }
 
@@ -385,7 +746,7 @@ static int Lbuf_tag(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     lua_Integer tag = luaL_checkinteger(L, 2);
     int isint, wiretype = (int)lua_tointegerx(L, 3, &isint);
-    if (!isint && (wiretype = find_wiretype(luaL_checkstring(L, 3)) < 0))
+    if (!isint && (wiretype = find_wiretype(luaL_checkstring(L, 3))) < 0)
         return luaL_argerror(L, 3, "invalid wire type name");
     if (tag < 0 || tag > (1<<29))
         luaL_argerror(L, 2, "tag too big");
@@ -406,14 +767,8 @@ static int Lbuf_varint(lua_State *L) {
 static int Lbuf_bytes(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     int i, top = lua_gettop(L);
-    for (i = 2; i <= top; ++i) {
-        size_t len;
-        const char *s = pb_tolbuffer(L, i, &len);
-        pb_addvarint(buf, len);
-        pb_prepbuffer(buf, len);
-        memcpy(&buf->buf[buf->used], s, len);
-        buf->used += len;
-    }
+    for (i = 2; i <= top; ++i)
+        pb_addvalue(buf, L, i, 1);
     return_self(L);
 }
 
@@ -440,7 +795,7 @@ static int Lbuf_fixed64(lua_State *L) {
 static int Lbuf_add(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     uint32_t tag = 0, hastag = 0;
-    const char *s, *type = luaL_checkstring(L, 3);
+    const char *type = luaL_checkstring(L, 3);
     union { float f; uint32_t u32;
             double d; uint64_t u64; } u;
     if (!lua_isnoneornil(L, 2)) {
@@ -457,12 +812,9 @@ static int Lbuf_add(lua_State *L) {
     case PB_Tbytes:
     case PB_Tstring:
     case PB_Tmessage:
-        s = luaL_checklstring(L, 4, &u.u32);
+        luaL_checkstring(L, 4);
         if (hastag) pb_addtag(buf, tag, PB_TLENGTH);
-        pb_addvarint(buf, u.u32);
-        pb_prepbuffer(buf, u.u32);
-        memcpy(&buf->buf[buf->used], s, u.u32);
-        buf->used += u.u32;
+        pb_addvalue(buf, L, 4, 1);
         break;
     case PB_Tdouble:
         u.d = (double)luaL_checknumber(L, 4);
@@ -475,11 +827,13 @@ static int Lbuf_add(lua_State *L) {
         pb_addfixed32(buf, u.u32);
         break;
     case PB_Tfixed32:
+    case PB_Tsfixed32:
         u.u32 = (uint32_t)luaL_checkinteger(L, 4);
         if (hastag) pb_addtag(buf, tag, PB_T32BIT);
         pb_addfixed32(buf, u.u32);
         break;
     case PB_Tfixed64:
+    case PB_Tsfixed64:
         u.u64 = (uint64_t)luaL_checkinteger(L, 4);
         if (hastag) pb_addtag(buf, tag, PB_T64BIT);
         pb_addfixed64(buf, u.u64);
@@ -499,13 +853,13 @@ static int Lbuf_add(lua_State *L) {
         break;
     case PB_Tsint32:
         u.u32 = (uint32_t)luaL_checkinteger(L, 4);
-        u.u32 = (u.u32 << 1) ^ (u.u32 >> 31);
+        u.u32 = (u.u32 << 1) ^ -(u.u32 >> 31);
         if (hastag) pb_addtag(buf, tag, PB_TVARINT);
         pb_addvarint(buf, (uint64_t)u.u32);
         break;
     case PB_Tsint64:
         u.u64 = (uint64_t)luaL_checkinteger(L, 4);
-        u.u64 = (u.u64 << 1) ^ (u.u64 >> 63);
+        u.u64 = (u.u64 << 1) ^ -(u.u64 >> 63);
         if (hastag) pb_addtag(buf, tag, PB_TVARINT);
         pb_addvarint(buf, u.u64);
         break;
@@ -519,10 +873,12 @@ static int Lbuf_add(lua_State *L) {
 
 static int Lbuf_clear(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
-    size_t sz = (size_t)luaL_optinteger(L, 2, buf->used);
+    size_t sz = (size_t)luaL_optinteger(L, 2, pb_bufferlen(buf));
+    if (sz > buf->used) pb_flatbuffer(buf);
     if (sz > buf->used) sz = buf->used;
     buf->used -= sz;
     if (lua_toboolean(L, 3)) {
+        pb_addstat(L, buffer_result, sz);
         lua_pushlstring(L, &buf->buf[buf->used], sz);
         return 1;
     }
@@ -532,19 +888,16 @@ static int Lbuf_clear(lua_State *L) {
 static int Lbuf_concat(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     int i, top = lua_gettop(L);
-    for (i = 2; i <= top; ++i) {
-        size_t len;
-        const char *s = pb_tolbuffer(L, i, &len);
-        pb_prepbuffer(buf, len);
-        memcpy(&buf->buf[buf->used], s, len);
-        buf->used += len;
-    }
+    for (i = 2; i <= top; ++i)
+        pb_addvalue(buf, L, i, 0);
     return_self(L);
 }
 
 static int Lbuf_result(lua_State *L) {
     pb_Buffer *buf = check_buffer(L, 1);
     const char *s = luaL_optstring(L, 2, NULL);
+    pb_flatbuffer(buf);
+    pb_addstat(L, buffer_result, buf->used);
     if (s == NULL)
         lua_pushlstring(L, buf->buf, buf->used);
     else if (strcmp(s, "hex") == 0) {
@@ -567,7 +920,7 @@ static int Lbuf_result(lua_State *L) {
     return 1;
 }
 
-LUALIB_API int luaopen_pb_buffer(lua_State *L) {
+PB_API int luaopen_pb_buffer(lua_State *L) {
     luaL_Reg libs[] = {
         { "__gc", Lbuf_reset },
         { "__len", Lbuf_len },
@@ -575,6 +928,7 @@ LUALIB_API int luaopen_pb_buffer(lua_State *L) {
         { "__tostring", Lbuf_tostring },
 #define ENTRY(name) { #name, Lbuf_##name }
         ENTRY(new),
+        ENTRY(chunked),
         ENTRY(reset),
         ENTRY(tag),
         ENTRY(varint),
@@ -634,6 +988,7 @@ static int pb_readfixed32(pb_Decoder *dec, uint32_t *pv) {
         n <<= 8;
         n |= dec->p[i] & 0xFF;
     }
+    dec->p += 4;
     *pv = n;
     return 1;
 }
@@ -641,12 +996,13 @@ static int pb_readfixed32(pb_Decoder *dec, uint32_t *pv) {
 static int pb_readfixed64(pb_Decoder *dec, uint64_t *pv) {
     int i;
     uint64_t n = 0;
-    if (dec->p + 8 < dec->end)
+    if (dec->p + 8 > dec->end)
         return 0;
     for (i = 7; i >= 0; --i) {
         n <<= 8;
         n |= dec->p[i] & 0xFF;
     }
+    dec->p += 8;
     *pv = n;
     return 1;
 }
@@ -738,7 +1094,7 @@ static int pb_pushfixed32(pb_FBDecoder *dec, int type) {
     case -1:
     case PB_Tfixed32:
         out = (lua_Integer)u.u32;
-        return 1;
+        break;
     case PB_Tfloat:
         lua_pushnumber(dec->L, (lua_Number)u.f);
         return 1;
@@ -766,7 +1122,7 @@ static int pb_pushfixed64(pb_FBDecoder *dec, int type) {
     case PB_Tfixed64:
     case PB_Tsfixed64:
         out = (lua_Integer)u.u64;
-        return 1;
+        break;
     default: return type_mismatch(dec, type, "fixed64");
     }
     lua_pushinteger(dec->L, out);
@@ -806,16 +1162,39 @@ static int pb_pushscalar(pb_FBDecoder *dec, int wiretype, int type) {
     }
 }
 
+/* pb.io.reader() objects, record log readers and pb.shm rings are
+ * decoder sources too, see io routines */
+static int reader_source(lua_State *L, int idx, pb_Decoder *dec,
+                         int advance);
+static int log_source(lua_State *L, int idx, pb_Decoder *dec, int advance);
+static int shm_source(lua_State *L, int idx, pb_Decoder *dec, int advance);
+
+static int stream_source(lua_State *L, int idx, pb_Decoder *dec,
+                         int advance) {
+    int res = reader_source(L, idx, dec, advance);
+    if (res == 0) res = log_source(L, idx, dec, advance);
+    return res != 0 ? res : shm_source(L, idx, dec, advance);
+}
+
 static void init_decoder(pb_Decoder *dec, lua_State *L, int idx) {
     size_t len;
-    const char *s = pb_tolbuffer(L, idx, &len);
-    lua_Integer i = luaL_optinteger(L, idx+1, 1);
-    lua_Integer j = luaL_optinteger(L, idx+2, len);
+    const char *s;
+    lua_Integer i, j;
+    if (stream_source(L, idx, dec, 0)) {
+        lua_pushvalue(L, idx);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, dec);
+        return;
+    }
+    s = pb_tolbuffer(L, idx, &len);
+    i = luaL_optinteger(L, idx+1, 1);
+    j = luaL_optinteger(L, idx+2, len);
     rangerelat(&i, &j, len);
     dec->s = s;
     dec->len = len;
     dec->p = s + i - 1;
     dec->end = dec->p + j;
+    pb_addstat(L, decoder_source, 1);
+    pb_addstat(L, decoder_bytes, dec->end - dec->p);
     lua_pushvalue(L, idx);
     lua_rawsetp(L, LUA_REGISTRYINDEX, dec);
 }
@@ -1048,22 +1427,35 @@ static int Ldec_values(lua_State *L) {
 
 static int Ldec_update(lua_State *L) {
     pb_Decoder *dec = check_decoder(L, 1);
+    int compact = lua_toboolean(L, 2);
+    size_t pos = dec->p - dec->s;
     pb_Buffer *buf;
     lua_rawgetp(L, LUA_REGISTRYINDEX, dec);
+    switch (stream_source(L, -1, dec, 1)) {
+    case 1: return_self(L);
+    case -1: return 0; /* end of input */
+    }
     if ((buf = testudata(L, -1, pb_buftype)) == NULL)
         return 0;
-    if (buf->used == dec->p - dec->s) {
-        dec->p = dec->s;
+    pb_flatbuffer(buf);
+    if (buf->used == pos) {
+        pos = 0;
         buf->used = 0;
     }
-    dec->p = buf->buf + (dec->p - dec->s);
+    else if (compact && pos != 0) {
+        /* drop consumed bytes, so a long stream keeps only its tail */
+        memmove(buf->buf, buf->buf + pos, buf->used - pos);
+        buf->used -= pos;
+        pos = 0;
+    }
+    dec->p = buf->buf + pos;
     dec->s = buf->buf;
     dec->len = buf->used;
     dec->end = buf->buf + buf->used;
     return_self(L);
 }
 
-LUALIB_API int luaopen_pb_decoder(lua_State *L) {
+PB_API int luaopen_pb_decoder(lua_State *L) {
     luaL_Reg libs[] = {
         { "__gc", Ldec_reset },
         { "__len", Ldec_len },
@@ -1097,80 +1489,6294 @@ LUALIB_API int luaopen_pb_decoder(lua_State *L) {
     return 1;
 }
 
-/* io routines */
+/* LuaJIT FFI ABI: pb.lua reads decoders and writes buffers in place
+ * through these declarations when running on LuaJIT, so its traces are
+ * not cut by C API calls. Buffers only grow through the C methods, the
+ * functions below never touch a lua_State. Fields are only added at
+ * the end of the declared part of the structs, a change of the layout
+ * or the functions bumps PB_FFIVERSION. */
 
-#ifdef _WIN32
-# include <io.h>
-# include <fcntl.h>
-#else
-# define setmode(a,b)  ((void)0)
-#endif
+#define PB_FFIVERSION 1
 
-static int io_write(lua_State *L, FILE *f, int arg) {
-    int nargs = lua_gettop(L) - arg + 1;
-    int status = 1;
-    for (; nargs--; arg++) {
-        size_t l;
-        const char *s = pb_tolbuffer(L, arg, &l);
-        status = status && (fwrite(s, sizeof(char), l, f) == l);
-    }
-    if (status) return 1;  /* file handle already on stack top */
-    else return luaL_fileresult(L, status, NULL);
+static const char pb_fficdef[] =
+"typedef struct pb_Decoder {\n"
+"    size_t len;\n"
+"    const char *s;\n"
+"    const char *p, *end;\n"
+"} pb_Decoder;\n"
+"typedef struct pb_Buffer {\n"
+"    size_t used;\n"
+"    size_t size;\n"
+"    void *L;\n"
+"    char *buf;\n"
+"    size_t segsize;\n"
+"} pb_Buffer;\n"
+"int pb_ffi_version(void);\n"
+"int pb_ffi_readvarint(pb_Decoder *dec, uint64_t *pv);\n"
+"int pb_ffi_skip(pb_Decoder *dec, int wiretype);\n"
+"int pb_ffi_addvarint(pb_Buffer *buf, int64_t n);\n";
+
+PB_API int pb_ffi_version(void) {
+    return PB_FFIVERSION;
 }
 
-static int Lio_read(lua_State *L) {
-    const char *fname = luaL_optstring(L, 1, NULL);
-    luaL_Buffer b;
-    FILE *fp = stdin;
-    size_t nr;
-    if (fname == NULL)
-        setmode(fileno(stdin), O_BINARY);
-    else if ((fp = fopen(fname, "rb")) == NULL)
-        return luaL_fileresult(L, 0, fname);
-    luaL_buffinit(L, &b);
-    do {  /* read file in chunks of LUAL_BUFFERSIZE bytes */
-        char *p = luaL_prepbuffer(&b);
-        nr = fread(p, sizeof(char), LUAL_BUFFERSIZE, fp);
-        luaL_addsize(&b, nr);
-    } while (nr == LUAL_BUFFERSIZE);
-    if (fp != stdin) fclose(fp);
-    else setmode(fileno(stdin), O_TEXT);
-    luaL_pushresult(&b);  /* close buffer */
-    return 1;
+/* 1 and the value at *pv, or 0 if the varint is incomplete */
+PB_API int pb_ffi_readvarint(pb_Decoder *dec, uint64_t *pv) {
+    return pb_readvarint(dec, pv);
 }
 
-static int Lio_write(lua_State *L) {
+/* skip a value of wiretype, 0 (not moving) if incomplete or a group */
+PB_API int pb_ffi_skip(pb_Decoder *dec, int wiretype) {
+    const char *p = dec->p;
+    uint64_t n;
     int res;
-    setmode(fileno(stdout), O_BINARY);
-    res = io_write(L, stdout, 1);
-    fflush(stdout);
-    setmode(fileno(stdout), O_TEXT);
+    switch (wiretype) {
+    case PB_TVARINT: res = pb_skipvarint(dec); break;
+    case PB_T64BIT:  res = pb_skipsize(dec, 8); break;
+    case PB_T32BIT:  res = pb_skipsize(dec, 4); break;
+    case PB_TLENGTH:
+        res = pb_readvarint(dec, &n) && pb_skipsize(dec, (size_t)n);
+        break;
+    default: res = 0;
+    }
+    if (!res) dec->p = p;
     return res;
 }
 
-static int Lio_dump(lua_State *L) {
-    int res;
-    const char *fname = luaL_checkstring(L, 1);
-    FILE *fp = fopen(fname, "wb");
-    if (fp == NULL) return luaL_fileresult(L, 0, fname);
-    res = io_write(L, fp, 1);
-    fclose(fp);
-    return res;
+/* add varint n if there is room for it, 0 if the buffer must grow */
+PB_API int pb_ffi_addvarint(pb_Buffer *buf, int64_t n) {
+    if (buf->size - buf->used < 10) return 0;
+    pb_addvarint(buf, (uint64_t)n);
+    return 1;
 }
 
-LUALIB_API int luaopen_pb_io(lua_State *L) {
-    luaL_Reg libs[] = {
-#define ENTRY(name) { #name, Lio_##name }
-        ENTRY(read),
-        ENTRY(write),
-        ENTRY(dump),
-#undef  ENTRY
-        { NULL, NULL }
-    };
-    luaL_newlib(L, libs);
+PB_API int luaopen_pb_ffi(lua_State *L) {
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, PB_FFIVERSION);
+    lua_setfield(L, -2, "version");
+    lua_pushstring(L, pb_fficdef);
+    lua_setfield(L, -2, "cdef");
+#define OFFSET(name, type, field) \
+    (lua_pushinteger(L, (lua_Integer)offsetof(type, field)), \
+     lua_setfield(L, -2, name))
+    OFFSET("decoder_p", pb_Decoder, p);
+    OFFSET("decoder_end", pb_Decoder, end);
+    OFFSET("buffer_size", pb_Buffer, size);
+    OFFSET("buffer_buf", pb_Buffer, buf);
+    OFFSET("buffer_segsize", pb_Buffer, segsize);
+#undef  OFFSET
+    lua_pushinteger(L, PB_REFSIZE);
+    lua_setfield(L, -2, "refsize");
     return 1;
 }
 
+/* schema access */
+
+/* message types are the tables pb.lua builds from descriptors:
+ *   type[tag] = { name = ..., type_name = "int32" | { "pkg", "Msg" },
+ *                 scalar = ..., repeated = ..., packed = ... }
+ * named types are resolved from the type root pb.type() returns. */
+
+typedef struct pb_Field {
+    const char *name;
+    int type;       /* pb_Type, PB_Tmessage/PB_Tenum for named types */
+    int repeated;
+    int packed;
+} pb_Field;
+
+typedef struct pb_Schema {
+    lua_State *L;
+    int root;       /* stack index of type root */
+} pb_Schema;
+
+static void pb_resolvetype(pb_Schema *S, int names) {
+    lua_State *L = S->L;
+    int i, n = (int)lua_rawlen(L, names);
+    lua_pushvalue(L, S->root);
+    for (i = 1; i <= n && lua_istable(L, -1); ++i) {
+        lua_rawgeti(L, names, i);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+}
+
+/* look up field of tag in type, pushes its named type (or nil), and
+ * returns 0 if the field is unknown */
+static int pb_getfield(pb_Schema *S, int type, lua_Integer tag, pb_Field *f) {
+    lua_State *L = S->L;
+    f->name = NULL, f->type = -1;
+    f->repeated = f->packed = 0;
+    lua_rawgeti(L, type, tag);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        return 0;
+    }
+    lua_getfield(L, -1, "name");
+    f->name = lua_tostring(L, -1); /* kept alive by the field table */
+    lua_getfield(L, -2, "repeated");
+    f->repeated = lua_toboolean(L, -1);
+    lua_getfield(L, -3, "packed");
+    f->packed = lua_toboolean(L, -1);
+    lua_getfield(L, -4, "type_name");
+    lua_remove(L, -5);
+    lua_replace(L, -4);
+    lua_pop(L, 2);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        f->type = find_type(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    else if (lua_istable(L, -1)) {
+        pb_resolvetype(S, lua_gettop(L));
+        lua_remove(L, -2);
+        if (lua_istable(L, -1)) {
+            const char *kind;
+            lua_getfield(L, -1, "type");
+            kind = lua_tostring(L, -1);
+            if (kind && strcmp(kind, "enum") == 0)
+                f->type = PB_Tenum;
+            else if (kind && strcmp(kind, "message") == 0)
+                f->type = PB_Tmessage;
+            lua_pop(L, 1);
+        }
+    }
+    return f->name != NULL;
+}
+
+static int pb_packedwiretype(int type) {
+    switch (type) {
+    case PB_Tfixed32: case PB_Tsfixed32: case PB_Tfloat:
+        return PB_T32BIT;
+    case PB_Tfixed64: case PB_Tsfixed64: case PB_Tdouble:
+        return PB_T64BIT;
+    case PB_Tbytes: case PB_Tstring: case PB_Tmessage: case PB_Tgroup:
+        return -1;
+    default:
+        return PB_TVARINT;
+    }
+}
+
+/* push value of field, enum values become their names */
+static void pb_pushfield(pb_FBDecoder *dec, int wiretype, pb_Field *f,
+                         int ftype) {
+    int type = f->type == PB_Tenum ? -1 : f->type;
+    if (!pb_pushscalar(dec, wiretype, type))
+        luaL_error(dec->L, "incomplete field '%s'", f->name);
+    if (f->type == PB_Tenum && lua_istable(dec->L, ftype)) {
+        lua_pushvalue(dec->L, -1);
+        lua_rawget(dec->L, ftype);
+        if (lua_isnil(dec->L, -1))
+            lua_pop(dec->L, 1);
+        else
+            lua_remove(dec->L, -2);
+    }
+}
+
+
+/* SAX style parse, calls handlers instead of building tables */
+
+#define PB_BATCHSIZE 256
+#define PB_MAXDEPTH  100 /* nesting limit of the recursive walkers */
+
+typedef struct pb_Parse {
+    pb_Schema S;
+    pb_FBDecoder dec;
+    int batch;      /* stack index of batch table */
+} pb_Parse;
+
+/* hooks of one handlers table, kept on stack while parsing a message */
+enum { H_FIELD, H_BATCH, H_FIELDS, H_END, H_COUNT };
+
+static int parse_hooks(lua_State *L, int h, const char *name) {
+    static const char *hooks[] = { "field", "batch", "fields", "end_message" };
+    int i, skip = 0;
+    luaL_checkstack(L, H_COUNT + 10, "message too deep");
+    for (i = 0; i < H_COUNT; ++i)
+        lua_getfield(L, h, hooks[i]);
+    lua_getfield(L, h, "begin_message");
+    if (lua_isfunction(L, -1)) {
+        lua_pushstring(L, name);
+        lua_call(L, 1, 1);
+        skip = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+    return skip;
+}
+
+/* call the field handler with key and value on stack top */
+static void parse_deliver(lua_State *L, int hooks, int fieldh) {
+    if (fieldh) {
+        lua_remove(L, -2);
+        lua_pushvalue(L, fieldh);
+        lua_insert(L, -2);
+        lua_call(L, 1, 0);
+    }
+    else if (lua_isfunction(L, hooks + H_FIELD)) {
+        lua_pushvalue(L, hooks + H_FIELD);
+        lua_insert(L, -3);
+        lua_call(L, 2, 0);
+    }
+    else
+        lua_pop(L, 2);
+}
+
+static void parse_batch(pb_Parse *ps, int hooks, int fieldh, int n,
+                        pb_Field *f) {
+    lua_State *L = ps->dec.L;
+    if (n == 0) return;
+    if (fieldh) {
+        lua_pushvalue(L, fieldh);
+        lua_pushvalue(L, ps->batch);
+        lua_pushinteger(L, n);
+        lua_call(L, 2, 0);
+    }
+    else if (lua_isfunction(L, hooks + H_BATCH)) {
+        lua_pushvalue(L, hooks + H_BATCH);
+        lua_pushstring(L, f->name);
+        lua_pushvalue(L, ps->batch);
+        lua_pushinteger(L, n);
+        lua_call(L, 3, 0);
+    }
+    else if (lua_isfunction(L, hooks + H_FIELD)) {
+        int i;
+        for (i = 1; i <= n; ++i) {
+            lua_pushvalue(L, hooks + H_FIELD);
+            lua_pushstring(L, f->name);
+            lua_rawgeti(L, ps->batch, i);
+            lua_call(L, 2, 0);
+        }
+    }
+}
+
+static void parse_packed(pb_Parse *ps, int hooks, int fieldh, pb_Field *f,
+                         int ftype) {
+    lua_State *L = ps->dec.L;
+    pb_Decoder *dec = ps->dec.dec;
+    const char *end = dec->end;
+    int n = 0, wiretype = pb_packedwiretype(f->type);
+    uint64_t len = 0;
+    if (!pb_readvarint(dec, &len) || len > (uint64_t)(dec->end - dec->p))
+        luaL_error(L, "incomplete packed field '%s'", f->name);
+    dec->end = dec->p + len;
+    while (dec->p < dec->end) {
+        pb_pushfield(&ps->dec, wiretype, f, ftype);
+        lua_rawseti(L, ps->batch, ++n);
+        if (n == PB_BATCHSIZE) {
+            parse_batch(ps, hooks, fieldh, n, f);
+            n = 0;
+        }
+    }
+    parse_batch(ps, hooks, fieldh, n, f);
+    dec->end = end;
+}
+
+static void parse_message(pb_Parse *ps, int type, int h, const char *name,
+                          int depth) {
+    lua_State *L = ps->dec.L;
+    pb_Decoder *dec = ps->dec.dec;
+    int top = lua_gettop(L), hooks = top + 1;
+    if (depth > PB_MAXDEPTH)
+        luaL_error(L, "message too deep");
+    if (parse_hooks(L, h, name)) {
+        dec->p = dec->end;
+        lua_settop(L, top);
+        return;
+    }
+    while (dec->p < dec->end) {
+        uint64_t n = 0;
+        pb_Field f;
+        int wiretype, ftype, fieldh = 0;
+        ps->dec.fb = dec->p;
+        if (!pb_readvarint(dec, &n))
+            luaL_error(L, "incomplete tag");
+        wiretype = (int)(n & 7);
+        if (!pb_getfield(&ps->S, type, (lua_Integer)(n >> 3), &f)) {
+            lua_pop(L, 1);
+            lua_pushinteger(L, (lua_Integer)(n >> 3));
+            if (!pb_pushscalar(&ps->dec, wiretype, -1))
+                luaL_error(L, "incomplete field %d", (int)(n >> 3));
+            parse_deliver(L, hooks, 0);
+            continue;
+        }
+        ftype = lua_gettop(L);
+        if (lua_istable(L, hooks + H_FIELDS)) {
+            /* per field handler: function for values, table of
+             * handlers for a sub-message */
+            lua_getfield(L, hooks + H_FIELDS, f.name);
+            fieldh = lua_gettop(L);
+        }
+        if (f.type == PB_Tmessage && wiretype == PB_TLENGTH) {
+            const char *end = dec->end;
+            if (!pb_readvarint(dec, &n) || n > (uint64_t)(dec->end - dec->p))
+                luaL_error(L, "incomplete message '%s'", f.name);
+            dec->end = dec->p + n;
+            parse_message(ps, ftype,
+                    fieldh && lua_istable(L, fieldh) ? fieldh : h, f.name,
+                    depth + 1);
+            dec->end = end;
+            lua_settop(L, ftype - 1);
+            continue;
+        }
+        if (fieldh && !lua_isfunction(L, fieldh))
+            fieldh = 0;
+        if (f.type == PB_Tmessage
+                || (f.type == -1 && wiretype != PB_TGSTART)) {
+            ps->dec.fb = dec->p;
+            skipvalue(&ps->dec, wiretype);
+        }
+        else if (wiretype == PB_TLENGTH && pb_packedwiretype(f.type) >= 0)
+            parse_packed(ps, hooks, fieldh, &f, ftype);
+        else {
+            lua_pushstring(L, f.name);
+            pb_pushfield(&ps->dec, wiretype, &f, ftype);
+            parse_deliver(L, hooks, fieldh);
+        }
+        lua_settop(L, ftype - 1);
+    }
+    if (lua_isfunction(L, hooks + H_END)) {
+        lua_pushvalue(L, hooks + H_END);
+        lua_pushstring(L, name);
+        lua_call(L, 1, 0);
+    }
+    lua_settop(L, top);
+}
+
+static int Lschema_parse(lua_State *L) {
+    pb_Parse ps;
+    pb_Decoder dec;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    dec.s = dec.p = pb_tolbuffer(L, 1, &dec.len);
+    dec.end = dec.s + dec.len;
+    lua_settop(L, 5);
+    lua_createtable(L, PB_BATCHSIZE, 0);
+    ps.S.L = L;
+    ps.S.root = 4;
+    ps.dec.dec = &dec;
+    ps.dec.fb = dec.p;
+    ps.dec.L = L;
+    ps.batch = 6;
+    parse_message(&ps, 2, 3, lua_tostring(L, 5), 1);
+    return 0;
+}
+
+/* JSON transcoding, proto3 JSON mapping straight between wire format
+ * and JSON text, no Lua table is built */
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static pb_Buffer *json_newbuffer(lua_State *L) {
+    pb_Buffer *b = (pb_Buffer*)lua_newuserdata(L, sizeof(pb_Buffer));
+    pb_initbuffer(b, L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_buftype);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        luaopen_pb_buffer(L);
+    }
+    lua_setmetatable(L, -2);
+    return b;
+}
+
+static void pb_addlstr(pb_Buffer *b, const char *s, size_t len) {
+    pb_prepbuffer(b, len);
+    memcpy(&b->buf[b->used], s, len);
+    b->used += len;
+}
+
+#define pb_addlit(b, s) pb_addlstr((b), "" s, sizeof(s) - 1)
+
+static void json_addint(pb_Buffer *b, uint64_t n, int neg) {
+    char s[24], *p = s + sizeof(s);
+    do *--p = (char)('0' + n % 10); while ((n /= 10) != 0);
+    if (neg) *--p = '-';
+    pb_addlstr(b, p, s + sizeof(s) - p);
+}
+
+static void json_addsigned(pb_Buffer *b, int64_t n) {
+    if (n < 0) json_addint(b, ~(uint64_t)n + 1, 1);
+    else       json_addint(b, (uint64_t)n, 0);
+}
+
+static void json_addnumber(pb_Buffer *b, double d, int isfloat) {
+    char s[32];
+    if (d != d)
+        pb_addlit(b, "\"NaN\"");
+    else if (d == HUGE_VAL)
+        pb_addlit(b, "\"Infinity\"");
+    else if (d == -HUGE_VAL)
+        pb_addlit(b, "\"-Infinity\"");
+    else if (isfloat) {
+        /* shortest form reading back as the same float */
+        sprintf(s, "%.7g", d);
+        if ((float)strtod(s, NULL) != (float)d) sprintf(s, "%.9g", d);
+        pb_addlstr(b, s, strlen(s));
+    }
+    else {
+        sprintf(s, "%.15g", d);
+        if (strtod(s, NULL) != d) sprintf(s, "%.17g", d);
+        pb_addlstr(b, s, strlen(s));
+    }
+}
+
+static void json_addstring(pb_Buffer *b, const char *s, size_t len) {
+    static const char hexa[] = "0123456789abcdef";
+    const char *e = s + len;
+    pb_prepbuffer(b, len + 2);
+    pb_addchar(b, '"');
+    for (; s < e; ++s) {
+        unsigned char ch = (unsigned char)*s;
+        pb_prepbuffer(b, 6);
+        if (ch == '"' || ch == '\\') {
+            pb_addchar(b, '\\');
+            pb_addchar(b, ch);
+        }
+        else if (ch >= 0x20)
+            pb_addchar(b, ch);
+        else {
+            switch (ch) {
+            case '\b': pb_addlit(b, "\\b"); break;
+            case '\f': pb_addlit(b, "\\f"); break;
+            case '\n': pb_addlit(b, "\\n"); break;
+            case '\r': pb_addlit(b, "\\r"); break;
+            case '\t': pb_addlit(b, "\\t"); break;
+            default:
+                pb_addlit(b, "\\u00");
+                pb_addchar(b, hexa[ch >> 4]);
+                pb_addchar(b, hexa[ch & 0xF]);
+            }
+        }
+    }
+    pb_prepbuffer(b, 1);
+    pb_addchar(b, '"');
+}
+
+static const char pb_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void json_addbase64(pb_Buffer *b, const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char*)s;
+    size_t i;
+    pb_prepbuffer(b, (len + 2) / 3 * 4 + 2);
+    pb_addchar(b, '"');
+    for (i = 0; i + 2 < len; i += 3) {
+        uint32_t n = (uint32_t)p[i] << 16 | (uint32_t)p[i+1] << 8 | p[i+2];
+        pb_addchar(b, pb_base64[n >> 18]);
+        pb_addchar(b, pb_base64[(n >> 12) & 0x3F]);
+        pb_addchar(b, pb_base64[(n >> 6) & 0x3F]);
+        pb_addchar(b, pb_base64[n & 0x3F]);
+    }
+    if (i < len) {
+        uint32_t n = (uint32_t)p[i] << 16;
+        if (i + 1 < len) n |= (uint32_t)p[i+1] << 8;
+        pb_addchar(b, pb_base64[n >> 18]);
+        pb_addchar(b, pb_base64[(n >> 12) & 0x3F]);
+        pb_addchar(b, i + 1 < len ? pb_base64[(n >> 6) & 0x3F] : '=');
+        pb_addchar(b, '=');
+    }
+    pb_addchar(b, '"');
+}
+
+/* protobuf -> JSON */
+
+typedef struct pb_ToJson {
+    pb_Schema S;
+    pb_FBDecoder dec;
+    pb_Buffer *b;
+    int proto_names;
+    int enum_numbers;
+    int depth;
+} pb_ToJson;
+
+static void tojson_key(pb_ToJson *J, const char *name) {
+    pb_Buffer *b = J->b;
+    int upper = 0;
+    pb_prepbuffer(b, strlen(name) + 3);
+    pb_addchar(b, '"');
+    for (; *name; ++name) {
+        if (J->proto_names)
+            pb_addchar(b, *name);
+        else if (*name == '_')
+            upper = 1;
+        else {
+            pb_addchar(b, upper && *name >= 'a' && *name <= 'z' ?
+                    *name - 'a' + 'A' : *name);
+            upper = 0;
+        }
+    }
+    pb_addchar(b, '"');
+    pb_addchar(b, ':');
+}
+
+static int tojson_mismatch(pb_ToJson *J, pb_Field *f, int wiretype) {
+    return luaL_error(J->dec.L, "type mismatch at field '%s' (wiretype %d)",
+            f->name, wiretype);
+}
+
+static void tojson_message(pb_ToJson *J, int type);
+
+/* write one value of field f, with type table of f at ftype */
+static void tojson_value(pb_ToJson *J, pb_Field *f, int ftype, int wiretype) {
+    pb_Decoder *dec = J->dec.dec;
+    lua_State *L = J->dec.L;
+    pb_Buffer *b = J->b;
+    uint64_t u = 0;
+    uint32_t u32 = 0;
+    int ok = 0;
+    switch (wiretype) {
+    case PB_TVARINT: ok = pb_readvarint(dec, &u); break;
+    case PB_T32BIT:  ok = pb_readfixed32(dec, &u32); u = u32; break;
+    case PB_T64BIT:  ok = pb_readfixed64(dec, &u); break;
+    case PB_TLENGTH:
+        ok = pb_readvarint(dec, &u) && u <= (uint64_t)(dec->end - dec->p);
+        break;
+    default: tojson_mismatch(J, f, wiretype);
+    }
+    if (!ok) luaL_error(L, "incomplete field '%s'", f->name);
+    if (wiretype == PB_TLENGTH) {
+        const char *s = dec->p;
+        dec->p += u;
+        switch (f->type) {
+        case PB_Tstring: json_addstring(b, s, (size_t)u); return;
+        case PB_Tbytes:  json_addbase64(b, s, (size_t)u); return;
+        case PB_Tmessage: {
+            const char *end = dec->end;
+            dec->p = s;
+            dec->end = s + u;
+            tojson_message(J, ftype);
+            dec->p = dec->end;
+            dec->end = end;
+            return;
+        }
+        default: tojson_mismatch(J, f, wiretype);
+        }
+    }
+    switch (f->type) {
+    case PB_Tbool:
+        if (wiretype != PB_TVARINT) tojson_mismatch(J, f, wiretype);
+        if (u) pb_addlit(b, "true"); else pb_addlit(b, "false");
+        break;
+    case PB_Tenum:
+        if (wiretype != PB_TVARINT) tojson_mismatch(J, f, wiretype);
+        if (!J->enum_numbers && lua_istable(L, ftype)) {
+            size_t len;
+            const char *name;
+            lua_rawgeti(L, ftype, (lua_Integer)(int32_t)u);
+            if ((name = lua_tolstring(L, -1, &len)) != NULL) {
+                json_addstring(b, name, len);
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pop(L, 1);
+        }
+        json_addsigned(b, (int32_t)u);
+        break;
+    case PB_Tint32: case PB_Tsfixed32:
+        json_addsigned(b, (int32_t)u);
+        break;
+    case PB_Tuint32: case PB_Tfixed32:
+        json_addint(b, (uint32_t)u, 0);
+        break;
+    case PB_Tsint32:
+        json_addsigned(b, (int32_t)((uint32_t)u >> 1 ^ -(int32_t)(u & 1)));
+        break;
+    case PB_Tint64: case PB_Tsfixed64:
+        pb_addlit(b, "\"");
+        json_addsigned(b, (int64_t)u);
+        pb_addlit(b, "\"");
+        break;
+    case PB_Tuint64: case PB_Tfixed64:
+        pb_addlit(b, "\"");
+        json_addint(b, u, 0);
+        pb_addlit(b, "\"");
+        break;
+    case PB_Tsint64:
+        pb_addlit(b, "\"");
+        json_addsigned(b, (int64_t)(u >> 1 ^ -(int64_t)(u & 1)));
+        pb_addlit(b, "\"");
+        break;
+    case PB_Tfloat: {
+        union { uint32_t u32; float f; } v;
+        if (wiretype != PB_T32BIT) tojson_mismatch(J, f, wiretype);
+        v.u32 = u32;
+        json_addnumber(b, v.f, 1);
+        break;
+    }
+    case PB_Tdouble: {
+        union { uint64_t u64; double d; } v;
+        if (wiretype != PB_T64BIT) tojson_mismatch(J, f, wiretype);
+        v.u64 = u;
+        json_addnumber(b, v.d, 0);
+        break;
+    }
+    default:
+        tojson_mismatch(J, f, wiretype);
+    }
+}
+
+static void tojson_skip(pb_ToJson *J, int wiretype) {
+    J->dec.fb = J->dec.dec->p;
+    if (!skipvalue(&J->dec, wiretype))
+        luaL_error(J->dec.L, "incomplete field");
+}
+
+static int pb_ismapentry(lua_State *L, int ftype) {
+    int res;
+    if (!lua_istable(L, ftype)) return 0;
+    lua_getfield(L, ftype, "map_entry");
+    res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return res;
+}
+
+/* value of a key or value missing in a map entry */
+static void tojson_zero(pb_ToJson *J, pb_Field *f, int ftype) {
+    lua_State *L = J->dec.L;
+    switch (f->type) {
+    case PB_Tstring: case PB_Tbytes:
+        pb_addlit(J->b, "\"\""); break;
+    case PB_Tbool:
+        pb_addlit(J->b, "false"); break;
+    case PB_Tint64: case PB_Tuint64: case PB_Tsint64:
+    case PB_Tfixed64: case PB_Tsfixed64:
+        pb_addlit(J->b, "\"0\""); break;
+    case PB_Tmessage:
+        pb_addlit(J->b, "{}"); break;
+    case PB_Tenum:
+        if (!J->enum_numbers && lua_istable(L, ftype)) {
+            size_t len;
+            const char *name;
+            lua_rawgeti(L, ftype, 0);
+            if ((name = lua_tolstring(L, -1, &len)) != NULL) {
+                json_addstring(J->b, name, len);
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pop(L, 1);
+        }
+        /* fall through */
+    default:
+        pb_addlit(J->b, "0");
+    }
+}
+
+/* one map entry as "key":value, JSON keys are always strings */
+static void tojson_entry(pb_ToJson *J, int entry, int wiretype) {
+    lua_State *L = J->dec.L;
+    pb_Decoder *dec = J->dec.dec;
+    const char *end = dec->end, *key = NULL, *value = NULL;
+    int kwt = 0, vwt = 0, top = lua_gettop(L);
+    uint64_t len = 0;
+    pb_Field kf, vf;
+    size_t start;
+    if (wiretype != PB_TLENGTH || !pb_readvarint(dec, &len)
+            || len > (uint64_t)(dec->end - dec->p))
+        luaL_error(L, "incomplete map entry");
+    dec->end = dec->p + len;
+    while (dec->p < dec->end) {
+        uint64_t n = 0;
+        if (!pb_readvarint(dec, &n))
+            luaL_error(L, "incomplete tag");
+        if ((n >> 3) == 1)      key = dec->p, kwt = (int)(n & 7);
+        else if ((n >> 3) == 2) value = dec->p, vwt = (int)(n & 7);
+        tojson_skip(J, (int)(n & 7));
+    }
+    pb_getfield(&J->S, entry, 1, &kf);
+    pb_getfield(&J->S, entry, 2, &vf);
+    start = J->b->used;
+    if (key == NULL)
+        tojson_zero(J, &kf, top + 1);
+    else {
+        dec->p = key;
+        tojson_value(J, &kf, top + 1, kwt);
+    }
+    if (J->b->buf[start] != '"') {
+        pb_prepbuffer(J->b, 2);
+        memmove(&J->b->buf[start + 1], &J->b->buf[start],
+                J->b->used - start);
+        J->b->buf[start] = '"';
+        ++J->b->used;
+        pb_addchar(J->b, '"');
+    }
+    pb_addlit(J->b, ":");
+    if (value == NULL)
+        tojson_zero(J, &vf, top + 2);
+    else {
+        dec->p = value;
+        tojson_value(J, &vf, top + 2, vwt);
+    }
+    dec->p = dec->end;
+    dec->end = end;
+    lua_settop(L, top);
+}
+
+/* write one occurrence of field, a packed one writes all its values */
+static int tojson_values(pb_ToJson *J, pb_Field *f, int ftype, int wiretype,
+                         int count, int ismap) {
+    pb_Decoder *dec = J->dec.dec;
+    if (ismap) {
+        if (count++) pb_addlit(J->b, ",");
+        tojson_entry(J, ftype, wiretype);
+        return count;
+    }
+    if (wiretype == PB_TLENGTH && pb_packedwiretype(f->type) >= 0) {
+        const char *end = dec->end;
+        uint64_t len = 0;
+        int wt = pb_packedwiretype(f->type);
+        if (!pb_readvarint(dec, &len) || len > (uint64_t)(dec->end - dec->p))
+            luaL_error(J->dec.L, "incomplete packed field '%s'", f->name);
+        dec->end = dec->p + len;
+        while (dec->p < dec->end) {
+            if (count++) pb_addlit(J->b, ",");
+            tojson_value(J, f, ftype, wt);
+        }
+        dec->end = end;
+        return count;
+    }
+    if (count++) pb_addlit(J->b, ",");
+    tojson_value(J, f, ftype, wiretype);
+    return count;
+}
+
+/* fields are written in the order they first appear: one scan notes
+ * where each field's values are, as (offset << 3 | wiretype) after its
+ * tag in a table per field, all of them for repeated fields (written
+ * as one array, an object for maps) and the last one for singular
+ * fields, like pb.decode() keeps it; then they are written */
+static void tojson_note(pb_ToJson *J, int fields, int order, int *count,
+                        lua_Integer tag, int repeated, int wiretype) {
+    lua_State *L = J->dec.L;
+    pb_Decoder *dec = J->dec.dec;
+    lua_Integer pos = (lua_Integer)(dec->p - dec->s) * 8 + wiretype;
+    lua_rawgeti(L, fields, tag);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, repeated ? 4 : 2, 0);
+        lua_pushinteger(L, tag);
+        lua_rawseti(L, -2, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, fields, tag);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, order, ++*count);
+    }
+    lua_pushinteger(L, pos);
+    lua_rawseti(L, -2, repeated ? (int)lua_rawlen(L, -2) + 1 : 2);
+    lua_pop(L, 1);
+}
+
+static void tojson_field(pb_ToJson *J, int type, int notes) {
+    lua_State *L = J->dec.L;
+    pb_Decoder *dec = J->dec.dec;
+    int i, n = (int)lua_rawlen(L, notes), ftype, count = 0, ismap = 0;
+    lua_Integer tag;
+    pb_Field f;
+    lua_rawgeti(L, notes, 1);
+    tag = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    pb_getfield(&J->S, type, tag, &f);
+    ftype = lua_gettop(L);
+    tojson_key(J, f.name);
+    if (f.repeated && f.type == PB_Tmessage)
+        ismap = pb_ismapentry(L, ftype);
+    if (f.repeated) pb_addlstr(J->b, ismap ? "{" : "[", 1);
+    for (i = 2; i <= n; ++i) {
+        lua_Integer pos;
+        lua_rawgeti(L, notes, i);
+        pos = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        dec->p = dec->s + (size_t)(pos >> 3);
+        if (f.repeated)
+            count = tojson_values(J, &f, ftype, (int)(pos & 7), count,
+                                  ismap);
+        else
+            tojson_value(J, &f, ftype, (int)(pos & 7));
+    }
+    if (f.repeated) pb_addlstr(J->b, ismap ? "}" : "]", 1);
+    lua_settop(L, ftype - 1);
+}
+
+static void tojson_message(pb_ToJson *J, int type) {
+    lua_State *L = J->dec.L;
+    pb_Decoder *dec = J->dec.dec;
+    int top = lua_gettop(L), i, count = 0;
+    const char *end;
+    if (++J->depth > PB_MAXDEPTH)
+        luaL_error(L, "message too deep");
+    luaL_checkstack(L, 10, "message too deep");
+    lua_newtable(L); /* tag -> notes */
+    lua_newtable(L); /* notes in order */
+    while (dec->p < dec->end) {
+        uint64_t n = 0;
+        lua_Integer tag;
+        pb_Field f;
+        int wiretype, known;
+        if (!pb_readvarint(dec, &n))
+            luaL_error(L, "incomplete tag");
+        tag = (lua_Integer)(n >> 3);
+        wiretype = (int)(n & 7);
+        known = pb_getfield(&J->S, type, tag, &f) && f.type >= 0
+            && (f.type != PB_Tmessage || lua_istable(L, -1));
+        lua_pop(L, 1);
+        if (known)
+            tojson_note(J, top + 1, top + 2, &count, tag, f.repeated,
+                        wiretype);
+        tojson_skip(J, wiretype);
+    }
+    end = dec->p;
+    pb_addlit(J->b, "{");
+    for (i = 1; i <= count; ++i) {
+        if (i > 1) pb_addlit(J->b, ",");
+        lua_rawgeti(L, top + 2, i);
+        tojson_field(J, type, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    pb_addlit(J->b, "}");
+    dec->p = end;
+    lua_settop(L, top);
+    --J->depth;
+}
+
+static int Lschema_tojson(lua_State *L) {
+    pb_ToJson J;
+    pb_Decoder dec;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    dec.s = dec.p = pb_tolbuffer(L, 1, &dec.len);
+    dec.end = dec.s + dec.len;
+    J.proto_names = J.enum_numbers = 0;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "proto_names");
+        J.proto_names = lua_toboolean(L, -1);
+        lua_getfield(L, 4, "enum_numbers");
+        J.enum_numbers = lua_toboolean(L, -1);
+    }
+    lua_settop(L, 3);
+    J.S.L = L;
+    J.S.root = 3;
+    J.dec.dec = &dec;
+    J.dec.fb = dec.p;
+    J.dec.L = L;
+    J.depth = 0;
+    J.b = json_newbuffer(L);
+    tojson_message(&J, 2);
+    lua_pushlstring(L, J.b->buf, J.b->used);
+    pb_resetbuffer(J.b);
+    return 1;
+}
+
+/* JSON -> protobuf */
+
+typedef struct pb_FromJson {
+    pb_Schema S;
+    lua_State *L;
+    pb_Buffer *b;   /* output */
+    pb_Buffer *tmp; /* decoded keys and strings */
+    const char *s, *p, *end;
+    int names;      /* stack index of JSON names cache */
+    int depth;
+} pb_FromJson;
+
+static int fromjson_error(pb_FromJson *J, const char *msg) {
+    return luaL_error(J->L, "%s at position %d of JSON", msg,
+            (int)(J->p - J->s) + 1);
+}
+
+static int json_peek(pb_FromJson *J) {
+    while (J->p < J->end && (*J->p == ' ' || *J->p == '\t'
+                || *J->p == '\n' || *J->p == '\r'))
+        ++J->p;
+    return J->p < J->end ? (unsigned char)*J->p : -1;
+}
+
+static void json_expect(pb_FromJson *J, int ch) {
+    char msg[] = "'?' expected";
+    if (json_peek(J) != ch) {
+        msg[1] = (char)ch;
+        fromjson_error(J, msg);
+    }
+    ++J->p;
+}
+
+static int json_literal(pb_FromJson *J, const char *lit) {
+    size_t len = strlen(lit);
+    json_peek(J);
+    if ((size_t)(J->end - J->p) < len || memcmp(J->p, lit, len) != 0)
+        return 0;
+    J->p += len;
+    return 1;
+}
+
+static unsigned long json_hex4(pb_FromJson *J) {
+    unsigned long c = 0;
+    int i;
+    if (J->end - J->p < 4) fromjson_error(J, "invalid escape");
+    for (i = 0; i < 4; ++i) {
+        int ch = (unsigned char)*J->p++;
+        c <<= 4;
+        if (ch >= '0' && ch <= '9')      c |= ch - '0';
+        else if (ch >= 'a' && ch <= 'f') c |= ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F') c |= ch - 'A' + 10;
+        else fromjson_error(J, "invalid escape");
+    }
+    return c;
+}
+
+static void json_addutf8(pb_Buffer *b, unsigned long c) {
+    pb_prepbuffer(b, 4);
+    if (c < 0x80)
+        pb_addchar(b, (char)c);
+    else if (c < 0x800) {
+        pb_addchar(b, (char)(0xC0 | (c >> 6)));
+        pb_addchar(b, (char)(0x80 | (c & 0x3F)));
+    }
+    else if (c < 0x10000) {
+        pb_addchar(b, (char)(0xE0 | (c >> 12)));
+        pb_addchar(b, (char)(0x80 | ((c >> 6) & 0x3F)));
+        pb_addchar(b, (char)(0x80 | (c & 0x3F)));
+    }
+    else {
+        pb_addchar(b, (char)(0xF0 | (c >> 18)));
+        pb_addchar(b, (char)(0x80 | ((c >> 12) & 0x3F)));
+        pb_addchar(b, (char)(0x80 | ((c >> 6) & 0x3F)));
+        pb_addchar(b, (char)(0x80 | (c & 0x3F)));
+    }
+}
+
+/* decode a JSON string to out */
+static void fromjson_string(pb_FromJson *J, pb_Buffer *out) {
+    json_expect(J, '"');
+    for (;;) {
+        const char *start = J->p;
+        unsigned long c;
+        while (J->p < J->end && *J->p != '"' && *J->p != '\\'
+                && (unsigned char)*J->p >= 0x20)
+            ++J->p;
+        pb_addlstr(out, start, J->p - start);
+        if (J->p >= J->end) fromjson_error(J, "unfinished string");
+        if (*J->p == '"') break;
+        if (*J->p != '\\') fromjson_error(J, "control character in string");
+        if (++J->p >= J->end) fromjson_error(J, "unfinished string");
+        switch (*J->p++) {
+        case '"':  c = '"'; break;
+        case '\\': c = '\\'; break;
+        case '/':  c = '/'; break;
+        case 'b':  c = '\b'; break;
+        case 'f':  c = '\f'; break;
+        case 'n':  c = '\n'; break;
+        case 'r':  c = '\r'; break;
+        case 't':  c = '\t'; break;
+        case 'u':
+            c = json_hex4(J);
+            if (c >= 0xDC00 && c < 0xE000)
+                fromjson_error(J, "invalid surrogate pair");
+            if (c >= 0xD800 && c < 0xDC00) {
+                unsigned long lo;
+                if (J->end - J->p < 6 || J->p[0] != '\\' || J->p[1] != 'u')
+                    fromjson_error(J, "invalid surrogate pair");
+                J->p += 2;
+                lo = json_hex4(J);
+                if (lo < 0xDC00 || lo >= 0xE000)
+                    fromjson_error(J, "invalid surrogate pair");
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+            }
+            break;
+        default:
+            --J->p;
+            fromjson_error(J, "invalid escape");
+            return;
+        }
+        json_addutf8(out, c);
+    }
+    ++J->p;
+}
+
+/* a number (or a quoted one) as a C string in s */
+static void fromjson_numstr(pb_FromJson *J, char *s, size_t size) {
+    const char *start;
+    size_t len;
+    if (json_peek(J) == '"') {
+        J->tmp->used = 0;
+        fromjson_string(J, J->tmp);
+        start = J->tmp->buf, len = J->tmp->used;
+    }
+    else {
+        start = J->p;
+        while (J->p < J->end && strchr("+-0123456789.eE", *J->p) != NULL)
+            ++J->p;
+        len = J->p - start;
+    }
+    if (len == 0 || len >= size) fromjson_error(J, "number expected");
+    memcpy(s, start, len);
+    s[len] = '\0';
+}
+
+static double fromjson_double(pb_FromJson *J) {
+    char s[64], *end;
+    double d;
+    fromjson_numstr(J, s, sizeof(s));
+    if (strcmp(s, "NaN") == 0) return HUGE_VAL - HUGE_VAL;
+    if (strcmp(s, "Infinity") == 0) return HUGE_VAL;
+    if (strcmp(s, "-Infinity") == 0) return -HUGE_VAL;
+    errno = 0;
+    d = strtod(s, &end);
+    if (*end != '\0') fromjson_error(J, "invalid number");
+    if (errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL))
+        fromjson_error(J, "number out of range");
+    return d;
+}
+
+/* integers, range checked for bits (sign bit included if issigned) */
+static uint64_t fromjson_int(pb_FromJson *J, int issigned, int bits) {
+    char s[64], *end;
+    uint64_t u;
+    fromjson_numstr(J, s, sizeof(s));
+    errno = 0;
+    if (strpbrk(s, ".eE") != NULL) {
+        double d = strtod(s, &end);
+        if (*end != '\0' || d != floor(d))
+            fromjson_error(J, "integer expected");
+        if (d < -9223372036854775808.0 || (issigned
+                    ? d >= 9223372036854775808.0
+                    : d < 0 || d >= 18446744073709551616.0))
+            fromjson_error(J, "integer out of range");
+        u = d < 0 ? (uint64_t)(int64_t)d : (uint64_t)d;
+    }
+    else if (issigned)
+        u = (uint64_t)strtoll(s, &end, 10);
+    else {
+        if (s[0] == '-') fromjson_error(J, "integer out of range");
+        u = (uint64_t)strtoull(s, &end, 10);
+    }
+    if (*end != '\0') fromjson_error(J, "integer expected");
+    if (errno == ERANGE) fromjson_error(J, "integer out of range");
+    if (bits == 32 && (issigned ? (int64_t)u != (int32_t)u
+                                : u > 0xFFFFFFFFu))
+        fromjson_error(J, "integer out of range");
+    return u;
+}
+
+static void fromjson_skip(pb_FromJson *J) {
+    int ch = json_peek(J);
+    if (++J->depth > PB_MAXDEPTH) fromjson_error(J, "JSON too deep");
+    if (ch == '{' || ch == '[') {
+        int close = ch == '{' ? '}' : ']';
+        ++J->p;
+        if (json_peek(J) != close) {
+            do {
+                if (close == '}') {
+                    J->tmp->used = 0;
+                    fromjson_string(J, J->tmp);
+                    json_expect(J, ':');
+                }
+                fromjson_skip(J);
+            } while (json_peek(J) == ',' && ++J->p);
+        }
+        json_expect(J, close);
+    }
+    else if (ch == '"') {
+        J->tmp->used = 0;
+        fromjson_string(J, J->tmp);
+    }
+    else if (!json_literal(J, "true") && !json_literal(J, "false")
+            && !json_literal(J, "null")) {
+        char s[64];
+        fromjson_numstr(J, s, sizeof(s));
+    }
+    --J->depth;
+}
+
+/* field of JSON key in tmp, accepting proto and lowerCamelCase names */
+static int fromjson_field(pb_FromJson *J, int type, lua_Integer *tag,
+                          pb_Field *f) {
+    lua_State *L = J->L;
+    lua_getfield(L, type, "map");
+    if (lua_istable(L, -1)) {
+        lua_pushlstring(L, J->tmp->buf, J->tmp->used);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+    }
+    if (!lua_isnumber(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, type);
+        lua_rawget(L, J->names);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushnil(L);
+            while (lua_next(L, type)) {
+                const char *name;
+                if (lua_type(L, -2) == LUA_TNUMBER && lua_istable(L, -1)) {
+                    lua_getfield(L, -1, "name");
+                    if ((name = lua_tostring(L, -1)) != NULL) {
+                        luaL_Buffer b;
+                        int upper = 0;
+                        luaL_buffinit(L, &b);
+                        for (; *name; ++name) {
+                            if (*name == '_') { upper = 1; continue; }
+                            luaL_addchar(&b, upper && *name >= 'a'
+                                    && *name <= 'z' ? *name - 'a' + 'A'
+                                    : *name);
+                            upper = 0;
+                        }
+                        luaL_pushresult(&b);
+                        lua_pushvalue(L, -4);
+                        lua_rawset(L, -6);
+                    }
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+            }
+            lua_pushvalue(L, type);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, J->names);
+        }
+        lua_pushlstring(L, J->tmp->buf, J->tmp->used);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+    }
+    if (!lua_isnumber(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        return 0;
+    }
+    *tag = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return pb_getfield(&J->S, type, *tag, f) && f->type >= 0;
+}
+
+static void fromjson_message(pb_FromJson *J, int type);
+
+/* prefix bytes written since start with their length */
+static void pb_addlength(pb_Buffer *b, size_t start) {
+    size_t len = b->used - start, n = len, size = 1;
+    while (n >= 0x80) n >>= 7, ++size;
+    pb_prepbuffer(b, size);
+    memmove(&b->buf[start + size], &b->buf[start], len);
+    b->used = start;
+    pb_addvarint(b, len);
+    b->used += len;
+}
+
+static int pb_wiretypeof(int type) {
+    switch (type) {
+    case PB_Tbytes: case PB_Tstring: case PB_Tmessage:
+        return PB_TLENGTH;
+    default:
+        return pb_packedwiretype(type);
+    }
+}
+
+static void fromjson_base64(pb_FromJson *J) {
+    static signed char map[256];
+    pb_Buffer *b = J->b;
+    uint32_t n = 0;
+    size_t i;
+    int bits = 0;
+    if (map['B'] == 0) {
+        memset(map, -1, sizeof(map));
+        for (i = 0; i < 64; ++i) map[(unsigned char)pb_base64[i]] = (char)i;
+        map['-'] = 62, map['_'] = 63;
+    }
+    J->tmp->used = 0;
+    fromjson_string(J, J->tmp);
+    pb_prepbuffer(b, J->tmp->used);
+    for (i = 0; i < J->tmp->used; ++i) {
+        int v = map[(unsigned char)J->tmp->buf[i]];
+        if (J->tmp->buf[i] == '=') break;
+        if (v < 0) fromjson_error(J, "invalid base64 string");
+        n = n << 6 | (uint32_t)v;
+        if ((bits += 6) >= 8) {
+            bits -= 8;
+            pb_addchar(b, (char)(n >> bits));
+        }
+    }
+}
+
+/* write value of scalar or enum field, without tag */
+static void fromjson_scalar(pb_FromJson *J, pb_Field *f, int ftype) {
+    pb_Buffer *b = J->b;
+    union { uint32_t u32; float f; uint64_t u64; double d; } u;
+    u.u64 = 0;
+    switch (f->type) {
+    case PB_Tbool:
+        if (json_literal(J, "true"))       u.u64 = 1;
+        else if (json_literal(J, "false")) u.u64 = 0;
+        else fromjson_error(J, "boolean expected");
+        pb_addvarint(b, u.u64);
+        break;
+    case PB_Tenum:
+        if (json_peek(J) == '"' && lua_istable(J->L, ftype)) {
+            lua_State *L = J->L;
+            J->tmp->used = 0;
+            fromjson_string(J, J->tmp);
+            lua_getfield(L, ftype, "map");
+            lua_pushlstring(L, J->tmp->buf, J->tmp->used);
+            lua_rawget(L, -2);
+            if (!lua_isnumber(L, -1))
+                fromjson_error(J, "unknown enum value");
+            u.u64 = (uint64_t)(int64_t)lua_tointeger(L, -1);
+            lua_pop(L, 2);
+        }
+        else
+            u.u64 = (uint64_t)(int64_t)(int32_t)fromjson_int(J, 1, 32);
+        pb_addvarint(b, u.u64);
+        break;
+    case PB_Tint32:
+        pb_addvarint(b, (uint64_t)(int64_t)(int32_t)fromjson_int(J, 1, 32));
+        break;
+    case PB_Tuint32:
+        pb_addvarint(b, fromjson_int(J, 0, 32));
+        break;
+    case PB_Tsint32:
+        u.u32 = (uint32_t)fromjson_int(J, 1, 32);
+        pb_addvarint(b, (uint32_t)((u.u32 << 1) ^ -(u.u32 >> 31)));
+        break;
+    case PB_Tint64:
+        pb_addvarint(b, fromjson_int(J, 1, 64));
+        break;
+    case PB_Tuint64:
+        pb_addvarint(b, fromjson_int(J, 0, 64));
+        break;
+    case PB_Tsint64:
+        u.u64 = fromjson_int(J, 1, 64);
+        pb_addvarint(b, (u.u64 << 1) ^ -(u.u64 >> 63));
+        break;
+    case PB_Tfixed32:
+        pb_addfixed32(b, (uint32_t)fromjson_int(J, 0, 32));
+        break;
+    case PB_Tsfixed32:
+        pb_addfixed32(b, (uint32_t)fromjson_int(J, 1, 32));
+        break;
+    case PB_Tfixed64:
+        pb_addfixed64(b, fromjson_int(J, 0, 64));
+        break;
+    case PB_Tsfixed64:
+        pb_addfixed64(b, fromjson_int(J, 1, 64));
+        break;
+    case PB_Tfloat:
+        u.d = fromjson_double(J);
+        if (u.d == u.d && (u.d > FLT_MAX || u.d < -FLT_MAX)
+                && u.d != HUGE_VAL && u.d != -HUGE_VAL)
+            fromjson_error(J, "number out of range");
+        u.f = (float)u.d;
+        pb_addfixed32(b, u.u32);
+        break;
+    case PB_Tdouble:
+        u.d = fromjson_double(J);
+        pb_addfixed64(b, u.u64);
+        break;
+    default:
+        fromjson_error(J, "unsupported field type");
+    }
+}
+
+static void fromjson_value(pb_FromJson *J, lua_Integer tag, pb_Field *f,
+                           int ftype) {
+    pb_Buffer *b = J->b;
+    size_t start;
+    pb_addtag(b, (uint32_t)tag, pb_wiretypeof(f->type));
+    switch (f->type) {
+    case PB_Tstring:
+        start = b->used;
+        fromjson_string(J, b);
+        pb_addlength(b, start);
+        break;
+    case PB_Tbytes:
+        start = b->used;
+        fromjson_base64(J);
+        pb_addlength(b, start);
+        break;
+    case PB_Tmessage:
+        start = b->used;
+        fromjson_message(J, ftype);
+        pb_addlength(b, start);
+        break;
+    default:
+        fromjson_scalar(J, f, ftype);
+    }
+}
+
+/* a JSON object to map entries, keys are parsed as JSON values of the
+ * key type */
+static void fromjson_map(pb_FromJson *J, lua_Integer tag, int entry) {
+    lua_State *L = J->L;
+    int top = lua_gettop(L);
+    pb_Field kf, vf;
+    json_expect(J, '{');
+    if (json_peek(J) == '}') {
+        ++J->p;
+        return;
+    }
+    pb_getfield(&J->S, entry, 1, &kf);
+    pb_getfield(&J->S, entry, 2, &vf);
+    do {
+        const char *s = J->s, *p, *end = J->end;
+        size_t start, len;
+        pb_addtag(J->b, (uint32_t)tag, PB_TLENGTH);
+        start = J->b->used;
+        J->tmp->used = 0;
+        if (json_peek(J) != '"') fromjson_error(J, "map key expected");
+        fromjson_string(J, J->tmp);
+        json_expect(J, ':');
+        p = J->p;
+        if (kf.type == PB_Tstring) {
+            pb_addtag(J->b, 1, PB_TLENGTH);
+            pb_addvarint(J->b, J->tmp->used);
+            pb_addlstr(J->b, J->tmp->buf, J->tmp->used);
+        }
+        else {
+            lua_pushlstring(L, J->tmp->buf, J->tmp->used);
+            J->s = J->p = lua_tolstring(L, -1, &len);
+            J->end = J->p + len;
+            pb_addtag(J->b, 1, pb_wiretypeof(kf.type));
+            fromjson_scalar(J, &kf, top + 1);
+            if (json_peek(J) != -1) fromjson_error(J, "invalid map key");
+            lua_pop(L, 1);
+            J->s = s, J->p = p, J->end = end;
+        }
+        if (!json_literal(J, "null"))
+            fromjson_value(J, 2, &vf, top + 2);
+        pb_addlength(J->b, start);
+    } while (json_peek(J) == ',' && ++J->p);
+    json_expect(J, '}');
+    lua_settop(L, top);
+}
+
+static void fromjson_repeated(pb_FromJson *J, lua_Integer tag, pb_Field *f,
+                              int ftype) {
+    if (f->type == PB_Tmessage && pb_ismapentry(J->L, ftype)) {
+        fromjson_map(J, tag, ftype);
+        return;
+    }
+    json_expect(J, '[');
+    if (json_peek(J) == ']') {
+        ++J->p;
+        return;
+    }
+    if (f->packed && pb_packedwiretype(f->type) >= 0) {
+        size_t start;
+        pb_addtag(J->b, (uint32_t)tag, PB_TLENGTH);
+        start = J->b->used;
+        do fromjson_scalar(J, f, ftype);
+        while (json_peek(J) == ',' && ++J->p);
+        pb_addlength(J->b, start);
+    }
+    else {
+        do fromjson_value(J, tag, f, ftype);
+        while (json_peek(J) == ',' && ++J->p);
+    }
+    json_expect(J, ']');
+}
+
+static void fromjson_message(pb_FromJson *J, int type) {
+    lua_State *L = J->L;
+    int top = lua_gettop(L);
+    if (++J->depth > PB_MAXDEPTH) fromjson_error(J, "JSON too deep");
+    luaL_checkstack(L, 10, "JSON too deep");
+    json_expect(J, '{');
+    if (json_peek(J) == '}') {
+        ++J->p;
+        --J->depth;
+        return;
+    }
+    do {
+        lua_Integer tag = 0;
+        pb_Field f;
+        J->tmp->used = 0;
+        if (json_peek(J) != '"') fromjson_error(J, "field name expected");
+        fromjson_string(J, J->tmp);
+        json_expect(J, ':');
+        if (!fromjson_field(J, type, &tag, &f)
+                || (f.type == PB_Tmessage && !lua_istable(L, -1)))
+            fromjson_skip(J);
+        else if (json_literal(J, "null"))
+            ; /* same as absent */
+        else if (f.repeated)
+            fromjson_repeated(J, tag, &f, lua_gettop(L));
+        else
+            fromjson_value(J, tag, &f, lua_gettop(L));
+        lua_settop(L, top);
+    } while (json_peek(J) == ',' && ++J->p);
+    json_expect(J, '}');
+    --J->depth;
+}
+
+static int Lschema_fromjson(lua_State *L) {
+    pb_FromJson J;
+    size_t len;
+    J.s = J.p = luaL_checklstring(L, 1, &len);
+    J.end = J.s + len;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 4);
+    J.L = L;
+    J.S.L = L;
+    J.S.root = 3;
+    J.names = 4;
+    J.depth = 0;
+    J.b = json_newbuffer(L);
+    J.tmp = json_newbuffer(L);
+    fromjson_message(&J, 2);
+    if (json_peek(&J) != -1) fromjson_error(&J, "garbage after JSON");
+    lua_pushlstring(L, J.b->buf, J.b->used);
+    pb_resetbuffer(J.b);
+    pb_resetbuffer(J.tmp);
+    return 1;
+}
+
+/* random access index, one pass skipping over a message records where
+ * each field is, so single fields decode later without the others */
+
+#define PB_DENSETAGS 32
+
+typedef struct pb_IndexEntry {
+    uint32_t tag;
+    int wiretype;
+    size_t offset;  /* of value (with its length prefix) in source */
+    size_t len;
+} pb_IndexEntry;
+
+/* entries are ordered by tag then offset, first[tag] is the first
+ * entry of tag when tags are dense, or NULL to binary search */
+typedef struct pb_Index {
+    const char *s;  /* source string, anchored in registry */
+    size_t count;
+    uint32_t maxtag;
+    uint32_t *first;
+    pb_IndexEntry entries[1];
+} pb_Index;
+
+typedef struct pb_IndexGet {
+    pb_Schema S;
+    pb_Index *idx;
+    pb_Field f;
+    lua_Integer tag;
+    int anchor, type, ftype, map;
+} pb_IndexGet;
+
+static const char pb_indextype[] = "pb.Index";
+#define check_index(L,idx) ((pb_Index*)checkudata(L,idx,(const void*)pb_indextype))
+
+static int index_cmp(const void *a, const void *b) {
+    const pb_IndexEntry *ea = (const pb_IndexEntry*)a;
+    const pb_IndexEntry *eb = (const pb_IndexEntry*)b;
+    if (ea->tag != eb->tag) return ea->tag < eb->tag ? -1 : 1;
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/* skip over fields in [p, end) of s, collecting entries to tmp */
+static size_t index_scan(lua_State *L, pb_Buffer *tmp, const char *s,
+                         const char *p, const char *end, uint32_t *maxtag) {
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    size_t count = 0;
+    dec.s = s, dec.p = p, dec.end = end;
+    dec.len = end - s;
+    fb.dec = &dec, fb.L = L;
+    *maxtag = 0;
+    while (dec.p < dec.end) {
+        pb_IndexEntry e;
+        uint64_t n = 0;
+        if (!pb_readvarint(&dec, &n) || (n >> 3) == 0 || (n >> 3) > 0x1FFFFFFF)
+            luaL_error(L, "invalid tag at offset %d", (int)(dec.p - s));
+        e.tag = (uint32_t)(n >> 3);
+        e.wiretype = (int)(n & 7);
+        e.offset = dec.p - s;
+        fb.fb = dec.p;
+        if (!skipvalue(&fb, e.wiretype))
+            luaL_error(L, "incomplete field at offset %d", (int)e.offset);
+        e.len = dec.p - s - e.offset;
+        pb_addlstr(tmp, (const char*)&e, sizeof(e));
+        if (e.tag > *maxtag) *maxtag = e.tag;
+        ++count;
+    }
+    return count;
+}
+
+static void index_sort(pb_Index *idx, const char *tmp, size_t ndir) {
+    size_t i, count = idx->count;
+    if (ndir == 0) {
+        memcpy(idx->entries, tmp, count * sizeof(pb_IndexEntry));
+        qsort(idx->entries, count, sizeof(pb_IndexEntry), index_cmp);
+        return;
+    }
+    /* counting sort, entries of one tag stay in wire order */
+    idx->first = (uint32_t*)&idx->entries[count];
+    memset(idx->first, 0, ndir * sizeof(uint32_t));
+    for (i = 0; i < count; ++i) {
+        pb_IndexEntry e;
+        memcpy(&e, tmp + i*sizeof(e), sizeof(e));
+        ++idx->first[e.tag + 2];
+    }
+    for (i = 2; i < ndir; ++i)
+        idx->first[i] += idx->first[i-1];
+    for (i = 0; i < count; ++i) {
+        pb_IndexEntry e;
+        memcpy(&e, tmp + i*sizeof(e), sizeof(e));
+        idx->entries[idx->first[e.tag + 1]++] = e;
+    }
+}
+
+static void index_new(pb_Schema *S, pb_Buffer *tmp, int type, int src,
+                      int decode, const char *p, const char *end, int depth);
+
+/* nested messages get their own index, kept in anchor[entry+1] */
+static void index_children(pb_Schema *S, pb_Buffer *tmp, pb_Index *idx,
+                           int type, int src, int decode, int depth) {
+    lua_State *L = S->L;
+    int anchor = lua_gettop(L);
+    size_t i = 0, j;
+    luaL_checkstack(L, 10, "message too deep");
+    while (i < idx->count) {
+        uint32_t tag = idx->entries[i].tag;
+        pb_Field f;
+        for (j = i; j < idx->count && idx->entries[j].tag == tag; ++j)
+            ;
+        if (pb_getfield(S, type, tag, &f) && f.type == PB_Tmessage
+                && lua_istable(L, -1) && !pb_ismapentry(L, -1)) {
+            int ftype = lua_gettop(L);
+            for (; i < j; ++i) {
+                pb_IndexEntry *e = &idx->entries[i];
+                pb_Decoder dec;
+                uint64_t len;
+                if (e->wiretype != PB_TLENGTH) continue;
+                dec.s = idx->s, dec.p = idx->s + e->offset;
+                dec.end = dec.p + e->len;
+                dec.len = dec.end - dec.s;
+                pb_readvarint(&dec, &len);
+                index_new(S, tmp, ftype, src, decode, dec.p, dec.end, depth);
+                lua_rawseti(L, anchor, (int)i + 1);
+            }
+        }
+        lua_settop(L, anchor);
+        i = j;
+    }
+}
+
+/* index message in [p, end) of string at src, pushes the index */
+static void index_new(pb_Schema *S, pb_Buffer *tmp, int type, int src,
+                      int decode, const char *p, const char *end, int depth) {
+    lua_State *L = S->L;
+    const char *s = lua_tostring(L, src);
+    uint32_t maxtag;
+    size_t count, ndir;
+    pb_Index *idx;
+    tmp->used = 0;
+    count = index_scan(L, tmp, s, p, end, &maxtag);
+    ndir = maxtag <= 2*count + PB_DENSETAGS ? maxtag + 3 : 0;
+    idx = (pb_Index*)lua_newuserdata(L, sizeof(pb_Index)
+            + count*sizeof(pb_IndexEntry) + ndir*sizeof(uint32_t));
+    idx->s = s;
+    idx->count = count;
+    idx->maxtag = maxtag;
+    idx->first = NULL;
+    index_sort(idx, tmp->buf, ndir);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_indextype);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, src);
+    lua_setfield(L, -2, "source");
+    lua_pushvalue(L, type);
+    lua_setfield(L, -2, "type");
+    lua_pushvalue(L, S->root);
+    lua_setfield(L, -2, "root");
+    lua_pushvalue(L, decode);
+    lua_setfield(L, -2, "decode");
+    if (depth > 0)
+        index_children(S, tmp, idx, type, src, decode, depth - 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, idx);
+}
+
+static size_t index_lower(pb_Index *idx, uint32_t tag) {
+    size_t l = 0, h = idx->count;
+    while (l < h) {
+        size_t m = l + (h - l) / 2;
+        if (idx->entries[m].tag < tag) l = m + 1;
+        else h = m;
+    }
+    return l;
+}
+
+/* entries of tag are [*lo, *lo + return value) */
+static size_t index_range(pb_Index *idx, lua_Integer tag, size_t *lo) {
+    if (tag <= 0 || tag > idx->maxtag) return 0;
+    if (idx->first != NULL) {
+        *lo = idx->first[tag];
+        return idx->first[tag + 1] - *lo;
+    }
+    *lo = index_lower(idx, (uint32_t)tag);
+    return index_lower(idx, (uint32_t)tag + 1) - *lo;
+}
+
+/* resolve field name or tag at 2, stack becomes
+ * index, field, n, anchor, type, root, ftype */
+static void index_field(lua_State *L, pb_IndexGet *G) {
+    G->idx = check_index(L, 1);
+    lua_settop(L, 3);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, G->idx);
+    lua_getfield(L, 4, "type");
+    lua_getfield(L, 4, "root");
+    if (lua_type(L, 2) == LUA_TNUMBER)
+        G->tag = lua_tointeger(L, 2);
+    else {
+        lua_getfield(L, 5, "map");
+        lua_getfield(L, -1, luaL_checkstring(L, 2));
+        G->tag = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    }
+    G->S.L = L;
+    G->S.root = 6;
+    G->anchor = 4, G->type = 5, G->ftype = 7;
+    if (!pb_getfield(&G->S, 5, G->tag, &G->f) || G->f.type < 0) {
+        lua_pushfstring(L, "field '%s' not found", lua_tostring(L, 2));
+        luaL_argerror(L, 2, lua_tostring(L, -1));
+    }
+    G->map = G->f.type == PB_Tmessage && pb_ismapentry(L, 7);
+}
+
+/* push one value of a not packed entry */
+static void index_pushone(pb_IndexGet *G, size_t i, pb_FBDecoder *fb) {
+    lua_State *L = G->S.L;
+    pb_IndexEntry *e = &G->idx->entries[i];
+    uint64_t len;
+    if (G->f.type != PB_Tmessage) {
+        pb_pushfield(fb, e->wiretype, &G->f, G->ftype);
+        return;
+    }
+    if (e->wiretype != PB_TLENGTH)
+        luaL_error(L, "type mismatch at field '%s'", G->f.name);
+    lua_rawgeti(L, G->anchor, (int)i + 1);
+    if (!lua_isnil(L, -1)) return;
+    lua_pop(L, 1);
+    pb_readvarint(fb->dec, &len);
+    lua_getfield(L, G->anchor, "decode");
+    lua_pushlstring(L, fb->dec->p, (size_t)len);
+    lua_pushvalue(L, G->ftype);
+    lua_call(L, 2, 1);
+}
+
+/* store value on top as the *pk-th one of table t */
+static void index_store(pb_IndexGet *G, int t, size_t k) {
+    lua_State *L = G->S.L;
+    if (!G->map) {
+        lua_rawseti(L, t, (int)k);
+        return;
+    }
+    lua_getfield(L, -1, "key");
+    lua_getfield(L, -2, "value");
+    if (lua_isnil(L, -2))
+        lua_pop(L, 2);
+    else
+        lua_rawset(L, t);
+    lua_pop(L, 1);
+}
+
+/* visit values of entry i, pushes the nth one counting from *pk and
+ * returns 1, or stores all of them to table t if nth is 0 */
+static int index_push(pb_IndexGet *G, size_t i, int t, size_t nth,
+                      size_t *pk) {
+    pb_IndexEntry *e = &G->idx->entries[i];
+    int wt = pb_packedwiretype(G->f.type);
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    dec.s = G->idx->s, dec.p = dec.s + e->offset;
+    dec.end = dec.p + e->len;
+    dec.len = dec.end - dec.s;
+    fb.dec = &dec, fb.fb = dec.p, fb.L = G->S.L;
+    if (e->wiretype == PB_TLENGTH && wt >= 0) { /* packed */
+        uint64_t len;
+        pb_readvarint(&dec, &len);
+        if (nth && wt != PB_TVARINT) {
+            size_t size = wt == PB_T32BIT ? 4 : 8;
+            size_t n = (dec.end - dec.p) / size;
+            if (nth > *pk + n) { *pk += n; return 0; }
+            dec.p += (nth - *pk - 1) * size;
+            *pk = nth - 1;
+        }
+        while (dec.p < dec.end) {
+            fb.fb = dec.p;
+            if (nth && ++*pk != nth) {
+                pb_skipvarint(&dec);
+                continue;
+            }
+            pb_pushfield(&fb, wt, &G->f, G->ftype);
+            if (nth) return 1;
+            index_store(G, t, ++*pk);
+        }
+        return 0;
+    }
+    if (nth && ++*pk != nth) return 0;
+    index_pushone(G, i, &fb);
+    if (nth) return 1;
+    index_store(G, t, ++*pk);
+    return 0;
+}
+
+static int Lindex_gc(lua_State *L) {
+    pb_Index *idx = check_index(L, 1);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, idx);
+    return 0;
+}
+
+static int Lindex_get(lua_State *L) {
+    pb_IndexGet G;
+    lua_Integer n = luaL_optinteger(L, 3, 0);
+    size_t i, lo = 0, cnt, k = 0;
+    index_field(L, &G);
+    cnt = index_range(G.idx, G.tag, &lo);
+    if (n < 0) return 0;
+    if (n == 0 && G.f.repeated) {
+        lua_newtable(L);
+        for (i = lo; i < lo + cnt; ++i)
+            index_push(&G, i, 8, 0, &k);
+        return 1;
+    }
+    if (n == 0) { /* last one wins */
+        if (cnt == 0) return 0;
+        index_push(&G, lo + cnt - 1, 0, 1, &k);
+        return 1;
+    }
+    for (i = lo; i < lo + cnt; ++i)
+        if (index_push(&G, i, 0, (size_t)n, &k))
+            return 1;
+    return 0;
+}
+
+static int Lindex_count(lua_State *L) {
+    pb_IndexGet G;
+    size_t i, lo = 0, cnt, n = 0;
+    int wt;
+    index_field(L, &G);
+    cnt = index_range(G.idx, G.tag, &lo);
+    wt = pb_packedwiretype(G.f.type);
+    for (i = lo; i < lo + cnt; ++i) {
+        pb_IndexEntry *e = &G.idx->entries[i];
+        pb_Decoder dec;
+        uint64_t len;
+        if (e->wiretype != PB_TLENGTH || wt < 0) {
+            ++n;
+            continue;
+        }
+        dec.s = G.idx->s, dec.p = dec.s + e->offset;
+        dec.end = dec.p + e->len;
+        dec.len = dec.end - dec.s;
+        pb_readvarint(&dec, &len);
+        if (wt != PB_TVARINT)
+            n += (dec.end - dec.p) / (wt == PB_T32BIT ? 4 : 8);
+        else
+            for (; dec.p < dec.end; ++dec.p)
+                n += (*dec.p & 0x80) == 0;
+    }
+    lua_pushinteger(L, (lua_Integer)n);
+    return 1;
+}
+
+static int Lschema_index(lua_State *L) {
+    pb_Schema S;
+    pb_Buffer *tmp;
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    lua_Integer depth = luaL_optinteger(L, 4, 0);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 5, LUA_TFUNCTION);
+    lua_settop(L, 5);
+    if (depth > PB_MAXDEPTH) depth = PB_MAXDEPTH;
+    S.L = L;
+    S.root = 3;
+    tmp = json_newbuffer(L);
+    index_new(&S, tmp, 2, 1, 5, s, s + len, (int)depth);
+    pb_resetbuffer(tmp);
+    return 1;
+}
+
+/* arena decoding, a whole message tree goes to memory blocks owned by
+ * one userdata instead of Lua tables: fields of a message are slots in
+ * tag order with presence bits, repeated fields are arrays of slots and
+ * strings/scalars are slices of the source string, converted when read.
+ * Layouts of message types are built once, cached by pb.lua as
+ *   cache[type] = layout, cache[layout] = { ud =, defaults =,
+ *       names = { [name] = i, [i] = name }, [i] = enum type } */
+
+#define PB_ARENABLOCK 1024
+
+typedef union pb_Slot {
+    struct { uint32_t off, len; } s;  /* in source, limited to 4G */
+    struct pb_Array *a;
+    void *m;        /* record of a message */
+} pb_Slot;
+
+typedef struct pb_Array {
+    size_t n;
+    pb_Slot items[1];
+} pb_Array;
+
+typedef struct pb_LayoutField {
+    uint32_t tag;
+    int type;       /* pb_Type, PB_Tmessage/PB_Tenum, -1 if unknown */
+    int repeated;
+    int map;
+    struct pb_Layout *sub;
+} pb_LayoutField;
+
+typedef struct pb_Layout {
+    size_t nfields;
+    size_t bitsize;  /* bytes of presence bits in front of slots */
+    size_t repeated; /* number of repeated fields */
+    pb_LayoutField fields[1];
+} pb_Layout;
+
+/* a decoded message or repeated field, the root one anchors source,
+ * layout cache and memory blocks (userdata, so the GC sees their size),
+ * others anchor the root */
+typedef struct pb_ArenaRef {
+    lua_State *L;
+    const char *src;
+    char *block;    /* current block while decoding */
+    size_t size, used;
+    int anchor, nblocks;
+    struct pb_ArenaRef *root;
+    pb_Layout *layout;
+    void *rec;
+    pb_Array *array;
+    pb_LayoutField *field;  /* of array */
+} pb_ArenaRef;
+
+static const char pb_arenatype[] = "pb.Arena";
+#define check_arena(L,idx) ((pb_ArenaRef*)checkudata(L,idx,(const void*)pb_arenatype))
+
+#define arena_bits(rec)      ((uint32_t*)(rec))
+#define arena_slots(l, rec)  ((pb_Slot*)((char*)(rec) + (l)->bitsize))
+#define arena_has(rec, i)    (arena_bits(rec)[(i)>>5] & (1u << ((i)&31)))
+#define arena_set(rec, i)    (arena_bits(rec)[(i)>>5] |= 1u << ((i)&31))
+
+static void *arena_alloc(pb_ArenaRef *A, size_t size) {
+    void *p;
+    size = (size + 7) & ~(size_t)7;
+    if (A->block == NULL || A->size - A->used < size) {
+        size_t bsize = A->block ? A->size*2 + PB_ARENABLOCK : A->size;
+        if (bsize < size) bsize = size;
+        A->block = (char*)lua_newuserdata(A->L, bsize);
+        lua_rawseti(A->L, A->anchor, ++A->nblocks);
+        A->size = bsize;
+        A->used = 0;
+    }
+    p = A->block + A->used;
+    A->used += size;
+    return p;
+}
+
+static int layout_cmp(const void *a, const void *b) {
+    uint32_t ta = ((const pb_LayoutField*)a)->tag;
+    uint32_t tb = ((const pb_LayoutField*)b)->tag;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* layout of type at type, built into cache at cache if needed */
+static pb_Layout *layout_get(pb_Schema *S, int cache, int type) {
+    lua_State *L = S->L;
+    pb_Layout *l;
+    size_t i, n = 0;
+    int info;
+    lua_pushvalue(L, type);
+    lua_rawget(L, cache);
+    l = (pb_Layout*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (l != NULL) return l;
+    luaL_checkstack(L, 10, "message too deep");
+    lua_pushnil(L);
+    while (lua_next(L, type)) {
+        if (lua_type(L, -2) == LUA_TNUMBER && lua_istable(L, -1)) ++n;
+        lua_pop(L, 1);
+    }
+    l = (pb_Layout*)lua_newuserdata(L, sizeof(pb_Layout)
+            + n*sizeof(pb_LayoutField));
+    l->nfields = n;
+    l->bitsize = ((n + 63) / 64) * 8;
+    l->repeated = 0;
+    i = 0;
+    lua_pushnil(L);
+    while (lua_next(L, type)) {
+        if (lua_type(L, -2) == LUA_TNUMBER && lua_istable(L, -1))
+            l->fields[i++].tag = (uint32_t)lua_tointeger(L, -2);
+        lua_pop(L, 1);
+    }
+    qsort(l->fields, n, sizeof(pb_LayoutField), layout_cmp);
+    lua_createtable(L, (int)n, 3);
+    info = lua_gettop(L);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, info, "ud");
+    lua_getfield(L, type, "defaults");
+    lua_setfield(L, info, "defaults");
+    lua_newtable(L);
+    lua_setfield(L, info, "names");
+    lua_pushlightuserdata(L, l);
+    lua_pushvalue(L, info);
+    lua_rawset(L, cache);
+    lua_pushvalue(L, type);
+    lua_pushlightuserdata(L, l);
+    lua_rawset(L, cache);
+    lua_getfield(L, info, "names");
+    for (i = 0; i < n; ++i) {
+        pb_LayoutField *lf = &l->fields[i];
+        pb_Field f;
+        pb_getfield(S, type, lf->tag, &f);
+        lf->type = f.type;
+        lf->repeated = f.repeated;
+        lf->map = 0;
+        lf->sub = NULL;
+        l->repeated += f.repeated != 0;
+        if (f.name != NULL) {
+            lua_pushstring(L, f.name);
+            lua_pushinteger(L, (lua_Integer)i + 1);
+            lua_rawset(L, -4);
+            lua_pushstring(L, f.name);
+            lua_rawseti(L, -3, (int)i + 1);
+        }
+        if (f.type == PB_Tenum) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, info, (int)i + 1);
+        }
+        else if (f.type == PB_Tmessage && lua_istable(L, -1)) {
+            lf->map = pb_ismapentry(L, -1);
+            lf->sub = layout_get(S, cache, lua_gettop(L));
+        }
+        else if (f.type == PB_Tmessage)
+            lf->type = -1;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 3);
+    return l;
+}
+
+static int layout_find(pb_Layout *l, uint32_t tag) {
+    size_t lo = 0, hi = l->nfields;
+    while (lo < hi) {
+        size_t m = lo + (hi - lo) / 2;
+        if (l->fields[m].tag < tag) lo = m + 1;
+        else if (l->fields[m].tag > tag) hi = m;
+        else return (int)m;
+    }
+    return -1;
+}
+
+/* wire type a value of field is stored as, without packing */
+static int arena_wiretype(pb_LayoutField *f) {
+    return f->type == PB_Tenum ? PB_TVARINT : pb_packedwiretype(f->type) < 0 ?
+        PB_TLENGTH : pb_packedwiretype(f->type);
+}
+
+/* slice of one scalar value at dec->p, skipped over */
+static void arena_scalar(pb_ArenaRef *A, pb_Decoder *dec, int wiretype,
+                         pb_Slot *slot) {
+    pb_FBDecoder fb;
+    fb.dec = dec, fb.fb = dec->p, fb.L = A->L;
+    slot->s.off = (uint32_t)(dec->p - dec->s);
+    if (!skipvalue(&fb, wiretype))
+        luaL_error(A->L, "incomplete field at offset %d",
+                (int)(dec->p - dec->s));
+    slot->s.len = (uint32_t)(dec->p - dec->s - slot->s.off);
+}
+
+static void *arena_message(pb_ArenaRef *A, pb_Layout *l, const char *s,
+                           const char *p, const char *end, int depth);
+
+/* store value of field i with wiretype at dec->p to slot */
+static void arena_value(pb_ArenaRef *A, pb_Decoder *dec, pb_LayoutField *f,
+                        int wiretype, pb_Slot *slot, int depth) {
+    uint64_t len = 0;
+    if (f->type == PB_Tmessage) {
+        if (!pb_readvarint(dec, &len) || len > (size_t)(dec->end - dec->p))
+            luaL_error(A->L, "incomplete message at offset %d",
+                    (int)(dec->p - dec->s));
+        slot->m = arena_message(A, f->sub, dec->s, dec->p,
+                dec->p + (size_t)len, depth + 1);
+        dec->p += (size_t)len;
+        return;
+    }
+    arena_scalar(A, dec, wiretype, slot);
+    if (wiretype == PB_TLENGTH) { /* strings are kept without length */
+        const char *p = dec->s + slot->s.off;
+        while (*p++ & 0x80) ;
+        slot->s.len -= (uint32_t)(p - dec->s - slot->s.off);
+        slot->s.off = (uint32_t)(p - dec->s);
+    }
+}
+
+#define arena_ispacked(f, wiretype) ((f)->repeated && (f)->type >= 0 \
+        && (wiretype) == PB_TLENGTH && arena_wiretype(f) != PB_TLENGTH)
+
+/* read a packed run of field f, storing its values to a if given;
+ * returns number of values in it. Every pass goes through here, so
+ * counted and stored values agree */
+static size_t arena_packed(pb_ArenaRef *A, pb_Decoder *dec,
+                           pb_LayoutField *f, pb_Array *a) {
+    int wiretype = arena_wiretype(f);
+    uint64_t len = 0;
+    size_t n = 0;
+    pb_Decoder sub;
+    pb_Slot slot;
+    if (!pb_readvarint(dec, &len) || len > (size_t)(dec->end - dec->p))
+        luaL_error(A->L, "incomplete field '%d'", (int)f->tag);
+    if ((wiretype == PB_T32BIT && len % 4 != 0)
+            || (wiretype == PB_T64BIT && len % 8 != 0))
+        luaL_error(A->L, "invalid packed field '%d'", (int)f->tag);
+    sub = *dec;
+    sub.end = dec->p + (size_t)len;
+    for (; sub.p < sub.end; ++n)
+        arena_scalar(A, &sub, wiretype, a ? &a->items[a->n++] : &slot);
+    dec->p = sub.end;
+    return n;
+}
+
+/* bytes message in [p, end) takes in the arena, an upper bound as every
+ * repeated field of the layout is given an array header */
+static size_t arena_measure(pb_ArenaRef *A, pb_Layout *l, const char *s,
+                            const char *p, const char *end, int depth) {
+    size_t size = l->bitsize + l->nfields*sizeof(pb_Slot)
+                + l->repeated*sizeof(pb_Array);
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    if (depth > PB_MAXDEPTH)
+        luaL_error(A->L, "message too deep");
+    dec.s = s, dec.len = end - s;
+    dec.p = p, dec.end = end;
+    fb.dec = &dec, fb.L = A->L;
+    while (dec.p < dec.end) {
+        uint64_t n = 0;
+        int i, wiretype;
+        pb_LayoutField *f;
+        if (!pb_readvarint(&dec, &n))
+            luaL_error(A->L, "incomplete tag");
+        wiretype = (int)(n & 7);
+        i = layout_find(l, (uint32_t)(n >> 3));
+        f = i < 0 || l->fields[i].type < 0 ? NULL : &l->fields[i];
+        if (f && arena_ispacked(f, wiretype)) {
+            size += arena_packed(A, &dec, f, NULL) * sizeof(pb_Slot);
+            continue;
+        }
+        if (f && f->repeated) size += sizeof(pb_Slot);
+        if (f && f->type == PB_Tmessage && wiretype == PB_TLENGTH) {
+            uint64_t len = 0;
+            if (!pb_readvarint(&dec, &len)
+                    || len > (size_t)(dec.end - dec.p))
+                luaL_error(A->L, "incomplete field '%d'", (int)f->tag);
+            size += arena_measure(A, f->sub, s, dec.p,
+                    dec.p + (size_t)len, depth + 1);
+            dec.p += (size_t)len;
+            continue;
+        }
+        fb.fb = dec.p;
+        if (!skipvalue(&fb, wiretype))
+            luaL_error(A->L, "incomplete field '%d'", (int)(n >> 3));
+    }
+    return size;
+}
+
+/* count values of repeated fields, into len of their slots */
+static void arena_count(pb_ArenaRef *A, pb_Layout *l, void *rec,
+                        pb_Decoder *dec) {
+    pb_Slot *slots = arena_slots(l, rec);
+    pb_FBDecoder fb;
+    fb.dec = dec, fb.L = A->L;
+    while (dec->p < dec->end) {
+        uint64_t n = 0;
+        int i, wiretype;
+        pb_LayoutField *f;
+        if (!pb_readvarint(dec, &n))
+            luaL_error(A->L, "incomplete tag");
+        wiretype = (int)(n & 7);
+        i = layout_find(l, (uint32_t)(n >> 3));
+        f = i < 0 ? NULL : &l->fields[i];
+        fb.fb = dec->p;
+        if (f && arena_ispacked(f, wiretype)) {
+            slots[i].s.len += arena_packed(A, dec, f, NULL);
+            continue;
+        }
+        if (f && f->repeated && f->type >= 0) ++slots[i].s.len;
+        if (!skipvalue(&fb, wiretype))
+            luaL_error(A->L, "incomplete field '%d'", (int)(n >> 3));
+    }
+}
+
+static void *arena_message(pb_ArenaRef *A, pb_Layout *l, const char *s,
+                           const char *p, const char *end, int depth) {
+    void *rec = arena_alloc(A, l->bitsize + l->nfields*sizeof(pb_Slot));
+    pb_Slot *slots = arena_slots(l, rec);
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    size_t i;
+    if (depth > PB_MAXDEPTH)
+        luaL_error(A->L, "message too deep");
+    memset(rec, 0, l->bitsize + l->nfields*sizeof(pb_Slot));
+    dec.s = s, dec.len = end - s;
+    dec.p = p, dec.end = end;
+    fb.dec = &dec, fb.L = A->L;
+    if (l->repeated) { /* arrays are sized by a first pass */
+        arena_count(A, l, rec, &dec);
+        for (i = 0; i < l->nfields; ++i) {
+            size_t n = slots[i].s.len;
+            if (n == 0) continue;
+            slots[i].a = (pb_Array*)arena_alloc(A, sizeof(pb_Array)
+                    + (n - 1)*sizeof(pb_Slot));
+            slots[i].a->n = 0;
+            arena_set(rec, i);
+        }
+        dec.p = p;
+    }
+    while (dec.p < dec.end) {
+        uint64_t n = 0;
+        int idx, wiretype, expected;
+        pb_LayoutField *f;
+        if (!pb_readvarint(&dec, &n))
+            luaL_error(A->L, "incomplete tag");
+        wiretype = (int)(n & 7);
+        idx = layout_find(l, (uint32_t)(n >> 3));
+        f = idx < 0 ? NULL : &l->fields[idx];
+        fb.fb = dec.p;
+        if (f == NULL || f->type < 0) {
+            if (!skipvalue(&fb, wiretype))
+                luaL_error(A->L, "incomplete field '%d'", (int)(n >> 3));
+            continue;
+        }
+        expected = arena_wiretype(f);
+        if (arena_ispacked(f, wiretype)) {
+            arena_packed(A, &dec, f, slots[idx].a);
+            continue;
+        }
+        if (wiretype != expected)
+            luaL_error(A->L, "type mismatch at field '%d'", (int)f->tag);
+        if (f->repeated) {
+            pb_Array *a = slots[idx].a;
+            arena_value(A, &dec, f, wiretype, &a->items[a->n++], depth);
+        }
+        else {
+            arena_value(A, &dec, f, wiretype, &slots[idx], depth);
+            arena_set(rec, idx);
+        }
+    }
+    return rec;
+}
+
+/* push a reference to message rec or array a of field f, R is at stack
+ * index 1 */
+static void arena_pushref(pb_ArenaRef *R, pb_Layout *l, void *rec,
+                          pb_Array *a, pb_LayoutField *f) {
+    lua_State *L = R->L;
+    pb_ArenaRef *ref = (pb_ArenaRef*)lua_newuserdata(L, sizeof(pb_ArenaRef));
+    memset(ref, 0, sizeof(pb_ArenaRef));
+    ref->L = L;
+    ref->src = R->src;
+    ref->root = R->root;
+    ref->layout = l;
+    ref->rec = rec;
+    ref->array = a;
+    ref->field = f;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_arenatype);
+    lua_setmetatable(L, -2);
+    if (R == R->root)
+        lua_pushvalue(L, 1);
+    else
+        lua_rawgetp(L, LUA_REGISTRYINDEX, R);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, ref);
+}
+
+/* push layout info of l, from cache anchored by the root */
+static int arena_info(pb_ArenaRef *R, pb_Layout *l) {
+    lua_State *L = R->L;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, R->root);
+    lua_getfield(L, -1, "cache");
+    lua_rawgetp(L, -1, l);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return lua_gettop(L);
+}
+
+static void arena_pushzero(pb_ArenaRef *R, pb_LayoutField *f, int info,
+                           size_t i) {
+    lua_State *L = R->L;
+    switch (f->type) {
+    case PB_Tstring: case PB_Tbytes: lua_pushliteral(L, ""); break;
+    case PB_Tbool: lua_pushboolean(L, 0); break;
+    case PB_Tdouble: case PB_Tfloat: lua_pushnumber(L, 0.0); break;
+    case PB_Tenum:
+        lua_rawgeti(L, info, (int)i + 1);
+        lua_rawgeti(L, -1, 0);
+        lua_remove(L, -2);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushinteger(L, 0);
+        }
+        break;
+    case PB_Tmessage: lua_pushnil(L); break;
+    default: lua_pushinteger(L, 0); break;
+    }
+}
+
+/* push value in slot of field i of layout l */
+static void arena_pushvalue(pb_ArenaRef *R, pb_Layout *l, size_t i,
+                            pb_Slot *slot, int info) {
+    lua_State *L = R->L;
+    pb_LayoutField *f = &l->fields[i];
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    pb_Field pf;
+    int wiretype = arena_wiretype(f);
+    if (f->type == PB_Tmessage) {
+        arena_pushref(R, f->sub, slot->m, NULL, NULL);
+        return;
+    }
+    if (wiretype == PB_TLENGTH) {
+        lua_pushlstring(L, R->src + slot->s.off, slot->s.len);
+        return;
+    }
+    dec.s = dec.p = R->src + slot->s.off;
+    dec.len = slot->s.len;
+    dec.end = dec.p + dec.len;
+    fb.dec = &dec, fb.fb = dec.p, fb.L = L;
+    pf.name = "?", pf.type = f->type;
+    pf.repeated = pf.packed = 0;
+    if (f->type == PB_Tenum) lua_rawgeti(L, info, (int)i + 1);
+    pb_pushfield(&fb, wiretype, &pf, lua_gettop(L));
+    if (f->type == PB_Tenum) lua_remove(L, -2);
+}
+
+/* map entries of array a to a new table */
+static void arena_pushmap(pb_ArenaRef *R, pb_LayoutField *f, pb_Array *a) {
+    lua_State *L = R->L;
+    pb_Layout *el = f->sub;
+    int kv[2], info = arena_info(R, el);
+    size_t i, j;
+    kv[0] = layout_find(el, 1);
+    kv[1] = layout_find(el, 2);
+    lua_createtable(L, 0, (int)a->n);
+    for (i = 0; i < a->n; ++i) {
+        void *rec = a->items[i].m;
+        for (j = 0; j < 2; ++j) {
+            int k = kv[j];
+            if (k < 0)
+                lua_pushnil(L);
+            else if (arena_has(rec, k))
+                arena_pushvalue(R, el, k, &arena_slots(el, rec)[k], info);
+            else
+                arena_pushzero(R, &el->fields[k], info, k);
+        }
+        if (lua_isnil(L, -2)) lua_pop(L, 2);
+        else lua_rawset(L, -3);
+    }
+    lua_remove(L, info);
+}
+
+static int Larena_gc(lua_State *L) {
+    pb_ArenaRef *R = check_arena(L, 1);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, R);
+    return 0;
+}
+
+static int Larena_tostring(lua_State *L) {
+    pb_ArenaRef *R = check_arena(L, 1);
+    lua_pushfstring(L, R->array ? "pb.Arena.Array: %p" : "pb.Arena: %p", R);
+    return 1;
+}
+
+static int Larena_len(lua_State *L) {
+    pb_ArenaRef *R = check_arena(L, 1);
+    lua_pushinteger(L, R->array ? (lua_Integer)R->array->n : 0);
+    return 1;
+}
+
+/* field index of name at idx in message R, -1 if none */
+static int arena_field(pb_ArenaRef *R, int info, int idx) {
+    lua_State *L = R->L;
+    int i;
+    lua_getfield(L, info, "names");
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    i = (int)lua_tointeger(L, -1) - 1;
+    lua_pop(L, 2);
+    return i;
+}
+
+static int Larena_index(lua_State *L) {
+    pb_ArenaRef *R = check_arena(L, 1);
+    pb_Layout *l = R->layout;
+    int i, info;
+    if (R->array) {
+        pb_LayoutField *f = R->field;
+        lua_Integer k = luaL_checkinteger(L, 2);
+        if (k < 1 || (size_t)k > R->array->n) return 0;
+        info = arena_info(R, l);
+        arena_pushvalue(R, l, f - l->fields, &R->array->items[k-1], info);
+        return 1;
+    }
+    if (lua_type(L, 2) != LUA_TSTRING) return 0;
+    info = arena_info(R, l);
+    if ((i = arena_field(R, info, 2)) < 0) return 0;
+    if (!arena_has(R->rec, i)) {
+        lua_getfield(L, info, "defaults");
+        if (!lua_istable(L, -1)) return 0;
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
+    }
+    if (l->fields[i].map)
+        arena_pushmap(R, &l->fields[i], arena_slots(l, R->rec)[i].a);
+    else if (l->fields[i].repeated)
+        arena_pushref(R, l, NULL, arena_slots(l, R->rec)[i].a,
+                &l->fields[i]);
+    else
+        arena_pushvalue(R, l, i, &arena_slots(l, R->rec)[i], info);
+    return 1;
+}
+
+/* iterates present fields of a message, or items of an array */
+static int Larena_next(lua_State *L) {
+    pb_ArenaRef *R = check_arena(L, 1);
+    pb_Layout *l = R->layout;
+    int info = arena_info(R, l);
+    size_t i;
+    if (R->array) {
+        lua_Integer k = lua_isnil(L, 2) ? 1 : luaL_checkinteger(L, 2) + 1;
+        if (k < 1 || (size_t)k > R->array->n) return 0;
+        lua_pushinteger(L, k);
+        arena_pushvalue(R, l, R->field - l->fields, &R->array->items[k-1],
+                info);
+        return 2;
+    }
+    i = lua_isnil(L, 2) ? 0 : (size_t)(arena_field(R, info, 2) + 1);
+    while (i < l->nfields && !arena_has(R->rec, i)) ++i;
+    if (i >= l->nfields) return 0;
+    lua_getfield(L, info, "names");
+    lua_rawgeti(L, -1, (int)i + 1);
+    lua_replace(L, 2);
+    lua_settop(L, 2);
+    Larena_index(L);
+    lua_pushvalue(L, 2);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int Larena_pairs(lua_State *L) {
+    check_arena(L, 1);
+    lua_pushcfunction(L, Larena_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int Lschema_arena(lua_State *L) {
+    pb_Schema S;
+    pb_ArenaRef *R;
+    pb_Layout *l;
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    luaL_argcheck(L, len <= 0xFFFFFFFFu, 1, "data too big");
+    lua_settop(L, 4);
+    S.L = L;
+    S.root = 3;
+    l = layout_get(&S, 4, 2);
+    R = (pb_ArenaRef*)lua_newuserdata(L, sizeof(pb_ArenaRef));
+    memset(R, 0, sizeof(pb_ArenaRef));
+    R->L = L;
+    R->src = s;
+    R->root = R;
+    R->layout = l;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_arenatype);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 1, 2);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "source");
+    lua_pushvalue(L, 4);
+    lua_setfield(L, -2, "cache");
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, R);
+    R->anchor = lua_gettop(L);
+    R->size = arena_measure(R, l, s, s, s + len, 0);
+    R->rec = arena_message(R, l, s, s, s + len, 0);
+    R->block = NULL;
+    R->size = R->used = 0;
+    lua_settop(L, 5);
+    return 1;
+}
+
+/* columnar decoding, a batch of messages goes straight to one array per
+ * selected field (a path like "a.b" through singular sub-messages), no
+ * table is made per message */
+
+#define PB_CINTEGER 0
+#define PB_CNUMBER  1
+#define PB_CBOOLEAN 2
+
+static const char *const pb_columnkinds[] = { "integer", "number", "boolean" };
+
+/* native column of numbers, one presence bit per row */
+typedef struct pb_Column {
+    size_t count, cap;
+    int kind;
+    unsigned char *mask;
+    union { lua_Integer *i; lua_Number *n; } v;
+} pb_Column;
+
+/* selected fields as a tree of nodes, siblings are one message level */
+typedef struct pb_ColNode {
+    pb_Field f;
+    lua_Integer tag;
+    int column;     /* stack index of leaf column, 0 for inner nodes */
+    int ftype;      /* stack index of enum type table, or 0 */
+    pb_Column *native;
+    int first, next;
+} pb_ColNode;
+
+typedef struct pb_Columns {
+    pb_Schema S;
+    pb_ColNode *nodes;
+    int count;
+    size_t row;
+} pb_Columns;
+
+static const char pb_columntype[] = "pb.Column";
+#define check_column(L,idx) ((pb_Column*)checkudata(L,idx,(const void*)pb_columntype))
+
+static int column_kind(int type) {
+    switch (type) {
+    case PB_Tdouble: case PB_Tfloat: return PB_CNUMBER;
+    case PB_Tbool: return PB_CBOOLEAN;
+    case PB_Tbytes: case PB_Tstring: return -1;
+    default: return PB_CINTEGER;
+    }
+}
+
+static void column_grow(lua_State *L, pb_Column *c, size_t row) {
+    size_t cap = c->cap ? c->cap : 64;
+    void *v;
+    unsigned char *mask;
+    while (cap <= row) cap *= 2;
+    v = realloc(c->v.i, cap * sizeof(lua_Integer));
+    if (v != NULL) c->v.i = (lua_Integer*)v;
+    mask = (unsigned char*)realloc(c->mask, (cap + 7) / 8);
+    if (mask != NULL) c->mask = mask;
+    if (v == NULL || mask == NULL) luaL_error(L, "out of memory");
+    memset(c->v.i + c->cap, 0, (cap - c->cap) * sizeof(lua_Integer));
+    memset(c->mask + (c->cap + 7) / 8, 0, (cap + 7) / 8 - (c->cap + 7) / 8);
+    c->cap = cap;
+}
+
+static int column_present(pb_Column *c, size_t row) {
+    return row < c->cap && (c->mask[row >> 3] & (1 << (row & 7))) != 0;
+}
+
+/* resolve path at idx to nodes, pushes the column of its leaf */
+static void columns_add(pb_Columns *C, int type, int idx, int native) {
+    lua_State *L = C->S.L;
+    const char *path = luaL_checkstring(L, idx);
+    int *link = &C->nodes[0].first, t = type, i;
+    pb_ColNode *n;
+    for (;;) {
+        const char *dot = strchr(path, '.');
+        size_t len = dot ? (size_t)(dot - path) : strlen(path);
+        lua_Integer tag;
+        lua_getfield(L, t, "map");
+        lua_pushlstring(L, path, len);
+        lua_rawget(L, -2);
+        tag = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        for (i = *link; i >= 0 && C->nodes[i].tag != tag; i = C->nodes[i].next)
+            ;
+        if (i < 0) {
+            i = C->count++;
+            n = &C->nodes[i];
+            memset(n, 0, sizeof(pb_ColNode));
+            n->first = -1, n->next = *link, *link = i;
+            n->tag = tag;
+            if (!pb_getfield(&C->S, t, tag, &n->f) || n->f.type < 0) {
+                lua_pushlstring(L, path, len);
+                luaL_error(L, "field '%s' not found in '%s'",
+                        lua_tostring(L, -1), lua_tostring(L, idx));
+            }
+            n->ftype = lua_istable(L, -1) ? lua_gettop(L) : 0;
+        }
+        n = &C->nodes[i];
+        if (n->f.type == PB_Tmessage && n->f.repeated && dot)
+            luaL_error(L, "'%s' goes through repeated field '%s'",
+                    lua_tostring(L, idx), n->f.name);
+        if (dot == NULL) break;
+        if (n->f.type != PB_Tmessage || pb_ismapentry(L, n->ftype))
+            luaL_error(L, "field '%s' in '%s' is not a message",
+                    n->f.name, lua_tostring(L, idx));
+        link = &n->first, t = n->ftype;
+        path = dot + 1;
+    }
+    if (n->f.type == PB_Tmessage)
+        luaL_error(L, "field '%s' is a message, select its fields",
+                lua_tostring(L, idx));
+    if (n->column == 0) {
+        if (native && !n->f.repeated && column_kind(n->f.type) >= 0) {
+            n->native = (pb_Column*)lua_newuserdata(L, sizeof(pb_Column));
+            memset(n->native, 0, sizeof(pb_Column));
+            n->native->kind = column_kind(n->f.type);
+            lua_rawgetp(L, LUA_REGISTRYINDEX, pb_columntype);
+            lua_setmetatable(L, -2);
+        }
+        else
+            lua_newtable(L);
+        n->column = lua_gettop(L);
+    }
+    lua_pushvalue(L, n->column);
+}
+
+/* one value of leaf n to its column */
+static void columns_value(pb_Columns *C, pb_ColNode *n, pb_FBDecoder *fb,
+                          int wiretype) {
+    lua_State *L = C->S.L;
+    pb_Column *c = n->native;
+    if (c == NULL) {
+        pb_pushfield(fb, wiretype, &n->f, n->ftype);
+        if (!n->f.repeated) {
+            lua_rawseti(L, n->column, (lua_Integer)C->row + 1);
+            return;
+        }
+        lua_rawgeti(L, n->column, (lua_Integer)C->row + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, n->column, (lua_Integer)C->row + 1);
+        }
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+        lua_pop(L, 1);
+        return;
+    }
+    if (!pb_pushscalar(fb, wiretype, n->f.type == PB_Tenum ? -1 : n->f.type))
+        luaL_error(L, "incomplete field '%s'", n->f.name);
+    if (C->row >= c->cap) column_grow(L, c, C->row);
+    if (c->kind == PB_CNUMBER)
+        c->v.n[C->row] = lua_tonumber(L, -1);
+    else if (c->kind == PB_CBOOLEAN)
+        c->v.i[C->row] = lua_toboolean(L, -1);
+    else
+        c->v.i[C->row] = lua_tointeger(L, -1);
+    c->mask[C->row >> 3] |= 1 << (C->row & 7);
+    lua_pop(L, 1);
+}
+
+/* selected fields in [p, end) of s, first is the node of this level */
+static void columns_message(pb_Columns *C, int first, const char *s,
+                            const char *p, const char *end) {
+    lua_State *L = C->S.L;
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    dec.s = s, dec.p = p, dec.end = end;
+    dec.len = end - s;
+    fb.dec = &dec, fb.L = L;
+    while (dec.p < dec.end) {
+        pb_ColNode *n;
+        uint64_t tag = 0, len = 0;
+        int i, wiretype;
+        if (!pb_readvarint(&dec, &tag))
+            luaL_error(L, "invalid tag at offset %d", (int)(dec.p - s));
+        wiretype = (int)(tag & 7);
+        for (i = first; i >= 0 && (uint64_t)C->nodes[i].tag != tag >> 3;
+                i = C->nodes[i].next)
+            ;
+        fb.fb = dec.p;
+        if (i < 0) {
+            if (!skipvalue(&fb, wiretype))
+                luaL_error(L, "incomplete field at offset %d",
+                        (int)(fb.fb - s));
+            continue;
+        }
+        n = &C->nodes[i];
+        if (n->f.type == PB_Tmessage) {
+            if (wiretype != PB_TLENGTH || !pb_readvarint(&dec, &len)
+                    || (uint64_t)(dec.end - dec.p) < len)
+                luaL_error(L, "invalid field '%s' at offset %d", n->f.name,
+                        (int)(fb.fb - s));
+            columns_message(C, n->first, s, dec.p, dec.p + len);
+            dec.p += len;
+        }
+        else if (wiretype == PB_TLENGTH && pb_packedwiretype(n->f.type) >= 0) {
+            pb_Decoder sub; /* values must not cross the run */
+            pb_FBDecoder sfb;
+            int wt = pb_packedwiretype(n->f.type);
+            if (!pb_readvarint(&dec, &len) || (uint64_t)(dec.end - dec.p) < len)
+                luaL_error(L, "incomplete field '%s'", n->f.name);
+            sub = dec, sub.end = dec.p + len;
+            sfb.dec = &sub, sfb.L = L;
+            while (sub.p < sub.end) {
+                sfb.fb = sub.p;
+                columns_value(C, n, &sfb, wt);
+            }
+            dec.p = sub.end;
+        }
+        else
+            columns_value(C, n, &fb, wiretype);
+    }
+}
+
+static void columns_row(pb_Columns *C, const char *s, const char *end) {
+    columns_message(C, C->nodes[0].first, s, s, end);
+    ++C->row;
+}
+
+/* messages from an array of strings or buffers, a log reader, or a
+ * string or buffer of length delimited messages */
+static void columns_source(pb_Columns *C, int src, size_t limit) {
+    lua_State *L = C->S.L;
+    pb_Decoder dec;
+    int res;
+    if (limit == 0) return;
+    if (lua_istable(L, src)) {
+        size_t i, n = (size_t)lua_rawlen(L, src);
+        for (i = 1; i <= n && C->row < limit; ++i) {
+            size_t len;
+            const char *s;
+            lua_rawgeti(L, src, (lua_Integer)i);
+            s = pb_tolbuffer(L, -1, &len);
+            columns_row(C, s, s + len);
+            lua_pop(L, 1);
+        }
+    }
+    else if ((res = log_source(L, src, &dec, 1)) != 0) {
+        for (; res > 0; res = C->row < limit ? log_source(L, src, &dec, 1) : 0)
+            columns_row(C, dec.s, dec.end);
+    }
+    else {
+        size_t len;
+        const char *s = pb_tolbuffer(L, src, &len);
+        dec.s = dec.p = s, dec.end = s + len;
+        dec.len = len;
+        while (dec.p < dec.end && C->row < limit) {
+            uint64_t size = 0;
+            if (!pb_readvarint(&dec, &size)
+                    || (uint64_t)(dec.end - dec.p) < size)
+                luaL_error(L, "incomplete message at offset %d",
+                        (int)(dec.p - s));
+            columns_row(C, dec.p, dec.p + size);
+            dec.p += size;
+        }
+    }
+}
+
+static int Lschema_columns(lua_State *L) {
+    pb_Columns C;
+    lua_Integer limit = -1;
+    int i, n, native = 0, result;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    if (lua_istable(L, 5)) {
+        lua_getfield(L, 5, "native");
+        native = lua_toboolean(L, -1);
+        lua_getfield(L, 5, "limit");
+        limit = luaL_optinteger(L, -1, -1);
+        lua_pop(L, 2);
+    }
+    lua_settop(L, 4);
+    n = (int)lua_rawlen(L, 4);
+    luaL_argcheck(L, n > 0, 4, "no field selected");
+    C.S.L = L;
+    C.S.root = 3;
+    C.count = 1;
+    C.row = 0;
+    for (i = 1; i <= n; ++i) { /* nodes of all paths at most */
+        const char *p;
+        lua_rawgeti(L, 4, i);
+        for (p = luaL_checkstring(L, -1); *p; ++p)
+            C.count += *p == '.';
+        C.count += 1;
+        lua_pop(L, 1);
+    }
+    luaL_checkstack(L, C.count * 3 + 10, "too many fields");
+    C.nodes = (pb_ColNode*)lua_newuserdata(L, C.count * sizeof(pb_ColNode));
+    C.nodes[0].first = -1;
+    C.count = 1;
+    lua_createtable(L, 0, n);
+    result = lua_gettop(L);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 4, i);
+        columns_add(&C, 2, lua_gettop(L), native);
+        lua_rawgeti(L, 4, i);
+        lua_insert(L, -2);
+        lua_rawset(L, result);
+    }
+    columns_source(&C, 1, limit < 0 ? (size_t)-1 : (size_t)limit);
+    for (i = 1; i < C.count; ++i)
+        if (C.nodes[i].native != NULL)
+            C.nodes[i].native->count = C.row;
+    lua_pushvalue(L, result);
+    lua_pushinteger(L, (lua_Integer)C.row);
+    return 2;
+}
+
+static int Lcolumn_gc(lua_State *L) {
+    pb_Column *c = check_column(L, 1);
+    free(c->v.i);
+    free(c->mask);
+    c->v.i = NULL, c->mask = NULL;
+    c->count = c->cap = 0;
+    return 0;
+}
+
+static int Lcolumn_tostring(lua_State *L) {
+    pb_Column *c = check_column(L, 1);
+    lua_pushfstring(L, "pb.Column (%s): %d values", pb_columnkinds[c->kind],
+            (int)c->count);
+    return 1;
+}
+
+static int Lcolumn_len(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)check_column(L, 1)->count);
+    return 1;
+}
+
+/* c[i] is the value of row i or nil, other keys are methods */
+static int Lcolumn_index(lua_State *L) {
+    pb_Column *c = check_column(L, 1);
+    lua_Integer i;
+    if (lua_type(L, 2) != LUA_TNUMBER) {
+        lua_getmetatable(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
+    }
+    i = lua_tointeger(L, 2) - 1;
+    if (i < 0 || (size_t)i >= c->count || !column_present(c, (size_t)i))
+        return 0;
+    if (c->kind == PB_CNUMBER)
+        lua_pushnumber(L, c->v.n[i]);
+    else if (c->kind == PB_CBOOLEAN)
+        lua_pushboolean(L, (int)c->v.i[i]);
+    else
+        lua_pushinteger(L, c->v.i[i]);
+    return 1;
+}
+
+static int Lcolumn_present(lua_State *L) {
+    pb_Column *c = check_column(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2) - 1;
+    lua_pushboolean(L, i >= 0 && (size_t)i < c->count
+            && column_present(c, (size_t)i));
+    return 1;
+}
+
+/* c:data() is a pointer to the values (8 bytes each, integers or
+ * doubles), the number of rows and the kind, for FFI code */
+static int Lcolumn_data(lua_State *L) {
+    pb_Column *c = check_column(L, 1);
+    if (c->cap < c->count) column_grow(L, c, c->count);
+    lua_pushlightuserdata(L, c->v.i);
+    lua_pushinteger(L, (lua_Integer)c->count);
+    lua_pushstring(L, pb_columnkinds[c->kind]);
+    return 3;
+}
+
+PB_API int luaopen_pb_schema(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lschema_##name }
+        ENTRY(parse),
+        ENTRY(tojson),
+        ENTRY(fromjson),
+        ENTRY(index),
+        ENTRY(arena),
+        ENTRY(columns),
+#undef  ENTRY
+        { "arena_pairs", Larena_pairs },
+        { NULL, NULL }
+    };
+    luaL_Reg methods[] = {
+        { "__gc", Lindex_gc },
+#define ENTRY(name) { #name, Lindex_##name }
+        ENTRY(get),
+        ENTRY(count),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg arena[] = {
+#define ENTRY(name) { "__" #name, Larena_##name }
+        ENTRY(gc),
+        ENTRY(tostring),
+        ENTRY(len),
+        ENTRY(index),
+        ENTRY(pairs),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg column[] = {
+#define ENTRY(name) { "__" #name, Lcolumn_##name }
+        ENTRY(gc),
+        ENTRY(tostring),
+        ENTRY(len),
+        ENTRY(index),
+#undef  ENTRY
+#define ENTRY(name) { #name, Lcolumn_##name }
+        ENTRY(present),
+        ENTRY(data),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, pb_indextype)) {
+        luaL_setfuncs(L, methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_indextype);
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, pb_arenatype)) {
+        luaL_setfuncs(L, arena, 0);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_arenatype);
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, pb_columntype)) {
+        luaL_setfuncs(L, column, 0);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_columntype);
+    }
+    lua_pop(L, 1);
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+
+/* io routines */
+
+#ifndef LUA_FILEHANDLE
+# include <lualib.h>
+#endif
+#ifndef LUA_FILEHANDLE
+# define LUA_FILEHANDLE "FILE*"
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+# include <io.h>
+typedef struct pb_IOVec {
+    void *iov_base;
+    size_t iov_len;
+} pb_IOVec;
+static long writev(int fd, pb_IOVec *iov, int n) {
+    long total = 0;
+    int i;
+    for (i = 0; i < n; ++i) {
+        int r = _write(fd, iov[i].iov_base, (unsigned)iov[i].iov_len);
+        if (r < 0) return total != 0 ? total : -1;
+        total += r;
+        if ((size_t)r < iov[i].iov_len) break;
+    }
+    return total;
+}
+#else
+# include <unistd.h>
+# include <sys/uio.h>
+# include <sys/mman.h>
+# include <poll.h>
+# define setmode(a,b)  ((void)0)
+# define O_BINARY      0
+typedef struct iovec pb_IOVec;
+#endif
+
+#define PB_IOVMAX 256
+
+static int io_write(lua_State *L, FILE *f, int arg) {
+    int nargs = lua_gettop(L) - arg + 1;
+    int status = 1;
+    for (; nargs--; arg++) {
+        size_t l;
+        const char *s = pb_tolbuffer(L, arg, &l);
+        status = status && (fwrite(s, sizeof(char), l, f) == l);
+    }
+    if (status) return 1;  /* file handle already on stack top */
+    else return luaL_fileresult(L, status, NULL);
+}
+
+static int Lio_read(lua_State *L) {
+    const char *fname = luaL_optstring(L, 1, NULL);
+    luaL_Buffer b;
+    FILE *fp = stdin;
+    size_t nr;
+    if (fname == NULL)
+        setmode(fileno(stdin), O_BINARY);
+    else if ((fp = fopen(fname, "rb")) == NULL)
+        return luaL_fileresult(L, 0, fname);
+    luaL_buffinit(L, &b);
+    do {  /* read file in chunks of LUAL_BUFFERSIZE bytes */
+        char *p = luaL_prepbuffer(&b);
+        nr = fread(p, sizeof(char), LUAL_BUFFERSIZE, fp);
+        luaL_addsize(&b, nr);
+    } while (nr == LUAL_BUFFERSIZE);
+    if (fp != stdin) fclose(fp);
+    else setmode(fileno(stdin), O_TEXT);
+    luaL_pushresult(&b);  /* close buffer */
+    return 1;
+}
+
+static int Lio_write(lua_State *L) {
+    int res;
+    setmode(fileno(stdout), O_BINARY);
+    res = io_write(L, stdout, 1);
+    fflush(stdout);
+    setmode(fileno(stdout), O_TEXT);
+    return res;
+}
+
+static FILE *io_tofile(lua_State *L, int idx) {
+    void *p = lua_touserdata(L, idx);
+    FILE *fp = NULL;
+    if (p != NULL && lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, LUA_FILEHANDLE);
+        if (lua_rawequal(L, -1, -2)) fp = *(FILE**)p;
+        lua_pop(L, 2);
+    }
+    return fp;
+}
+
+/* file descriptor at idx, -1 if it is not a number; strings are
+ * always paths, even "3" */
+static int io_tofd(lua_State *L, int idx) {
+    lua_Number fd;
+    if (lua_type(L, idx) != LUA_TNUMBER) return -1;
+    fd = lua_tonumber(L, idx);
+    luaL_argcheck(L, fd >= 0 && fd <= 0x7FFFFFFF && fd == (int)fd, idx,
+            "invalid file descriptor");
+    return (int)fd;
+}
+
+/* write all bytes in iov, retrying short writes */
+static int io_writeall(int fd, pb_IOVec *iov, int n) {
+    while (n > 0) {
+        long r = (long)writev(fd, iov, n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= (long)iov->iov_len;
+            ++iov, --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + r;
+            iov->iov_len -= (size_t)r;
+        }
+    }
+    return 1;
+}
+
+static int io_addvec(pb_IOVec *iov, int *n, int fd, const char *p, size_t len) {
+    if (len == 0) return 1;
+    if (*n == PB_IOVMAX) {
+        if (!io_writeall(fd, iov, *n)) return 0;
+        *n = 0;
+    }
+    iov[*n].iov_base = (void*)p;
+    iov[*n].iov_len = len;
+    ++*n;
+    return 1;
+}
+
+static int io_writev(lua_State *L, int fd, int arg) {
+    pb_IOVec iov[PB_IOVMAX];
+    int n = 0, top = lua_gettop(L), ok = 1;
+    size_t total = 0, i;
+    for (; ok && arg <= top; ++arg) {
+        pb_Buffer *buf = (pb_Buffer*)testudata(L, arg, pb_buftype);
+        if (buf == NULL) {
+            size_t len;
+            const char *s = luaL_checklstring(L, arg, &len);
+            ok = io_addvec(iov, &n, fd, s, len);
+            total += len;
+            continue;
+        }
+        for (i = 0; ok && i < buf->nslices; ++i)
+            ok = io_addvec(iov, &n, fd, buf->slices[i].p, buf->slices[i].len);
+        ok = ok && io_addvec(iov, &n, fd, buf->buf, buf->used);
+        total += pb_bufferlen(buf);
+    }
+    if (ok && !io_writeall(fd, iov, n)) ok = 0;
+    if (!ok) return -1;
+    lua_pushinteger(L, (lua_Integer)total);
+    return 1;
+}
+
+static int Lio_writev(lua_State *L) {
+    FILE *fp = io_tofile(L, 1);
+    int fd, res;
+    const char *fname = NULL;
+    if (fp != NULL) {
+        fflush(fp);
+        fd = fileno(fp);
+    }
+    else if ((fd = io_tofd(L, 1)) < 0) {
+        fname = luaL_checkstring(L, 1);
+        fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+        if (fd < 0) return luaL_fileresult(L, 0, fname);
+    }
+    res = io_writev(L, fd, 2);
+    if (fname != NULL) {
+        int olderr = errno;
+        close(fd);
+        errno = olderr;
+    }
+    if (res < 0) return luaL_fileresult(L, 0, fname);
+    return res;
+}
+
+/* background writer, full buffers are handed to a thread through a
+ * bounded ring, so the Lua thread only waits when all of them are in
+ * flight. The ring is synchronized once per buffer, write() itself just
+ * copies into the buffer being filled. */
+
+#ifdef _WIN32
+# include <windows.h>
+typedef HANDLE pb_Thread;
+typedef CRITICAL_SECTION pb_Mutex;
+typedef CONDITION_VARIABLE pb_Cond;
+# define pb_mutexinit(m)     InitializeCriticalSection(m)
+# define pb_mutexfree(m)     DeleteCriticalSection(m)
+# define pb_lock(m)          EnterCriticalSection(m)
+# define pb_unlock(m)        LeaveCriticalSection(m)
+# define pb_condinit(c)      InitializeConditionVariable(c)
+# define pb_condfree(c)      ((void)0)
+# define pb_wait(c, m)       SleepConditionVariableCS(c, m, INFINITE)
+# define pb_broadcast(c)     WakeAllConditionVariable(c)
+# define PB_THREADFUNC(name, arg) static DWORD WINAPI name(LPVOID arg)
+# define fsync(fd)           _commit(fd)
+static SRWLOCK pb_glock = SRWLOCK_INIT;
+# define pb_globallock()     AcquireSRWLockExclusive(&pb_glock)
+# define pb_globalunlock()   ReleaseSRWLockExclusive(&pb_glock)
+static int pb_spawn(pb_Thread *t, LPTHREAD_START_ROUTINE f, void *arg)
+{ return (*t = CreateThread(NULL, 0, f, arg, 0, NULL)) != NULL; }
+static void pb_join(pb_Thread t)
+{ WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+#else
+# include <pthread.h>
+typedef pthread_t pb_Thread;
+typedef pthread_mutex_t pb_Mutex;
+typedef pthread_cond_t pb_Cond;
+# define pb_mutexinit(m)     pthread_mutex_init(m, NULL)
+# define pb_mutexfree(m)     pthread_mutex_destroy(m)
+# define pb_lock(m)          pthread_mutex_lock(m)
+# define pb_unlock(m)        pthread_mutex_unlock(m)
+# define pb_condinit(c)      pthread_cond_init(c, NULL)
+# define pb_condfree(c)      pthread_cond_destroy(c)
+# define pb_wait(c, m)       pthread_cond_wait(c, m)
+# define pb_broadcast(c)     pthread_cond_broadcast(c)
+# define PB_THREADFUNC(name, arg) static void *name(void *arg)
+static pthread_mutex_t pb_glock = PTHREAD_MUTEX_INITIALIZER;
+# define pb_globallock()     pthread_mutex_lock(&pb_glock)
+# define pb_globalunlock()   pthread_mutex_unlock(&pb_glock)
+static int pb_spawn(pb_Thread *t, void *(*f)(void*), void *arg)
+{ return pthread_create(t, NULL, f, arg) == 0; }
+static void pb_join(pb_Thread t) { pthread_join(t, NULL); }
+#endif
+
+#define PB_WRITERSIZE    (1 << 20)
+#define PB_WRITERBUFFERS 3
+
+typedef struct pb_Writer {
+    int fd, owned;      /* owned fd is closed by close() */
+    int running;        /* thread started and not joined */
+    int stop;           /* no more buffers are coming */
+    int err;            /* errno of the first failed write */
+    int seen;           /* err as last seen by the Lua thread */
+    unsigned head, tail; /* buffers published / written */
+    size_t size, nbufs;
+    size_t syncbytes;   /* fsync() after so many bytes, 0 for never */
+    size_t unsynced;
+    char **bufs;
+    size_t *used;
+    pb_Mutex lock;
+    pb_Cond cond;
+    pb_Thread thread;
+} pb_Writer;
+
+static const char pb_writertype[] = "pb.Writer";
+#define check_writer(L,idx) ((pb_Writer*)checkudata(L,idx,(const void*)pb_writertype))
+
+PB_THREADFUNC(writer_main, arg) {
+    pb_Writer *w = (pb_Writer*)arg;
+    for (;;) {
+        size_t i, len;
+        int err = 0;
+        pb_lock(&w->lock);
+        while (w->tail == w->head && !w->stop)
+            pb_wait(&w->cond, &w->lock);
+        if (w->tail == w->head) {
+            pb_unlock(&w->lock);
+            break;
+        }
+        i = w->tail % w->nbufs;
+        len = w->used[i];
+        err = w->err;
+        pb_unlock(&w->lock);
+        if (err == 0) {
+            pb_IOVec iov;
+            iov.iov_base = w->bufs[i];
+            iov.iov_len = len;
+            if (!io_writeall(w->fd, &iov, 1))
+                err = errno;
+            else if (w->syncbytes && (w->unsynced += len) >= w->syncbytes) {
+                w->unsynced = 0;
+                if (fsync(w->fd) != 0) err = errno;
+            }
+        }
+        pb_lock(&w->lock);
+        if (err && !w->err) w->err = err;
+        ++w->tail;
+        pb_broadcast(&w->cond);
+        pb_unlock(&w->lock);
+    }
+    return 0;
+}
+
+/* publish the buffer being filled and wait for a free one */
+static void writer_publish(pb_Writer *w) {
+    pb_lock(&w->lock);
+    if (w->used[w->head % w->nbufs] != 0) {
+        ++w->head;
+        pb_broadcast(&w->cond);
+    }
+    while (w->head - w->tail >= w->nbufs)
+        pb_wait(&w->cond, &w->lock);
+    w->used[w->head % w->nbufs] = 0;
+    w->seen = w->err;
+    pb_unlock(&w->lock);
+}
+
+/* wait until all published buffers are written, returns errno or 0 */
+static int writer_drain(pb_Writer *w) {
+    int err;
+    writer_publish(w);
+    pb_lock(&w->lock);
+    while (w->tail != w->head)
+        pb_wait(&w->cond, &w->lock);
+    err = w->err;
+    pb_unlock(&w->lock);
+    return err;
+}
+
+static void writer_add(pb_Writer *w, const char *s, size_t len) {
+    while (len > 0) {
+        size_t i = w->head % w->nbufs;
+        size_t n = w->size - w->used[i];
+        if (n == 0) {
+            writer_publish(w);
+            continue;
+        }
+        if (n > len) n = len;
+        memcpy(w->bufs[i] + w->used[i], s, n);
+        w->used[i] += n;
+        s += n, len -= n;
+    }
+}
+
+/* push nil, message for err */
+static int writer_error(lua_State *L, int err) {
+    errno = err;
+    return luaL_fileresult(L, 0, NULL);
+}
+
+static int writer_close(pb_Writer *w) {
+    int err = 0;
+    size_t i;
+    if (w->running) {
+        err = writer_drain(w);
+        pb_lock(&w->lock);
+        w->stop = 1;
+        pb_broadcast(&w->cond);
+        pb_unlock(&w->lock);
+        pb_join(w->thread);
+        pb_condfree(&w->cond);
+        pb_mutexfree(&w->lock);
+        w->running = 0;
+        if (!err && w->syncbytes && fsync(w->fd) != 0) err = errno;
+    }
+    if (w->owned && w->fd >= 0 && close(w->fd) != 0 && !err)
+        err = errno;
+    w->fd = -1;
+    for (i = 0; w->bufs != NULL && i < w->nbufs; ++i)
+        free(w->bufs[i]);
+    free(w->bufs);
+    free(w->used);
+    w->bufs = NULL;
+    w->used = NULL;
+    return err;
+}
+
+static int Lwriter_gc(lua_State *L) {
+    writer_close(check_writer(L, 1));
+    return 0;
+}
+
+static int Lwriter_close(lua_State *L) {
+    int err = writer_close(check_writer(L, 1));
+    if (err) return writer_error(L, err);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int Lwriter_write(lua_State *L) {
+    pb_Writer *w = check_writer(L, 1);
+    int arg, top = lua_gettop(L);
+    size_t i;
+    if (!w->running) return luaL_error(L, "attempt to use a closed writer");
+    for (arg = 2; arg <= top; ++arg) {
+        pb_Buffer *buf = (pb_Buffer*)testudata(L, arg, pb_buftype);
+        size_t len;
+        const char *s;
+        if (buf == NULL) {
+            s = luaL_checklstring(L, arg, &len);
+            writer_add(w, s, len);
+            continue;
+        }
+        for (i = 0; i < buf->nslices; ++i)
+            writer_add(w, buf->slices[i].p, buf->slices[i].len);
+        writer_add(w, buf->buf, buf->used);
+    }
+    if (w->seen) return writer_error(L, w->seen);
+    return_self(L);
+}
+
+static int Lwriter_flush(lua_State *L) {
+    pb_Writer *w = check_writer(L, 1);
+    int err;
+    if (!w->running) return luaL_error(L, "attempt to use a closed writer");
+    if ((err = writer_drain(w)) == 0 && w->syncbytes) {
+        w->unsynced = 0;
+        if (fsync(w->fd) != 0) err = errno;
+    }
+    if (err) return writer_error(L, err);
+    return_self(L);
+}
+
+static lua_Integer writer_opt(lua_State *L, int opts, const char *name,
+                              lua_Integer def) {
+    lua_Integer v = def;
+    if (!lua_istable(L, opts)) return def;
+    lua_getfield(L, opts, name);
+    if (lua_type(L, -1) == LUA_TBOOLEAN) /* fsync = true: only on flush */
+        v = lua_toboolean(L, -1) ? (lua_Integer)((size_t)-1 >> 1) : 0;
+    else if (!lua_isnil(L, -1))
+        v = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+static int Lio_writer(lua_State *L) {
+    FILE *fp = io_tofile(L, 1);
+    pb_Writer *w;
+    size_t i;
+    lua_Integer size = writer_opt(L, 2, "size", PB_WRITERSIZE);
+    lua_Integer nbufs = writer_opt(L, 2, "buffers", PB_WRITERBUFFERS);
+    lua_Integer syncbytes = writer_opt(L, 2, "fsync", 0);
+    luaL_argcheck(L, size > 0 && nbufs >= 2 && syncbytes >= 0, 2,
+            "invalid writer options");
+    w = (pb_Writer*)lua_newuserdata(L, sizeof(pb_Writer));
+    memset(w, 0, sizeof(pb_Writer));
+    w->fd = -1;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_writertype);
+    lua_setmetatable(L, -2);
+    if (fp != NULL) {
+        fflush(fp);
+        w->fd = fileno(fp);
+    }
+    else if ((w->fd = io_tofd(L, 1)) < 0) {
+        const char *fname = luaL_checkstring(L, 1);
+        w->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+        if (w->fd < 0) return luaL_fileresult(L, 0, fname);
+        w->owned = 1;
+    }
+    w->size = (size_t)size;
+    w->nbufs = (size_t)nbufs;
+    w->syncbytes = (size_t)syncbytes;
+    w->bufs = (char**)calloc(w->nbufs, sizeof(char*));
+    w->used = (size_t*)calloc(w->nbufs, sizeof(size_t));
+    for (i = 0; w->bufs && w->used && i < w->nbufs; ++i)
+        if ((w->bufs[i] = (char*)malloc(w->size)) == NULL) break;
+    if (w->bufs == NULL || w->used == NULL || i < w->nbufs) {
+        writer_close(w);
+        return luaL_error(L, "not enough memory");
+    }
+    pb_mutexinit(&w->lock);
+    pb_condinit(&w->cond);
+    if (!pb_spawn(&w->thread, writer_main, w)) {
+        pb_condfree(&w->cond);
+        pb_mutexfree(&w->lock);
+        writer_close(w);
+        return luaL_error(L, "can not start writer thread");
+    }
+    w->running = 1;
+    return 1;
+}
+
+/* read-ahead reader, a thread reads the input into a ring of buffers
+ * ahead of the consumer. Used as a decoder source it gives the decoder
+ * the current chunk in place; dec:update() moves to the next one,
+ * copying only the unconsumed tail in front of it (there is pad room
+ * for that in every buffer). */
+
+#define PB_READERSIZE    (1 << 20)
+#define PB_READERBUFFERS 4
+#define PB_READERPAD     (1 << 16)
+#define PB_READERALIGN   4096
+
+typedef struct pb_Reader {
+    int fd, owned;
+    int running;        /* thread started and not joined */
+    int stop;
+    int eof, err;       /* end of input or errno seen by the thread */
+    int wake[2];        /* pipe, written to interrupt a blocking read */
+    int held;           /* chunk tail is the current window */
+    unsigned head, tail; /* buffers filled / consumed */
+    size_t size, nbufs;
+    char **raw;         /* as allocated */
+    char **data;        /* aligned, PB_READERPAD bytes after raw */
+    size_t *used;
+    const char *win;    /* current window, in a chunk or in spill */
+    size_t winlen;
+    char *spill;        /* for tails longer than PB_READERPAD */
+    size_t spillsize;
+    pb_Mutex lock;
+    pb_Cond cond;
+    pb_Thread thread;
+} pb_Reader;
+
+static const char pb_readertype[] = "pb.Reader";
+#define check_reader(L,idx) ((pb_Reader*)checkudata(L,idx,(const void*)pb_readertype))
+
+/* waits for input, returns 0 if reader_stop() woke it instead; on
+ * Windows reader_stop() cancels the read itself */
+static int reader_poll(pb_Reader *r) {
+#ifdef _WIN32
+    (void)r;
+    return 1;
+#else
+    struct pollfd fds[2];
+    fds[0].fd = r->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->wake[0];
+    fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+    while (poll(fds, 2, -1) < 0)
+        if (errno != EINTR) return 1; /* read() reports it */
+    return fds[1].revents == 0;
+#endif
+}
+
+PB_THREADFUNC(reader_main, arg) {
+    pb_Reader *r = (pb_Reader*)arg;
+    for (;;) {
+        size_t i;
+        long n;
+        pb_lock(&r->lock);
+        while (r->head - r->tail >= r->nbufs && !r->stop)
+            pb_wait(&r->cond, &r->lock);
+        if (r->stop) {
+            pb_unlock(&r->lock);
+            break;
+        }
+        i = r->head % r->nbufs;
+        pb_unlock(&r->lock);
+        if (!reader_poll(r)) break;
+        do n = (long)read(r->fd, r->data[i], (unsigned)r->size);
+        while (n < 0 && errno == EINTR);
+        pb_lock(&r->lock);
+        if (n > 0) {
+            r->used[i] = (size_t)n;
+            ++r->head;
+        }
+        else if (n == 0)
+            r->eof = 1;
+        else
+            r->err = errno;
+        pb_broadcast(&r->cond);
+        pb_unlock(&r->lock);
+        if (n <= 0) break;
+    }
+    return 0;
+}
+
+/* keep memory of [p, p+n) in spill, followed by len bytes of s */
+static void reader_spill(lua_State *L, pb_Reader *r, const char *p,
+                         size_t n, const char *s, size_t len) {
+    if (n + len > r->spillsize) {
+        size_t off = 0, size = r->spillsize ? r->spillsize : 1024;
+        int inspill = r->spill != NULL && p >= r->spill
+                   && p <= r->spill + r->spillsize;
+        char *newspill;
+        if (inspill) off = (size_t)(p - r->spill);
+        while (size < n + len) size *= 2;
+        if ((newspill = (char*)realloc(r->spill, size)) == NULL)
+            luaL_error(L, "not enough memory");
+        if (inspill) p = newspill + off;
+        r->spill = newspill;
+        r->spillsize = size;
+    }
+    memmove(r->spill, p, n);
+    memcpy(r->spill + n, s, len);
+    r->win = r->spill;
+    r->winlen = n + len;
+}
+
+/* move window to next chunk keeping [keep, keep+n) in front of it,
+ * returns 0 at end of input */
+static int reader_advance(lua_State *L, pb_Reader *r, const char *keep,
+                          size_t n) {
+    unsigned want = r->tail + (r->held ? 1 : 0);
+    size_t i;
+    int err;
+    if (!r->running) return 0;
+    pb_lock(&r->lock);
+    while (r->head == want && !r->eof && !r->err)
+        pb_wait(&r->cond, &r->lock);
+    err = r->head == want ? r->err : 0;
+    pb_unlock(&r->lock);
+    if (err) {
+        errno = err;
+        luaL_error(L, "read error: %s", strerror(err));
+    }
+    if (r->head == want) return 0;
+    i = want % r->nbufs;
+    if (n <= PB_READERPAD) {
+        if (n != 0) memcpy(r->data[i] - n, keep, n);
+        r->win = r->data[i] - n;
+        r->winlen = n + r->used[i];
+    }
+    else
+        reader_spill(L, r, keep, n, r->data[i], r->used[i]);
+    pb_lock(&r->lock);
+    r->tail = want;
+    if (r->win == r->spill) ++r->tail; /* copied, not held */
+    r->held = r->win != r->spill;
+    pb_broadcast(&r->cond);
+    pb_unlock(&r->lock);
+    return 1;
+}
+
+/* set decoder to window of reader at idx, the next one if advance,
+ * returns 0 if idx is not a reader, -1 at end of input */
+static int reader_source(lua_State *L, int idx, pb_Decoder *dec,
+                         int advance) {
+    pb_Reader *r = (pb_Reader*)testudata(L, idx, pb_readertype);
+    const char *keep = advance ? dec->p : NULL;
+    size_t n = advance ? dec->end - dec->p : 0;
+    if (r == NULL) return 0;
+    if ((advance || r->win == NULL) && !reader_advance(L, r, keep, n)) {
+        dec->s = dec->p = dec->end = "";
+        dec->len = 0;
+        return -1;
+    }
+    dec->s = dec->p = r->win;
+    dec->len = r->winlen;
+    dec->end = r->win + r->winlen;
+    return 1;
+}
+
+static void reader_stop(pb_Reader *r) {
+    if (r->running) {
+        pb_lock(&r->lock);
+        r->stop = 1;
+        pb_broadcast(&r->cond);
+        pb_unlock(&r->lock);
+#ifdef _WIN32
+        while (WaitForSingleObject(r->thread, 10) == WAIT_TIMEOUT)
+            CancelSynchronousIo(r->thread);
+#else
+        while (write(r->wake[1], "", 1) < 0 && errno == EINTR)
+            ;
+#endif
+        pb_join(r->thread);
+        pb_condfree(&r->cond);
+        pb_mutexfree(&r->lock);
+        r->running = 0;
+    }
+    if (r->owned && r->fd >= 0) close(r->fd);
+    if (r->wake[0] >= 0) close(r->wake[0]);
+    if (r->wake[1] >= 0) close(r->wake[1]);
+    r->fd = r->wake[0] = r->wake[1] = -1;
+}
+
+static int Lreader_gc(lua_State *L) {
+    pb_Reader *r = check_reader(L, 1);
+    size_t i;
+    reader_stop(r);
+    for (i = 0; r->raw != NULL && i < r->nbufs; ++i)
+        free(r->raw[i]);
+    free(r->raw);
+    free(r->data);
+    free(r->used);
+    free(r->spill);
+    r->raw = r->data = NULL;
+    r->used = NULL;
+    r->spill = NULL;
+    return 0;
+}
+
+/* stops reading, decoders using it see end of input, but their current
+ * window stays valid until the reader is collected */
+static int Lreader_close(lua_State *L) {
+    reader_stop(check_reader(L, 1));
+    return 0;
+}
+
+static int Lio_reader(lua_State *L) {
+    FILE *fp = io_tofile(L, 1);
+    pb_Reader *r;
+    size_t i;
+    lua_Integer size = writer_opt(L, 2, "size", PB_READERSIZE);
+    lua_Integer nbufs = writer_opt(L, 2, "buffers", PB_READERBUFFERS);
+    luaL_argcheck(L, size > 0 && nbufs >= 2, 2, "invalid reader options");
+    r = (pb_Reader*)lua_newuserdata(L, sizeof(pb_Reader));
+    memset(r, 0, sizeof(pb_Reader));
+    r->fd = r->wake[0] = r->wake[1] = -1;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_readertype);
+    lua_setmetatable(L, -2);
+    if (fp != NULL)
+        r->fd = fileno(fp);
+    else if ((r->fd = io_tofd(L, 1)) < 0) {
+        const char *fname = luaL_checkstring(L, 1);
+        r->fd = open(fname, O_RDONLY|O_BINARY);
+        if (r->fd < 0) return luaL_fileresult(L, 0, fname);
+        r->owned = 1;
+    }
+    r->size = (size_t)size;
+    r->nbufs = (size_t)nbufs;
+    r->raw = (char**)calloc(r->nbufs, sizeof(char*));
+    r->data = (char**)calloc(r->nbufs, sizeof(char*));
+    r->used = (size_t*)calloc(r->nbufs, sizeof(size_t));
+    for (i = 0; r->raw && r->data && r->used && i < r->nbufs; ++i) {
+        size_t p;
+        if ((r->raw[i] = (char*)malloc(PB_READERPAD + r->size
+                        + PB_READERALIGN)) == NULL)
+            break;
+        p = (size_t)(r->raw[i] + PB_READERPAD + PB_READERALIGN - 1);
+        r->data[i] = (char*)(p & ~(size_t)(PB_READERALIGN - 1));
+    }
+    if (!r->raw || !r->data || !r->used || i < r->nbufs)
+        return luaL_error(L, "not enough memory");
+#ifndef _WIN32
+    if (pipe(r->wake) != 0) return luaL_fileresult(L, 0, NULL);
+#endif
+    pb_mutexinit(&r->lock);
+    pb_condinit(&r->cond);
+    if (!pb_spawn(&r->thread, reader_main, r)) {
+        pb_condfree(&r->cond);
+        pb_mutexfree(&r->lock);
+        return luaL_error(L, "can not start reader thread");
+    }
+    r->running = 1;
+    return 1;
+}
+
+/* CRC32C (Castagnoli), with the SSE4.2 instruction when the CPU has it */
+
+static uint32_t pb_crctable[256];
+static uint32_t (*pb_crcfunc)(uint32_t crc, const unsigned char *p, size_t n);
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n) {
+    crc = ~crc;
+    while (n--) crc = pb_crctable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t n) {
+    crc = ~crc;
+# ifdef __x86_64__
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = (uint32_t)__builtin_ia32_crc32di(crc, v);
+    }
+# endif
+    while (n--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return ~crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    uint32_t i, j;
+    pb_globallock();
+    if (pb_crcfunc == NULL) {
+        for (i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (j = 0; j < 8; ++j)
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            pb_crctable[i] = c;
+        }
+        pb_crcfunc = crc32c_sw;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) pb_crcfunc = crc32c_hw;
+#endif
+    }
+    pb_globalunlock();
+}
+
+#define pb_crc32c(crc, p, n) pb_crcfunc((crc), (const unsigned char*)(p), (n))
+
+static int Lio_crc32c(lua_State *L) {
+    size_t len;
+    const char *s = pb_tolbuffer(L, 1, &len);
+    uint32_t crc = (uint32_t)luaL_optinteger(L, 2, 0);
+    lua_pushinteger(L, (lua_Integer)pb_crc32c(crc, s, len));
+    return 1;
+}
+
+/* record logs: the data file is made of 32K blocks holding records cut
+ * into fragments, each with its length, type and a CRC32C; the side
+ * index (path..".idx") has the offset and key of every interval-th
+ * record. A reader finds record n by reading one index entry and
+ * skipping less than interval records, a bad fragment costs the rest
+ * of its block, and a torn write at the end only loses the records
+ * after the last complete one (a writer opening the log cuts them). */
+
+#define PB_LOGBLOCK    32768
+#define PB_LOGHEADER   8    /* crc32c(4), length(2), type(1), flags(1) */
+#define PB_LOGMINROOM  (2*PB_LOGHEADER) /* else pad to the next block */
+#define PB_LOGINTERVAL 64
+#define PB_LOGFLUSH    (1 << 20)
+#define PB_LOGIDXHEAD  16   /* "PBLOGIDX", version(4), interval(4) */
+#define PB_LOGIDXENTRY 16   /* offset(8), key(8) */
+#define PB_LOGVERSION  1
+
+enum { PB_LOGFULL = 1, PB_LOGFIRST, PB_LOGMIDDLE, PB_LOGLAST };
+#define PB_LOGKEYED 1       /* flag: record starts with an 8 byte key */
+
+#ifdef _WIN32
+# define ftruncate(fd, n) _chsize_s((fd), (n))
+#endif
+
+static uint32_t log_get32(const char *p) {
+    const unsigned char *s = (const unsigned char*)p;
+    return s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16
+         | (uint32_t)s[3] << 24;
+}
+
+static uint64_t log_get64(const char *p)
+{ return log_get32(p) | (uint64_t)log_get32(p + 4) << 32; }
+
+static void log_put64(char *p, uint64_t n) {
+    int i;
+    for (i = 0; i < 8; ++i, n >>= 8) p[i] = (char)(n & 0xFF);
+}
+
+/* stored CRCs are masked, so a CRC of data holding CRCs stays strong */
+static uint32_t log_mask(uint32_t crc)
+{ return ((crc >> 15) | (crc << 17)) + 0xa282ead8u; }
+
+#ifdef _WIN32
+/* read bytes [from, to) of the file to p + from */
+static void log_fill(int fd, char *p, uint64_t from, uint64_t to) {
+    _lseeki64(fd, (__int64)from, SEEK_SET);
+    while (from < to) {
+        int n = _read(fd, p + from, (unsigned)(to - from));
+        if (n <= 0) break;
+        from += (uint64_t)n;
+    }
+}
+#endif
+
+/* whole file read or mapped, with room for cap bytes so it can grow in
+ * place (the file is mapped beyond its end) */
+static const char *log_map(int fd, uint64_t size, uint64_t cap) {
+#ifdef _WIN32
+    char *p;
+    if (cap == 0 || (p = (char*)malloc((size_t)cap)) == NULL) return NULL;
+    log_fill(fd, p, 0, size);
+    return p;
+#else
+    void *p;
+    (void)size;
+    if (cap == 0) return NULL;
+    p = mmap(NULL, (size_t)cap, PROT_READ, MAP_SHARED, fd, 0);
+    return p == MAP_FAILED ? NULL : (const char*)p;
+#endif
+}
+
+static void log_unmap(const char *p, uint64_t cap) {
+    if (p == NULL) return;
+#ifdef _WIN32
+    (void)cap;
+    free((void*)p);
+#else
+    munmap((void*)p, (size_t)cap);
+#endif
+}
+
+static uint64_t log_filesize(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/* a growable malloc()ed block, for records made of many fragments */
+typedef struct pb_LogSpill {
+    char *p;
+    size_t len, size;
+} pb_LogSpill;
+
+static int log_spill(pb_LogSpill *sp, const char *s, size_t len) {
+    if (sp->len + len > sp->size) {
+        size_t size = sp->size ? sp->size : 1024;
+        char *p;
+        while (size < sp->len + len) size *= 2;
+        if ((p = (char*)realloc(sp->p, size)) == NULL) return 0;
+        sp->p = p, sp->size = size;
+    }
+    memcpy(sp->p + sp->len, s, len);
+    sp->len += len;
+    return 1;
+}
+
+typedef struct pb_LogRecord {
+    const char *p;          /* in the data, or in spill */
+    size_t len;
+    int keyed;
+    int64_t key;
+} pb_LogRecord;
+
+/* read the record at *poff of data[0, size), advancing *poff past it.
+ * Returns 1, 0 at the end (or a torn one), -1 if a fragment is bad
+ * (*poff is its offset). Without spill records are only checked. */
+static int log_read(const char *data, uint64_t size, uint64_t *poff,
+                    pb_LogSpill *spill, pb_LogRecord *rec) {
+    uint64_t off = *poff;
+    int first = 1;
+    if (spill) spill->len = 0;
+    for (;;) {
+        uint64_t left = PB_LOGBLOCK - off % PB_LOGBLOCK;
+        const char *h;
+        size_t len;
+        int type, last;
+        if (first && left < PB_LOGMINROOM) off += left, left = PB_LOGBLOCK;
+        if (off + PB_LOGHEADER > size) return 0;
+        h = data + off;
+        len = (unsigned char)h[4] | (size_t)(unsigned char)h[5] << 8;
+        type = (unsigned char)h[6];
+        if (off + PB_LOGHEADER + len > size) return 0;
+        if (PB_LOGHEADER + len > left
+                || log_mask(pb_crc32c(0, h + 4, 4 + len)) != log_get32(h)
+                || (first ? type != PB_LOGFULL && type != PB_LOGFIRST
+                          : type != PB_LOGMIDDLE && type != PB_LOGLAST)
+                || (first && (h[7] & PB_LOGKEYED) && len < 8)) {
+            *poff = off;
+            return -1;
+        }
+        last = type == PB_LOGFULL || type == PB_LOGLAST;
+        if (first) {
+            rec->keyed = h[7] & PB_LOGKEYED;
+            rec->key = rec->keyed ? (int64_t)log_get64(h + PB_LOGHEADER) : 0;
+        }
+        if (spill == NULL)
+            ;
+        else if (first && last) /* in place */
+            rec->p = h + PB_LOGHEADER, rec->len = len;
+        else if (!log_spill(spill, h + PB_LOGHEADER, len)) {
+            *poff = off;
+            return -1;
+        }
+        off += PB_LOGHEADER + len;
+        first = 0;
+        if (last) break;
+    }
+    if (spill && spill->len != 0)
+        rec->p = spill->p, rec->len = spill->len;
+    if (spill && rec->keyed) rec->p += 8, rec->len -= 8;
+    *poff = off;
+    return 1;
+}
+
+/* where the first record after the bad fragment at off starts: in the
+ * next blocks on, past fragments ending records begun before. size if
+ * no good fragment comes, so it may be a torn write */
+static uint64_t log_resync(const char *data, uint64_t size, uint64_t off) {
+    off = (off / PB_LOGBLOCK + 1) * PB_LOGBLOCK;
+    while (off + PB_LOGHEADER <= size) {
+        uint64_t left = PB_LOGBLOCK - off % PB_LOGBLOCK;
+        const char *h = data + off;
+        size_t len;
+        int type;
+        if (left < PB_LOGMINROOM) { off += left; continue; }
+        len = (unsigned char)h[4] | (size_t)(unsigned char)h[5] << 8;
+        type = (unsigned char)h[6];
+        if (off + PB_LOGHEADER + len > size) break;
+        if (PB_LOGHEADER + len > left
+                || log_mask(pb_crc32c(0, h + 4, 4 + len)) != log_get32(h))
+            off += left;
+        else if (type == PB_LOGFULL || type == PB_LOGFIRST)
+            return off;
+        else
+            off += PB_LOGHEADER + len;
+    }
+    return size;
+}
+
+/* writer, records are framed into a pb.Buffer written out when it has
+ * opts.size bytes, and on flush() and close() */
+
+typedef struct pb_LogWriter {
+    int fd, idxfd;
+    int sync;               /* fsync() on flush */
+    uint32_t interval;
+    uint64_t offset;        /* size of the data, with unwritten bytes */
+    uint64_t count;         /* records */
+    int64_t lastkey;
+    size_t flushsize;
+    pb_Buffer buf, idx;
+} pb_LogWriter;
+
+static const char pb_logwritertype[] = "pb.LogWriter";
+#define check_logwriter(L,idx) ((pb_LogWriter*)checkudata(L,idx,(const void*)pb_logwritertype))
+
+static int log_writeall(int fd, const char *p, size_t len) {
+    pb_IOVec iov;
+    iov.iov_base = (void*)p;
+    iov.iov_len = len;
+    return len == 0 || io_writeall(fd, &iov, 1);
+}
+
+static int log_flush(pb_LogWriter *w) {
+    if (!log_writeall(w->fd, w->buf.buf, w->buf.used)) return errno;
+    w->buf.used = 0;
+    if (!log_writeall(w->idxfd, w->idx.buf, w->idx.used)) return errno;
+    w->idx.used = 0;
+    if (w->sync && (fsync(w->fd) != 0 || fsync(w->idxfd) != 0))
+        return errno;
+    return 0;
+}
+
+static void log_addindex(pb_LogWriter *w, uint64_t off) {
+    pb_prepbuffer(&w->idx, PB_LOGIDXENTRY);
+    log_put64(w->idx.buf + w->idx.used, off);
+    log_put64(w->idx.buf + w->idx.used + 8, (uint64_t)w->lastkey);
+    w->idx.used += PB_LOGIDXENTRY;
+}
+
+static void log_addrecord(pb_LogWriter *w, const char *s, size_t len,
+                          int keyed) {
+    char key[8];
+    size_t keyleft = keyed ? 8 : 0, left;
+    int type = 0;
+    left = PB_LOGBLOCK - (size_t)(w->offset % PB_LOGBLOCK);
+    if (left < PB_LOGMINROOM) { /* block trailer */
+        pb_prepbuffer(&w->buf, left);
+        memset(w->buf.buf + w->buf.used, 0, left);
+        w->buf.used += left;
+        w->offset += left;
+        left = PB_LOGBLOCK;
+    }
+    if (w->count % w->interval == 0) log_addindex(w, w->offset);
+    log_put64(key, (uint64_t)w->lastkey);
+    do {
+        size_t n = left - PB_LOGHEADER, k, frag;
+        char *h;
+        if (n > keyleft + len) n = keyleft + len;
+        k = n < keyleft ? n : keyleft;
+        frag = n - k;
+        type = n == keyleft + len ? (type ? PB_LOGLAST : PB_LOGFULL)
+                                  : (type ? PB_LOGMIDDLE : PB_LOGFIRST);
+        pb_prepbuffer(&w->buf, PB_LOGHEADER + n);
+        h = w->buf.buf + w->buf.used;
+        h[4] = (char)(n & 0xFF);
+        h[5] = (char)(n >> 8);
+        h[6] = (char)type;
+        h[7] = (char)(keyed && (type == PB_LOGFULL || type == PB_LOGFIRST)
+                      ? PB_LOGKEYED : 0);
+        memcpy(h + PB_LOGHEADER, key + 8 - keyleft, k);
+        memcpy(h + PB_LOGHEADER + k, s, frag);
+        {
+            uint32_t crc = log_mask(pb_crc32c(0, h + 4, 4 + n));
+            h[0] = (char)(crc & 0xFF), h[1] = (char)(crc >> 8 & 0xFF);
+            h[2] = (char)(crc >> 16 & 0xFF), h[3] = (char)(crc >> 24);
+        }
+        w->buf.used += PB_LOGHEADER + n;
+        w->offset += PB_LOGHEADER + n;
+        keyleft -= k, s += frag, len -= frag;
+        left = PB_LOGBLOCK;
+    } while (keyleft + len != 0);
+    ++w->count;
+}
+
+static int log_error(lua_State *L, int err) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+}
+
+/* open or make the index, then cut the data after the last complete
+ * record, skipping damaged ones before it as readers do; index entries
+ * from the last one pointing into the data on are made again from the
+ * records kept */
+static int log_recover(pb_LogWriter *w, uint32_t interval) {
+    char head[PB_LOGIDXHEAD], e[PB_LOGIDXENTRY];
+    uint64_t idxsize = log_filesize(w->idxfd), size = log_filesize(w->fd);
+    uint64_t n, off = 0;
+    const char *data;
+    pb_LogRecord rec;
+    if (idxsize < PB_LOGIDXHEAD) {
+        memcpy(head, "PBLOGIDX", 8);
+        log_put64(head + 8, PB_LOGVERSION | (uint64_t)interval << 32);
+        if (ftruncate(w->idxfd, 0) != 0 || lseek(w->idxfd, 0, SEEK_SET) < 0
+                || !log_writeall(w->idxfd, head, PB_LOGIDXHEAD))
+            return errno;
+        idxsize = PB_LOGIDXHEAD;
+    }
+    else if (lseek(w->idxfd, 0, SEEK_SET) != 0
+            || read(w->idxfd, head, PB_LOGIDXHEAD) != PB_LOGIDXHEAD)
+        return errno ? errno : EIO;
+    else if (memcmp(head, "PBLOGIDX", 8) != 0
+            || log_get32(head + 8) != PB_LOGVERSION
+            || (interval = log_get32(head + 12)) == 0)
+        return EINVAL;
+    w->interval = interval;
+    for (n = (idxsize - PB_LOGIDXHEAD) / PB_LOGIDXENTRY; n > 0; --n) {
+        if (lseek(w->idxfd, (off_t)(PB_LOGIDXHEAD + (n-1)*PB_LOGIDXENTRY),
+                    SEEK_SET) < 0
+                || read(w->idxfd, e, PB_LOGIDXENTRY) != PB_LOGIDXENTRY)
+            return errno ? errno : EIO;
+        if ((off = log_get64(e)) < size) break;
+    }
+    if (n == 0) off = 0;
+    w->lastkey = n ? (int64_t)log_get64(e + 8) : 0;
+    w->count = n ? (n - 1) * interval : 0;
+    data = log_map(w->fd, size, size);
+    if (size != 0 && data == NULL) return errno ? errno : ENOMEM;
+    for (;;) {
+        uint64_t start = off;
+        int res = log_read(data, size, &off, NULL, &rec);
+        if (res < 0 && (off = log_resync(data, size, off)) < size)
+            continue;
+        if (res != 1) {
+            off = start;
+            break;
+        }
+        if (rec.keyed) w->lastkey = rec.key;
+        if (w->count % interval == 0) log_addindex(w, start);
+        ++w->count;
+    }
+    log_unmap(data, size);
+    w->offset = off;
+    if (ftruncate(w->fd, (off_t)off) != 0
+            || ftruncate(w->idxfd, (off_t)(PB_LOGIDXHEAD
+                    + (n ? n - 1 : 0) * PB_LOGIDXENTRY)) != 0
+            || lseek(w->fd, 0, SEEK_END) < 0
+            || lseek(w->idxfd, 0, SEEK_END) < 0)
+        return errno;
+    return 0;
+}
+
+static int log_closewriter(pb_LogWriter *w) {
+    int err = 0;
+    if (w->fd >= 0) {
+        err = log_flush(w);
+        if (close(w->fd) != 0 && !err) err = errno;
+        if (close(w->idxfd) != 0 && !err) err = errno;
+        w->fd = w->idxfd = -1;
+    }
+    pb_resetbuffer(&w->buf);
+    pb_resetbuffer(&w->idx);
+    return err;
+}
+
+static int Llogwriter_gc(lua_State *L) {
+    log_closewriter(check_logwriter(L, 1));
+    return 0;
+}
+
+static int Llogwriter_close(lua_State *L) {
+    int err = log_closewriter(check_logwriter(L, 1));
+    if (err) return log_error(L, err);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int Llogwriter_flush(lua_State *L) {
+    pb_LogWriter *w = check_logwriter(L, 1);
+    int err;
+    if (w->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    if ((err = log_flush(w)) != 0) return log_error(L, err);
+    return_self(L);
+}
+
+/* w:write(data [, key]) appends a record, returns its number */
+static int Llogwriter_write(lua_State *L) {
+    pb_LogWriter *w = check_logwriter(L, 1);
+    size_t len;
+    const char *s = pb_tolbuffer(L, 2, &len);
+    int keyed = !lua_isnoneornil(L, 3);
+    if (w->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    if (keyed) {
+        int64_t key = (int64_t)luaL_checkinteger(L, 3);
+        luaL_argcheck(L, key >= w->lastkey, 3, "keys must not decrease");
+        w->lastkey = key;
+    }
+    log_addrecord(w, s, len, keyed);
+    if (w->buf.used >= w->flushsize) {
+        int err = log_flush(w);
+        if (err) return log_error(L, err);
+    }
+    lua_pushinteger(L, (lua_Integer)w->count);
+    return 1;
+}
+
+static int Llogwriter_count(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)check_logwriter(L, 1)->count);
+    return 1;
+}
+
+static int log_openidx(lua_State *L, const char *path, int flags) {
+    int fd;
+    lua_pushfstring(L, "%s.idx", path);
+    fd = open(lua_tostring(L, -1), flags|O_BINARY, 0666);
+    lua_pop(L, 1);
+    return fd;
+}
+
+static int Lio_logwriter(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_Integer interval = writer_opt(L, 2, "interval", PB_LOGINTERVAL);
+    lua_Integer size = writer_opt(L, 2, "size", PB_LOGFLUSH);
+    pb_LogWriter *w;
+    int err;
+    luaL_argcheck(L, interval > 0 && interval <= 0xFFFFFFFF && size > 0, 2,
+            "invalid log options");
+    w = (pb_LogWriter*)lua_newuserdata(L, sizeof(pb_LogWriter));
+    memset(w, 0, sizeof(pb_LogWriter));
+    w->fd = w->idxfd = -1;
+    pb_initbuffer(&w->buf, L);
+    pb_initbuffer(&w->idx, L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_logwritertype);
+    lua_setmetatable(L, -2);
+    w->flushsize = (size_t)size;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "fsync");
+        w->sync = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    if ((w->fd = open(path, O_RDWR|O_CREAT|O_BINARY, 0666)) < 0)
+        return luaL_fileresult(L, 0, path);
+    w->idxfd = log_openidx(L, path, O_RDWR|O_CREAT);
+    err = w->idxfd < 0 ? errno : log_recover(w, (uint32_t)interval);
+    if (err) {
+        close(w->fd);
+        if (w->idxfd >= 0) close(w->idxfd);
+        w->fd = w->idxfd = -1;
+        errno = err;
+        return luaL_fileresult(L, 0, path);
+    }
+    return 1;
+}
+
+/* reader, the data is mapped, records of one fragment are read in
+ * place and others joined in spill. Windows read the file instead.
+ * Decoders made on a reader may point into the data, so mappings
+ * outgrown by refresh() are kept until the reader is collected */
+
+typedef struct pb_LogMapping {
+    struct pb_LogMapping *next;
+    const char *data;
+    uint64_t cap;
+} pb_LogMapping;
+
+typedef struct pb_LogReader {
+    int fd, idxfd;
+    const char *data;
+    uint64_t size;
+    uint64_t cap;           /* bytes mapped at data */
+    pb_LogMapping *old;     /* outgrown mappings */
+    char *index;            /* entries of the index file */
+    uint64_t nindex;
+    uint32_t interval;
+    uint64_t off;           /* of the next record */
+    uint64_t next;          /* its number, from 0 */
+    uint64_t corrupt;       /* bytes skipped over bad fragments */
+    int held;               /* rec is the current record */
+    pb_LogRecord rec;
+    pb_LogSpill spill;
+} pb_LogReader;
+
+static const char pb_logreadertype[] = "pb.LogReader";
+#define check_logreader(L,idx) ((pb_LogReader*)checkudata(L,idx,(const void*)pb_logreadertype))
+
+static void log_unload(pb_LogReader *r) {
+    while (r->old != NULL) {
+        pb_LogMapping *m = r->old;
+        r->old = m->next;
+        log_unmap(m->data, m->cap);
+        free(m);
+    }
+    log_unmap(r->data, r->cap);
+    free(r->index);
+    r->data = NULL, r->index = NULL;
+    r->size = r->cap = r->nindex = 0;
+}
+
+/* map size bytes of data, in place while they fit, else in a mapping
+ * twice as big with the current one kept */
+static int log_loaddata(pb_LogReader *r, uint64_t size) {
+    uint64_t cap = r->cap;
+    const char *data;
+    pb_LogMapping *m = NULL;
+    if (size <= cap) {
+#ifdef _WIN32
+        if (size > r->size) log_fill(r->fd, (char*)r->data, r->size, size);
+#endif
+        r->size = size;
+        return 0;
+    }
+    if (cap == 0) cap = size;
+    while (cap < size) cap *= 2;
+    if (r->data != NULL
+            && (m = (pb_LogMapping*)malloc(sizeof(pb_LogMapping))) == NULL)
+        return ENOMEM;
+    if ((data = log_map(r->fd, size, cap)) == NULL) {
+        free(m);
+        return errno ? errno : ENOMEM;
+    }
+    if (m != NULL) {
+        m->data = r->data, m->cap = r->cap;
+        m->next = r->old, r->old = m;
+    }
+    r->data = data, r->size = size, r->cap = cap;
+    return 0;
+}
+
+/* (re)load data and index, as they are now */
+static int log_load(pb_LogReader *r) {
+    uint64_t idxsize = log_filesize(r->idxfd);
+    char head[PB_LOGIDXHEAD];
+    int err = log_loaddata(r, log_filesize(r->fd));
+    if (err) return err;
+    free(r->index);
+    r->index = NULL, r->nindex = 0;
+    if (idxsize < PB_LOGIDXHEAD) return 0; /* no index yet */
+    if (lseek(r->idxfd, 0, SEEK_SET) != 0
+            || read(r->idxfd, head, PB_LOGIDXHEAD) != PB_LOGIDXHEAD)
+        return errno ? errno : EIO;
+    if (memcmp(head, "PBLOGIDX", 8) != 0
+            || log_get32(head + 8) != PB_LOGVERSION
+            || (r->interval = log_get32(head + 12)) == 0)
+        return EINVAL;
+    r->nindex = (idxsize - PB_LOGIDXHEAD) / PB_LOGIDXENTRY;
+    if (r->nindex == 0) return 0;
+    if ((r->index = (char*)malloc((size_t)(r->nindex*PB_LOGIDXENTRY)))
+            == NULL)
+        return ENOMEM;
+    {
+        size_t got = 0, want = (size_t)(r->nindex*PB_LOGIDXENTRY);
+        while (got < want) {
+            long n = (long)read(r->idxfd, r->index + got,
+                    (unsigned)(want - got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        r->nindex = got / PB_LOGIDXENTRY;
+    }
+    /* entries written before their data are not used */
+    while (r->nindex > 0 && log_get64(r->index
+                + (r->nindex-1)*PB_LOGIDXENTRY) >= r->size)
+        --r->nindex;
+    return 0;
+}
+
+/* move to the next record, skipping bad fragments up to the next
+ * record starting in a later block; 0 at the end of data for now. With
+ * skip the record is only checked, its bytes are not found. */
+static int log_next(lua_State *L, pb_LogReader *r, int skip) {
+    if (r->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    r->held = 0;
+    for (;;) {
+        uint64_t start = r->off;
+        int res = log_read(r->data, r->size, &r->off,
+                           skip ? NULL : &r->spill, &r->rec);
+        uint64_t next;
+        if (res > 0) {
+            r->held = 1;
+            ++r->next;
+            return 1;
+        }
+        if (res == 0) return 0;
+        /* a bad fragment with nothing good after may be a torn write */
+        if ((next = log_resync(r->data, r->size, r->off)) >= r->size) {
+            r->off = start;
+            return 0;
+        }
+        r->corrupt += next - start;
+        r->off = next;
+    }
+}
+
+/* position before record number n (from 0), 0 if past the end */
+static int log_seek(lua_State *L, pb_LogReader *r, uint64_t n) {
+    uint64_t e = r->interval ? n / r->interval : 0;
+    if (e >= r->nindex) e = r->nindex ? r->nindex - 1 : 0;
+    r->off = r->nindex ? log_get64(r->index + e*PB_LOGIDXENTRY) : 0;
+    r->next = e * r->interval;
+    r->held = 0;
+    while (r->next < n)
+        if (!log_next(L, r, 1)) return 0;
+    r->held = 0;
+    return 1;
+}
+
+static int log_source(lua_State *L, int idx, pb_Decoder *dec,
+                      int advance) {
+    pb_LogReader *r = (pb_LogReader*)testudata(L, idx, pb_logreadertype);
+    if (r == NULL) return 0;
+    if ((advance || !r->held) && !log_next(L, r, 0)) {
+        dec->s = dec->p = dec->end = "";
+        dec->len = 0;
+        return -1;
+    }
+    dec->s = dec->p = r->rec.p;
+    dec->len = r->rec.len;
+    dec->end = r->rec.p + r->rec.len;
+    return 1;
+}
+
+/* closing keeps the data for decoders still on the current record */
+static int Llogreader_close(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    if (r->fd >= 0) close(r->fd);
+    if (r->idxfd >= 0) close(r->idxfd);
+    r->fd = r->idxfd = -1;
+    r->held = 0;
+    return 0;
+}
+
+static int Llogreader_gc(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    Llogreader_close(L);
+    log_unload(r);
+    free(r->spill.p);
+    r->spill.p = NULL;
+    return 0;
+}
+
+static int log_pushrecord(lua_State *L, pb_LogReader *r) {
+    lua_pushinteger(L, (lua_Integer)r->next);
+    if (!r->rec.keyed) return 1;
+    lua_pushinteger(L, (lua_Integer)r->rec.key);
+    return 2;
+}
+
+/* r:next() moves to the next record, returns its number and key */
+static int Llogreader_next(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    if (!log_next(L, r, 0)) return 0;
+    return log_pushrecord(L, r);
+}
+
+/* r:read() is r:next() returning the record first */
+static int Llogreader_read(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    if (!log_next(L, r, 0)) return 0;
+    lua_pushlstring(L, r->rec.p, r->rec.len);
+    return 1 + log_pushrecord(L, r);
+}
+
+/* r:seek(n) makes record n the next one */
+static int Llogreader_seek(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 1, 2, "record number expected");
+    if (r->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    if (!log_seek(L, r, (uint64_t)n - 1)) return 0;
+    return_self(L);
+}
+
+/* r:seekkey(key) makes the first record with a key >= key the next
+ * one, returns its number */
+static int Llogreader_seekkey(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    int64_t key = (int64_t)luaL_checkinteger(L, 2);
+    uint64_t lo = 0, hi = r->nindex, off, n;
+    if (r->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    while (lo < hi) { /* first entry with a key >= key */
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((int64_t)log_get64(r->index + mid*PB_LOGIDXENTRY + 8) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    log_seek(L, r, lo ? (lo - 1) * r->interval : 0);
+    for (;;) {
+        off = r->off, n = r->next;
+        if (!log_next(L, r, 1)) return 0;
+        if (r->rec.keyed && r->rec.key >= key) break;
+    }
+    r->off = off, r->next = n, r->held = 0;
+    lua_pushinteger(L, (lua_Integer)n + 1);
+    return 1;
+}
+
+/* r:count() is the number of complete records now */
+static int Llogreader_count(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    uint64_t off = r->off, next = r->next;
+    int held = r->held;
+    pb_LogRecord rec = r->rec;
+    if (r->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    log_seek(L, r, r->nindex ? (r->nindex - 1) * r->interval : 0);
+    while (log_next(L, r, 1))
+        ;
+    lua_pushinteger(L, (lua_Integer)r->next);
+    r->off = off, r->next = next;
+    r->held = held, r->rec = rec;
+    return 1;
+}
+
+/* r:refresh() sees what was written since, for tailing a log; the
+ * current record stays where it is */
+static int Llogreader_refresh(lua_State *L) {
+    pb_LogReader *r = check_logreader(L, 1);
+    int err;
+    if (r->fd < 0) return luaL_error(L, "attempt to use a closed log");
+    if (log_filesize(r->fd) == r->size) return_self(L);
+    if ((err = log_load(r)) != 0) return log_error(L, err);
+    return_self(L);
+}
+
+static int Llogreader_corrupted(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)check_logreader(L, 1)->corrupt);
+    return 1;
+}
+
+static int Lio_logreader(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    pb_LogReader *r = (pb_LogReader*)lua_newuserdata(L, sizeof(pb_LogReader));
+    int err;
+    memset(r, 0, sizeof(pb_LogReader));
+    r->fd = r->idxfd = -1;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_logreadertype);
+    lua_setmetatable(L, -2);
+    if ((r->fd = open(path, O_RDONLY|O_BINARY)) < 0)
+        return luaL_fileresult(L, 0, path);
+    r->idxfd = log_openidx(L, path, O_RDONLY);
+    if ((err = log_load(r)) != 0) {
+        errno = err;
+        return luaL_fileresult(L, 0, path);
+    }
+    return 1;
+}
+
+static int Lio_dump(lua_State *L) {
+    int res;
+    const char *fname = luaL_checkstring(L, 1);
+    FILE *fp = fopen(fname, "wb");
+    if (fp == NULL) return luaL_fileresult(L, 0, fname);
+    res = io_write(L, fp, 1);
+    fclose(fp);
+    return res;
+}
+
+PB_API int luaopen_pb_io(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lio_##name }
+        ENTRY(read),
+        ENTRY(write),
+        ENTRY(dump),
+        ENTRY(writev),
+        ENTRY(writer),
+        ENTRY(reader),
+        ENTRY(logwriter),
+        ENTRY(logreader),
+        ENTRY(crc32c),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg reader[] = {
+        { "__gc", Lreader_gc },
+        { "close", Lreader_close },
+        { NULL, NULL }
+    };
+    luaL_Reg logwriter[] = {
+        { "__gc", Llogwriter_gc },
+#define ENTRY(name) { #name, Llogwriter_##name }
+        ENTRY(write),
+        ENTRY(flush),
+        ENTRY(count),
+        ENTRY(close),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg logreader[] = {
+        { "__gc", Llogreader_gc },
+        { "close", Llogreader_close },
+#define ENTRY(name) { #name, Llogreader_##name }
+        ENTRY(next),
+        ENTRY(read),
+        ENTRY(seek),
+        ENTRY(seekkey),
+        ENTRY(count),
+        ENTRY(refresh),
+        ENTRY(corrupted),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg writer[] = {
+        { "__gc", Lwriter_gc },
+#define ENTRY(name) { #name, Lwriter_##name }
+        ENTRY(write),
+        ENTRY(flush),
+        ENTRY(close),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, pb_writertype)) {
+        luaL_setfuncs(L, writer, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_writertype);
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, pb_readertype)) {
+        luaL_setfuncs(L, reader, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_readertype);
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, pb_logwritertype)) {
+        luaL_setfuncs(L, logwriter, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_logwritertype);
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, pb_logreadertype)) {
+        luaL_setfuncs(L, logreader, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_logreadertype);
+    }
+    lua_pop(L, 1);
+    crc32c_init();
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+/* shared memory rings, many producers and one consumer in any local
+ * processes. Producers claim space by moving `reserved` with a CAS,
+ * copy the message in and publish it by writing its position into the
+ * stamp of its cache line, so records commit out of order without
+ * locks. The consumer takes committed records in order and frees them
+ * by moving `released`; both sides sleep on futex counters only when
+ * they have to wait. Records never wrap: a pad record skips the end of
+ * the ring when one does not fit there, so each message is one slice
+ * of the mapping the decoder reads in place. */
+
+#if !defined(_WIN32) && defined(__GNUC__)
+# define PB_HAVESHM
+#endif
+
+#ifdef PB_HAVESHM
+# include <limits.h>
+# include <time.h>
+# ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+# endif
+
+#define PB_SHMMAGIC   0x4d485350 /* "PSHM" */
+#define PB_SHMVERSION 1
+#define PB_SHMLINE    64         /* record alignment, one stamp each */
+#define PB_SHMHEADER  256
+#define PB_SHMSIZE    (1 << 20)
+#define PB_SHMPAD     0xFFFFFFFFu
+
+#define shm_load(p)      __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define shm_store(p, v)  __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define shm_add(p, v)    __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define shm_cas(p, o, n) \
+    __atomic_compare_exchange_n(p, o, n, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/* in the mapping, fields written by each side on their own lines */
+typedef struct pb_ShmHeader {
+    uint32_t magic, version;
+    uint64_t size;              /* ring bytes, a power of 2 */
+    char line0[PB_SHMLINE - 16];
+    uint64_t reserved;          /* bytes claimed by producers */
+    uint32_t freed, fwaiters;   /* futex: bumped on release, producers waiting */
+    uint32_t closed;
+    char line1[PB_SHMLINE - 20];
+    uint64_t released;          /* bytes freed by the consumer */
+    uint32_t posted, pwaiters;  /* futex: bumped on commit, consumer waiting */
+    uint32_t consumer;          /* consumer role taken */
+} pb_ShmHeader;
+
+typedef struct pb_Shm {
+    pb_ShmHeader *h;
+    uint64_t *stamps;           /* pos+1 of the record starting there */
+    char *data;
+    size_t maplen;
+    int consumer;               /* this handle holds the consumer role */
+    int closed;                 /* closed, mapped until collected */
+    int held;                   /* win is a record not released yet */
+    uint64_t next;              /* where the record after win starts */
+    const char *win;
+    size_t winlen;
+} pb_Shm;
+
+static const char pb_shmtype[] = "pb.Shm";
+#define check_shm(L,idx) ((pb_Shm*)checkudata(L,idx,(const void*)pb_shmtype))
+
+static double shm_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* sleep while *addr == v, until deadline (< 0 for none) */
+static void shm_wait(uint32_t *addr, uint32_t v, double deadline) {
+    struct timespec ts, *pts = NULL;
+    double left = deadline < 0 ? 0 : deadline - shm_now();
+    if (deadline >= 0) {
+        if (left <= 0) return;
+        ts.tv_sec = (time_t)left;
+        ts.tv_nsec = (long)((left - (double)ts.tv_sec) * 1e9);
+        pts = &ts;
+    }
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT, v, pts, NULL, 0);
+#else
+    if (pts == NULL || left > 2e-4) {
+        ts.tv_sec = 0, ts.tv_nsec = 200000; /* poll */
+        pts = &ts;
+    }
+    if (shm_load(addr) == v) nanosleep(pts, NULL);
+#endif
+}
+
+static void shm_wake(uint32_t *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+static size_t shm_recsize(size_t len)
+{ return (8 + len + PB_SHMLINE - 1) & ~(size_t)(PB_SHMLINE - 1); }
+
+static uint64_t *shm_stamp(pb_Shm *r, uint64_t pos)
+{ return &r->stamps[(pos & (r->h->size - 1)) / PB_SHMLINE]; }
+
+static void shm_release(pb_Shm *r, uint64_t pos) {
+    pb_ShmHeader *h = r->h;
+    shm_store(&h->released, pos);
+    shm_add(&h->freed, 1);
+    if (shm_load(&h->fwaiters)) shm_wake(&h->freed);
+}
+
+/* claim room for a len bytes message, returns 1 and its position, 0 on
+ * timeout, -1 when the ring is shut down */
+static int shm_reserve(pb_Shm *r, size_t len, double deadline,
+                       uint64_t *ppos) {
+    pb_ShmHeader *h = r->h;
+    uint64_t size = h->size, need = shm_recsize(len);
+    uint64_t pos, off, room, total;
+    for (;;) {
+        uint32_t v;
+        if (shm_load(&h->closed)) return -1;
+        pos = shm_load(&h->reserved);
+        off = pos & (size - 1);
+        room = size - off;
+        total = need <= room ? need : room + need;
+        if (pos + total - shm_load(&h->released) <= size) {
+            if (shm_cas(&h->reserved, &pos, pos + total)) break;
+            continue;
+        }
+        v = shm_load(&h->freed);
+        shm_add(&h->fwaiters, 1);
+        if (pos + total - shm_load(&h->released) > size
+                && !shm_load(&h->closed))
+            shm_wait(&h->freed, v, deadline);
+        shm_add(&h->fwaiters, (uint32_t)-1);
+        if (deadline >= 0 && shm_now() >= deadline) return 0;
+    }
+    if (total != need) { /* skip the end of the ring */
+        *(uint32_t*)(r->data + off) = PB_SHMPAD;
+        shm_store(shm_stamp(r, pos), pos + 1);
+        pos += room;
+    }
+    *ppos = pos;
+    return 1;
+}
+
+static void shm_commit(pb_Shm *r, uint64_t pos, size_t len) {
+    pb_ShmHeader *h = r->h;
+    *(uint32_t*)(r->data + (pos & (h->size - 1))) = (uint32_t)len;
+    shm_store(shm_stamp(r, pos), pos + 1);
+    shm_add(&h->posted, 1);
+    if (shm_load(&h->pwaiters)) shm_wake(&h->posted);
+}
+
+/* release the current record and wait for the next one, returns 1, 0
+ * on timeout, -1 when shut down and drained */
+static int shm_next(lua_State *L, pb_Shm *r, double deadline) {
+    pb_ShmHeader *h = r->h;
+    uint64_t pos;
+    if (r->closed) return luaL_error(L, "attempt to use a closed ring");
+    if (!r->consumer) {
+        uint32_t none = 0;
+        if (!shm_cas(&h->consumer, &none, 1))
+            return luaL_error(L, "ring already has a consumer");
+        r->consumer = 1;
+    }
+    if (r->held) {
+        r->held = 0;
+        shm_release(r, r->next);
+    }
+    pos = shm_load(&h->released);
+    for (;;) {
+        uint64_t *stamp = shm_stamp(r, pos);
+        uint32_t v;
+        if (shm_load(stamp) == pos + 1) {
+            const char *p = r->data + (pos & (h->size - 1));
+            uint32_t len = *(const uint32_t*)p;
+            if (len == PB_SHMPAD) {
+                pos += h->size - (pos & (h->size - 1));
+                shm_release(r, pos);
+                continue;
+            }
+            r->win = p + 8;
+            r->winlen = len;
+            r->next = pos + shm_recsize(len);
+            r->held = 1;
+            return 1;
+        }
+        if (shm_load(&h->closed) && shm_load(&h->reserved) == pos)
+            return -1;
+        v = shm_load(&h->posted);
+        shm_add(&h->pwaiters, 1);
+        if (shm_load(stamp) != pos + 1 && !shm_load(&h->closed))
+            shm_wait(&h->posted, v, deadline);
+        shm_add(&h->pwaiters, (uint32_t)-1);
+        if (deadline >= 0 && shm_now() >= deadline) return 0;
+    }
+}
+
+static int shm_source(lua_State *L, int idx, pb_Decoder *dec,
+                      int advance) {
+    pb_Shm *r = (pb_Shm*)testudata(L, idx, pb_shmtype);
+    if (r == NULL) return 0;
+    if ((advance || !r->held) && shm_next(L, r, -1) < 0) {
+        dec->s = dec->p = dec->end = "";
+        dec->len = 0;
+        return -1;
+    }
+    dec->s = dec->p = r->win;
+    dec->len = r->winlen;
+    dec->end = r->win + r->winlen;
+    return 1;
+}
+
+/* gives up the ring but keeps it mapped: decoders made on it hold the
+ * handle, so their windows stay readable until it is collected */
+static void shm_detach(pb_Shm *r) {
+    if (r->h == NULL || r->closed) return;
+    if (r->consumer) {
+        if (r->held) shm_release(r, r->next);
+        shm_store(&r->h->consumer, 0);
+    }
+    r->consumer = r->held = 0;
+    r->closed = 1;
+}
+
+static void shm_unmap(pb_Shm *r) {
+    if (r->h == NULL) return;
+    shm_detach(r);
+    munmap((void*)r->h, r->maplen);
+    r->h = NULL;
+}
+
+static pb_Shm *shm_new(lua_State *L) {
+    pb_Shm *r = (pb_Shm*)lua_newuserdata(L, sizeof(pb_Shm));
+    memset(r, 0, sizeof(pb_Shm));
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_shmtype);
+    lua_setmetatable(L, -2);
+    return r;
+}
+
+static size_t shm_maplen(uint64_t size)
+{ return PB_SHMHEADER + size / PB_SHMLINE * 8 + size; }
+
+static int shm_map(pb_Shm *r, int fd, size_t maplen) {
+    void *p = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return 0;
+    r->h = (pb_ShmHeader*)p;
+    r->maplen = maplen;
+    r->stamps = (uint64_t*)((char*)p + PB_SHMHEADER);
+    return 1;
+}
+
+static int Lshm_create(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    lua_Integer want = luaL_optinteger(L, 2, PB_SHMSIZE);
+    uint64_t size = 4096;
+    pb_Shm *r;
+    int fd;
+    luaL_argcheck(L, want > 0 && want <= (lua_Integer)1 << 40, 2,
+            "invalid ring size");
+    while (size < (uint64_t)want) size <<= 1;
+    r = shm_new(L);
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) return luaL_fileresult(L, 0, name);
+    if (ftruncate(fd, (off_t)shm_maplen(size)) != 0
+            || !shm_map(r, fd, shm_maplen(size))) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return luaL_fileresult(L, 0, name);
+    }
+    close(fd);
+    r->data = (char*)r->stamps + size / PB_SHMLINE * 8;
+    r->h->size = size;
+    r->h->version = PB_SHMVERSION;
+    shm_store(&r->h->magic, PB_SHMMAGIC);
+    return 1;
+}
+
+static int Lshm_open(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    pb_Shm *r = shm_new(L);
+    pb_ShmHeader *h;
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return luaL_fileresult(L, 0, name);
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < PB_SHMHEADER
+            || !shm_map(r, fd, (size_t)st.st_size)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return luaL_fileresult(L, 0, name);
+    }
+    close(fd);
+    h = r->h;
+    if (shm_load(&h->magic) != PB_SHMMAGIC || h->version != PB_SHMVERSION
+            || shm_maplen(h->size) != r->maplen) {
+        shm_unmap(r);
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: not a pb.shm ring", name);
+        return 2;
+    }
+    r->data = (char*)r->stamps + h->size / PB_SHMLINE * 8;
+    return 1;
+}
+
+static int Lshm_unlink(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    return luaL_fileresult(L, shm_unlink(name) == 0, name);
+}
+
+static double shm_deadline(lua_State *L, int idx) {
+    lua_Number t = luaL_optnumber(L, idx, -1);
+    return t < 0 ? -1 : shm_now() + t;
+}
+
+static int shm_result(lua_State *L, int res) {
+    lua_pushnil(L);
+    lua_pushstring(L, res == 0 ? "timeout" : "closed");
+    return 2;
+}
+
+/* copies args from first on into one record, blocks while full */
+static int shm_write(lua_State *L, int first, double deadline) {
+    pb_Shm *r = check_shm(L, 1);
+    int arg, res, top = lua_gettop(L);
+    size_t i, len = 0;
+    uint64_t pos;
+    char *p;
+    if (r->closed) return luaL_error(L, "attempt to use a closed ring");
+    for (arg = first; arg <= top; ++arg) {
+        pb_Buffer *buf = (pb_Buffer*)testudata(L, arg, pb_buftype);
+        size_t n;
+        if (buf == NULL)
+            luaL_checklstring(L, arg, &n);
+        else for (n = buf->used, i = 0; i < buf->nslices; ++i)
+            n += buf->slices[i].len;
+        len += n;
+    }
+    if (len >= PB_SHMPAD || shm_recsize(len) > r->h->size)
+        return luaL_error(L, "message too big for ring (%d bytes)", (int)len);
+    if ((res = shm_reserve(r, len, deadline, &pos)) <= 0)
+        return shm_result(L, res);
+    p = r->data + (pos & (r->h->size - 1)) + 8;
+    for (arg = first; arg <= top; ++arg) {
+        pb_Buffer *buf = (pb_Buffer*)testudata(L, arg, pb_buftype);
+        const char *s;
+        size_t n;
+        if (buf == NULL) {
+            s = lua_tolstring(L, arg, &n);
+            memcpy(p, s, n), p += n;
+            continue;
+        }
+        for (i = 0; i < buf->nslices; ++i) {
+            memcpy(p, buf->slices[i].p, buf->slices[i].len);
+            p += buf->slices[i].len;
+        }
+        memcpy(p, buf->buf, buf->used), p += buf->used;
+    }
+    shm_commit(r, pos, len);
+    return_self(L);
+}
+
+static int Lshm_write(lua_State *L)
+{ return shm_write(L, 2, -1); }
+
+static int Lshm_timedwrite(lua_State *L)
+{ return shm_write(L, 3, shm_deadline(L, 2)); }
+
+static int Lshm_next(lua_State *L) {
+    pb_Shm *r = check_shm(L, 1);
+    int res = shm_next(L, r, shm_deadline(L, 2));
+    if (res <= 0) return shm_result(L, res);
+    lua_pushinteger(L, (lua_Integer)r->winlen);
+    return 1;
+}
+
+static int Lshm_read(lua_State *L) {
+    pb_Shm *r = check_shm(L, 1);
+    int res = shm_next(L, r, shm_deadline(L, 2));
+    if (res <= 0) return shm_result(L, res);
+    lua_pushlstring(L, r->win, r->winlen);
+    return 1;
+}
+
+static int Lshm_shutdown(lua_State *L) {
+    pb_Shm *r = check_shm(L, 1);
+    if (r->closed) return luaL_error(L, "attempt to use a closed ring");
+    shm_store(&r->h->closed, 1);
+    shm_add(&r->h->posted, 1);
+    shm_add(&r->h->freed, 1);
+    shm_wake(&r->h->posted);
+    shm_wake(&r->h->freed);
+    return 0;
+}
+
+static int Lshm_close(lua_State *L) {
+    shm_detach(check_shm(L, 1));
+    return 0;
+}
+
+static int Lshm_gc(lua_State *L) {
+    shm_unmap(check_shm(L, 1));
+    return 0;
+}
+
+static int Lshm_tostring(lua_State *L) {
+    pb_Shm *r = check_shm(L, 1);
+    if (r->closed)
+        lua_pushstring(L, "pb.Shm: closed");
+    else
+        lua_pushfstring(L, "pb.Shm: %p (%d bytes)", r->h, (int)r->h->size);
+    return 1;
+}
+
+#else /* !PB_HAVESHM */
+
+static int shm_source(lua_State *L, int idx, pb_Decoder *dec, int advance)
+{ (void)L, (void)idx, (void)dec, (void)advance; return 0; }
+
+static int shm_unsupported(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "shared memory rings are not supported");
+    return 2;
+}
+# define Lshm_create shm_unsupported
+# define Lshm_open   shm_unsupported
+# define Lshm_unlink shm_unsupported
+
+#endif /* PB_HAVESHM */
+
+PB_API int luaopen_pb_shm(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lshm_##name }
+        ENTRY(create),
+        ENTRY(open),
+        ENTRY(unlink),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+#ifdef PB_HAVESHM
+    luaL_Reg methods[] = {
+#define ENTRY(name) { #name, Lshm_##name }
+        ENTRY(write),
+        ENTRY(timedwrite),
+        ENTRY(next),
+        ENTRY(read),
+        ENTRY(shutdown),
+        ENTRY(close),
+#undef  ENTRY
+        { "__gc", Lshm_gc },
+        { "__tostring", Lshm_tostring },
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, pb_shmtype)) {
+        luaL_setfuncs(L, methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_shmtype);
+    }
+    lua_pop(L, 1);
+#endif
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+/* process wide shared schemas: built once in C from a compiled
+ * FileDescriptorSet, never changed after, and reference counted by the
+ * handles states hold. Messages are decoded and encoded straight from
+ * it (h:decode(), h:encode()); other functions of pb.lua need type
+ * tables and copy the types they use into the state (h:load()). Only
+ * the registry needs the lock. */
+
+typedef struct pb_SField {
+    char *name;
+    char *type_name;        /* full name of named type, without dot */
+    char *default_value;
+    char *extendee;         /* extensions only, while building */
+    const struct pb_SType *ftype; /* type_name, NULL if not in schema */
+    int32_t tag;            /* value for enum items */
+    int type;               /* pb_Type, -1 if not known yet */
+    int repeated, packed;
+    int hidden;             /* name taken by a later field (extension) */
+} pb_SField;
+
+typedef struct pb_SType {
+    char *name;             /* full name, without leading dot */
+    int isenum, map_entry;
+    size_t nfields, fieldcap;
+    pb_SField *fields;      /* items of enums, sorted by tag */
+    size_t nbyname;
+    pb_SField **byname;     /* fields sorted by name, as pb.lua's map */
+} pb_SType;
+
+typedef struct pb_Shared {
+    struct pb_Shared *next;
+    char *name;
+    size_t refs;
+    size_t ntypes, typecap;
+    pb_SType *types;        /* sorted by name after building */
+    size_t nexts, extcap;
+    pb_SField *exts;
+} pb_Shared;
+
+typedef struct pb_SValue {
+    uint32_t tag;
+    int wiretype;
+    uint64_t n;
+    pb_Slice s;
+} pb_SValue;
+
+static pb_Shared *pb_shared; /* registry, under pb_globallock() */
+
+static const char pb_sharedtype[] = "pb.Shared";
+
+/* FieldDescriptorProto.Type to pb_Type */
+static const int pb_descriptortypes[] = {
+    -1, PB_Tdouble, PB_Tfloat, PB_Tint64, PB_Tuint64, PB_Tint32,
+    PB_Tfixed64, PB_Tfixed32, PB_Tbool, PB_Tstring, PB_Tgroup,
+    PB_Tmessage, PB_Tbytes, PB_Tuint32, PB_Tenum, PB_Tsfixed32,
+    PB_Tsfixed64, PB_Tsint32, PB_Tsint64,
+};
+
+/* next field of d, returns 0 at end and -1 on bad data */
+static int shared_value(pb_Decoder *d, pb_SValue *v) {
+    uint64_t key;
+    if (d->p >= d->end) return 0;
+    if (!pb_readvarint(d, &key)) return -1;
+    v->tag = (uint32_t)(key >> 3);
+    v->wiretype = (int)(key & 7);
+    switch (v->wiretype) {
+    case PB_TVARINT:
+        return pb_readvarint(d, &v->n) ? 1 : -1;
+    case PB_TLENGTH:
+        if (!pb_readvarint(d, &v->n)
+                || (uint64_t)(d->end - d->p) < v->n)
+            return -1;
+        v->s.p = d->p, v->s.len = (size_t)v->n;
+        d->p += v->s.len;
+        return 1;
+    case PB_T64BIT:
+        return pb_skipsize(d, 8) ? 1 : -1;
+    case PB_T32BIT:
+        return pb_skipsize(d, 4) ? 1 : -1;
+    default:
+        return -1;
+    }
+}
+
+static void shared_decoder(pb_Decoder *d, pb_Slice s) {
+    d->len = s.len;
+    d->s = d->p = s.p;
+    d->end = s.p + s.len;
+}
+
+/* "prefix.name", or a copy of name if prefix is empty */
+static char *shared_name(const char *prefix, pb_Slice name) {
+    size_t plen = prefix ? strlen(prefix) : 0;
+    char *s = (char*)malloc(plen + name.len + 2), *p = s;
+    if (s == NULL) return NULL;
+    if (plen) {
+        memcpy(p, prefix, plen);
+        p[plen] = '.';
+        p += plen + 1;
+    }
+    memcpy(p, name.p, name.len);
+    p[name.len] = '\0';
+    return s;
+}
+
+static void *shared_grow(void *items, size_t n, size_t *cap, size_t size) {
+    size_t newcap;
+    void *newitems;
+    if (n < *cap) return items;
+    newcap = *cap ? *cap * 2 : 8;
+    newitems = realloc(items, newcap * size);
+    if (newitems) *cap = newcap;
+    return newitems;
+}
+
+static pb_SField *shared_newfield(pb_SField **fields, size_t *n,
+        size_t *cap) {
+    pb_SField *f, *grown = (pb_SField*)shared_grow(*fields, *n, cap,
+            sizeof(pb_SField));
+    if (grown == NULL) return NULL;
+    *fields = grown;
+    f = &grown[(*n)++];
+    memset(f, 0, sizeof(*f));
+    f->type = -1;
+    return f;
+}
+
+/* adds type of name (taken), returns its index or -1 */
+static long shared_newtype(pb_Shared *S, char *name, int isenum) {
+    pb_SType *t, *grown;
+    if (name == NULL) return -1;
+    grown = (pb_SType*)shared_grow(S->types, S->ntypes, &S->typecap,
+            sizeof(pb_SType));
+    if (grown == NULL) {
+        free(name);
+        return -1;
+    }
+    S->types = grown;
+    t = &grown[S->ntypes];
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->isenum = isenum;
+    return (long)S->ntypes++;
+}
+
+/* the name (tag 1) of a descriptor in s */
+static pb_Slice shared_descname(pb_Slice s) {
+    pb_Decoder d;
+    pb_SValue v;
+    pb_Slice name = { "", 0 };
+    shared_decoder(&d, s);
+    while (shared_value(&d, &v) > 0)
+        if (v.tag == 1 && v.wiretype == PB_TLENGTH)
+            name = v.s;
+    return name;
+}
+
+static int shared_field(pb_SField *f, pb_Slice s) {
+    pb_Decoder d, od;
+    pb_SValue v, ov;
+    int r;
+    shared_decoder(&d, s);
+    while ((r = shared_value(&d, &v)) > 0) {
+        pb_Slice str = v.s;
+        char **ps = NULL;
+        if (v.wiretype == PB_TVARINT) {
+            switch (v.tag) {
+            case 3: f->tag = (int32_t)v.n; break;
+            case 4: f->repeated = (v.n == 3); break;
+            case 5: f->type = v.n < sizeof(pb_descriptortypes)/sizeof(int) ?
+                        pb_descriptortypes[v.n] : -1; break;
+            }
+            continue;
+        }
+        if (v.wiretype != PB_TLENGTH) continue;
+        switch (v.tag) {
+        case 1: ps = &f->name; break;
+        case 2: ps = &f->extendee; break;
+        case 6: ps = &f->type_name; break;
+        case 7: ps = &f->default_value; break;
+        case 8:
+            shared_decoder(&od, v.s);
+            while ((r = shared_value(&od, &ov)) > 0)
+                if (ov.tag == 2 && ov.wiretype == PB_TVARINT)
+                    f->packed = (ov.n != 0);
+            if (r < 0) return 0;
+            continue;
+        default: continue;
+        }
+        if (ps != &f->name && ps != &f->default_value
+                && str.len && str.p[0] == '.')
+            ++str.p, --str.len; /* names are fully qualified */
+        free(*ps);
+        if ((*ps = shared_name(NULL, str)) == NULL) return 0;
+    }
+    return r == 0 && f->name != NULL;
+}
+
+static int shared_enum(pb_Shared *S, const char *prefix, pb_Slice s) {
+    pb_Decoder d, vd;
+    pb_SValue v, vv;
+    long ti = shared_newtype(S, shared_name(prefix, shared_descname(s)), 1);
+    int r;
+    if (ti < 0) return 0;
+    shared_decoder(&d, s);
+    while ((r = shared_value(&d, &v)) > 0) {
+        pb_SType *t = &S->types[ti];
+        pb_SField *f;
+        if (v.tag != 2 || v.wiretype != PB_TLENGTH) continue;
+        f = shared_newfield(&t->fields, &t->nfields, &t->fieldcap);
+        if (f == NULL) return 0;
+        shared_decoder(&vd, v.s);
+        while ((r = shared_value(&vd, &vv)) > 0) {
+            if (vv.tag == 1 && vv.wiretype == PB_TLENGTH) {
+                free(f->name);
+                if ((f->name = shared_name(NULL, vv.s)) == NULL) return 0;
+            }
+            else if (vv.tag == 2 && vv.wiretype == PB_TVARINT)
+                f->tag = (int32_t)vv.n;
+        }
+        if (r < 0 || f->name == NULL) return 0;
+    }
+    return r == 0;
+}
+
+static int shared_extension(pb_Shared *S, pb_Slice s) {
+    pb_SField *f = shared_newfield(&S->exts, &S->nexts, &S->extcap);
+    return f != NULL && shared_field(f, s) && f->extendee != NULL;
+}
+
+static int shared_message(pb_Shared *S, const char *prefix, pb_Slice s) {
+    pb_Decoder d, od;
+    pb_SValue v, ov;
+    long ti = shared_newtype(S, shared_name(prefix, shared_descname(s)), 0);
+    int r;
+    if (ti < 0) return 0;
+    shared_decoder(&d, s);
+    while ((r = shared_value(&d, &v)) > 0) {
+        pb_SType *t = &S->types[ti];
+        pb_SField *f;
+        int ok = 1;
+        if (v.wiretype != PB_TLENGTH) continue;
+        switch (v.tag) {
+        case 2:
+            f = shared_newfield(&t->fields, &t->nfields, &t->fieldcap);
+            ok = f != NULL && shared_field(f, v.s);
+            break;
+        case 3: ok = shared_message(S, t->name, v.s); break;
+        case 4: ok = shared_enum(S, t->name, v.s); break;
+        case 6: ok = shared_extension(S, v.s); break;
+        case 7:
+            shared_decoder(&od, v.s);
+            while ((r = shared_value(&od, &ov)) > 0)
+                if (ov.tag == 7 && ov.wiretype == PB_TVARINT)
+                    t->map_entry = (ov.n != 0);
+            ok = r == 0;
+            break;
+        }
+        if (!ok) return 0;
+    }
+    return r == 0;
+}
+
+static int shared_file(pb_Shared *S, pb_Slice s) {
+    pb_Decoder d;
+    pb_SValue v;
+    char *package = NULL;
+    int r, ok = 1;
+    shared_decoder(&d, s);
+    while ((r = shared_value(&d, &v)) > 0)
+        if (v.tag == 2 && v.wiretype == PB_TLENGTH) {
+            free(package);
+            if ((package = shared_name(NULL, v.s)) == NULL) return 0;
+        }
+    shared_decoder(&d, s);
+    while (ok && (r = shared_value(&d, &v)) > 0) {
+        if (v.wiretype != PB_TLENGTH) continue;
+        switch (v.tag) {
+        case 4: ok = shared_message(S, package, v.s); break;
+        case 5: ok = shared_enum(S, package, v.s); break;
+        case 7: ok = shared_extension(S, v.s); break;
+        }
+    }
+    free(package);
+    return ok && r == 0;
+}
+
+static void shared_freefield(pb_SField *f) {
+    free(f->name);
+    free(f->type_name);
+    free(f->default_value);
+    free(f->extendee);
+}
+
+static void shared_free(pb_Shared *S) {
+    size_t i, j;
+    for (i = 0; i < S->ntypes; ++i) {
+        pb_SType *t = &S->types[i];
+        for (j = 0; j < t->nfields; ++j)
+            shared_freefield(&t->fields[j]);
+        free(t->fields);
+        free(t->byname);
+        free(t->name);
+    }
+    for (i = 0; i < S->nexts; ++i)
+        shared_freefield(&S->exts[i]);
+    free(S->exts);
+    free(S->types);
+    free(S->name);
+    free(S);
+}
+
+static int shared_cmptype(const void *a, const void *b) {
+    return strcmp(((const pb_SType*)a)->name, ((const pb_SType*)b)->name);
+}
+
+static pb_SType *shared_find(const pb_Shared *S, const char *name) {
+    pb_SType key;
+    key.name = (char*)name;
+    return (pb_SType*)bsearch(&key, S->types, S->ntypes, sizeof(pb_SType),
+            shared_cmptype);
+}
+
+static int shared_cmptag(const void *a, const void *b) {
+    int32_t ta = ((const pb_SField*)a)->tag, tb = ((const pb_SField*)b)->tag;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static int shared_cmpname(const void *a, const void *b) {
+    return strcmp((*(pb_SField*const*)a)->name, (*(pb_SField*const*)b)->name);
+}
+
+/* same names in the order the fields were added */
+static int shared_cmporder(const void *a, const void *b) {
+    int res = shared_cmpname(a, b);
+    if (res != 0) return res;
+    return *(pb_SField*const*)a < *(pb_SField*const*)b ? -1 : 1;
+}
+
+static const pb_SField *shared_bytag(const pb_SType *t, int32_t tag) {
+    pb_SField key;
+    key.tag = tag;
+    return (const pb_SField*)bsearch(&key, t->fields, t->nfields,
+            sizeof(pb_SField), shared_cmptag);
+}
+
+static const pb_SField *shared_byname(const pb_SType *t, const char *name) {
+    pb_SField key, *pkey = &key, **f;
+    key.name = (char*)name;
+    f = (pb_SField**)bsearch(&pkey, t->byname, t->nbyname,
+            sizeof(pb_SField*), shared_cmpname);
+    return f ? *f : NULL;
+}
+
+/* extension fields go to their extendee, as pb.lua loads them, then
+ * fields are indexed and their types resolved */
+static int shared_link(pb_Shared *S) {
+    size_t i, j;
+    qsort(S->types, S->ntypes, sizeof(pb_SType), shared_cmptype);
+    for (i = 0; i < S->nexts; ++i) {
+        pb_SField *ext = &S->exts[i], *f;
+        pb_SType *t = shared_find(S, ext->extendee);
+        if (t == NULL || t->isenum) continue;
+        f = shared_newfield(&t->fields, &t->nfields, &t->fieldcap);
+        if (f == NULL) return 0;
+        *f = *ext;
+        free(f->extendee);
+        f->extendee = NULL;
+        memset(ext, 0, sizeof(*ext));
+    }
+    for (i = 0; i < S->ntypes; ++i) {
+        pb_SType *t = &S->types[i];
+        if (t->nfields == 0) continue;
+        t->byname = (pb_SField**)malloc(t->nfields * sizeof(pb_SField*));
+        if (t->byname == NULL) return 0;
+        for (j = 0; j < t->nfields; ++j)
+            t->byname[j] = &t->fields[j];
+        qsort(t->byname, t->nfields, sizeof(pb_SField*), shared_cmporder);
+        for (j = 0; j + 1 < t->nfields; ++j)
+            t->byname[j]->hidden = !shared_cmpname(&t->byname[j],
+                    &t->byname[j + 1]);
+        qsort(t->fields, t->nfields, sizeof(pb_SField), shared_cmptag);
+        for (j = 0; j < t->nfields; ++j) {
+            pb_SField *f = &t->fields[j];
+            if (!f->hidden) t->byname[t->nbyname++] = f;
+            if (t->isenum || f->type_name == NULL || f->type == PB_Tgroup)
+                continue; /* groups are not supported */
+            if ((f->ftype = shared_find(S, f->type_name)) != NULL)
+                f->type = f->ftype->isenum ? PB_Tenum : PB_Tmessage;
+        }
+        qsort(t->byname, t->nbyname, sizeof(pb_SField*), shared_cmpname);
+    }
+    return 1;
+}
+
+static pb_Shared *shared_build(const char *name, pb_Slice data) {
+    pb_Shared *S = (pb_Shared*)malloc(sizeof(pb_Shared));
+    pb_Decoder d;
+    pb_SValue v;
+    int r, ok = 1;
+    pb_Slice sname;
+    if (S == NULL) return NULL;
+    memset(S, 0, sizeof(*S));
+    sname.p = name, sname.len = strlen(name);
+    if ((S->name = shared_name(NULL, sname)) == NULL) ok = 0;
+    shared_decoder(&d, data);
+    while (ok && (r = shared_value(&d, &v)) > 0)
+        if (v.tag == 1 && v.wiretype == PB_TLENGTH)
+            ok = shared_file(S, v.s);
+    if (!ok || r != 0 || !shared_link(S)) {
+        shared_free(S);
+        return NULL;
+    }
+    return S;
+}
+
+static void shared_release(pb_Shared *S) {
+    pb_Shared **pS;
+    int last = 0;
+    pb_globallock();
+    if (--S->refs == 0) {
+        for (pS = &pb_shared; *pS != S; pS = &(*pS)->next)
+            ;
+        *pS = S->next;
+        last = 1;
+    }
+    pb_globalunlock();
+    if (last) shared_free(S);
+}
+
+/* find name in registry, adding S (if any) when not there */
+static pb_Shared *shared_attach(const char *name, pb_Shared *S) {
+    pb_Shared *found;
+    pb_globallock();
+    for (found = pb_shared; found; found = found->next)
+        if (strcmp(found->name, name) == 0) break;
+    if (found == NULL && S != NULL) {
+        S->next = pb_shared;
+        pb_shared = found = S, S = NULL;
+    }
+    if (found) ++found->refs;
+    pb_globalunlock();
+    if (S) shared_free(S); /* built by someone else meanwhile */
+    return found;
+}
+
+#define check_shared(L,idx) ((pb_Shared**)checkudata(L,idx,(const void*)pb_sharedtype))
+
+static int Lshared_open(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    pb_Shared **pS;
+    lua_settop(L, 2);
+    pS = (pb_Shared**)lua_newuserdata(L, sizeof(pb_Shared*));
+    *pS = NULL;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, pb_sharedtype);
+    lua_setmetatable(L, -2);
+    if ((*pS = shared_attach(name, NULL)) == NULL && !lua_isnil(L, 2)) {
+        pb_Slice data;
+        pb_Shared *S;
+        data.p = pb_tolbuffer(L, 2, &data.len);
+        if ((S = shared_build(name, data)) == NULL) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "bad or incomplete schema for '%s'", name);
+            return 2;
+        }
+        *pS = shared_attach(name, S);
+    }
+    if (*pS == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "no shared schema '%s'", name);
+        return 2;
+    }
+    return 1;
+}
+
+static int Lshared_close(lua_State *L) {
+    pb_Shared **pS = check_shared(L, 1);
+    if (*pS) shared_release(*pS);
+    *pS = NULL;
+    return 0;
+}
+
+static void shared_pushfield(lua_State *L, const pb_SField *f) {
+    int type = f->type;
+    lua_createtable(L, 0, 6);
+    lua_pushliteral(L, "field");
+    lua_setfield(L, -2, "type");
+    lua_pushstring(L, f->name);
+    lua_setfield(L, -2, "name");
+    lua_pushboolean(L, f->repeated);
+    lua_setfield(L, -2, "repeated");
+    if (f->packed) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "packed");
+    }
+    if (f->default_value) {
+        lua_pushstring(L, f->default_value);
+        lua_setfield(L, -2, "default_value");
+    }
+    if (f->type_name) {
+        const char *p = f->type_name, *e;
+        int i = 0;
+        lua_newtable(L);
+        while ((e = strchr(p, '.')) != NULL) {
+            lua_pushlstring(L, p, e - p);
+            lua_rawseti(L, -2, ++i);
+            p = e + 1;
+        }
+        lua_pushstring(L, p);
+        lua_rawseti(L, -2, ++i);
+    }
+    else if (type >= 0 && type < PB_TCOUNT) {
+        lua_pushstring(L, pb_types[type]);
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -3, "scalar");
+    }
+    else
+        lua_pushnil(L);
+    lua_setfield(L, -2, "type_name");
+}
+
+/* type t in the format of pb.lua's type tables */
+static void shared_pushtype(lua_State *L, const pb_SType *t) {
+    size_t i;
+    lua_newtable(L);
+    lua_pushstring(L, t->isenum ? "enum" : "message");
+    lua_setfield(L, -2, "type");
+    if (t->map_entry) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "map_entry");
+    }
+    lua_createtable(L, 0, (int)t->nfields);
+    for (i = 0; i < t->nfields; ++i) {
+        const pb_SField *f = &t->fields[i];
+        if (t->isenum) {
+            lua_pushstring(L, f->name);
+            lua_pushinteger(L, f->tag);
+            lua_rawset(L, -3);
+            lua_pushstring(L, f->name);
+            lua_rawseti(L, -3, f->tag);
+            continue;
+        }
+        lua_pushinteger(L, f->tag);
+        lua_setfield(L, -2, f->name);
+        shared_pushfield(L, f);
+        lua_rawseti(L, -3, f->tag);
+        if (f->default_value && !f->repeated) {
+            lua_getfield(L, -2, "defaults");
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_setfield(L, -4, "defaults");
+            }
+            lua_pushstring(L, f->default_value);
+            lua_setfield(L, -2, f->name);
+            lua_pop(L, 1);
+        }
+    }
+    lua_setfield(L, -2, "map");
+}
+
+/* add t and the types it reaches to table at r, by full name */
+static void shared_collect(lua_State *L, const pb_Shared *S,
+        const pb_SType *t, int r) {
+    size_t i;
+    lua_getfield(L, r, t->name);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    luaL_checkstack(L, 4, "types nested too deep");
+    shared_pushtype(L, t);
+    lua_setfield(L, r, t->name);
+    for (i = 0; !t->isenum && i < t->nfields; ++i) {
+        const pb_SType *ft;
+        if (t->fields[i].type_name == NULL) continue;
+        ft = shared_find(S, t->fields[i].type_name);
+        if (ft) shared_collect(L, S, ft, r);
+    }
+}
+
+static int Lshared_load(lua_State *L) {
+    pb_Shared **pS = check_shared(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    const pb_SType *t;
+    if (*pS == NULL) return luaL_error(L, "shared schema closed");
+    if (*name == '.') ++name;
+    if ((t = shared_find(*pS, name)) == NULL) return 0;
+    lua_newtable(L);
+    shared_collect(L, *pS, t, lua_gettop(L));
+    return 1;
+}
+
+/* decoding and encoding with a shared schema, as pb.decode() and
+ * pb.encode() do with type tables (default options) */
+
+static int shared_truncated(pb_FBDecoder *fb) {
+    restore_decoder(fb);
+    return luaL_error(fb->L, "truncated message at offset %d",
+            (int)(fb->dec->p - fb->dec->s));
+}
+
+/* read a length delimited value as sub decoder */
+static void shared_sub(pb_FBDecoder *fb, pb_Decoder *sub) {
+    uint64_t n = 0;
+    if (!pb_readvarint(fb->dec, &n)
+            || (uint64_t)(fb->dec->end - fb->dec->p) < n)
+        shared_truncated(fb);
+    *sub = *fb->dec;
+    sub->end = sub->p + n;
+    fb->dec->p += n;
+}
+
+static int shared_ismessage(const pb_SField *f)
+{ return f->ftype != NULL && !f->ftype->isenum; }
+
+static int shared_packable(const pb_SField *f)
+{ return f->repeated && pb_packedwiretype(f->type) >= 0; }
+
+/* the integer on top becomes the name of its value in enum e */
+static void shared_enumname(lua_State *L, const pb_SType *e) {
+    const pb_SField *v;
+    lua_Integer n;
+    if (lua_type(L, -1) != LUA_TNUMBER) return;
+    n = lua_tointeger(L, -1);
+    if (n != (int32_t)n || (v = shared_bytag(e, (int32_t)n)) == NULL)
+        return;
+    lua_pop(L, 1);
+    lua_pushstring(L, v->name);
+}
+
+/* copy declared defaults of t to unset fields of the table on top */
+static void shared_defaults(lua_State *L, const pb_SType *t) {
+    size_t i;
+    for (i = 0; i < t->nfields; ++i) {
+        const pb_SField *f = &t->fields[i];
+        if (f->default_value == NULL) continue;
+        lua_pushstring(L, f->name);
+        lua_rawget(L, -2);
+        if (lua_isnil(L, -1)) {
+            lua_pushstring(L, f->name);
+            lua_pushstring(L, f->default_value);
+            lua_rawset(L, -4);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static void shared_decodemsg(pb_FBDecoder *fb, const pb_SType *t,
+        int nodefaults, int depth);
+
+/* push value of field f, enum values become their names */
+static void shared_decodevalue(pb_FBDecoder *fb, const pb_SField *f,
+        int wiretype, int nodefaults, int depth) {
+    if (shared_ismessage(f)) {
+        pb_Decoder sub;
+        pb_FBDecoder sfb;
+        if (wiretype != PB_TLENGTH)
+            luaL_error(fb->L, "can not convert from %s to message",
+                    wiretype < PB_TWCOUNT ? pb_wiretypes[wiretype] : "?");
+        shared_sub(fb, &sub);
+        sfb.dec = &sub, sfb.L = fb->L;
+        shared_decodemsg(&sfb, f->ftype, nodefaults, depth + 1);
+        return;
+    }
+    if (!pb_pushscalar(fb, wiretype, f->ftype ? -1 : f->type))
+        shared_truncated(fb);
+    if (f->ftype) shared_enumname(fb->L, f->ftype);
+}
+
+/* append values of a packed field to the array on top */
+static void shared_decodepacked(pb_FBDecoder *fb, const pb_SField *f) {
+    lua_State *L = fb->L;
+    pb_Decoder sub;
+    pb_FBDecoder sfb;
+    int wiretype = pb_packedwiretype(f->type);
+    int n = (int)lua_rawlen(L, -1);
+    shared_sub(fb, &sub);
+    sfb.dec = &sub, sfb.L = L;
+    while (sub.p < sub.end) {
+        sfb.fb = sub.p;
+        if (!pb_pushscalar(&sfb, wiretype, f->ftype ? -1 : f->type))
+            shared_truncated(&sfb);
+        if (f->ftype) shared_enumname(L, f->ftype);
+        lua_rawseti(L, -2, ++n);
+    }
+}
+
+/* push the array (or map) of field f of the table on top, made if
+ * needed */
+static void shared_array(lua_State *L, const pb_SField *f) {
+    lua_pushstring(L, f->name);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushstring(L, f->name);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+}
+
+/* zero value of field f, for map entries without key or value */
+static void shared_pushzero(lua_State *L, const pb_SField *f,
+        int nodefaults) {
+    if (shared_ismessage(f)) {
+        lua_newtable(L);
+        if (!nodefaults) shared_defaults(L, f->ftype);
+        return;
+    }
+    switch (f->type) {
+    case PB_Tdouble: case PB_Tfloat:
+        lua_pushnumber(L, 0.0); break;
+    case PB_Tbool:
+        lua_pushboolean(L, 0); break;
+    case PB_Tstring: case PB_Tbytes:
+        lua_pushliteral(L, ""); break;
+    default:
+        lua_pushinteger(L, 0);
+        if (f->ftype) shared_enumname(L, f->ftype);
+    }
+}
+
+static void shared_decodeentry(pb_FBDecoder *fb, const pb_SField *f,
+        int wiretype, int nodefaults, int depth) {
+    lua_State *L = fb->L;
+    const pb_SField *kf = shared_bytag(f->ftype, 1);
+    const pb_SField *vf = shared_bytag(f->ftype, 2);
+    pb_Decoder sub;
+    pb_FBDecoder sfb;
+    int top;
+    if (kf == NULL || vf == NULL || wiretype != PB_TLENGTH)
+        luaL_error(L, "bad map entry for field '%s'", f->name);
+    shared_array(L, f);
+    top = lua_gettop(L);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    shared_sub(fb, &sub);
+    sfb.dec = &sub, sfb.L = L;
+    while (sub.p < sub.end) {
+        uint64_t key = 0;
+        sfb.fb = sub.p;
+        if (!pb_readvarint(&sub, &key)) shared_truncated(&sfb);
+        if ((key >> 3) != 1 && (key >> 3) != 2) {
+            if (!skipvalue(&sfb, (int)(key & 7))) shared_truncated(&sfb);
+            continue;
+        }
+        shared_decodevalue(&sfb, (key >> 3) == 1 ? kf : vf, (int)(key & 7),
+                nodefaults, depth);
+        lua_replace(L, top + (int)(key >> 3));
+    }
+    if (lua_isnil(L, top + 1)) {
+        shared_pushzero(L, kf, nodefaults);
+        lua_replace(L, top + 1);
+    }
+    if (lua_isnil(L, top + 2)) {
+        shared_pushzero(L, vf, nodefaults);
+        lua_replace(L, top + 2);
+    }
+    lua_rawset(L, top);
+    lua_pop(L, 1);
+}
+
+/* push message of type t decoded from fb */
+static void shared_decodemsg(pb_FBDecoder *fb, const pb_SType *t,
+        int nodefaults, int depth) {
+    lua_State *L = fb->L;
+    pb_Decoder *dec = fb->dec;
+    if (depth > PB_MAXDEPTH)
+        luaL_error(L, "message nested too deep");
+    luaL_checkstack(L, 8, "message nested too deep");
+    lua_newtable(L);
+    while (dec->p < dec->end) {
+        const pb_SField *f;
+        uint64_t key = 0;
+        int wiretype;
+        fb->fb = dec->p;
+        if (!pb_readvarint(dec, &key)) shared_truncated(fb);
+        wiretype = (int)(key & 7);
+        f = shared_bytag(t, (int32_t)(key >> 3));
+        if (f == NULL || (f->type_name != NULL && f->ftype == NULL)) {
+            if (!skipvalue(fb, wiretype)) shared_truncated(fb);
+        }
+        else if (f->ftype && f->ftype->map_entry)
+            shared_decodeentry(fb, f, wiretype, nodefaults, depth);
+        else if (!f->repeated) {
+            lua_pushstring(L, f->name);
+            shared_decodevalue(fb, f, wiretype, nodefaults, depth);
+            lua_rawset(L, -3);
+        }
+        else {
+            shared_array(L, f);
+            if (wiretype == PB_TLENGTH && shared_packable(f))
+                shared_decodepacked(fb, f);
+            else {
+                shared_decodevalue(fb, f, wiretype, nodefaults, depth);
+                lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    if (!nodefaults) shared_defaults(L, t);
+}
+
+static int shared_typeerror(lua_State *L, int idx, const pb_SField *f,
+        const char *tname) {
+    return luaL_error(L, "%s expected for field '%s', got %s",
+            tname, f->name, luaL_typename(L, idx));
+}
+
+static lua_Integer shared_checkinteger(lua_State *L, int idx,
+        const pb_SField *f) {
+    int isint;
+    lua_Integer v = lua_tointegerx(L, idx, &isint);
+    if (!isint) shared_typeerror(L, idx, f, "integer");
+    return v;
+}
+
+static lua_Number shared_checknumber(lua_State *L, int idx,
+        const pb_SField *f) {
+    if (!lua_isnumber(L, idx)) shared_typeerror(L, idx, f, "number");
+    return lua_tonumber(L, idx);
+}
+
+static int shared_wiretype(const pb_SField *f) {
+    return shared_ismessage(f) ? PB_TLENGTH : pb_wiretypeof(f->type);
+}
+
+static void shared_encodemsg(lua_State *L, pb_Buffer *b, int idx,
+        const pb_SType *t, int depth);
+
+/* add value at idx of field f, without tag */
+static void shared_addvalue(lua_State *L, pb_Buffer *b, int idx,
+        const pb_SField *f, int depth) {
+    union { float f; uint32_t u32;
+            double d; uint64_t u64; } u;
+    if (shared_ismessage(f)) {
+        size_t start = b->used;
+        if (!lua_istable(L, idx)) shared_typeerror(L, idx, f, "table");
+        shared_encodemsg(L, b, idx, f->ftype, depth + 1);
+        pb_addlength(b, start);
+        return;
+    }
+    if (f->ftype && lua_type(L, idx) == LUA_TSTRING) {
+        const pb_SField *v = shared_byname(f->ftype, lua_tostring(L, idx));
+        if (v == NULL)
+            luaL_error(L, "unknown value '%s' of enum '%s' for field '%s'",
+                    lua_tostring(L, idx), f->ftype->name, f->name);
+        pb_addvarint(b, (uint64_t)(int64_t)v->tag);
+        return;
+    }
+    switch (f->type) {
+    case PB_Tbool:
+        pb_prepbuffer(b, 1);
+        pb_addchar(b, lua_toboolean(L, idx) ? 1 : 0);
+        break;
+    case PB_Tbytes:
+    case PB_Tstring:
+        if (lua_type(L, idx) != LUA_TSTRING
+                && lua_type(L, idx) != LUA_TNUMBER
+                && lua_type(L, idx) != LUA_TUSERDATA)
+            shared_typeerror(L, idx, f, "string");
+        pb_addvalue(b, L, idx, 1);
+        break;
+    case PB_Tdouble:
+        u.d = (double)shared_checknumber(L, idx, f);
+        pb_addfixed64(b, u.u64);
+        break;
+    case PB_Tfloat:
+        u.f = (float)shared_checknumber(L, idx, f);
+        pb_addfixed32(b, u.u32);
+        break;
+    case PB_Tfixed32:
+    case PB_Tsfixed32:
+        pb_addfixed32(b, (uint32_t)shared_checkinteger(L, idx, f));
+        break;
+    case PB_Tfixed64:
+    case PB_Tsfixed64:
+        pb_addfixed64(b, (uint64_t)shared_checkinteger(L, idx, f));
+        break;
+    case PB_Tint32:
+    case PB_Tuint32:
+        pb_addvarint(b, (uint32_t)shared_checkinteger(L, idx, f));
+        break;
+    case PB_Tsint32:
+        u.u32 = (uint32_t)shared_checkinteger(L, idx, f);
+        pb_addvarint(b, (uint32_t)((u.u32 << 1) ^ -(u.u32 >> 31)));
+        break;
+    case PB_Tsint64:
+        u.u64 = (uint64_t)shared_checkinteger(L, idx, f);
+        pb_addvarint(b, (u.u64 << 1) ^ -(u.u64 >> 63));
+        break;
+    default: /* enums, int64, uint64 */
+        pb_addvarint(b, (uint64_t)shared_checkinteger(L, idx, f));
+    }
+}
+
+static void shared_encodemap(lua_State *L, pb_Buffer *b, int idx,
+        const pb_SField *f, int depth) {
+    const pb_SField *kf = shared_bytag(f->ftype, 1);
+    const pb_SField *vf = shared_bytag(f->ftype, 2);
+    int top = lua_gettop(L);
+    if (kf == NULL || vf == NULL)
+        luaL_error(L, "bad map entry for field '%s'", f->name);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        size_t start;
+        lua_pushvalue(L, top + 1); /* converting the key breaks next() */
+        pb_addtag(b, (uint32_t)f->tag, PB_TLENGTH);
+        start = b->used;
+        pb_addtag(b, 1, shared_wiretype(kf));
+        shared_addvalue(L, b, top + 3, kf, depth);
+        pb_addtag(b, 2, shared_wiretype(vf));
+        shared_addvalue(L, b, top + 2, vf, depth);
+        pb_addlength(b, start);
+        lua_settop(L, top + 1);
+    }
+}
+
+/* add field f of value at idx with its tag */
+static void shared_encodefield(lua_State *L, pb_Buffer *b, int idx,
+        const pb_SField *f, int depth) {
+    int i, wiretype = shared_wiretype(f);
+    if (f->ftype && f->ftype->map_entry) {
+        if (!lua_istable(L, idx)) shared_typeerror(L, idx, f, "table");
+        shared_encodemap(L, b, idx, f, depth);
+        return;
+    }
+    if (!f->repeated) {
+        const char *s;
+        if (f->default_value && lua_type(L, idx) == LUA_TSTRING
+                && (s = lua_tostring(L, idx)) != NULL
+                && strcmp(s, f->default_value) == 0)
+            return;
+        pb_addtag(b, (uint32_t)f->tag, wiretype);
+        shared_addvalue(L, b, idx, f, depth);
+        return;
+    }
+    if (!lua_istable(L, idx)) shared_typeerror(L, idx, f, "table");
+    if (f->packed && shared_packable(f)) {
+        size_t start;
+        pb_addtag(b, (uint32_t)f->tag, PB_TLENGTH);
+        start = b->used;
+        for (i = 1; lua_rawgeti(L, idx, i), !lua_isnil(L, -1); ++i) {
+            shared_addvalue(L, b, lua_gettop(L), f, depth);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        pb_addlength(b, start);
+        return;
+    }
+    for (i = 1; lua_rawgeti(L, idx, i), !lua_isnil(L, -1); ++i) {
+        pb_addtag(b, (uint32_t)f->tag, wiretype);
+        shared_addvalue(L, b, lua_gettop(L), f, depth);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/* add fields of message at idx, in pairs() order like pb.encode() */
+static void shared_encodemsg(lua_State *L, pb_Buffer *b, int idx,
+        const pb_SType *t, int depth) {
+    if (depth > PB_MAXDEPTH)
+        luaL_error(L, "message nested too deep");
+    luaL_checkstack(L, 8, "message nested too deep");
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        const pb_SField *f;
+        if (lua_type(L, -2) == LUA_TSTRING
+                && (f = shared_byname(t, lua_tostring(L, -2))) != NULL
+                && (f->type_name == NULL || f->ftype != NULL))
+            shared_encodefield(L, b, lua_gettop(L), f, depth);
+        lua_pop(L, 1);
+    }
+}
+
+/* message type name of S, NULL if not there */
+static const pb_SType *shared_checktype(lua_State *L, int idx,
+        int nameidx) {
+    pb_Shared **pS = check_shared(L, idx);
+    const char *name = luaL_checkstring(L, nameidx);
+    const pb_SType *t;
+    if (*pS == NULL) luaL_error(L, "shared schema closed");
+    if (*name == '.') ++name;
+    t = shared_find(*pS, name);
+    return t != NULL && !t->isenum ? t : NULL;
+}
+
+/* h:decode(data, name [, nodefaults]), nothing if name is not in it */
+static int Lshared_decode(lua_State *L) {
+    const pb_SType *t = shared_checktype(L, 1, 3);
+    pb_Decoder dec;
+    pb_FBDecoder fb;
+    if (t == NULL) return 0;
+    dec.s = dec.p = pb_tolbuffer(L, 2, &dec.len);
+    dec.end = dec.p + dec.len;
+    fb.dec = &dec, fb.fb = dec.p, fb.L = L;
+    lua_settop(L, 4);
+    shared_decodemsg(&fb, t, lua_toboolean(L, 4), 1);
+    return 1;
+}
+
+/* h:encode(t, name), nothing if name is not in it */
+static int Lshared_encode(lua_State *L) {
+    const pb_SType *t = shared_checktype(L, 1, 3);
+    pb_Buffer *b;
+    if (t == NULL) return 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    b = json_newbuffer(L);
+    shared_encodemsg(L, b, 2, t, 1);
+    lua_pushlstring(L, b->buf, b->used);
+    pb_resetbuffer(b);
+    return 1;
+}
+
+static int Lshared_tostring(lua_State *L) {
+    pb_Shared **pS = check_shared(L, 1);
+    if (*pS == NULL)
+        lua_pushliteral(L, "pb.Shared: (closed)");
+    else
+        lua_pushfstring(L, "pb.Shared: %s (%d types)", (*pS)->name,
+                (int)(*pS)->ntypes);
+    return 1;
+}
+
+PB_API int luaopen_pb_shared(lua_State *L) {
+    luaL_Reg libs[] = {
+        { "open", Lshared_open },
+        { NULL, NULL }
+    };
+    luaL_Reg methods[] = {
+#define ENTRY(name) { #name, Lshared_##name }
+        ENTRY(load),
+        ENTRY(decode),
+        ENTRY(encode),
+        ENTRY(close),
+#undef  ENTRY
+        { "__gc", Lshared_close },
+        { "__tostring", Lshared_tostring },
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, pb_sharedtype)) {
+        luaL_setfuncs(L, methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, pb_sharedtype);
+    }
+    lua_pop(L, 1);
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+/* support for codecs generated by protoc-gen-lua */
+
+#ifdef PB_CODEGEN
+
+/* field and enum value names of a generated module are upvalues of its
+ * functions, or items of a table at upvalue 1 when there are too many */
+#ifndef PBC_KEYTABLE
+# define pbc_pushkey(L,k)    lua_pushvalue((L), lua_upvalueindex(k))
+# define pbc_iskey(L,idx,k)  lua_rawequal((L), (idx), lua_upvalueindex(k))
+#else
+# define pbc_pushkey(L,k)    lua_rawgeti((L), lua_upvalueindex(1), (k))
+static int pbc_iskey(lua_State *L, int idx, int k) {
+    int res;
+    idx = lua_absindex(L, idx);
+    pbc_pushkey(L, k);
+    res = lua_rawequal(L, idx, -1);
+    lua_pop(L, 1);
+    return res;
+}
+#endif
+
+typedef void pbc_Encode(lua_State *L, pb_Buffer *b, int idx, int depth);
+typedef void pbc_Decode(lua_State *L, pb_Decoder *dec, int depth);
+
+typedef struct pbc_Codec {
+    const char *name;
+    lua_CFunction encode, decode;
+} pbc_Codec;
+
+static void pbc_checkdepth(lua_State *L, int depth) {
+    if (depth > PB_MAXDEPTH)
+        luaL_error(L, "message nested too deep");
+    luaL_checkstack(L, 8, "message nested too deep");
+}
+
+static int pbc_truncated(pb_FBDecoder *fb) {
+    restore_decoder(fb);
+    return luaL_error(fb->L, "truncated message at offset %d",
+            (int)(fb->dec->p - fb->dec->s));
+}
+
+static void pbc_scalar(pb_FBDecoder *fb, int wiretype, int type) {
+    if (!pb_pushscalar(fb, wiretype, type))
+        pbc_truncated(fb);
+}
+
+static void pbc_skip(pb_FBDecoder *fb, uint64_t key) {
+    if (!skipvalue(fb, (int)(key & 7)))
+        pbc_truncated(fb);
+}
+
+/* read a length delimited value as sub decoder */
+static void pbc_sub(pb_FBDecoder *fb, pb_Decoder *sub) {
+    uint64_t n = 0;
+    if (!pb_readvarint(fb->dec, &n)
+            || (uint64_t)(fb->dec->end - fb->dec->p) < n)
+        pbc_truncated(fb);
+    *sub = *fb->dec;
+    sub->end = sub->p + n;
+    fb->dec->p += n;
+}
+
+/* push the array of field k of the table on top, made if needed */
+static void pbc_array(lua_State *L, int k) {
+    pbc_pushkey(L, k);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        pbc_pushkey(L, k);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+}
+
+static void pbc_append(lua_State *L) {
+    lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+}
+
+/* append values of a packed field to the array on top, conv (if any)
+ * converts each one */
+static void pbc_packed(pb_FBDecoder *fb, int wiretype, int type,
+        void (*conv)(lua_State *L)) {
+    lua_State *L = fb->L;
+    pb_Decoder sub;
+    pb_FBDecoder sfb;
+    int n = (int)lua_rawlen(L, -1);
+    pbc_sub(fb, &sub);
+    sfb.dec = &sub, sfb.L = L;
+    while (sub.p < sub.end) {
+        sfb.fb = sub.p;
+        pbc_scalar(&sfb, wiretype, type);
+        if (conv) conv(L);
+        lua_rawseti(L, -2, ++n);
+    }
+}
+
+/* is field k of the table on top unset? pushes its key if so */
+static int pbc_unset(lua_State *L, int k) {
+    pbc_pushkey(L, k);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+    pbc_pushkey(L, k);
+    return 1;
+}
+
+static int pbc_decode(lua_State *L, pbc_Decode *decode) {
+    pb_Decoder dec;
+    dec.s = dec.p = pb_tolbuffer(L, 1, &dec.len);
+    dec.end = dec.p + dec.len;
+    lua_settop(L, 1);
+    decode(L, &dec, 0);
+    return 1;
+}
+
+/* encoding, values are checked as by buffer:add() */
+
+static int pbc_typeerror(lua_State *L, int idx, int k, const char *tname) {
+    const char *got = luaL_typename(L, idx);
+    pbc_pushkey(L, k);
+    return luaL_error(L, "%s expected for field '%s', got %s",
+            tname, lua_tostring(L, -1), got);
+}
+
+static lua_Integer pbc_checkinteger(lua_State *L, int idx, int k) {
+    int isint;
+    lua_Integer v = lua_tointegerx(L, idx, &isint);
+    if (!isint) pbc_typeerror(L, idx, k, "integer");
+    return v;
+}
+
+static lua_Number pbc_checknumber(lua_State *L, int idx, int k) {
+    if (!lua_isnumber(L, idx)) pbc_typeerror(L, idx, k, "number");
+    return lua_tonumber(L, idx);
+}
+
+static void pbc_checktable(lua_State *L, int idx, int k) {
+    if (!lua_istable(L, idx)) pbc_typeerror(L, idx, k, "table");
+}
+
+/* push field k of table at idx, returns 0 if it's nil */
+static int pbc_field(lua_State *L, int idx, int k) {
+    pbc_pushkey(L, k);
+    lua_rawget(L, idx);
+    return !lua_isnil(L, -1);
+}
+
+/* push item i of array at idx, returns 0 (pushes nothing) at its end */
+static int pbc_item(lua_State *L, int idx, int i) {
+    lua_rawgeti(L, idx, i);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+static int pbc_enumerror(lua_State *L, int idx, int k, const char *name) {
+    const char *value = lua_tostring(L, idx);
+    if (value == NULL) return pbc_typeerror(L, idx, k, name);
+    pbc_pushkey(L, k);
+    return luaL_error(L, "unknown value '%s' of enum '%s' for field '%s'",
+            value, name, lua_tostring(L, -1));
+}
+
+/* add value at idx of field k as type, without tag */
+static void pbc_addscalar(pb_Buffer *b, lua_State *L, int idx, int type,
+        int k) {
+    union { float f; uint32_t u32;
+            double d; uint64_t u64; } u;
+    switch (type) {
+    case PB_Tbool:
+        pb_prepbuffer(b, 1);
+        pb_addchar(b, lua_toboolean(L, idx) ? 1 : 0);
+        break;
+    case PB_Tbytes:
+    case PB_Tstring:
+        if (lua_type(L, idx) != LUA_TSTRING
+                && lua_type(L, idx) != LUA_TNUMBER
+                && lua_type(L, idx) != LUA_TUSERDATA)
+            pbc_typeerror(L, idx, k, "string");
+        pb_addvalue(b, L, idx, 1);
+        break;
+    case PB_Tdouble:
+        u.d = (double)pbc_checknumber(L, idx, k);
+        pb_addfixed64(b, u.u64);
+        break;
+    case PB_Tfloat:
+        u.f = (float)pbc_checknumber(L, idx, k);
+        pb_addfixed32(b, u.u32);
+        break;
+    case PB_Tfixed32:
+    case PB_Tsfixed32:
+        pb_addfixed32(b, (uint32_t)pbc_checkinteger(L, idx, k));
+        break;
+    case PB_Tfixed64:
+    case PB_Tsfixed64:
+        pb_addfixed64(b, (uint64_t)pbc_checkinteger(L, idx, k));
+        break;
+    case PB_Tint32:
+    case PB_Tuint32:
+        pb_addvarint(b, (uint32_t)pbc_checkinteger(L, idx, k));
+        break;
+    case PB_Tenum:
+    case PB_Tint64:
+    case PB_Tuint64:
+        pb_addvarint(b, (uint64_t)pbc_checkinteger(L, idx, k));
+        break;
+    case PB_Tsint32:
+        u.u32 = (uint32_t)pbc_checkinteger(L, idx, k);
+        pb_addvarint(b, (uint32_t)((u.u32 << 1) ^ -(u.u32 >> 31)));
+        break;
+    case PB_Tsint64:
+        u.u64 = (uint64_t)pbc_checkinteger(L, idx, k);
+        pb_addvarint(b, (u.u64 << 1) ^ -(u.u64 >> 63));
+        break;
+    }
+}
+
+static int pbc_encode(lua_State *L, pbc_Encode *encode) {
+    pb_Buffer *b;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    b = json_newbuffer(L);
+    encode(L, b, 1, 0);
+    lua_pushlstring(L, b->buf, b->used);
+    pb_resetbuffer(b);
+    return 1;
+}
+
+/* module table of codecs, from message name to {encode=, decode=} */
+static int pbc_newmodule(lua_State *L, const pbc_Codec *codecs,
+        const char *const *keys) {
+    int i, base, nkeys = 0;
+    while (keys[nkeys] != NULL)
+        ++nkeys;
+#ifdef PBC_KEYTABLE
+    lua_createtable(L, nkeys, 0);
+    for (i = 0; i < nkeys; ++i) {
+        lua_pushstring(L, keys[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    nkeys = 1;
+#else
+    luaL_checkstack(L, nkeys * 2 + 4, "too many names");
+    for (i = 0; i < nkeys; ++i)
+        lua_pushstring(L, keys[i]);
+#endif
+    base = lua_gettop(L) - nkeys;
+    lua_newtable(L);
+    for (; codecs->name != NULL; ++codecs) {
+        lua_createtable(L, 0, 2);
+        for (i = 1; i <= nkeys; ++i)
+            lua_pushvalue(L, base + i);
+        lua_pushcclosure(L, codecs->encode, nkeys);
+        lua_setfield(L, -2, "encode");
+        for (i = 1; i <= nkeys; ++i)
+            lua_pushvalue(L, base + i);
+        lua_pushcclosure(L, codecs->decode, nkeys);
+        lua_setfield(L, -2, "decode");
+        lua_setfield(L, -2, codecs->name);
+    }
+    return 1;
+}
+
+#endif /* PB_CODEGEN */
+
 /* cc: flags+='-s -O3 -mdll -DLUA_BUILD_AS_DLL'
  * xcc: flags+='-ID:\luajit\include' libs+='-LD:\luajit\'
  * cc: output='pb.dll' libs+='-llua53' */
@@ -3,6 +3,8 @@ local decoder = require "pb.decoder"
 local buffer = require "pb.buffer"
 local conv = require "pb.conv"
 local pbio = require "pb.io"
+local schema = require "pb.schema"
+local shared = require "pb.shared"
 local ipairs = ipairs
 local pairs = pairs
 local type = type
@@ -27,18 +29,26 @@ end
 ------------------------------------------------------------ 
 
 local typeinfo = require "pb_typeinfo"
+local load_shared
 
-local function qualitied_type(qname)
+local function qualitied_type(qname, no_shared)
    local realtype = typeinfo
    local package = ""
    for comp in qname:gmatch "[^.]+" do
       realtype = realtype[comp]
       if not realtype then
+         if not no_shared and load_shared(qname) then
+            return qualitied_type(qname, true)
+         end
          error(("no such type '%s' in package '%s'")
             :format(comp, package))
       end
       package = package .. "." .. comp
    end
+   if realtype.type == "package" and not no_shared
+         and load_shared(qname) then
+      return qualitied_type(qname, true)
+   end
    return realtype
 end
 
@@ -51,6 +61,28 @@ local function field_type(field)
    return realtype
 end
 
+-- full name of a type table, found by walking the type tree once
+local type_names = setmetatable({}, { __mode = "k" })
+local function type_name(ptype)
+   if type(ptype) ~= "table" then return ptype end
+   local name = type_names[ptype]
+   if name then return name end
+   local function dfs(t, prefix)
+      for k, v in pairs(t) do
+         if type(k) == "string" and type(v) == "table"
+               and (v.type == "package" or v.type == "message") then
+            local qname = prefix and prefix.."."..k or k
+            if v.type == "message" then type_names[v] = qname end
+            dfs(v, qname)
+         end
+      end
+   end
+   dfs(typeinfo)
+   name = type_names[ptype] or tostring(ptype)
+   type_names[ptype] = name
+   return name
+end
+
 local function subtable(t, k, type)
    local subt = t[k]
    if not subt then
@@ -82,6 +114,66 @@ function pb.type(qname)
    end
 end
 
+-- process wide schemas shared by all states (see pb.shared in pb.c):
+-- pb.decode() and pb.encode() run on them in C (see shared_codec()),
+-- for the rest a type found in one is copied into typeinfo when first
+-- looked up, together with all the types it reaches
+local shared_schemas = {}
+
+local function install_type(qname, t)
+   local cur, last = typeinfo
+   for comp in qname:gmatch "[^.]+" do
+      if last then
+         local sub = cur[last]
+         if not sub then
+            sub = { type = "package" }
+            cur[last] = sub
+         end
+         cur = sub
+      end
+      last = comp
+   end
+   local old = cur[last]
+   if not old then
+      cur[last] = t
+   elseif old.type == "package" then -- made for a nested type
+      for k, v in pairs(t) do old[k] = v end
+   end
+end
+
+function load_shared(qname)
+   for _, s in ipairs(shared_schemas) do
+      local types = s.handle:load(qname)
+      if types then
+         for name, t in pairs(types) do
+            install_type(name, t)
+         end
+         return true
+      end
+   end
+end
+
+function pb.share(name, data)
+   for _, s in ipairs(shared_schemas) do
+      if s.name == name then return true end
+   end
+   local handle, err = shared.open(name, data)
+   if not handle then return nil, err end
+   shared_schemas[#shared_schemas+1] = { name = name, handle = handle }
+   return true
+end
+
+function pb.unshare(name)
+   for i, s in ipairs(shared_schemas) do
+      if s.name == name then
+         s.handle:close()
+         table.remove(shared_schemas, i)
+         return true
+      end
+   end
+   return false
+end
+
 local buffer_pool = {}
 local buffer_used = setmetatable({}, { __mode="k" })
 
@@ -142,10 +234,161 @@ function pb.clearbuffers()
    end
 end
 
+-- recycled message tables for pb.decode_into()/pb.release(), keyed by
+-- message type (arrays of repeated fields are kept under array_type)
+local POOL_SIZE = 1024
+local array_type = {}
+local table_pool = setmetatable({}, { __mode="k" })
+local table_type = setmetatable({}, { __mode="k" })
+local pooling = false
+
+-- encoded bytes of tables frozen by pb.freeze(), spliced in as they are;
+-- frozen tables are never taken back by the pool
+local frozen = setmetatable({}, { __mode="k" })
+
+local function get_table(ptype)
+   local pool = table_pool[ptype]
+   local t = pool and pool[#pool]
+   if t then
+      pool[#pool] = nil
+   else
+      t = {}
+   end
+   table_type[t] = ptype
+   return t
+end
+
+local function put_table(t, ptype)
+   if frozen[t] then return end
+   local pool = table_pool[ptype]
+   if not pool then
+      pool = {}
+      table_pool[ptype] = pool
+   end
+   if #pool < POOL_SIZE then
+      pool[#pool+1] = t
+   end
+end
+
+function pb.cleartables()
+   table_pool = setmetatable({}, { __mode="k" })
+end
+
+local function field_array(t, field)
+   local vs = t[field.name]
+   if not vs then
+      vs = pooling and get_table(array_type) or {}
+      t[field.name] = vs
+   end
+   return vs
+end
+
 local decode, encode
 
+local function copy_defaults(t, ptype)
+   if ptype.defaults then
+      for k,v in pairs(ptype.defaults) do
+         if t[k] == nil then t[k] = v end
+      end
+   end
+   return t
+end
+
+-- shared per type metatables serving defaults through __index, with
+-- typed_zeros fields without a declared default read as zero values
+local typed_zeros = false
+local default_metatables = setmetatable({}, { __mode="k" })
+
+local zero_values = {
+   double = 0.0, float = 0.0, bool = false, string = "", bytes = "",
+}
+
+-- zero value of scalar type_name, keeping false for bool
+local function scalar_zero(type_name)
+   local zero = zero_values[type_name]
+   if zero == nil then zero = 0 end
+   return zero
+end
+
+local function default_metatable(ptype)
+   local mt = default_metatables[ptype]
+   if mt == nil then
+      local defaults = ptype.defaults
+      if typed_zeros then
+         local t = {}
+         for _, field in pairs(ptype) do
+            if type(field) == "table" and field.type == "field"
+                  and not field.repeated then
+               local zero
+               if field.scalar then
+                  zero = scalar_zero(field.type_name)
+               else
+                  local ftype = field_type(field)
+                  if ftype and ftype.type == "enum" then
+                     zero = ftype[0] or 0
+                  end
+               end
+               t[field.name] = zero
+            end
+         end
+         for k, v in pairs(defaults or {}) do t[k] = v end
+         defaults = next(t) and t
+      end
+      mt = defaults and { __index = defaults } or false
+      default_metatables[ptype] = mt
+   end
+   return mt
+end
+
+local function set_default_metatable(t, ptype)
+   local mt = default_metatable(ptype)
+   if mt then setmetatable(t, mt) end
+   return t
+end
+
+local function no_defaults(t)
+   return t
+end
+
+local apply_defaults = copy_defaults
+local deterministic_maps = false
+local well_known = false
+
+local options = {
+   use_default_values = function() apply_defaults = copy_defaults end,
+   use_default_metatable = function()
+      apply_defaults = set_default_metatable
+   end,
+   no_default_values = function() apply_defaults = no_defaults end,
+   enable_typed_zeros = function()
+      typed_zeros = true
+      default_metatables = setmetatable({}, { __mode="k" })
+   end,
+   disable_typed_zeros = function()
+      typed_zeros = false
+      default_metatables = setmetatable({}, { __mode="k" })
+   end,
+   deterministic_maps = function() deterministic_maps = true end,
+   unordered_maps = function() deterministic_maps = false end,
+   enable_well_known_types = function() well_known = true end,
+   disable_well_known_types = function() well_known = false end,
+}
+
+function pb.option(name)
+   local f = options[name]
+   if not f then
+      error("unknown option: "..tostring(name))
+   end
+   f()
+end
+
+-- is the field present in t, not just served as a default
+function pb.has(t, name)
+   return rawget(t, name) ~= nil
+end
+
 local function decode_unknown_field(t, dec, wiretype, tag)
-   do return end -- XXX ignore unknown fields
+   do return dec:skip(wiretype) end -- XXX ignore unknown fields
    local value = dec:fetch(wiretype)
    if not value then return end
    local uf = t.unknown_fields
@@ -165,53 +408,263 @@ end
 
 local repeated_fixed32 = { fixed32 = true, sfixed32 = true, float = true }
 local repeated_fixed64 = { fixed64 = true, sfixed64 = true, double = true }
-local function decode_packed_repeated(t, dec, field)
-   local len = assert(dec:varint())
-   local old = dec:len(dec:pos() + len - 1)
-   local wt = "varint"
+local function packed_wiretype(field)
    if repeated_fixed32[field.type_name] then
-      wt = "fixed32"
+      return "32bit"
    elseif repeated_fixed64[field.type_name] then
-      wt = "fixed64"
+      return "64bit"
    end
+   return "varint"
+end
+
+local function decode_packed_repeated(t, dec, field)
+   local len = assert(dec:varint())
+   local old = dec:len(dec:pos() + len - 1)
+   local wt = packed_wiretype(field)
    repeat
       local value = dec:fetch(wt, field.type_name)
       t[#t+1] = value
-   until not value
+   until value == nil
    dec:len(old)
 end
 
-local function decode_field(t, dec, wiretype, tag, field)
-   local value
-   if not field.scalar then
-      local ftype = field_type(field)
-      if not ftype then
-         --return decode_unknown_field(t, dec, wiretype, tag)
-         return -- XXX ignore type-unknown fields
-      elseif ftype.type == "enum" then
-         value = dec:fetch(wiretype)
-         value = ftype[value] or value
-      else
-         local len = assert(dec:varint())
-         local old = dec:len(dec:pos() + len - 1)
-         value = decode(dec, ftype)
-         dec:len(old)
-      end
-   elseif wiretype == 2 and field.packed then
-      local t = subtable(t, field.name)
-      return decode_packed_repeated(t, dec, field)
-   else
-      value = dec:fetch(wiretype, field.type_name)
-   end
-
+local function store_field(t, field, value)
    if not field.repeated then
       t[field.name] = value
    else
-      local vs = subtable(t, field.name)
+      local vs = field_array(t, field)
       vs[#vs+1] = value
    end
 end
 
+-- well known types, after pb.option "enable_well_known_types" fields of
+-- these types are read and written by codecs instead of as messages:
+-- Timestamp and Duration are integer numbers of nanoseconds, wrappers
+-- their value and Any keeps type_url and value, decoding value as
+-- .message when first read. Each codec has decode(dec),
+-- encode(buff, v, ftype), convert(t) (from the generic table) and zero.
+local NANOS = 1000000000
+
+local function decode_time(dec)
+   local seconds, nanos = 0, 0
+   while not dec:finished() do
+      local tag, wiretype = dec:tag()
+      if tag == 1 then
+         seconds = dec:fetch(wiretype, "int64")
+      elseif tag == 2 then
+         nanos = dec:fetch(wiretype, "int32")
+      elseif tag then
+         dec:skip(wiretype)
+      end
+   end
+   return seconds * NANOS + nanos
+end
+
+local function time_codec(is_duration)
+   return {
+      decode = decode_time,
+      encode = function(buff, v, ftype)
+         if type(v) == "table" then return encode(buff, v, ftype) end
+         local seconds = math.floor(v / NANOS)
+         local nanos = v - seconds * NANOS
+         if nanos < 0 then -- v / NANOS rounded up
+            seconds, nanos = seconds - 1, nanos + NANOS
+         end
+         nanos = math.floor(nanos + 0.5)
+         -- nanos of a Duration have the sign of its seconds
+         if is_duration and seconds < 0 and nanos > 0 then
+            seconds, nanos = seconds + 1, nanos - NANOS
+         end
+         if nanos >= NANOS then
+            seconds, nanos = seconds + 1, nanos - NANOS
+         elseif nanos <= -NANOS then
+            seconds, nanos = seconds - 1, nanos + NANOS
+         end
+         if seconds ~= 0 then buff:add(1, "int64", seconds) end
+         if nanos ~= 0 then buff:add(2, "int32", nanos) end
+      end,
+      convert = function(t)
+         return (t.seconds or 0) * NANOS + (t.nanos or 0)
+      end,
+      zero = 0,
+   }
+end
+
+local function wrapper_codec(type_name)
+   local zero = scalar_zero(type_name)
+   return {
+      decode = function(dec)
+         local value = zero
+         while not dec:finished() do
+            local tag, wiretype = dec:tag()
+            if tag == 1 then
+               value = dec:fetch(wiretype, type_name)
+            elseif tag then
+               dec:skip(wiretype)
+            end
+         end
+         return value
+      end,
+      encode = function(buff, v, ftype)
+         if type(v) == "table" then return encode(buff, v, ftype) end
+         if v ~= zero then buff:add(1, type_name, v) end
+      end,
+      convert = function(t)
+         local value = t.value
+         if value == nil then return zero end
+         return value
+      end,
+      zero = zero,
+   }
+end
+
+local function any_type(url)
+   return url:match "[^/]*$"
+end
+
+local any_mt = { __index = function(t, k)
+   local url = rawget(t, "type_url")
+   if k ~= "message" or not url then return end
+   local msg = pb.decode(rawget(t, "value") or "", any_type(url))
+   rawset(t, "message", msg)
+   return msg
+end }
+
+local any_codec = {
+   decode = function(dec)
+      local t = {}
+      while not dec:finished() do
+         local tag, wiretype = dec:tag()
+         if tag == 1 then
+            t.type_url = dec:fetch(wiretype, "string")
+         elseif tag == 2 then
+            t.value = dec:fetch(wiretype, "bytes")
+         elseif tag then
+            dec:skip(wiretype)
+         end
+      end
+      return setmetatable(t, any_mt)
+   end,
+   encode = function(buff, v)
+      local url, value = v.type_url, v.value
+      local msg = rawget(v, "message")
+      if msg then value = pb.encode(msg, any_type(url)) end
+      if url and url ~= "" then buff:add(1, "string", url) end
+      if value and value ~= "" then buff:add(2, "bytes", value) end
+   end,
+   convert = function(t)
+      return setmetatable(t, any_mt)
+   end,
+}
+
+local well_known_types = {
+   ["google.protobuf.Timestamp"]   = time_codec(false),
+   ["google.protobuf.Duration"]    = time_codec(true),
+   ["google.protobuf.DoubleValue"] = wrapper_codec "double",
+   ["google.protobuf.FloatValue"]  = wrapper_codec "float",
+   ["google.protobuf.Int64Value"]  = wrapper_codec "int64",
+   ["google.protobuf.UInt64Value"] = wrapper_codec "uint64",
+   ["google.protobuf.Int32Value"]  = wrapper_codec "int32",
+   ["google.protobuf.UInt32Value"] = wrapper_codec "uint32",
+   ["google.protobuf.BoolValue"]   = wrapper_codec "bool",
+   ["google.protobuf.StringValue"] = wrapper_codec "string",
+   ["google.protobuf.BytesValue"]  = wrapper_codec "bytes",
+   ["google.protobuf.Any"]         = any_codec,
+}
+
+local wkt_codecs = setmetatable({}, { __mode="k" })
+
+-- codec of message type ftype, nil when off or not a well known type
+local function wkt_codec(ftype)
+   if not well_known then return end
+   local codec = wkt_codecs[ftype]
+   if codec == nil then
+      codec = well_known_types[type_name(ftype)] or false
+      wkt_codecs[ftype] = codec
+   end
+   return codec or nil
+end
+
+-- value of enum or message type ftype
+local function decode_value(dec, wiretype, ftype)
+   if ftype.type == "enum" then
+      local value = dec:fetch(wiretype)
+      return ftype[value] or value
+   end
+   local len = assert(dec:varint())
+   local old = dec:len(dec:pos() + len - 1)
+   local codec = wkt_codec(ftype)
+   local value
+   if codec then
+      value = codec.decode(dec)
+   else
+      value = decode(dec, ftype, pooling and get_table(ftype))
+   end
+   dec:len(old)
+   return value
+end
+
+-- map<K,V> fields are repeated entry messages (key = 1, value = 2),
+-- kept as a hash table from key to value
+local function map_zero(field)
+   if field.scalar then
+      return scalar_zero(field.type_name)
+   end
+   local ftype = field_type(field)
+   if ftype.type == "enum" then
+      return ftype[0] or 0
+   end
+   local codec = wkt_codec(ftype)
+   if codec then
+      return codec.zero or codec.convert {}
+   end
+   return apply_defaults(pooling and get_table(ftype) or {}, ftype)
+end
+
+local function store_map_entry(t, field, ftype, key, value)
+   if key == nil then key = map_zero(ftype[1]) end
+   if value == nil then value = map_zero(ftype[2]) end
+   field_array(t, field)[key] = value
+end
+
+local function decode_map_entry(t, dec, field, ftype)
+   local len = assert(dec:varint())
+   local old = dec:len(dec:pos() + len - 1)
+   local kfield, vfield = ftype[1], ftype[2]
+   local key, value
+   while not dec:finished() do
+      local tag, wiretype = dec:tag()
+      if tag == 1 then
+         key = dec:fetch(wiretype, kfield.type_name)
+      elseif tag == 2 and vfield.scalar then
+         value = dec:fetch(wiretype, vfield.type_name)
+      elseif tag == 2 then
+         value = decode_value(dec, wiretype, field_type(vfield))
+      elseif tag then
+         dec:skip(wiretype)
+      end
+   end
+   dec:len(old)
+   store_map_entry(t, field, ftype, key, value)
+end
+
+local function decode_field(t, dec, wiretype, tag, field)
+   if field.scalar then
+      if wiretype == 2 and field.packed then
+         return decode_packed_repeated(field_array(t, field), dec, field)
+      end
+      return store_field(t, field, dec:fetch(wiretype, field.type_name))
+   end
+   local ftype = field_type(field)
+   if not ftype then
+      --return decode_unknown_field(t, dec, wiretype, tag)
+      return dec:skip(wiretype) -- XXX ignore type-unknown fields
+   elseif ftype.map_entry then
+      return decode_map_entry(t, dec, field, ftype)
+   end
+   store_field(t, field, decode_value(dec, wiretype, ftype))
+end
+
 function decode(dec, ptype, t)
    local t = t or {}
    while not dec:finished() do
@@ -223,17 +676,28 @@ function decode(dec, ptype, t)
          decode_unknown_field(t, dec, wiretype, tag)
       end
    end
-   if ptype.defaults then
-      for k,v in pairs(ptype.defaults) do
-         if t[k] == nil then t[k] = v end
-      end
-   end
-   return t
+   return apply_defaults(t, ptype)
+end
+
+local function frozen_bytes(t, ptype)
+   local f = frozen[t]
+   return f and f.ptype == ptype and f.bytes
 end
 
 local function encode_message(buff, tag, msg, ftype)
+   local bytes = frozen_bytes(msg, ftype)
+   if bytes then
+      buff:tag(tag, "bytes")
+      buff:bytes(bytes)
+      return
+   end
+   local codec = wkt_codec(ftype)
    local inner = get_buffer()
-   encode(inner, msg, ftype)
+   if codec then
+      codec.encode(inner, msg, ftype)
+   else
+      encode(inner, msg, ftype)
+   end
    buff:tag(tag, "bytes")
    buff:bytes(inner)
    put_buffer(inner)
@@ -267,6 +731,46 @@ local function encode_scalar(buff, tag, v, field)
    end
 end
 
+local function map_key_lt(a, b)
+   if type(a) == "boolean" then return not a and b end
+   return a < b
+end
+
+local function encode_map_entry(buff, inner, tag, k, v, ftype)
+   local vfield = ftype[2]
+   inner:add(1, ftype[1].type_name, k)
+   if vfield.scalar then
+      inner:add(2, vfield.type_name, v)
+   else
+      local vtype = field_type(vfield)
+      if vtype.type == "enum" then
+         encode_enum(inner, 2, v, vtype)
+      else
+         encode_message(inner, 2, v, vtype)
+      end
+   end
+   buff:tag(tag, "bytes")
+   buff:bytes(inner)
+   inner:clear()
+end
+
+local function encode_map(buff, tag, map, ftype)
+   local inner = get_buffer()
+   if deterministic_maps then
+      local keys = {}
+      for k in pairs(map) do keys[#keys+1] = k end
+      table.sort(keys, map_key_lt)
+      for _, k in ipairs(keys) do
+         encode_map_entry(buff, inner, tag, k, map[k], ftype)
+      end
+   else
+      for k, v in pairs(map) do
+         encode_map_entry(buff, inner, tag, k, v, ftype)
+      end
+   end
+   put_buffer(inner)
+end
+
 local function encode_field(buff, tag, v, ptype)
    --print(("encode_field(%d, %s)"):format(tag,
    --require"serpent".block(v)))
@@ -279,7 +783,9 @@ local function encode_field(buff, tag, v, ptype)
 
    local ftype = field_type(field)
    if ftype.type == "message" then
-      if not field.repeated then
+      if ftype.map_entry then
+         encode_map(buff, tag, v, ftype)
+      elseif not field.repeated then
          encode_message(buff, tag, v, ftype)
       else
          for _, v in ipairs(v) do
@@ -314,8 +820,30 @@ function encode(buff, t, ptype)
    end
 end
 
+-- shared schema handles to decode/encode qname with, nil when it is a
+-- type of this state or an option the C codec has not is on
+local function shared_codec(qname)
+   if not shared_schemas[1] or apply_defaults == set_default_metatable
+         or well_known or deterministic_maps then
+      return
+   end
+   local realtype = typeinfo
+   for comp in qname:gmatch "[^.]+" do
+      realtype = realtype[comp]
+      if not realtype then break end
+   end
+   if not realtype or realtype.type == "package" then
+      return shared_schemas
+   end
+end
+
 function pb.decode(s, ptype, dec)
    if type(ptype) ~= "table" then
+      local shared = type(s) == "string" and shared_codec(ptype)
+      for _, sh in ipairs(shared or {}) do
+         local t = sh.handle:decode(s, ptype, apply_defaults == no_defaults)
+         if t then return t end
+      end
       ptype = qualitied_type(ptype)
    end
    if dec then
@@ -323,15 +851,101 @@ function pb.decode(s, ptype, dec)
    else
       dec = decoder.new(s)
    end
+   pooling = false
    local res = decode(dec, ptype)
    dec:reset()
    return res
 end
 
+-- clear t and put its sub-messages and arrays back to the pool
+local function release_fields(t, ptype)
+   if frozen[t] then return end
+   for k, v in pairs(t) do
+      if type(v) == "table" then
+         local tag = ptype.map[k]
+         local field = tag and ptype[tag]
+         local ftype = field and not field.scalar and field_type(field)
+         if ftype and ftype.type ~= "message" then ftype = nil end
+         if ftype and ftype.map_entry then
+            local vtype = not ftype[2].scalar and field_type(ftype[2])
+            if vtype and vtype.type ~= "message" then vtype = nil end
+            for key, value in pairs(v) do
+               if vtype then
+                  release_fields(value, vtype)
+                  put_table(value, vtype)
+               end
+               v[key] = nil
+            end
+            put_table(v, array_type)
+         elseif field and field.repeated then
+            for i = #v, 1, -1 do
+               if ftype then
+                  release_fields(v[i], ftype)
+                  put_table(v[i], ftype)
+               end
+               v[i] = nil
+            end
+            put_table(v, array_type)
+         elseif ftype then
+            release_fields(v, ftype)
+            put_table(v, ftype)
+         end
+      end
+      t[k] = nil
+   end
+end
+
+function pb.release(t, ptype)
+   if ptype == nil then
+      ptype = assert(table_type[t], "type expected")
+   elseif type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   release_fields(t, ptype)
+   put_table(t, ptype)
+end
+
+-- decode into t reusing its tables (or a pooled table if t is nil)
+local into_decoder
+function pb.decode_into(t, s, ptype, dec)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   if t then
+      frozen[t] = nil
+      release_fields(t, ptype)
+      table_type[t] = ptype
+   else
+      t = get_table(ptype)
+   end
+   dec = dec or into_decoder
+   if dec then
+      dec:source(s)
+   else
+      dec = decoder.new(s)
+      into_decoder = dec
+   end
+   pooling = true
+   local ok, err = pcall(decode, dec, ptype, t)
+   pooling = false
+   dec:reset()
+   if not ok then error(err, 0) end
+   return t
+end
+
 function pb.encode(t, ptype, init_buff)
    if type(ptype) ~= "table" then
+      local shared = not init_buff and shared_codec(ptype)
+      for _, sh in ipairs(shared or {}) do
+         local s = sh.handle:encode(t, ptype)
+         if s then return s end
+      end
       ptype = qualitied_type(ptype)
    end
+   if not init_buff then
+      local bytes = frozen_bytes(t, ptype)
+      if bytes then return bytes end
+   end
    local buff = init_buff or get_buffer()
    encode(buff, t, ptype)
    local res = buff:clear(nil, true)
@@ -341,6 +955,536 @@ function pb.encode(t, ptype, init_buff)
    return res
 end
 
+-- t must not change while frozen: unfreeze it first (and the tables
+-- frozen with it inside, whose bytes contain its old encoding)
+function pb.freeze(t, ptype)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   frozen[t] = nil
+   frozen[t] = { ptype = ptype, bytes = pb.encode(t, ptype) }
+   return t
+end
+
+function pb.unfreeze(t)
+   frozen[t] = nil
+   return t
+end
+
+function pb.isfrozen(t)
+   return frozen[t] ~= nil
+end
+
+-- SAX style decoding, no table is built:
+--   handlers.begin_message(name)  -- return false to skip the message
+--   handlers.end_message(name)
+--   handlers.field(name_or_tag, value)
+--   handlers.batch(name, values, n) -- packed repeated fields in batches
+--   handlers.fields[name] = function(value) or function(values, n)
+--                         | handlers table for a sub-message field
+function pb.parse(data, ptype, handlers)
+   local name = type_name(ptype)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.parse(data, ptype, handlers, typeinfo, name)
+end
+
+-- proto3 JSON mapping done in C straight from/to wire format, opts:
+--   proto_names = true   -- keep field names instead of lowerCamelCase
+--   enum_numbers = true  -- write enum values as numbers
+local json_names = setmetatable({}, { __mode = "k" })
+
+function pb.tojson(data, ptype, opts)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.tojson(data, ptype, typeinfo, opts)
+end
+
+function pb.fromjson(json, ptype)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.fromjson(json, ptype, typeinfo, json_names)
+end
+
+-- random access to fields of a big message without decoding it:
+--
+--   local idx = pb.index(data, "Type" [, depth])
+--   idx:get "name"      -- value, a list for repeated fields
+--   idx:get("name", n)  -- the nth value of a repeated field
+--   idx:count "name"
+--
+-- building the index only skips over fields, messages nested less than
+-- depth levels deep get an index of their own instead of a table. The
+-- index keeps data alive.
+function pb.index(data, ptype, depth)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.index(data, ptype, typeinfo, depth, pb.decode)
+end
+
+-- decode to one block of C memory instead of Lua tables:
+--
+--   local msg = pb.decode_arena(data, "Type")
+--   msg.name, msg.phone[1].number, #msg.phone
+--   for k, v in pb.arena_pairs(msg) do ... end
+--
+-- sub-messages and repeated fields are read through proxies, maps come
+-- back as tables. Unset fields give the declared default or nil. The
+-- memory is freed at once when msg and all proxies from it are gone.
+-- pairs(msg) works too where __pairs is honoured (not Lua 5.1/LuaJIT).
+local arena_layouts = setmetatable({}, { __mode="k" })
+
+function pb.decode_arena(data, ptype)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.arena(data, ptype, typeinfo, arena_layouts)
+end
+
+pb.arena_pairs = schema.arena_pairs
+
+-- decode a batch of messages to one array per selected field:
+--
+--   local cols, n = pb.decode_columns(source, "Type", { "id", "a.b" }
+--                                     [, { native = true, limit = n }])
+--   cols.id[i], cols["a.b"][i]   -- nil where message i hasn't the field
+--
+-- source is an array of strings, a string of length delimited messages
+-- or a pb.io.logreader() (its records after the current one). With
+-- native, singular numeric fields go to C arrays (c[i], #c,
+-- c:present(i), c:data()) instead of tables.
+function pb.decode_columns(source, ptype, fields, opts)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return schema.columns(source, ptype, typeinfo, fields, opts)
+end
+
+------------------------------------------------------------
+-- resumable parser, for messages arriving in pieces:
+--
+--   local p = pb.parser("Type" [, len])
+--   local status, t = p:feed(chunk) -- "need_more" or "done", t
+--
+-- nested messages are kept as an explicit stack of frames holding the
+-- partially built tables, so a chunk boundary anywhere just suspends the
+-- parser and consumed bytes are never read again. Without a known len
+-- the message ends when p:feed() is called without a chunk.
+
+local Parser = {}
+Parser.__index = Parser
+
+function pb.parser(ptype, len)
+   local buff = buffer.new()
+   local p = setmetatable({
+      buff = buff,
+      dec = decoder.new(buff),
+      base = 0,
+   }, Parser)
+   return p:reset(ptype, len)
+end
+
+function Parser:offset()
+   return self.base + self.dec:pos() - 1
+end
+
+-- start a new message, bytes fed but not consumed yet are kept
+function Parser:reset(ptype, len)
+   if ptype == nil then
+      ptype = self.ptype
+   elseif type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   self.ptype = ptype
+   self.stack = { { ptype = ptype, t = {}, limit = len and self:offset() + len } }
+   self.eof = false
+   self.result = nil
+   return self
+end
+
+function Parser:feed(chunk)
+   if self.result then return "done", self.result end
+   local dec = self.dec
+   if chunk then
+      self.buff:concat(chunk)
+   else
+      self.eof = true
+   end
+   self.base = self.base + dec:pos() - 1
+   dec:update(true)
+   return self:run()
+end
+
+function Parser:need_more()
+   if self.eof then
+      error "truncated message"
+   end
+   return "need_more"
+end
+
+-- read one field with tag already read, false if it's incomplete
+function Parser:field(frame, tag, wiretype)
+   local dec, stack = self.dec, self.stack
+   local field = frame.ptype[tag]
+   local value
+   if not field then
+      return dec:skip(wiretype) ~= nil
+   elseif not field.scalar then
+      local ftype = field_type(field)
+      if not ftype then
+         return dec:skip(wiretype) ~= nil
+      elseif ftype.type == "enum" then
+         value = dec:fetch(wiretype)
+         if value == nil then return false end
+         value = ftype[value] or value
+      else
+         local len = dec:varint()
+         if not len then return false end
+         value = {}
+         if ftype.map_entry then
+            stack[#stack+1] = { ptype = ftype, t = value,
+                                limit = self:offset() + len,
+                                map = field, parent = frame.t }
+            return true
+         end
+         local codec = wkt_codec(ftype)
+         if codec then -- stored converted when complete
+            stack[#stack+1] = { ptype = ftype, t = value,
+                                limit = self:offset() + len, wkt = codec,
+                                field = field, parent = frame.t }
+            return true
+         end
+         stack[#stack+1] = { ptype = ftype, t = value,
+                             limit = self:offset() + len }
+      end
+   elseif wiretype == 2 and field.packed then
+      local len = dec:varint()
+      if not len then return false end
+      stack[#stack+1] = { packed = field, t = subtable(frame.t, field.name),
+                          wt = packed_wiretype(field),
+                          limit = self:offset() + len }
+      return true
+   else
+      value = dec:fetch(wiretype, field.type_name)
+      if value == nil then return false end
+   end
+   store_field(frame.t, field, value)
+   return true
+end
+
+function Parser:run()
+   local dec, stack = self.dec, self.stack
+   while true do
+      local frame = stack[#stack]
+      local offset = self:offset()
+      if frame.limit and offset >= frame.limit
+            or not frame.limit and self.eof and dec:finished() then
+         if frame.limit and offset > frame.limit then
+            error "field exceeds the length of message"
+         end
+         stack[#stack] = nil
+         local ptype = frame.ptype
+         if frame.map then
+            store_map_entry(frame.parent, frame.map, ptype,
+               frame.t[ptype[1].name], frame.t[ptype[2].name])
+         elseif frame.wkt then
+            store_field(frame.parent, frame.field, frame.wkt.convert(frame.t))
+         elseif not frame.packed then
+            apply_defaults(frame.t, ptype)
+         end
+         if #stack == 0 then
+            self.result = frame.t
+            return "done", frame.t
+         end
+      elseif self.pause and offset >= self.pause then
+         return "suspended"
+      elseif frame.packed then
+         local value = dec:fetch(frame.wt, frame.packed.type_name)
+         if value == nil then return self:need_more() end
+         frame.t[#frame.t+1] = value
+      else
+         local tag, wiretype = frame.tag, frame.wiretype
+         if not tag then
+            tag, wiretype = dec:tag()
+            if not tag then return self:need_more() end
+            frame.tag, frame.wiretype = tag, wiretype
+         end
+         if not self:field(frame, tag, wiretype) then
+            return self:need_more()
+         end
+         frame.tag, frame.wiretype = nil, nil
+      end
+   end
+end
+
+------------------------------------------------------------
+-- time sliced decode/encode, for huge messages in event loops:
+--
+--   local task = pb.decode_task(data, "Type" [, step])
+--   local task = pb.encode_task(t, "Type" [, step])
+--   local status, res = task:step([n]) -- "suspended" or "done", res
+--   local res = task:finish([yield])   -- calls yield() between steps
+--
+-- a decode step reads about step bytes (default 64K), an encode step
+-- writes step fields (default 1024, each element of a repeated field,
+-- each map entry or each sub-message counts, strings one more per 1K
+-- bytes; repeated fields, maps and long strings are split over steps).
+-- The result is the same as pb.decode() or pb.encode().
+
+local DECODE_STEP = 65536
+local ENCODE_STEP = 1024
+local STRING_UNIT = 1024
+
+local function value_cost(v)
+   return type(v) == "string" and 1 + #v / STRING_UNIT or 1
+end
+
+local function finish_task(task, yield)
+   yield = yield or coroutine.yield
+   while true do
+      local status, res = task:step()
+      if status == "done" then return res end
+      yield()
+   end
+end
+
+-- decode tasks are parsers over the whole data with a byte budget
+function pb.decode_task(s, ptype, step)
+   local p = setmetatable({ dec = decoder.new(s), base = 0 }, Parser)
+   p:reset(ptype, #s)
+   p.eof = true
+   p.step_size = step or DECODE_STEP
+   return p
+end
+
+function Parser:step(n)
+   if self.result then return "done", self.result end
+   self.pause = self:offset() + (n or self.step_size)
+   return self:run()
+end
+
+Parser.finish = finish_task
+
+-- encode tasks keep a stack of messages being encoded, each with its own
+-- buffer and the key of its last visited field, so next() resumes the
+-- same traversal order as pairs() in encode(); a frame inside a repeated
+-- field, a map or a long string keeps its position there too
+local EncodeTask = {}
+EncodeTask.__index = EncodeTask
+
+function pb.encode_task(t, ptype, step)
+   if type(ptype) ~= "table" then
+      ptype = qualitied_type(ptype)
+   end
+   return setmetatable({
+      stack = { { t = t, ptype = ptype, buff = get_buffer() } },
+      step_size = step or ENCODE_STEP,
+   }, EncodeTask)
+end
+
+function EncodeTask:step(n)
+   if self.result then return "done", self.result end
+   local stack = self.stack
+   local budget = n or self.step_size
+   while true do
+      local frame = stack[#stack]
+      local list = frame.list
+      if budget <= 0 then
+         return "suspended"
+      elseif frame.str then -- inside a long string field
+         local s, i = frame.str, frame.spos
+         local j = i + math.ceil(budget) * STRING_UNIT - 1
+         frame.buff:concat(s:sub(i, j))
+         if j >= #s then
+            frame.str, j = nil, #s
+         else
+            frame.spos = j + 1
+         end
+         budget = budget - (j - i + 1) / STRING_UNIT
+      elseif frame.values then -- inside a repeated scalar or enum field
+         local i = frame.i + 1
+         local v = frame.values[i]
+         if v == nil then
+            if frame.inner then -- packed
+               frame.buff:tag(frame.ltag, "bytes")
+               frame.buff:bytes(frame.inner)
+               put_buffer(frame.inner)
+               frame.inner = nil
+            end
+            frame.values = nil
+         else
+            frame.i, budget = i, budget - value_cost(v)
+            if frame.enum then
+               encode_enum(frame.buff, frame.ltag, v, frame.enum)
+            elseif frame.inner then
+               frame.inner:add(nil, frame.type_name, v)
+            else
+               frame.buff:add(frame.ltag, frame.type_name, v)
+            end
+         end
+      elseif frame.map then -- inside a map field
+         local k
+         if frame.keys then
+            frame.i = frame.i + 1
+            k = frame.keys[frame.i]
+         else
+            k = next(frame.map, frame.mkey)
+            frame.mkey = k
+         end
+         if k == nil then
+            put_buffer(frame.inner)
+            frame.map, frame.keys, frame.inner = nil, nil, nil
+         else
+            local v = frame.map[k]
+            budget = budget - value_cost(v)
+            encode_map_entry(frame.buff, frame.inner, frame.ltag, k, v,
+                             frame.ftype)
+         end
+      elseif list then -- inside a repeated message field
+         local i = frame.i + 1
+         local v = list[i]
+         if v == nil then
+            frame.list = nil
+         else
+            frame.i, budget = i, budget - 1
+            if frozen_bytes(v, frame.ftype) then
+               encode_message(frame.buff, frame.ltag, v, frame.ftype)
+            else
+               stack[#stack+1] = { t = v, ptype = frame.ftype,
+                                   buff = get_buffer(), tag = frame.ltag }
+            end
+         end
+      else
+         local k, v = next(frame.t, frame.key)
+         frame.key = k
+         if k == nil then
+            stack[#stack] = nil
+            local parent = stack[#stack]
+            if not parent then
+               self.result = frame.buff:clear(nil, true)
+               put_buffer(frame.buff)
+               return "done", self.result
+            end
+            parent.buff:tag(frame.tag, "bytes")
+            parent.buff:bytes(frame.buff)
+            put_buffer(frame.buff)
+         else
+            local ptype = frame.ptype
+            local tag = ptype.map[k]
+            local field = tag and ptype[tag]
+            local ftype = field and not field.scalar and field_type(field)
+            if ftype and ftype.type == "message" and not ftype.map_entry
+                  and not wkt_codec(ftype) then
+               if field.repeated then
+                  frame.list, frame.i = v, 0
+                  frame.ftype, frame.ltag = ftype, tag
+               elseif frozen_bytes(v, ftype) then
+                  budget = budget - 1
+                  encode_message(frame.buff, tag, v, ftype)
+               else
+                  budget = budget - 1
+                  stack[#stack+1] = { t = v, ptype = ftype,
+                                      buff = get_buffer(), tag = tag }
+               end
+            elseif ftype and ftype.map_entry then
+               frame.map, frame.mkey = v, nil
+               frame.ftype, frame.ltag = ftype, tag
+               frame.inner = get_buffer()
+               if deterministic_maps then
+                  local keys = {}
+                  for key in pairs(v) do keys[#keys+1] = key end
+                  table.sort(keys, map_key_lt)
+                  frame.keys, frame.i = keys, 0
+               end
+            elseif field and field.repeated
+                  and (field.scalar or ftype.type == "enum") then
+               frame.values, frame.i, frame.ltag = v, 0, tag
+               frame.enum = not field.scalar and ftype
+               frame.type_name = field.type_name
+               if field.scalar and field.packed
+                     and field.type_name ~= "string" then
+                  frame.inner = get_buffer()
+               end
+            elseif field and type(v) == "string" and #v > STRING_UNIT
+                  and (field.type_name == "string"
+                       or field.type_name == "bytes") then
+               frame.buff:tag(tag, "bytes")
+               frame.buff:varint(#v)
+               frame.str, frame.spos = v, 1
+            elseif field then
+               encode_field(frame.buff, tag, v, ptype)
+               budget = budget - (field.repeated and #v or value_cost(v))
+            end
+         end
+      end
+   end
+end
+
+EncodeTask.finish = finish_task
+
+------------------------------------------------------------
+-- per type statistics, pb.stats_enable(true) swaps pb.decode/pb.encode
+-- with counting versions, so nothing is paid when it's off.
+
+local stats = require "pb.stats"
+local plain_decode, plain_encode = pb.decode, pb.encode
+local type_stats = {}
+
+local function get_stats(ptype)
+   local name = type_name(ptype)
+   local st = type_stats[name]
+   if not st then
+      st = { decode_calls = 0, decode_bytes = 0,
+             decode_time  = 0, decode_alloc = 0,
+             encode_calls = 0, encode_bytes = 0,
+             encode_time  = 0, encode_alloc = 0 }
+      type_stats[name] = st
+   end
+   return st
+end
+
+local function stats_decode(s, ptype, dec)
+   local clock, alloc = stats.clock(), stats.allocated()
+   local res = plain_decode(s, ptype, dec)
+   local st = get_stats(ptype)
+   st.decode_calls = st.decode_calls + 1
+   st.decode_bytes = st.decode_bytes + #s
+   st.decode_time  = st.decode_time + (stats.clock() - clock)
+   st.decode_alloc = st.decode_alloc + (stats.allocated() - alloc)
+   return res
+end
+
+local function stats_encode(t, ptype, init_buff)
+   local clock, alloc = stats.clock(), stats.allocated()
+   local res = plain_encode(t, ptype, init_buff)
+   local st = get_stats(ptype)
+   st.encode_calls = st.encode_calls + 1
+   st.encode_bytes = st.encode_bytes + #res
+   st.encode_time  = st.encode_time + (stats.clock() - clock)
+   st.encode_alloc = st.encode_alloc + (stats.allocated() - alloc)
+   return res
+end
+
+function pb.stats_enable(enable)
+   enable = stats.enable(enable)
+   pb.decode = enable and stats_decode or plain_decode
+   pb.encode = enable and stats_encode or plain_encode
+   return enable
+end
+
+function pb.stats()
+   return type_stats, stats.counters()
+end
+
+function pb.stats_reset()
+   type_stats = {}
+   stats.reset()
+end
+
 ------------------------------------------------------------
 
 local scalar_typemap = {
@@ -464,6 +1608,9 @@ local function load_message(pkg, msg)
    if msg.options and msg.options.deprecated then
       t.deprecated = true
    end
+   if msg.options and msg.options.map_entry then
+      t.map_entry = true
+   end
    return t
 end
 
@@ -496,9 +1643,16 @@ local function load_fileset(pb)
 end
 
 function pb.load(data)
-   local proto = pb.decode(data,
+   -- the loader expects plain tables, whatever the option is
+   local saved = apply_defaults
+   apply_defaults = copy_defaults
+   local ok, proto = pcall(pb.decode, data,
       "google.protobuf.FileDescriptorSet")
+   apply_defaults = saved
+   if not ok then error(proto, 0) end
    load_fileset(proto)
+   default_metatables = setmetatable({}, { __mode="k" })
+   arena_layouts = setmetatable({}, { __mode="k" })
    return proto
 end
 
@@ -507,6 +1661,8 @@ function pb.loadfile(filename)
 end
 
 function pb.loadproto(proto)
+   default_metatables = setmetatable({}, { __mode="k" })
+   arena_layouts = setmetatable({}, { __mode="k" })
    return load_file(proto)
 end
 
@@ -561,6 +1717,9 @@ local function merge_message(pkg, msg)
    if msg.deprecated ~= nil then
       pkg.deprecated = msg.deprecated
    end
+   if msg.map_entry ~= nil then
+      pkg.map_entry = msg.map_entry
+   end
    merge_table(pkg, msg, "defaults")
 end
 
@@ -577,6 +1736,8 @@ local function merge_package(pkg, other)
 end
 
 function pb.merge(package)
+   default_metatables = setmetatable({}, { __mode="k" })
+   arena_layouts = setmetatable({}, { __mode="k" })
    merge_package(typeinfo, package)
 end
 
@@ -674,6 +1835,9 @@ end
 local function dump_message(name, msg, lvl)
    local lvls = ('  '):rep(lvl)
    G(lvls, name)' = { type = "message";\n'
+   if msg.map_entry then
+      G'  '(lvls)'map_entry = true;\n'
+   end
    local nested = {}
    for k,v in sorted_ipairs(msg) do
       if v.type == "field" then
@@ -685,8 +1849,8 @@ local function dump_message(name, msg, lvl)
          if v.scalar then
             G'    '(lvls)'type_name = "'(v.type_name)'";\n'
          else
-            G'    '(lvls)'type_name = { "'
-               (table.concat(v.type_name, '","'))'" };\n'
+            G'    '(lvls)'type_name = { "'(table.concat(v.type_name,
+               '","'))'" };\n'
          end
          if v.default_value then
             G'    '(lvls)'default_value = '(
@@ -763,4 +1927,479 @@ end
 
 ------------------------------------------------------------
 
+-- On LuaJIT the decoder and buffer methods the codec calls for every
+-- value are replaced by Lua versions working on the C structs through
+-- the FFI (pb.ffi describes them), so its loops compile into traces.
+-- Whatever they don't handle, a buffer that must grow, unusual
+-- arguments or errors, goes to the C methods.
+
+local ffi_methods, c_methods
+
+local function load_ffi()
+   if not jit then return end
+   local ok, ffi = pcall(require, "ffi")
+   local ok2, abi = pcall(require, "pb.ffi")
+   if not (ok and ok2) or abi.version ~= 1 or not ffi.abi "le" then
+      return
+   end
+   if not pcall(ffi.typeof, "pb_Decoder") then ffi.cdef(abi.cdef) end
+   if ffi.offsetof("pb_Decoder", "p") ~= abi.decoder_p
+         or ffi.offsetof("pb_Decoder", "end") ~= abi.decoder_end
+         or ffi.offsetof("pb_Buffer", "size") ~= abi.buffer_size
+         or ffi.offsetof("pb_Buffer", "buf") ~= abi.buffer_buf
+         or ffi.offsetof("pb_Buffer", "segsize") ~= abi.buffer_segsize then
+      return
+   end
+   local function check(lib)
+      return lib.pb_ffi_version() == abi.version and lib
+   end
+   local C
+   ok, C = pcall(check, ffi.C) -- linked into the host
+   if not (ok and C) and package.searchpath then
+      local path = package.searchpath("pb", package.cpath)
+      ok, C = pcall(function() return check(ffi.load(path)) end)
+   end
+   if not (ok and C) then return end
+
+   local cast, copy, fstring = ffi.cast, ffi.copy, ffi.string
+   local Dec, Buf = ffi.typeof "pb_Decoder*", ffi.typeof "pb_Buffer*"
+   local u8p, cu8p = ffi.typeof "uint8_t*", ffi.typeof "const uint8_t*"
+   local int64_t = ffi.typeof "int64_t"
+   local int32_t, uint32_t = ffi.typeof "int32_t", ffi.typeof "uint32_t"
+   local box = ffi.new [[union { uint8_t b[8]; uint32_t u32; int32_t i32;
+                                 uint32_t w[2]; float f; int64_t i64;
+                                 double d; }]]
+   local u64box = ffi.new "uint64_t[1]"
+   local tonumber, getmetatable = tonumber, getmetatable
+   local refsize = abi.refsize
+
+   -- the first load keeps the C methods, reloading pb.lua must not
+   -- take the Lua ones for them
+   if not abi.c_methods then
+      abi.c_methods = { decoder = {}, buffer = {} }
+      for _, name in ipairs { "tag", "varint", "fixed32", "fixed64",
+                              "bytes", "fetch", "skip", "pos", "len",
+                              "finished" } do
+         abi.c_methods.decoder[name] = decoder[name]
+      end
+      for _, name in ipairs { "tag", "varint", "bytes", "add" } do
+         abi.c_methods.buffer[name] = buffer[name]
+      end
+   end
+   local cd, cb = abi.c_methods.decoder, abi.c_methods.buffer
+   local D, B = {}, {}
+
+   local wiretypes = { varint = 0, ["64bit"] = 1, bytes = 2,
+                       startgroup = 3, endgroup = 4, ["32bit"] = 5 }
+   local wirenames = { [0] = "varint", "64bit", "bytes",
+                       "startgroup", "endgroup", "32bit" }
+
+   -- varint at d.p, a number below 2^28, an uint64_t above
+   local function readvarint(d)
+      local p, e = cast(cu8p, d.p), cast(cu8p, d["end"])
+      local n, scale = 0, 1
+      for i = 0, 3 do
+         if p + i >= e then break end
+         local b = p[i]
+         if b < 128 then
+            d.p = d.p + (i + 1)
+            return n + b * scale
+         end
+         n, scale = n + (b - 128) * scale, scale * 128
+      end
+      if C.pb_ffi_readvarint(d, u64box) == 0 then return nil end
+      return u64box[0]
+   end
+
+   local function readfixed(d, size)
+      local p = d.p
+      if d["end"] - p < size then return false end
+      copy(box.b, p, size)
+      d.p = p + size
+      return true
+   end
+
+   -- NaNs read from cdata are not made canonical, some would look like
+   -- other Lua values
+   local function tofloat()
+      if box.u32 % 2^31 > 0x7F800000 then return 0/0 end
+      return box.f
+   end
+   local function todouble()
+      local hi = box.w[1] % 2^31
+      if hi > 0x7FF00000 or hi == 0x7FF00000 and box.w[0] ~= 0 then
+         return 0/0
+      end
+      return box.d
+   end
+
+   -- conversions of a varint as the C methods do them
+   local function toint(v)
+      if type(v) == "number" then return v end
+      return tonumber(cast(int64_t, v))
+   end
+   local function unzigzag(v)
+      if type(v) == "number" then
+         if v % 2 == 0 then return v / 2 end
+         return -(v + 1) / 2
+      end
+      local h = tonumber(cast(int64_t, v / 2))
+      if v % 2 == 0 then return h end
+      return -h - 1
+   end
+   local varint_types = {
+      int64 = toint, uint64 = toint, enum = toint,
+      sint32 = unzigzag, sint64 = unzigzag,
+      int32 = function(v)
+         if type(v) == "number" then return v end
+         return tonumber(cast(int32_t, v))
+      end,
+      uint32 = function(v)
+         if type(v) == "number" then return v end
+         return tonumber(cast(uint32_t, v))
+      end,
+      bool = function(v) return v ~= 0 end,
+   }
+
+   -- a tag and wiretype read from d, nil if incomplete or too big
+   local function readtag(d)
+      local key = readvarint(d)
+      if type(key) ~= "number" then return nil end
+      local wiretype = key % 8
+      return (key - wiretype) / 8, wiretype
+   end
+
+   function D.tag(self)
+      if getmetatable(self) ~= decoder then return cd.tag(self) end
+      local d = cast(Dec, self)
+      local p = d.p
+      local tag, wiretype = readtag(d)
+      if tag == nil then
+         d.p = p
+         return cd.tag(self)
+      end
+      return tag, wiretype, wirenames[wiretype]
+   end
+
+   function D.varint(self)
+      if getmetatable(self) ~= decoder then return cd.varint(self) end
+      local v = readvarint(cast(Dec, self))
+      if v ~= nil then return toint(v) end
+   end
+
+   function D.fixed32(self)
+      if getmetatable(self) ~= decoder then return cd.fixed32(self) end
+      if readfixed(cast(Dec, self), 4) then return box.u32 end
+   end
+
+   function D.fixed64(self)
+      if getmetatable(self) ~= decoder then return cd.fixed64(self) end
+      if readfixed(cast(Dec, self), 8) then return tonumber(box.i64) end
+   end
+
+   function D.bytes(self, n)
+      if getmetatable(self) ~= decoder
+            or n ~= nil and (type(n) ~= "number" or n < 0 or n % 1 ~= 0) then
+         return cd.bytes(self, n)
+      end
+      local d = cast(Dec, self)
+      local p = d.p
+      if n == nil or n == 0 then
+         n = readvarint(d)
+         if type(n) ~= "number" then
+            d.p = p
+            return cd.bytes(self)
+         end
+      end
+      if d["end"] - d.p < n then
+         d.p = p
+         return
+      end
+      local s = fstring(d.p, n)
+      d.p = d.p + n
+      return s
+   end
+
+   -- value of wiretype as type t at d, nil if incomplete, nil and true
+   -- if the C method must do it
+   local function readvalue(d, wt, t)
+      if wt == 0 then
+         local conv = t == nil and toint or varint_types[t]
+         if not conv then return nil, true end
+         local v = readvarint(d)
+         if v == nil then return nil end
+         return conv(v)
+      elseif wt == 2 then
+         local n = readvarint(d)
+         if n == nil then return nil end
+         if type(n) ~= "number" then return nil, true end
+         if d["end"] - d.p < n then return nil end
+         local s = fstring(d.p, n)
+         d.p = d.p + n
+         return s
+      elseif wt == 1 then
+         if t == nil or t == "fixed64" or t == "sfixed64" then
+            return readfixed(d, 8) and tonumber(box.i64) or nil
+         elseif t == "double" then
+            return readfixed(d, 8) and todouble() or nil
+         end
+      elseif wt == 5 then
+         if t == nil or t == "fixed32" then
+            return readfixed(d, 4) and box.u32 or nil
+         elseif t == "float" then
+            return readfixed(d, 4) and tofloat() or nil
+         elseif t == "sfixed32" then
+            return readfixed(d, 4) and box.i32 or nil
+         end
+      end
+      return nil, true
+   end
+
+   function D.fetch(self, wiretype, t)
+      if getmetatable(self) ~= decoder then
+         return cd.fetch(self, wiretype, t)
+      end
+      local d = cast(Dec, self)
+      local p = d.p
+      local tag, wt = nil, wiretype
+      if wt == nil then
+         tag, wt = readtag(d)
+      elseif type(wt) == "string" then
+         wt = wiretypes[wt]
+      end
+      local v, fallback = readvalue(d, wt, t)
+      if v == nil then
+         d.p = p
+         if fallback then return cd.fetch(self, wiretype, t) end
+         return
+      end
+      if tag then return tag, v end
+      return v
+   end
+
+   function D.skip(self, wiretype)
+      if getmetatable(self) ~= decoder then return cd.skip(self, wiretype) end
+      local d = cast(Dec, self)
+      local p = d.p
+      local tag, wt = nil, wiretype
+      if wt == nil then
+         tag, wt = readtag(d)
+      elseif type(wt) == "string" then
+         wt = wiretypes[wt]
+      end
+      if wt == 0 or wt == 1 or wt == 2 or wt == 5 then
+         if C.pb_ffi_skip(d, wt) == 0 then
+            d.p = p
+            return
+         end
+         if tag then return tag, wt end
+         return wt
+      end
+      d.p = p
+      return cd.skip(self, wiretype)
+   end
+
+   function D.pos(self, ...)
+      if getmetatable(self) ~= decoder then return cd.pos(self, ...) end
+      local d = cast(Dec, self)
+      local pos = tonumber(d.p - d.s) + 1
+      if select("#", ...) == 0 then return pos end
+      local npos = ...
+      if npos == nil then npos = pos end
+      if type(npos) ~= "number" or npos % 1 ~= 0 then
+         return cd.pos(self, ...)
+      end
+      if npos < 0 then
+         local len = tonumber(d["end"] - d.s)
+         npos = -npos > len and 0 or len + npos
+      end
+      if npos < 1 then npos = 1 end
+      d.p = d.s + (npos - 1)
+      return pos
+   end
+
+   function D.len(self, n)
+      if getmetatable(self) ~= decoder then return cd.len(self, n) end
+      local d = cast(Dec, self)
+      local cur, len = tonumber(d["end"] - d.s), tonumber(d.len)
+      if n == nil then
+         d["end"] = d.s + len
+      elseif type(n) == "number" then
+         if n < 0 or n % 1 ~= 0 then return cd.len(self, n) end
+         d["end"] = d.s + (n < len and n or len)
+      end
+      return cur, len
+   end
+
+   function D.finished(self)
+      if getmetatable(self) ~= decoder then return cd.finished(self) end
+      local d = cast(Dec, self)
+      return d.p >= d["end"]
+   end
+
+   -- write n, an integer in [0, 2^63), as a varint at p, returns the
+   -- bytes written
+   local function putvarint(p, n)
+      local i = 0
+      while n >= 128 do
+         local lo = n % 128
+         p[i] = lo + 128
+         n, i = (n - lo) / 128, i + 1
+      end
+      p[i] = n
+      return i + 1
+   end
+
+   local function isint(v, limit)
+      return type(v) == "number" and v % 1 == 0 and v >= -limit and v < limit
+   end
+
+   -- bytes are written after used, it only moves when a value is
+   -- complete, so a fallback to C starts from a clean buffer
+   local add_wiretypes = {
+      bool = 0, int32 = 0, uint32 = 0, int64 = 0, uint64 = 0, enum = 0,
+      sint32 = 0, sint64 = 0, double = 1, fixed64 = 1, sfixed64 = 1,
+      string = 2, bytes = 2, message = 2, float = 5, fixed32 = 5,
+      sfixed32 = 5,
+   }
+
+   function B.add(self, tag, t, v)
+      local wt = add_wiretypes[t]
+      if getmetatable(self) ~= buffer or wt == nil
+            or tag ~= nil and not (isint(tag, 2^29) and tag >= 0) then
+         return cb.add(self, tag, t, v)
+      end
+      local b = cast(Buf, self)
+      local used = tonumber(b.used)
+      local avail = tonumber(b.size) - used
+      if avail < 20 then return cb.add(self, tag, t, v) end
+      local p = cast(u8p, b.buf) + used
+      local n = tag and putvarint(p, tag * 8 + wt) or 0
+      if t == "bool" then
+         p[n] = v and 1 or 0
+         n = n + 1
+      elseif wt == 2 then
+         if type(v) ~= "string" then return cb.add(self, tag, t, v) end
+         local len = #v
+         if len + 20 > avail or b.segsize ~= 0 and len >= refsize then
+            return cb.add(self, tag, t, v)
+         end
+         n = n + putvarint(p + n, len)
+         copy(p + n, v, len)
+         n = n + len
+      elseif t == "double" or t == "float" then
+         if type(v) ~= "number" then return cb.add(self, tag, t, v) end
+         if t == "double" then
+            box.d = v
+            copy(p + n, box.b, 8)
+            n = n + 8
+         else
+            box.f = v
+            copy(p + n, box.b, 4)
+            n = n + 4
+         end
+      elseif wt == 5 or t == "int32" or t == "uint32" then
+         if not isint(v, 2^53) then return cb.add(self, tag, t, v) end
+         if wt == 5 then
+            box.u32 = v % 2^32
+            copy(p + n, box.b, 4)
+            n = n + 4
+         else
+            n = n + putvarint(p + n, v % 2^32)
+         end
+      elseif wt == 1 then
+         if not isint(v, 2^63) then return cb.add(self, tag, t, v) end
+         box.i64 = v
+         copy(p + n, box.b, 8)
+         n = n + 8
+      elseif t == "sint32" or t == "sint64" then
+         if not isint(v, t == "sint32" and 2^31 or 2^52) then
+            return cb.add(self, tag, t, v)
+         end
+         n = n + putvarint(p + n, v >= 0 and v * 2 or -v * 2 - 1)
+      else -- int64, uint64, enum
+         if not isint(v, 2^63) then return cb.add(self, tag, t, v) end
+         if v < 0 then
+            b.used = used + n
+            C.pb_ffi_addvarint(b, v)
+            return self
+         end
+         n = n + putvarint(p + n, v)
+      end
+      b.used = used + n
+      return self
+   end
+
+   function B.tag(self, tag, wiretype)
+      local wt = wiretype
+      if type(wt) == "string" then wt = wiretypes[wt] end
+      if getmetatable(self) ~= buffer or not isint(wt, 8) or wt < 0
+            or not isint(tag, 2^29) or tag < 0 then
+         return cb.tag(self, tag, wiretype)
+      end
+      local b = cast(Buf, self)
+      local used = tonumber(b.used)
+      if tonumber(b.size) - used < 10 then
+         return cb.tag(self, tag, wiretype)
+      end
+      b.used = used + putvarint(cast(u8p, b.buf) + used, tag * 8 + wt)
+      return self
+   end
+
+   function B.varint(self, v, ...)
+      if getmetatable(self) ~= buffer or select("#", ...) ~= 0
+            or not isint(v, 2^63) then
+         return cb.varint(self, v, ...)
+      end
+      local b = cast(Buf, self)
+      local used = tonumber(b.used)
+      if tonumber(b.size) - used < 10 then return cb.varint(self, v) end
+      if v < 0 then
+         C.pb_ffi_addvarint(b, v)
+      else
+         b.used = used + putvarint(cast(u8p, b.buf) + used, v)
+      end
+      return self
+   end
+
+   function B.bytes(self, s, ...)
+      if getmetatable(self) ~= buffer or select("#", ...) ~= 0
+            or type(s) ~= "string" then
+         return cb.bytes(self, s, ...)
+      end
+      local b = cast(Buf, self)
+      local used, len = tonumber(b.used), #s
+      if tonumber(b.size) - used < len + 10
+            or b.segsize ~= 0 and len >= refsize then
+         return cb.bytes(self, s)
+      end
+      local p = cast(u8p, b.buf) + used
+      local n = putvarint(p, len)
+      copy(p + n, s, len)
+      b.used = used + n + len
+      return self
+   end
+
+   c_methods = abi.c_methods
+   return { decoder = D, buffer = B }
+end
+
+local function use_methods(methods)
+   for name, f in pairs(methods.decoder) do decoder[name] = f end
+   for name, f in pairs(methods.buffer) do buffer[name] = f end
+end
+
+ffi_methods = load_ffi()
+if ffi_methods then use_methods(ffi_methods) end
+
+function options.enable_ffi()
+   if ffi_methods then use_methods(ffi_methods) end
+end
+
+function options.disable_ffi()
+   if ffi_methods then use_methods(c_methods) end
+end
+
+------------------------------------------------------------
+
 return pb
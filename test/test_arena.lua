@@ -0,0 +1,98 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local buffer = require "pb.buffer"
+
+pb.loadfile "addressbook.pb"
+local book = { person = {} }
+for i = 1, 20 do
+   book.person[i] = {
+      name = "Person "..i, id = i * 1000, email = "p"..i.."@example.com",
+      phone = { { number = "555-"..i, type = "WORK" }, { number = "0-"..i } },
+   }
+end
+local data = pb.encode(book, "tutorial.AddressBook")
+
+local msg = pb.decode_arena(data, "tutorial.AddressBook")
+assert(#msg.person == 20)
+local p = msg.person[13]
+assert(p.name == "Person 13" and p.id == 13000)
+assert(p.email == "p13@example.com")
+assert(#p.phone == 2 and p.phone[1].type == "WORK")
+assert(p.phone[2].number == "0-13")
+assert(p.phone[2].type == "HOME") -- declared default
+assert(p.phone[3] == nil and msg.person[0] == nil)
+assert(p.nonexist == nil)
+
+-- proxies keep the arena alive
+msg = nil
+collectgarbage()
+assert(p.phone[1].number == "555-13")
+
+local function count(iter, ...)
+   local n = 0
+   for k, v in iter(...) do
+      n = n + 1
+      assert(v ~= nil and k ~= "nonexist")
+   end
+   return n
+end
+local function sum(iter, ...)
+   local n = 0
+   for i, v in iter(...) do n = n + i; assert(v.number) end
+   return n
+end
+assert(count(pb.arena_pairs, p) == 4)
+assert(sum(pb.arena_pairs, p.phone) == 3)
+assert(not pcall(pb.arena_pairs, {}))
+if _VERSION ~= "Lua 5.1" then
+   assert(count(pairs, p) == 4)
+   assert(sum(pairs, p.phone) == 3)
+end
+
+-- packed and not packed values of one repeated field, the last one of
+-- a singular field wins
+local packed = buffer.new():varint(1):varint(300):result()
+local s = buffer.new()
+   :add(1, "string", "first")
+   :add(5, "bytes", packed)
+   :add(5, "int32", -1)
+   :add(1, "string", "second")
+   :add(2, "int32", 7)
+   :result()
+p = pb.decode_arena(s, "tutorial.Person")
+assert(p.name == "second" and p.id == 7)
+
+-- maps
+pb.loadfile "map.pb"
+local config = {
+   title = "config",
+   labels = { env = "prod", zone = "eu-1" },
+   items = { [1] = { name = "one", count = 1 }, [-7] = { name = "neg" } },
+   colors = { a = "RED", b = "GREEN" },
+   flags = { [true] = 1099511627776, [false] = -1 },
+}
+msg = pb.decode_arena(pb.encode(config, "maps.Config"), "maps.Config")
+assert(msg.title == "config")
+assert(msg.labels.env == "prod" and msg.labels.zone == "eu-1")
+assert(msg.items[1].name == "one" and msg.items[-7].name == "neg")
+assert(msg.items[-7].count == 0 or msg.items[-7].count == nil)
+assert(msg.colors.a == "RED" and msg.colors.b == "GREEN")
+assert(msg.flags[true] == 1099511627776 and msg.flags[false] == -1)
+
+-- broken input
+assert(not pcall(pb.decode_arena, "\10\5abc", "tutorial.Person"))
+assert(not pcall(pb.decode_arena, "\8", "tutorial.Person"))
+assert(not pcall(pb.decode_arena, "\13\0\0\0\0", "tutorial.Person"))
+
+-- packed runs must hold whole values, within the run
+pb.loadfile "codegen.pb"
+local bad = ("\26\12"..("\0"):rep(12).."\160\6\129\1"):rep(100)
+assert(not pcall(pb.decode_arena, bad, "codegen.Lists"))
+assert(not pcall(pb.decode_arena, "\10\1\128\16\1", "codegen.Lists"))
+local lists = pb.decode_arena("\10\3\1\128\1\26\8"..("\0"):rep(8),
+                              "codegen.Lists")
+assert(#lists.packed == 2 and lists.packed[2] == 128)
+assert(#lists.doubles == 1 and lists.doubles[1] == 0)
+
+print "ok"
@@ -0,0 +1,50 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+local buffer = require "pb.buffer"
+
+pb.loadfile "addressbook.pb"
+
+-- a chunked buffer holds the same bytes as a plain one
+local plain, chunked = buffer.new(), buffer.chunked(64)
+local big = ("x"):rep(1000)
+for i = 1, 100 do
+   local s = pb.encode({ name = "Person "..i, id = i,
+      email = i % 10 == 0 and big or nil }, "tutorial.Person")
+   plain:tag(1, "bytes"):bytes(s)
+   chunked:tag(1, "bytes"):bytes(s)
+end
+plain:add(2, "string", big):varint(300):concat(big)
+chunked:add(2, "string", big):varint(300):concat(big)
+collectgarbage()
+assert(#chunked == #plain)
+local expected = plain:result()
+
+-- writev to a path, a file handle and several arguments
+assert(pbio.writev("chunked.bin", chunked) == #expected)
+assert(pbio.read "chunked.bin" == expected)
+local fp = assert(io.open("chunked.bin", "wb"))
+fp:write "head"
+assert(pbio.writev(fp, "<", chunked, ">") == #expected + 2)
+fp:close()
+assert(pbio.read "chunked.bin" == "head<"..expected..">")
+os.remove "chunked.bin"
+assert(not pbio.writev("no/such/dir/chunked.bin", chunked))
+
+-- reading the whole buffer joins the segments
+assert(chunked:result() == expected)
+chunked:varint(1)
+assert(chunked:clear(nil, true) == expected.."\1")
+assert(#chunked == 0)
+
+-- as a decoder source and as the encode buffer
+chunked:reset()
+chunked:add(1, "string", big):add(2, "int32", 42)
+local t = pb.decode(chunked:result(), "tutorial.Person")
+assert(t.name == big and t.id == 42)
+chunked:reset()
+local data = pb.encode({ name = big, id = 42 }, "tutorial.Person", chunked)
+assert(pb.decode(data, "tutorial.Person").name == big)
+
+print "ok"
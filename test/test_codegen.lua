@@ -0,0 +1,128 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+-- run protoc-gen-lua in process on a request made from a .pb file
+local function generate(pbfile)
+   local fh = assert(io.open(pbfile, "rb"))
+   local set = pb.decode(fh:read "*a", "google.protobuf.FileDescriptorSet")
+   fh:close()
+   local files = {}
+   for i, file in ipairs(set.file) do files[i] = file.name end
+   local req = pb.encode({ file_to_generate = files, proto_file = set.file },
+      "google.protobuf.compiler.CodeGeneratorRequest")
+   local read, write, out = pbio.read, pbio.write
+   pbio.read = function() return req end
+   pbio.write = function(s) out = s end
+   local ok, err = pcall(dofile, "../protoc-gen-lua")
+   pbio.read, pbio.write = read, write
+   assert(ok, err)
+   local res = pb.decode(out, "google.protobuf.compiler.CodeGeneratorResponse")
+   assert(not res.error, res.error)
+   return res.file[1]
+end
+
+local gen = generate "codegen.pb"
+assert(gen.name == "codegen_pb.c")
+assert(gen.content:match "luaopen_codegen_pb")
+
+-- build it with $CC and the Lua headers in $LUA_INCDIR (the ones pb.c
+-- was built with), else the usual places; a failed build is an error
+-- only when LUA_INCDIR is set
+local cc = os.getenv "CC" or "cc"
+local inc = os.getenv "LUA_INCDIR"
+local ver = _VERSION:match "%d+%.%d+"
+local incs = inc and { inc } or { false, "/usr/include/lua"..ver,
+   "/usr/local/include/lua"..ver, "/usr/include/luajit-2.1" }
+local fh = assert(io.open("codegen_pb.c", "wb"))
+fh:write(gen.content)
+fh:close()
+local built, cmd
+for _, dir in ipairs(incs) do
+   cmd = ("%s -O2 -shared -fPIC -I.. %s -o codegen_pb.so codegen_pb.c -lpthread")
+      :format(cc, dir and "-I"..dir or "")
+   if not inc then cmd = cmd.." 2>/dev/null" end
+   built = os.execute(cmd) -- true in 5.2+, 0 in 5.1
+   if built == true or built == 0 then break end
+end
+os.remove "codegen_pb.c"
+if built ~= true and built ~= 0 then
+   if inc then
+      error("can not build the generated codecs (check CC and LUA_INCDIR): "
+            ..cmd)
+   end
+   print "Lua headers not found (set LUA_INCDIR), skipped"
+   print "ok"
+   return
+end
+local open = package.loadlib("./codegen_pb.so", "luaopen_codegen_pb")
+local codecs = open()
+os.remove "codegen_pb.so"
+
+pb.loadfile "codegen.pb"
+
+local function check(ptype, t)
+   local c = codecs[ptype]
+   local data = c.encode(t)
+   dfs(pb.decode(data, ptype), c.decode(data))
+   dfs(c.decode(data), c.decode(pb.encode(t, ptype)))
+   return c.decode(data)
+end
+
+local s = check("codegen.Scalars", {
+   i32 = -2, i64 = -1099511627776, u32 = 4294967295, u64 = 1,
+   s32 = -3, s64 = -1099511627777, f32 = 7, f64 = 8, sf32 = -9, sf64 = -10,
+   fl = 1.5, db = -0.25, b = true, s = "str", by = "\0\1\2", level = "LOW",
+})
+assert(s.i32 == -2 and s.sf32 == -9 and s.level == "LOW")
+assert(codecs["codegen.Scalars"].decode(
+   codecs["codegen.Scalars"].encode { level = 1 }).level == "HIGH")
+
+-- declared defaults are typed constants
+local d = codecs["codegen.Defaults"].decode ""
+assert(d.i == -5 and d.s == 'a"b\n' and d.by == "\1\0x")
+assert(d.d == math.huge and d.b == true and d.level == "HIGH" and d.u == -1)
+
+local l = check("codegen.Lists", {
+   packed = { 1, -2, 300 }, unpacked = { -1, 2 }, doubles = { 0.5 },
+   strings = { "a", "", "c" },
+   items = { { s = "x" }, { i32 = 1 } },
+   byname = { one = { i32 = 1 }, two = {} },
+   bylevel = { [5] = "HIGH", [-6] = "LOW" },
+   next = { packed = { 7 }, next = { strings = { "deep" } } },
+})
+assert(#l.packed == 3 and l.packed[3] == 300)
+assert(l.next.next.strings[1] == "deep")
+
+-- packed enums (pb.decode() does not read them)
+l = codecs["codegen.Lists"].decode(codecs["codegen.Lists"].encode {
+   levels = { "MID", "LOW", "HIGH", 7 } })
+assert(l.levels[1] == "MID" and l.levels[2] == "LOW" and l.levels[4] == 7)
+
+-- packed and unpacked values are both accepted
+local buffer = require "pb.buffer"
+local unpacked = buffer.new():add(1, "int32", 4):add(1, "int32", 5):result()
+l = codecs["codegen.Lists"].decode(unpacked)
+assert(l.packed[1] == 4 and l.packed[2] == 5)
+
+-- bad input
+assert(not pcall(codecs["codegen.Scalars"].encode, { i32 = "x" }))
+assert(not pcall(codecs["codegen.Scalars"].encode, { level = "NONE" }))
+assert(not pcall(codecs["codegen.Lists"].encode, { items = 1 }))
+assert(not pcall(codecs["codegen.Scalars"].decode, "\8"))
+local ok, err = pcall(codecs["codegen.Lists"].encode, { items = { 1 } })
+assert(not ok and err:match "items")
+
+print "ok"
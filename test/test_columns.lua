@@ -0,0 +1,137 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pio = require "pb.io"
+local buffer = require "pb.buffer"
+
+pb.loadfile "codegen.pb"
+pb.loadfile "wkt.pb"
+pb.loadfile "addressbook.pb"
+
+local rows = {}
+for i = 1, 300 do
+   rows[i] = { i32 = -i, u64 = i * 1000, db = i / 4, b = i % 2 == 0,
+               s = i % 3 == 0 and ("s"..i) or nil,
+               level = ({ "LOW", "MID", "HIGH" })[i % 3 + 1] }
+   if i % 5 == 0 then rows[i].db = nil end
+end
+local msgs = {}
+for i, t in ipairs(rows) do msgs[i] = pb.encode(t, "codegen.Scalars") end
+
+local function check(cols, n, native)
+   assert(n == #rows)
+   for i, t in ipairs(rows) do
+      assert(cols.i32[i] == t.i32 and cols.u64[i] == t.u64)
+      assert(cols.db[i] == t.db and cols.b[i] == t.b)
+      assert(cols.s[i] == t.s)
+      if native then
+         assert(cols.level[i] == ({ LOW = -1, MID = 0, HIGH = 1 })[t.level])
+      else
+         assert(cols.level[i] == t.level)
+      end
+   end
+   assert(cols.sf32[1] == nil and cols.sf32[n] == nil)
+end
+
+local fields = { "i32", "u64", "db", "b", "s", "level", "sf32" }
+local cols, n = pb.decode_columns(msgs, "codegen.Scalars", fields)
+check(cols, n)
+assert(type(cols.i32) == "table")
+
+-- native columns, strings stay in tables
+cols, n = pb.decode_columns(msgs, "codegen.Scalars", fields, { native = true })
+check(cols, n, true)
+assert(type(cols.s) == "table" and type(cols.db) == "userdata")
+assert(#cols.db == 300 and #cols.sf32 == 300)
+assert(cols.db:present(1) and not cols.db:present(5))
+assert(not cols.db:present(0) and not cols.db:present(301))
+assert(cols.db[301] == nil)
+local p, count, kind = cols.db:data()
+assert(type(p) == "userdata" and count == 300 and kind == "number")
+assert(select(3, cols.i32:data()) == "integer")
+assert(select(3, cols.b:data()) == "boolean")
+assert(tostring(cols.i32):match "integer.*300 values")
+
+-- a delimited string or buffer, with a limit
+local buf = buffer.new()
+for _, s in ipairs(msgs) do buf:bytes(s) end
+check(pb.decode_columns(buf:result(), "codegen.Scalars", fields))
+check(pb.decode_columns(buf, "codegen.Scalars", fields))
+cols, n = pb.decode_columns(buf:result(), "codegen.Scalars", { "i32" },
+                            { limit = 10 })
+assert(n == 10 and #cols.i32 == 10)
+assert(select(2, pb.decode_columns({}, "codegen.Scalars", { "i32" })) == 0)
+assert(not pcall(pb.decode_columns, buf:result():sub(1, -2),
+                 "codegen.Scalars", { "i32" }))
+
+-- repeated fields give a list per message, paths go into sub-messages
+local lists = {
+   { packed = { 1, 2, 3 }, strings = { "a" }, next = { packed = { 9 } } },
+   { doubles = { 0.5 }, next = { next = { levels = { "HIGH", "LOW" } } } },
+   {},
+}
+for i, t in ipairs(lists) do lists[i] = pb.encode(t, "codegen.Lists") end
+cols, n = pb.decode_columns(lists, "codegen.Lists",
+   { "packed", "strings", "doubles", "next.packed", "next.next.levels" },
+   { native = true })
+assert(n == 3)
+assert(#cols.packed[1] == 3 and cols.packed[1][3] == 3)
+assert(cols.packed[2] == nil and cols.strings[1][1] == "a")
+assert(cols.doubles[2][1] == 0.5 and cols["next.packed"][1][1] == 9)
+assert(cols["next.next.levels"][2][2] == "LOW")
+assert(cols["next.packed"][3] == nil)
+
+-- values in a packed run must end within it
+for _, bad in ipairs { "\10\1\128\1", "\26\4"..("\0"):rep(8) } do
+   assert(not pcall(pb.decode_columns, { bad }, "codegen.Lists",
+                    { "packed", "doubles", "unpacked" }))
+end
+
+-- singular sub-message fields, in place of the well known types
+local events = {}
+for i = 1, 50 do
+   events[i] = pb.encode({ at = { seconds = i, nanos = i },
+                           ratio = i % 2 == 0 and { value = i } or nil,
+                           flag = { value = true } }, "wkt.Event")
+end
+cols, n = pb.decode_columns(events, "wkt.Event",
+   { "at.seconds", "at.nanos", "ratio.value", "flag.value", "at.seconds" },
+   { native = true })
+assert(n == 50)
+for i = 1, 50 do
+   assert(cols["at.seconds"][i] == i and cols["at.nanos"][i] == i)
+   assert(cols["ratio.value"][i] == (i % 2 == 0 and i or nil))
+   assert(cols["flag.value"][i] == true)
+end
+
+-- fields must exist and be scalars
+assert(not pcall(pb.decode_columns, events, "wkt.Event", { "nope" }))
+assert(not pcall(pb.decode_columns, events, "wkt.Event", { "at" }))
+assert(not pcall(pb.decode_columns, events, "wkt.Event", { "times.seconds" }))
+assert(not pcall(pb.decode_columns, events, "wkt.Event", { "at.seconds.x" }))
+assert(not pcall(pb.decode_columns, events, "wkt.Event", {}))
+
+-- records of a log, in batches
+local path = os.tmpname()
+local w = assert(pio.logwriter(path))
+for i = 1, 250 do
+   w:write(pb.encode({ name = "p"..i, id = i }, "tutorial.Person"))
+end
+w:close()
+local r = assert(pio.logreader(path))
+local total = 0
+while true do
+   cols, n = pb.decode_columns(r, "tutorial.Person", { "id", "name" },
+                               { limit = 100, native = true })
+   if n == 0 then break end
+   for i = 1, n do
+      assert(cols.id[i] == total + i and cols.name[i] == "p"..(total + i))
+   end
+   total = total + n
+end
+assert(total == 250)
+r:close()
+os.remove(path)
+os.remove(path..".idx")
+
+print "ok"
@@ -0,0 +1,53 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+
+pb.loadfile "addressbook.pb"
+local data = pb.encode({ number = "12345" }, "tutorial.Person.PhoneNumber")
+
+-- defaults are copied by default
+local t = pb.decode(data, "tutorial.Person.PhoneNumber")
+assert(t.type == "HOME" and rawget(t, "type") == "HOME")
+
+-- shared metatable
+pb.option "use_default_metatable"
+t = pb.decode(data, "tutorial.Person.PhoneNumber")
+local t2 = pb.decode(data, "tutorial.Person.PhoneNumber")
+assert(t.type == "HOME" and rawget(t, "type") == nil)
+assert(getmetatable(t) == getmetatable(t2))
+assert(pb.has(t, "number") and not pb.has(t, "type"))
+assert(pb.encode(t, "tutorial.Person.PhoneNumber") == data)
+t.type = "WORK"
+assert(pb.has(t, "type"))
+assert(pb.decode(pb.encode(t, "tutorial.Person.PhoneNumber"),
+   "tutorial.Person.PhoneNumber").type == "WORK")
+
+-- typed zeros
+local p = pb.decode(pb.encode({ name = "Alice" }, "tutorial.Person"),
+   "tutorial.Person")
+assert(p.id == nil and p.email == nil)
+pb.option "enable_typed_zeros"
+p = pb.decode(pb.encode({ name = "Alice" }, "tutorial.Person"),
+   "tutorial.Person")
+assert(p.id == 0 and p.email == "" and p.phone == nil)
+assert(not pb.has(p, "id"))
+t = pb.decode(data, "tutorial.Person.PhoneNumber")
+assert(t.type == "HOME")
+pb.loadfile "codegen.pb"
+local z = pb.decode("", "codegen.Scalars")
+assert(z.b == false and z.i32 == 0 and z.db == 0.0 and z.s == "")
+assert(z.level == "MID")
+
+-- loading schemas is not affected by the options
+pb.loadfile "addressbook.pb"
+pb.option "disable_typed_zeros"
+
+-- no defaults at all
+pb.option "no_default_values"
+t = pb.decode(data, "tutorial.Person.PhoneNumber")
+assert(t.type == nil and getmetatable(t) == nil)
+pb.option "use_default_values"
+
+assert(not pcall(pb.option, "no_such_option"))
+
+print "ok"
@@ -0,0 +1,148 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local abi = require "pb.ffi"
+local decoder = require "pb.decoder"
+local buffer = require "pb.buffer"
+
+assert(abi.version == 1 and type(abi.cdef) == "string")
+if not abi.c_methods then
+   print "LuaJIT FFI not available, skipped"
+   print "ok"
+   return
+end
+local cd, cb = abi.c_methods.decoder, abi.c_methods.buffer
+assert(decoder.fetch ~= cd.fetch and buffer.add ~= cb.add)
+
+-- values written by the FFI and the C methods are the same
+local ints = { 0, 1, 127, 128, 300, 2^28-1, 2^28, 2^31-1, 2^31, 2^32-1,
+               2^32, 2^53, 2^62, -1, -128, -2^31, -2^31-1, -2^53, 1.5 }
+local cases = {}
+for _, t in ipairs { "int32", "uint32", "int64", "uint64", "enum",
+                     "sint32", "sint64", "fixed32", "sfixed32",
+                     "fixed64", "sfixed64", "double", "float" } do
+   for _, v in ipairs(ints) do cases[#cases+1] = { t, v } end
+end
+for _, v in ipairs { true, false } do cases[#cases+1] = { "bool", v } end
+for _, n in ipairs { 0, 1, 127, 128, 511, 512, 5000 } do
+   cases[#cases+1] = { "string", ("s"):rep(n) }
+   cases[#cases+1] = { "bytes", ("\0"):rep(n) }
+end
+
+local function encode(add, new, untagged)
+   local b = new()
+   for i, c in ipairs(cases) do
+      add(b, not untagged and i or nil, c[1], c[2])
+   end
+   return b:result()
+end
+local function C_add(b, ...) return cb.add(b, ...) end
+local data = encode(buffer.add, buffer.new)
+assert(data == encode(C_add, buffer.new))
+assert(data == encode(buffer.add, function() return buffer.chunked(64) end))
+assert(encode(buffer.add, buffer.new, true) == encode(C_add, buffer.new, true))
+
+local b1, b2 = buffer.new(), buffer.new()
+for _, v in ipairs(ints) do
+   b1:varint(v):tag(v % 2^29, "bytes"):bytes(tostring(v))
+   cb.bytes(cb.tag(cb.varint(b2, v), v % 2^29, "bytes"), tostring(v))
+end
+local b3 = buffer.new "b3"
+b1:varint(1, 2, 3):tag(2^29, 0):tag(1, 7):bytes("a", b3):bytes(b3)
+cb.bytes(cb.bytes(cb.tag(cb.tag(cb.varint(b2, 1, 2, 3), 2^29, 0), 1, 7),
+                  "a", b3), b3)
+assert(b1:result() == b2:result())
+assert(not pcall(buffer.add, b1, 1, "nope", 1))
+assert(not pcall(buffer.add, b1, 1, "int32", "x"))
+assert(not pcall(buffer.tag, b1, 1, "nope"))
+assert(not pcall(buffer.add, decoder.new "", 1, "int32", 1))
+
+-- and read back the same, complete or cut anywhere
+local function same(name, d1, d2, ...)
+   local r1 = { pcall(decoder[name], d1, ...) }
+   local r2 = { pcall(cd[name], d2, ...) }
+   assert(#r1 == #r2, name)
+   for i = 1, #r1 do
+      assert(r1[i] == r2[i] or r1[i] ~= r1[i] and r2[i] ~= r2[i]
+             or not r1[1], name)
+   end
+   assert(d1:pos() == d2:pos(), name)
+   return r1[1] and r1[2] ~= nil
+end
+local function both(s, ...)
+   for _, step in ipairs { ... } do
+      local d1, d2 = decoder.new(s), decoder.new(s)
+      repeat until not step(d1, d2)
+      assert(d1:finished() == d2:finished())
+   end
+end
+
+local i = 0
+both(data, function(d1, d2)
+   i = i + 1
+   local c = cases[i]
+   return same("fetch", d1, d2, nil, c and c[1])
+end)
+assert(i == #cases + 1)
+
+local wiretypes = { 0, 1, 2, 5, "varint", "64bit", "bytes", "32bit" }
+for cut = 0, 60 do
+   local s = data:sub(1, cut)
+   both(s, function(d1, d2) return same("tag", d1, d2)
+                                   and same("skip", d1, d2) end,
+           function(d1, d2) return same("skip", d1, d2, nil) end,
+           function(d1, d2) return same("varint", d1, d2) end)
+   for _, wt in ipairs(wiretypes) do
+      both(s, function(d1, d2) return same("fetch", d1, d2, wt) end,
+              function(d1, d2) return same("skip", d1, d2, wt) end)
+   end
+end
+for _, s in ipairs { "", "\1", "\5abc", "\3abc", "\255\255\255\255\255\1",
+                     "\255\255\255\255\255\255\255\255\255\1",
+                     "\128\128\128\128\128\128\128\128\128\128\1" } do
+   for _, f in ipairs { "tag", "varint", "fixed32", "fixed64", "bytes" } do
+      both(s, function(d1, d2) return same(f, d1, d2) end)
+   end
+   both(s, function(d1, d2) return same("bytes", d1, d2, 2) end)
+   for _, wt in ipairs(wiretypes) do
+      for _, t in ipairs { "int32", "uint32", "sint32", "sint64", "bool",
+                           "float", "sfixed32", "double", "string" } do
+         both(s, function(d1, d2) return same("fetch", d1, d2, wt, t) end)
+      end
+   end
+end
+assert(not pcall(decoder.fetch, decoder.new "\8\1", nil, "string"))
+assert(not pcall(decoder.fetch, decoder.new "\11", nil))
+assert(not pcall(decoder.skip, decoder.new "\11", nil))
+assert(not pcall(decoder.fetch, buffer.new(), 0))
+
+-- positions and windows
+local d1, d2 = decoder.new(data), decoder.new(data)
+for _, n in ipairs { 10, -1, -5, -1e9, 0, 3.0 } do same("pos", d1, d2, n) end
+same("pos", d1, d2, nil)
+for _, n in ipairs { 10, 1e9, 0, "x" } do
+   same("len", d1, d2, n)
+   same("finished", d1, d2)
+end
+same("len", d1, d2)
+assert(decoder.new():varint() == nil and decoder.new():finished())
+
+-- the codec runs on them, and they can be switched off
+pb.loadfile "addressbook.pb"
+local person = { name = "Alice", id = 12345, email = ("x"):rep(1000),
+                 phone = { { number = "1301234567" },
+                           { number = "87654321", type = "WORK" } } }
+local function roundtrip()
+   local p = pb.decode(pb.encode(person, "tutorial.Person"),
+                       "tutorial.Person")
+   assert(p.name == "Alice" and p.id == 12345 and #p.email == 1000)
+   assert(p.phone[2].number == "87654321" and p.phone[2].type == "WORK")
+end
+for _ = 1, 200 do roundtrip() end
+pb.option "disable_ffi"
+assert(decoder.fetch == cd.fetch and buffer.add == cb.add)
+roundtrip()
+pb.option "enable_ffi"
+assert(decoder.fetch ~= cd.fetch and buffer.add ~= cb.add)
+
+print "ok"
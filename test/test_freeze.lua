@@ -0,0 +1,59 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+
+pb.loadfile "addressbook.pb"
+
+local alice = { name = "Alice", id = 1, phone = { { number = "1" } } }
+local bob = { name = "Bob", id = 2, email = "bob@example.com" }
+local book = { person = { alice, bob } }
+local plain = pb.encode(book, "tutorial.AddressBook")
+
+-- frozen sub-messages are spliced, the result doesn't change
+assert(pb.freeze(alice, "tutorial.Person") == alice)
+assert(pb.isfrozen(alice) and not pb.isfrozen(bob))
+assert(pb.encode(book, "tutorial.AddressBook") == plain)
+local a = pb.decode(pb.encode(alice, "tutorial.Person"), "tutorial.Person")
+assert(a.name == "Alice" and a.phone[1].number == "1")
+
+-- the cached bytes are used until unfrozen
+alice.name = "Changed"
+assert(pb.encode(book, "tutorial.AddressBook") == plain)
+local task = pb.encode_task(book, "tutorial.AddressBook", 1)
+assert(task:finish(function() end) == plain)
+pb.unfreeze(alice)
+assert(not pb.isfrozen(alice))
+local changed = pb.encode(book, "tutorial.AddressBook")
+assert(changed ~= plain)
+assert(pb.decode(changed, "tutorial.AddressBook").person[1].name == "Changed")
+
+-- a whole frozen message comes back as is
+pb.freeze(book, "tutorial.AddressBook")
+assert(pb.encode(book, "tutorial.AddressBook") == changed)
+pb.unfreeze(book)
+
+-- bytes frozen for another type are not used
+pb.freeze(bob, "tutorial.Person.PhoneNumber")
+assert(pb.encode(book, "tutorial.AddressBook") == changed)
+pb.unfreeze(bob)
+
+-- the encode task splices singular and repeated frozen messages
+pb.freeze(alice, "tutorial.Person")
+alice.id = 99
+task = pb.encode_task(book, "tutorial.AddressBook", 1)
+assert(task:finish(function() end) == changed)
+
+-- the table pool doesn't take frozen tables back
+local t = pb.decode(changed, "tutorial.AddressBook")
+pb.freeze(t.person[1], "tutorial.Person")
+local first = t.person[1]
+pb.release(t, "tutorial.AddressBook")
+assert(first.name == "Changed")
+a = pb.decode(pb.encode(first, "tutorial.Person"), "tutorial.Person")
+assert(a.name == "Changed" and a.id == 1)
+
+-- decode_into() rewrites its table, so it is unfrozen
+pb.decode_into(first, pb.encode(bob, "tutorial.Person"), "tutorial.Person")
+assert(not pb.isfrozen(first) and first.name == "Bob")
+
+print "ok"
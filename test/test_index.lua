@@ -0,0 +1,80 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local buffer = require "pb.buffer"
+
+pb.loadfile "addressbook.pb"
+local book = { person = {} }
+for i = 1, 50 do
+   book.person[i] = {
+      name = "Person "..i, id = i, email = "p"..i.."@example.com",
+      phone = { { number = "555-"..i, type = "WORK" }, { number = "0-"..i } },
+   }
+end
+local data = pb.encode(book, "tutorial.AddressBook")
+
+-- top level only, nested messages decode to tables on demand
+local idx = pb.index(data, "tutorial.AddressBook")
+assert(idx:count "person" == 50)
+local p = idx:get("person", 42)
+assert(p.name == "Person 42" and p.phone[1].type == "WORK")
+assert(idx:get("person", 51) == nil)
+assert(#idx:get "person" == 50)
+assert(idx:get(1, 1).id == 1)
+
+-- nested indexes, fields and packed values inside them
+idx = pb.index(data, "tutorial.AddressBook", 2)
+p = idx:get("person", 7)
+assert(p:get "name" == "Person 7")
+assert(p:get "id" == 7)
+assert(p:get("phone", 1):get "type" == "WORK")
+assert(p:get("phone", 2):get "type" == nil)
+assert(p:get("phone", 2):get "number" == "0-7")
+
+-- packed values split across occurrences, the last singular one wins,
+-- Person.test is shadowed by an extension so tag 5 is used
+local function packed(...)
+   local b = buffer.new()
+   for _, v in ipairs { ... } do b:varint(v) end
+   return b:result()
+end
+local s = buffer.new()
+   :add(1, "string", "first")
+   :add(5, "bytes", packed(1, 2))
+   :add(2, "int32", 1)
+   :add(5, "int32", 3)
+   :add(5, "bytes", packed(4, 5))
+   :add(1, "string", "second")
+   :result()
+idx = pb.index(s, "tutorial.Person")
+assert(idx:get "name" == "second")
+assert(idx:count "name" == 2)
+assert(idx:count(5) == 5)
+for i = 1, 5 do assert(idx:get(5, i) == i) end
+assert(idx:get(5, 6) == nil)
+local test = idx:get(5)
+assert(#test == 5 and test[5] == 5)
+assert(idx:get "email" == nil)
+assert(not pcall(idx.get, idx, "nonexist"))
+
+-- sparse tags are binary searched
+s = buffer.new():add(536870911, "int32", 1):add(10, "int32", 2)
+   :add(1, "string", "x"):result()
+idx = pb.index(s, "tutorial.Person")
+assert(idx:get(10) == 2 and idx:get "name" == "x")
+assert(idx:count(5) == 0 and idx:get(5, 1) == nil)
+
+-- maps come back as tables, the source outlives its string
+pb.loadfile "map.pb"
+idx = pb.index(pb.encode({ labels = { a = "x", b = "y" }, title = "t" },
+                         "maps.Config"), "maps.Config")
+collectgarbage()
+local labels = idx:get "labels"
+assert(labels.a == "x" and labels.b == "y")
+assert(idx:get "title" == "t")
+
+-- broken input
+assert(not pcall(pb.index, "\10\5abc", "tutorial.Person"))
+assert(not pcall(pb.index, "\0", "tutorial.Person"))
+
+print "ok"
@@ -0,0 +1,123 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+pb.loadfile "addressbook.pb"
+local data = pb.encode({
+   name = "Alice \"A\"\n", id = 12345,
+   phone = { { number = "1301234567" },
+             { number = "87654321", type = "WORK" } },
+}, "tutorial.Person")
+local json = pb.tojson(data, "tutorial.Person")
+for _, s in ipairs {
+   '"name":"Alice \\"A\\"\\n"', '"id":12345',
+   '"phone":[{"number":"1301234567"},{', '"number":"87654321"',
+   '"type":"WORK"',
+} do
+   assert(json:find(s, 1, true), json)
+end
+assert(pb.tojson(data, "tutorial.Person", { enum_numbers = true })
+   :find('"type":2', 1, true))
+dfs(pb.decode(data, "tutorial.Person"),
+    pb.decode(pb.fromjson(json, "tutorial.Person"), "tutorial.Person"))
+
+-- names, int64 as strings, bytes as base64, floating point
+local opt = pb.encode({
+   identifier_value = "x", positive_int_value = 1099511627776,
+   negative_int_value = -5, double_value = 0.5,
+   string_value = "\0\1\2\255",
+}, "google.protobuf.UninterpretedOption")
+json = pb.tojson(opt, "google.protobuf.UninterpretedOption")
+for _, s in ipairs {
+   '"identifierValue":"x"', '"positiveIntValue":"1099511627776"',
+   '"negativeIntValue":"-5"', '"doubleValue":0.5', '"stringValue":"AAEC/w=="',
+} do
+   assert(json:find(s, 1, true), json)
+end
+assert(pb.tojson(opt, "google.protobuf.UninterpretedOption",
+   { proto_names = true }):find('"identifier_value":"x"', 1, true))
+local t = pb.decode(pb.fromjson(json, "google.protobuf.UninterpretedOption"),
+   "google.protobuf.UninterpretedOption")
+assert(t.positive_int_value == 1099511627776 and t.negative_int_value == -5)
+assert(t.string_value == "\0\1\2\255" and t.double_value == 0.5)
+
+-- input side accepts both names, numbers for int64, escapes and nulls
+t = pb.decode(pb.fromjson([[ {
+   "identifier_value": "é😀",
+   "positiveIntValue": 42, "negativeIntValue": "-1e3",
+   "doubleValue": "Infinity", "aggregateValue": null,
+   "unknown": { "a": [1, {"b": null}] }
+} ]], "google.protobuf.UninterpretedOption"),
+   "google.protobuf.UninterpretedOption")
+assert(t.identifier_value == "\195\169\240\159\152\128")
+assert(t.positive_int_value == 42 and t.negative_int_value == -1000)
+assert(t.double_value == math.huge and t.aggregate_value == nil)
+
+for _, bad in ipairs {
+   '{"id": 1.5}', '{"id": 4294967296}', '{"id": "x"}', '{"name": 1}',
+   '{"phone": [{"type": "NOPE"}]}', '{"name": "a"', '{} x',
+} do
+   assert(not pcall(pb.fromjson, bad, "tutorial.Person"), bad)
+end
+
+-- range of 64 bit and float values, surrogates must come in pairs
+pb.loadfile "map.pb"
+pb.loadfile "codegen.pb"
+for name, cases in pairs {
+   ["maps.Config"] = { '{"flags":{"true":9.3e18}}', '{"title":"\\ud83d"}',
+                       '{"title":"\\ude00"}', '{"title":"\\ud83d\\u0041"}' },
+   ["codegen.Scalars"] = { '{"fl":1e39}', '{"fl":-1e39}', '{"db":1e999}',
+                           '{"i64":9223372036854775808.0}' },
+} do
+   for _, bad in ipairs(cases) do
+      assert(not pcall(pb.fromjson, bad, name), bad)
+   end
+end
+t = pb.decode(pb.fromjson([[{"flags":{"true":9.2e18,"false":-9.2e18},
+   "title":"\ud83d\ude00"}]], "maps.Config"), "maps.Config")
+assert(t.flags[true] == 9200000000000000000 and t.title == "\240\159\152\128")
+t = pb.decode(pb.fromjson('{"fl":"-Infinity","u64":1.8e19}',
+   "codegen.Scalars"), "codegen.Scalars")
+assert(t.fl == -math.huge)
+
+-- repeated fields split on the wire still make one array
+local buffer = require "pb.buffer"
+local ph1 = pb.encode({ number = "1" }, "tutorial.Person.PhoneNumber")
+local ph2 = pb.encode({ number = "2" }, "tutorial.Person.PhoneNumber")
+data = buffer.new():add(4, "message", ph1):add(1, "string", "Bob")
+   :add(4, "message", ph2):result()
+json = pb.tojson(data, "tutorial.Person")
+assert(json == '{"phone":[{"number":"1"},{"number":"2"}],"name":"Bob"}', json)
+
+-- round trip of a real schema
+local descriptor = pbio.read "descriptor.pb"
+local set = "google.protobuf.FileDescriptorSet"
+json = pb.tojson(descriptor, set)
+dfs(pb.decode(descriptor, set), pb.decode(pb.fromjson(json, set), set))
+
+-- a singular field repeated on the wire is written once, the last value
+-- wins as in pb.decode(); repeated fields gather from anywhere
+local twice = pb.encode({ name = "first", id = 1 }, "tutorial.Person")
+   ..pb.encode({ phone = { { number = "1" } } }, "tutorial.Person")
+   ..pb.encode({ name = "last" }, "tutorial.Person")
+   ..pb.encode({ phone = { { number = "2" } } }, "tutorial.Person")
+json = pb.tojson(twice, "tutorial.Person")
+assert(select(2, json:gsub('"name"', "")) == 1, json)
+assert(json:match '"name":"last"' and json:match '"id":1', json)
+assert(json:match '"phone":%[{"number":"1"},{"number":"2"}%]', json)
+assert(pb.decode(pb.fromjson(json, "tutorial.Person"), "tutorial.Person")
+   .name == pb.decode(twice, "tutorial.Person").name)
+
+print "ok"
@@ -0,0 +1,174 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pio = require "pb.io"
+local buffer = require "pb.buffer"
+local decoder = require "pb.decoder"
+
+pb.loadfile "addressbook.pb"
+
+-- the CRC32C check value
+assert(pio.crc32c "123456789" == 0xE3069283)
+assert(pio.crc32c("56789", pio.crc32c "1234") == 0xE3069283)
+
+local path = os.tmpname()
+local function readall(name)
+   local f = assert(io.open(name, "rb"))
+   local s = f:read "a"
+   f:close()
+   return s
+end
+local function writeall(name, s)
+   local f = assert(io.open(name, "wb"))
+   f:write(s)
+   f:close()
+end
+
+-- keyed records, buffers and records spanning blocks
+local N = 1000
+local w = assert(pio.logwriter(path, { interval = 16 }))
+for i = 1, N do
+   local data = pb.encode({ name = "p"..i, id = i,
+                            email = ("x"):rep(i % 7 == 0 and 40000 or i) },
+                          "tutorial.Person")
+   assert(w:write(data, i*10) == i)
+end
+assert(w:write(buffer.new():add(1, "string", "buf"), N*10) == N+1)
+assert(w:write "" == N+2) -- no key
+assert(w:count() == N+2)
+assert(w:close())
+assert(not pcall(w.write, w, "x"))
+
+local r = assert(pio.logreader(path))
+assert(r:count() == N+2)
+for i = 1, N do
+   local data, n, key = r:read()
+   assert(n == i and key == i*10)
+   local p = pb.decode(data, "tutorial.Person")
+   assert(p.id == i and #p.email == (i % 7 == 0 and 40000 or i))
+end
+local data, n, key = r:read()
+assert(n == N+1 and key == N*10)
+assert(pb.decode(data, "tutorial.Person").name == "buf")
+assert(select(3, r:read()) == nil)
+assert(r:read() == nil)
+
+-- random access, decoded in place
+for _, i in ipairs { 1, 17, 500, 16, 999, 700, 2 } do
+   assert(r:seek(i) == r)
+   assert(r:next() == i)
+   local p = pb.decode(r, "tutorial.Person")
+   assert(p.id == i and p.name == "p"..i)
+end
+assert(r:seek(N+3) == r and r:next() == nil) -- at the end
+assert(r:seek(N+4) == nil)
+assert(r:seekkey(5000) == 500)
+assert(r:seekkey(5001) == 501)
+assert(r:seekkey(0) == 1)
+assert(r:seekkey(N*10) == N)
+assert(r:seekkey(N*10+1) == nil)
+
+-- a decoder walks the records from the current one
+r:seek(998)
+local dec = decoder.new(r)
+for i = 998, N do
+   local size = #pb.encode({ name = "p"..i, id = i,
+                             email = ("x"):rep(i % 7 == 0 and 40000 or i) },
+                           "tutorial.Person")
+   assert(select(2, dec:len()) == size)
+   assert(dec:update())
+end
+assert(dec:varint() == 10 and dec:bytes() == "buf")
+assert(dec:update())
+assert(dec:finished())
+assert(dec:update() == nil)
+r:close()
+
+-- appending later, a reader tailing the log
+w = assert(pio.logwriter(path, { size = 1 })) -- flushes every record
+assert(w:count() == N+2)
+assert(not pcall(w.write, w, "x", 1)) -- keys must not decrease
+r = assert(pio.logreader(path))
+r:seek(N+2)
+assert(r:next() == N+2 and r:next() == nil)
+w:write("tail", N*10+5)
+assert(r:next() == nil)
+assert(r:refresh() == r)
+data, n, key = r:read()
+assert(data == "tail" and n == N+3 and key == N*10+5)
+r:close()
+w:close()
+
+-- decoders on the current record outlive a refresh and close
+local path2 = os.tmpname()
+w = assert(pio.logwriter(path2, { size = 1 }))
+w:write "\10\3cur"
+r = assert(pio.logreader(path2))
+assert(r:next() == 1)
+local cur = decoder.new(r)
+local big = buffer.new():add(2, "string", ("y"):rep(40000)):result()
+for _ = 1, 20 do w:write(big) end
+assert(r:refresh() == r)
+assert(cur:varint() == 10 and cur:bytes() == "cur")
+assert(cur:update())
+r:close()
+assert(cur:varint() == 18 and cur:bytes() == ("y"):rep(40000))
+assert(not pcall(cur.update, cur))
+r = nil
+collectgarbage()
+w:close()
+os.remove(path2)
+os.remove(path2..".idx")
+
+-- a torn write at the end is cut away when reopened
+local full = readall(path)
+writeall(path, full:sub(1, -3))
+r = assert(pio.logreader(path))
+assert(r:count() == N+2)
+r:close()
+w = assert(pio.logwriter(path))
+assert(w:count() == N+2)
+assert(w:write("again", N*10+5) == N+3)
+w:close()
+r = assert(pio.logreader(path))
+r:seek(N+3)
+assert(r:read() == "again")
+assert(r:corrupted() == 0)
+r:close()
+
+-- a damaged block is skipped, the rest is still read
+full = readall(path)
+writeall(path, full:sub(1, 40000)..("\255"):rep(8)..full:sub(40009))
+r = assert(pio.logreader(path))
+local count, last = 0, 0
+while true do
+   data, n, key = r:read()
+   if not data then break end
+   assert(n > last and (key or 0) >= 0)
+   count, last = count + 1, n
+end
+assert(count < N+3 and r:corrupted() > 0)
+local kept = r:count()
+r:close()
+
+-- and reopening for writing keeps the records after it
+w = assert(pio.logwriter(path))
+assert(w:count() == kept and kept > N+2 - 16)
+assert(w:write("after", N*10+6) == kept + 1)
+w:close()
+r = assert(pio.logreader(path))
+assert(r:seekkey(N*10+6) == kept + 1 and r:read() == "after")
+assert(r:corrupted() == 0)
+r:close()
+
+-- garbage alone makes no records
+writeall(path, ("\0"):rep(100))
+os.remove(path..".idx")
+r = assert(pio.logreader(path))
+assert(r:count() == 0 and r:read() == nil)
+r:close()
+assert(pio.logreader(path..".none") == nil)
+
+os.remove(path)
+os.remove(path..".idx")
+print "ok"
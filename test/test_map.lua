@@ -0,0 +1,71 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local buffer = require "pb.buffer"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+pb.loadfile "map.pb"
+local config = {
+   title = "config",
+   labels = { env = "prod", zone = "eu-1", [""] = "empty" },
+   items = { [1] = { name = "one", count = 1 }, [-7] = { name = "neg" } },
+   colors = { a = "RED", b = "GREEN" },
+   flags = { [true] = 1099511627776, [false] = -1 },
+}
+local data = pb.encode(config, "maps.Config")
+local t = pb.decode(data, "maps.Config")
+dfs(config, t)
+
+-- missing key or value in an entry takes the zero value
+local entry = buffer.new():add(2, "string", "v"):result()
+data = buffer.new():add(1, "message", entry):result()
+assert(pb.decode(data, "maps.Config").labels[""] == "v")
+data = buffer.new():add(6, "message", "\10\1a"):result()
+assert(pb.decode(data, "maps.Config").enabled.a == false)
+
+-- deterministic key order
+pb.option "deterministic_maps"
+local l1, l2 = {}, {}
+for i = 1, 100 do l1["k"..i] = tostring(i) end
+for i = 100, 1, -1 do l2["k"..i] = tostring(i) end
+local d1 = pb.encode({ labels = l1 }, "maps.Config")
+assert(pb.encode({ labels = l2 }, "maps.Config") == d1)
+assert(pb.decode(d1, "maps.Config").labels.k42 == "42")
+d1 = pb.encode(config, "maps.Config")
+pb.option "unordered_maps"
+
+-- resumable parser, tasks and the table pool
+local p = pb.parser("maps.Config", #d1)
+for i = 1, #d1 do p:feed(d1:sub(i, i)) end
+dfs(config, p.result)
+dfs(config, pb.decode_task(d1, "maps.Config", 8):finish(function() end))
+assert(pb.decode(pb.encode_task(config, "maps.Config", 2):finish(
+   function() end), "maps.Config").items[1].name == "one")
+local pooled = pb.decode_into({}, d1, "maps.Config")
+pooled = pb.decode_into(pooled, d1, "maps.Config")
+dfs(config, pooled)
+
+-- JSON objects for maps
+local json = pb.tojson(d1, "maps.Config")
+for _, s in ipairs {
+   '"labels":{"":"empty","env":"prod","zone":"eu-1"}',
+   '"items":{"-7":{"name":"neg"},"1":{', '"count":1',
+   '"colors":{"a":"RED","b":"GREEN"}',
+   '"flags":{"false":"-1","true":"1099511627776"}',
+} do
+   assert(json:find(s, 1, true), json)
+end
+dfs(config, pb.decode(pb.fromjson(json, "maps.Config"), "maps.Config"))
+assert(not pcall(pb.fromjson, '{"items":{"x":{}}}', "maps.Config"))
+
+print "ok"
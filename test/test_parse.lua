@@ -0,0 +1,87 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+pb.loadfile "addressbook.pb"
+
+local book = { person = {} }
+for i = 1, 3 do
+   book.person[i] = { name = "P"..i, id = i,
+      phone = { { number = tostring(i) }, { number = "x", type = "WORK" } } }
+end
+local Person = pb.type "tutorial.Person"
+local data = pb.encode(book, "tutorial.AddressBook")
+
+-- count events
+local begins, ends, ids, numbers, types = {}, 0, 0, 0, {}
+pb.parse(data, "tutorial.AddressBook", {
+   begin_message = function(name) begins[#begins+1] = name end,
+   end_message = function(name) ends = ends + 1 end,
+   field = function(name, value)
+      if name == "id" then ids = ids + value
+      elseif name == "number" then numbers = numbers + 1
+      elseif name == "type" then types[#types+1] = value end
+   end,
+})
+assert(begins[1] == "tutorial.AddressBook" and begins[2] == "person")
+assert(#begins == 1 + 3 + 6 and ends == #begins)
+assert(ids == 6 and numbers == 6)
+assert(types[1] == "WORK" and #types == 3)
+
+-- per field handlers and skipping
+local names = {}
+pb.parse(data, "tutorial.AddressBook", {
+   fields = { person = {
+      begin_message = function(name) return #names < 2 end,
+      fields = { name = function(v) names[#names+1] = v end },
+   } },
+})
+assert(#names == 2 and names[2] == "P2")
+
+-- batches for packed fields
+local buff = require "pb.buffer".new()
+local inner = require "pb.buffer".new()
+for i = 1, 1000 do inner:varint(i) end
+buff:tag(5, "bytes"):bytes(inner)
+local sum, calls = 0, 0
+pb.parse(buff, "tutorial.Person", {
+   batch = function(name, values, n)
+      assert(name == "test")
+      calls = calls + 1
+      for i = 1, n do sum = sum + values[i] end
+   end,
+})
+assert(sum == 500500 and calls == 4)
+sum = 0
+pb.parse(buff, Person, { field = function(name, v) sum = sum + v end })
+assert(sum == 500500)
+
+-- descriptor.pb, every field gets delivered
+local count = 0
+pb.parse(pbio.read "descriptor.pb", "google.protobuf.FileDescriptorSet",
+   { field = function() count = count + 1 end })
+assert(count > 100)
+
+-- nesting deeper than the C stack allows is an error, not a crash
+pb.loadfile "codegen.pb"
+local levels, sizes = 50000, { [50001] = 0 }
+local function varint(n)
+   local t = {}
+   repeat
+      local b = n % 128
+      n = (n - b) / 128
+      t[#t+1] = string.char(n > 0 and b + 128 or b)
+   until n == 0
+   return table.concat(t)
+end
+local heads = {}
+for i = levels, 1, -1 do
+   heads[i] = "\74"..varint(sizes[i+1]) -- next = 9, length delimited
+   sizes[i] = #heads[i] + sizes[i+1]
+end
+local ok, err = pcall(pb.parse, table.concat(heads), "codegen.Lists", {})
+assert(not ok and err:match "too deep")
+pb.parse(table.concat(heads, "", levels - 50), "codegen.Lists", {})
+
+print "ok"
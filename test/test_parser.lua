@@ -0,0 +1,69 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+pb.loadfile "addressbook.pb"
+local book = { person = {
+   { name = "Alice", id = 12345, phone = {
+      { number = "1301234567" },
+      { number = "87654321", type = "WORK" } } },
+   { name = "Bob", id = 2, email = "bob@example.com" },
+} }
+local data = pb.encode(book, "tutorial.AddressBook")
+local expected = pb.decode(data, "tutorial.AddressBook")
+
+-- one byte at a time, length known
+local p = pb.parser("tutorial.AddressBook", #data)
+for i = 1, #data do
+   local status, t = p:feed(data:sub(i, i))
+   if i < #data then
+      assert(status == "need_more")
+   else
+      assert(status == "done")
+      dfs(expected, t)
+   end
+end
+
+-- random chunks, end of input marks the end
+local descriptor = pbio.read "descriptor.pb"
+expected = pb.decode(descriptor, "google.protobuf.FileDescriptorSet")
+p = pb.parser "google.protobuf.FileDescriptorSet"
+local i = 1
+while i <= #descriptor do
+   local n = math.random(1, 64)
+   assert(p:feed(descriptor:sub(i, i+n-1)) == "need_more")
+   i = i + n
+end
+local status, t = p:feed()
+assert(status == "done")
+dfs(expected, t)
+
+-- two messages back to back, reusing leftover bytes
+local d1 = pb.encode(book.person[1], "tutorial.Person")
+local d2 = pb.encode(book.person[2], "tutorial.Person")
+p = pb.parser("tutorial.Person", #d1)
+status, t = p:feed(d1..d2:sub(1, 5))
+assert(status == "done" and t.name == "Alice")
+p:reset(nil, #d2)
+assert(p:feed(d2:sub(6, -2)) == "need_more")
+status, t = p:feed(d2:sub(-1))
+assert(status == "done" and t.email == "bob@example.com")
+
+-- truncated input
+p = pb.parser "tutorial.Person"
+p:feed(d1:sub(1, -2))
+assert(not pcall(p.feed, p))
+
+print "ok"
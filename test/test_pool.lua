@@ -0,0 +1,85 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+pb.loadfile "addressbook.pb"
+local d1 = pb.encode({ person = {
+   { name = "Alice", id = 1, phone = { { number = "1" }, { number = "2" } } },
+   { name = "Bob", id = 2, email = "bob@example.com" },
+} }, "tutorial.AddressBook")
+local d2 = pb.encode({ person = {
+   { name = "Carol", id = 3 },
+} }, "tutorial.AddressBook")
+
+-- decode into the same table, nested tables are reused
+local t = pb.decode_into({}, d1, "tutorial.AddressBook")
+dfs(pb.decode(d1, "tutorial.AddressBook"), t)
+local alice, phones = t.person[1], t.person[1].phone
+pb.decode_into(t, d2, "tutorial.AddressBook")
+dfs(pb.decode(d2, "tutorial.AddressBook"), t)
+pb.decode_into(t, d1, "tutorial.AddressBook")
+dfs(pb.decode(d1, "tutorial.AddressBook"), t)
+local reused = {}
+for _, p in ipairs(t.person) do
+   reused[p] = true
+   for _, ph in ipairs(p.phone or {}) do reused[ph] = true end
+   if p.phone then reused[p.phone] = true end
+end
+assert(reused[alice] or reused[phones])
+
+-- release to the pool and get it back without the type
+pb.release(t)
+local t2 = pb.decode_into(nil, d2, "tutorial.AddressBook")
+assert(t2 == t)
+dfs(pb.decode(d2, "tutorial.AddressBook"), t2)
+pb.release(t2)
+
+-- a failed decode_into() leaves nothing behind: later decodes by other
+-- paths don't draw tables from the pool
+pb.cleartables()
+local p = pb.decode_into(nil, pb.encode({ name = "A", phone = {
+   { number = "1" } } }, "tutorial.Person"), "tutorial.Person")
+local arr = p.phone
+pb.release(p)
+assert(not pcall(pb.decode_into, {}, "\34", "tutorial.Person"))
+local q = pb.decode_task(d1, "tutorial.AddressBook"):finish(function() end)
+assert(q.person[1].phone ~= arr)
+p = pb.decode_into(nil, d1, "tutorial.AddressBook")
+assert(p.person[1].phone == arr) -- still pooled
+
+-- steady state loop allocates little
+local descriptor = pbio.read "descriptor.pb"
+local set = pb.decode(descriptor, "google.protobuf.FileDescriptorSet")
+collectgarbage "collect"
+collectgarbage "stop"
+local msg
+for i = 1, 3 do
+   msg = pb.decode_into(msg, descriptor, "google.protobuf.FileDescriptorSet")
+end
+local before = collectgarbage "count"
+for i = 1, 10 do
+   msg = pb.decode_into(msg, descriptor, "google.protobuf.FileDescriptorSet")
+end
+local pooled = collectgarbage "count" - before
+before = collectgarbage "count"
+for i = 1, 10 do
+   pb.decode(descriptor, "google.protobuf.FileDescriptorSet")
+end
+local plain = collectgarbage "count" - before
+collectgarbage "restart"
+dfs(set, msg)
+assert(pooled * 4 < plain, pooled.." "..plain)
+
+print "ok"
@@ -0,0 +1,83 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+local buffer = require "pb.buffer"
+local decoder = require "pb.decoder"
+
+pb.loadfile "addressbook.pb"
+local tmp = os.tmpname()
+local function dump(s)
+   local f = assert(io.open(tmp, "wb"))
+   f:write(s)
+   f:close()
+end
+
+-- a log of length delimited messages, one big enough to spill
+local b = buffer.new()
+local n = 500
+for i = 1, n do
+   local email = i == 250 and ("x"):rep(100000) or "p"..i.."@example.com"
+   b:bytes(pb.encode({ name = "Person "..i, id = i, email = email },
+                     "tutorial.Person"))
+end
+local data = b:result()
+dump(data)
+
+local function replay(rd)
+   local dec = decoder.new(rd)
+   local got = {}
+   repeat
+      for s in function() return dec:bytes() end do
+         got[#got+1] = pb.decode(s, "tutorial.Person")
+      end
+   until not dec:update()
+   assert(dec:finished())
+   return got
+end
+
+for _, size in ipairs { 7, 100, 4096, 1048576 } do
+   local got = replay(assert(pbio.reader(tmp, { size = size, buffers = 2 })))
+   assert(#got == n, #got)
+   for i = 1, n do assert(got[i].id == i and got[i].name == "Person "..i) end
+   assert(#got[250].email == 100000)
+end
+
+-- file handles, and close() ends the input early
+local f = assert(io.open(tmp, "rb"))
+local rd = assert(pbio.reader(f, { size = 64 }))
+local dec = decoder.new(rd)
+assert(dec:bytes())
+rd:close()
+while dec:bytes() do end
+assert(dec:update() == nil)
+f:close()
+
+-- empty input and errors
+dump ""
+dec = decoder.new(pbio.reader(tmp))
+assert(dec:finished() and dec:update() == nil)
+assert(pbio.reader("/nonexistent/file") == nil)
+assert(not pcall(pbio.reader, tmp, { buffers = 1 }))
+assert(not pcall(pbio.reader, 0.5))
+
+-- a numeric string is a path, not a file descriptor
+dump "\3abc"
+os.rename(tmp, "0")
+dec = decoder.new(pbio.reader "0")
+assert(dec:bytes() == "abc")
+os.remove "0"
+
+-- close() does not hang on a read that would block forever
+local res = os.execute("mkfifo "..tmp..".fifo 2>/dev/null")
+if res == true or res == 0 then
+   f = assert(io.open(tmp..".fifo", "r+b")) -- no writer can end it
+   rd = assert(pbio.reader(f))
+   rd:close()
+   assert(decoder.new(rd):finished())
+   f:close()
+   os.remove(tmp..".fifo")
+end
+
+os.remove(tmp)
+print "ok"
@@ -0,0 +1,131 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+local buffer = require "pb.buffer"
+local shared = require "pb.shared"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+local addressbook = assert(pbio.read "addressbook.pb")
+assert(pb.share("addressbook", addressbook))
+assert(pb.share "addressbook") -- attached already
+assert(rawget(pb.type(), "tutorial") == nil) -- nothing copied yet
+
+-- pb.decode() and pb.encode() run on the shared schema in C
+local phone = { number = "123", type = "WORK" }
+dfs(phone, pb.decode(pb.encode(phone, "tutorial.Person.PhoneNumber"),
+   "tutorial.Person.PhoneNumber"))
+local book = { person = {
+   { name = "Alice", id = 1, phone = { phone, { number = "456" } } },
+   { name = "Bob", id = 2, email = "bob@example.com", test = 7 },
+} }
+local data = pb.encode(book, "tutorial.AddressBook")
+local t = pb.decode(data, "tutorial.AddressBook")
+assert(t.person[1].phone[2].type == "HOME")
+assert(t.person[2].email == "bob@example.com")
+assert(t.person[2].test == 7) -- the extension, named like field 5
+local packed = buffer.new():varint(1, 300):result()
+packed = buffer.new():tag(2, "varint"):varint(1):tag(5, "bytes")
+   :bytes(packed):tag(5, "varint"):varint(-1):result()
+local person = pb.decode(packed, "tutorial.Person")
+dfs({ id = 1, test = { 1, 300, -1 } }, person)
+assert(pb.decode(pb.encode({ number = "1", type = 7 },
+   ".tutorial.Person.PhoneNumber"), "tutorial.Person.PhoneNumber").type == 7)
+pb.option "no_default_values"
+assert(pb.decode("", "tutorial.Person.PhoneNumber").type == nil)
+pb.option "use_default_values"
+assert(not pcall(pb.decode, data:sub(1, -2), "tutorial.AddressBook"))
+assert(not pcall(pb.encode, { type = "FAX" }, "tutorial.Person.PhoneNumber"))
+assert(not pcall(pb.encode, { id = "x" }, "tutorial.Person"))
+assert(rawget(pb.type(), "tutorial") == nil) -- still nothing copied
+
+-- with options the C codec has not (or other functions than decode and
+-- encode) types are copied, nested type first, its parent later
+pb.option "deterministic_maps"
+dfs(phone, pb.decode(pb.encode(phone, "tutorial.Person.PhoneNumber"),
+   "tutorial.Person.PhoneNumber"))
+assert(rawget(pb.type(), "tutorial") ~= nil)
+assert(pb.encode(book, "tutorial.AddressBook") == data)
+dfs(t, pb.decode(data, "tutorial.AddressBook"))
+dfs(person, pb.decode(packed, "tutorial.Person"))
+pb.option "unordered_maps"
+
+-- same type tables as pb.load() makes, extensions included
+person = pb.type "tutorial.Person"
+local enum = pb.type "tutorial.Person.PhoneType"
+assert(person[10].name == "test" and person.map.test == 10)
+pb.cleartypes()
+pb.unshare "addressbook"
+pb.load(addressbook)
+for tag = 1, 10 do
+   local f1, f2 = person[tag], pb.type "tutorial.Person"[tag]
+   assert((f1 == nil) == (f2 == nil))
+   if f1 then
+      for _, k in ipairs { "name", "repeated", "scalar", "default_value" } do
+         assert(f1[k] == f2[k], k)
+      end
+      assert(not f1.packed == not f2.packed)
+      if f1.scalar then
+         assert(f1.type_name == f2.type_name)
+      else
+         dfs(f1.type_name, f2.type_name)
+      end
+   end
+end
+dfs(person.map, pb.type "tutorial.Person".map)
+assert(enum[2] == "WORK" and enum.map.HOME == 1)
+
+-- maps, entries without key or value get zero values
+pb.cleartypes()
+assert(pb.share("maps", assert(pbio.read "map.pb")))
+local config = { labels = { a = "b" }, items = { [3] = { name = "x" } },
+   colors = { c = "GREEN" }, flags = { [true] = 5 } }
+dfs(config, pb.decode(pb.encode(config, "maps.Config"), "maps.Config"))
+local function entry(tag, s) return buffer.new():tag(tag, "bytes"):bytes(s) end
+data = buffer.new(entry(2, "\8\7"), entry(3, ""), entry(1, "\18\1v"),
+   entry(4, "\16\1"), entry(6, "\10\1a")):result()
+t = pb.decode(data, "maps.Config")
+dfs({ items = { [7] = {} }, colors = { [""] = "RED" }, labels = { [""] = "v" },
+      flags = { [false] = 1 }, enabled = { a = false } }, t)
+assert(rawget(pb.type(), "maps") == nil)
+pb.option "deterministic_maps"
+dfs(t, pb.decode(data, "maps.Config"))
+pb.option "unordered_maps"
+assert(pb.type "maps.Config.LabelsEntry".map_entry)
+
+-- nesting is limited
+local sh = assert(shared.open("descriptor", assert(pbio.read "descriptor.pb")))
+local deep, msg = "", {}
+for _ = 1, 200 do deep = buffer.new():tag(3, "bytes"):bytes(deep):result() end
+assert(sh:decode("", ".google.protobuf.DescriptorProto"))
+assert(not pcall(sh.decode, sh, deep, "google.protobuf.DescriptorProto"))
+msg.nested_type = { msg }
+assert(not pcall(sh.encode, sh, msg, "google.protobuf.DescriptorProto"))
+assert(sh:decode("", "google.protobuf.Nothing") == nil)
+sh:close()
+
+-- handles are reference counted, the last close frees the schema
+local h = assert(shared.open "maps")
+assert(tostring(h):match "maps")
+assert(h:load(".maps.Item")["maps.Item"].type == "message")
+assert(h:load "maps.Nothing" == nil)
+pb.unshare "maps"
+assert(shared.open "maps") -- h still holds it
+h:close()
+collectgarbage()
+assert(shared.open "maps" == nil)
+assert(not pb.share "maps")
+assert(not pb.share("bad", "\10\5\1"))
+assert(not pcall(pb.type, "maps.Config.Nothing"))
+
+print "ok"
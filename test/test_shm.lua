@@ -0,0 +1,96 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local shm = require "pb.shm"
+local buffer = require "pb.buffer"
+local decoder = require "pb.decoder"
+
+pb.loadfile "addressbook.pb"
+local N = 2000
+
+-- producer process: test_shm.lua produce <name> <id>
+if arg[1] == "produce" then
+   local ring = assert(shm.open(arg[2]))
+   local id = tonumber(arg[3])
+   for i = 1, N do
+      ring:write(pb.encode({ name = ("p%d"):format(id), id = i,
+                             email = ("x"):rep(i % 300) }, "tutorial.Person"))
+   end
+   ring:close()
+   return
+end
+
+local name = ("/pb_test_%d_%s"):format(os.time(), tostring{}:match "%x+$")
+local ring, err = shm.create(name, 4096) -- small, so it wraps and fills up
+if not ring and err:match "not supported" then
+   print "shared memory rings not supported, skipped"
+   print "ok"
+   return
+end
+assert(ring, err)
+assert(shm.create(name) == nil) -- already exists
+assert(tostring(ring):match "4096 bytes")
+
+-- same process: timeout, strings and buffers, the decoder source
+assert(select(2, ring:next(0.01)) == "timeout")
+ring:write("\8\1", buffer.new():add(2, "string", "x"))
+assert(ring:read() == "\8\1\18\1x")
+assert(not pcall(ring.write, ring, ("x"):rep(4096)))
+assert(select(2, ring:timedwrite(0.01, ("x"):rep(4050), "y")) == "timeout")
+ring:write "\10\1a"
+ring:write "\10\1b"
+assert(ring:next() == 3)
+local dec = decoder.new(ring) -- reads the current message
+assert(dec:varint() == 10 and dec:bytes() == "a")
+assert(dec:update())
+assert(dec:varint() == 10 and dec:bytes() == "b")
+
+-- a second consumer is refused
+local other = assert(shm.open(name))
+assert(not pcall(other.next, other, 0))
+other:close()
+
+-- two producer processes, decoded in place
+for id = 1, 2 do
+   os.execute(("%s test_shm.lua produce %s %d &")
+      :format(arg[-1] or "lua", name, id))
+end
+local last = { p1 = 0, p2 = 0 }
+for _ = 1, 2*N do
+   assert(ring:next(10))
+   local p = pb.decode(ring, "tutorial.Person")
+   assert(p.id == last[p.name] + 1, p.name)
+   assert(#p.email == p.id % 300)
+   last[p.name] = p.id
+end
+assert(last.p1 == N and last.p2 == N)
+
+-- after shutdown, writes fail and reads end once drained
+ring:write "last"
+ring:shutdown()
+assert(select(2, ring:write "more") == "closed")
+assert(ring:read() == "last")
+assert(select(2, ring:next()) == "closed")
+assert(dec:update() == nil)
+
+ring:close()
+assert(not pcall(ring.read, ring))
+assert(tostring(ring) == "pb.Shm: closed")
+
+-- a decoder keeps the ring mapped after close, later reads fail
+local ring2 = assert(shm.create(name.."_2", 4096))
+assert(shm.unlink(name.."_2"))
+ring2:write "\10\1c"
+assert(ring2:next() == 3)
+local dec2 = decoder.new(ring2)
+ring2:close()
+assert(dec2:varint() == 10 and dec2:bytes() == "c")
+assert(not pcall(dec2.update, dec2))
+assert(not pcall(decoder.new, ring2))
+ring2 = nil
+collectgarbage()
+assert(dec2:finished())
+assert(shm.unlink(name))
+assert(shm.open(name) == nil)
+
+print "ok"
@@ -0,0 +1,41 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbstats = require "pb.stats"
+
+pb.loadfile "addressbook.pb"
+
+local person = { name = "Alice", id = 12345,
+   phone = { { number = "1301234567" } } }
+
+-- disabled: nothing recorded
+pb.decode(pb.encode(person, "tutorial.Person"), "tutorial.Person")
+assert(next((pb.stats())) == nil)
+
+assert(pb.stats_enable(true))
+for i = 1, 10 do
+   local code = pb.encode(person, "tutorial.Person")
+   pb.decode(code, pb.type "tutorial.Person")
+end
+local st, counters = pb.stats()
+local s = assert(st["tutorial.Person"])
+assert(s.decode_calls == 10 and s.encode_calls == 10)
+assert(s.decode_bytes == s.encode_bytes and s.decode_bytes > 0)
+assert(s.decode_alloc > 0 and s.decode_time >= 0)
+if pbstats.compiled then
+   assert(counters.decoder_source >= 10)
+end
+
+pb.stats_reset()
+assert(next((pb.stats())) == nil)
+assert(pb.stats_enable(false) == false)
+pb.decode(pb.encode(person, "tutorial.Person"), "tutorial.Person")
+assert(next((pb.stats())) == nil)
+if pbstats.compiled then -- counters belong to the state, gone now
+   assert(select(2, pb.stats()).decoder_source == 0)
+end
+
+-- keep enabled on exit, lua_close() must restore the allocator
+pb.stats_enable(true)
+
+print "ok"
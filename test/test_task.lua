@@ -0,0 +1,99 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+
+local function dfs(t1, t2)
+   for k, v in pairs(t1) do
+      if type(v) == "table" then
+         dfs(v, t2[k])
+      else
+         assert(v == t2[k], tostring(k))
+      end
+   end
+   for k in pairs(t2) do assert(t1[k] ~= nil, k) end
+end
+
+pb.loadfile "addressbook.pb"
+local book = { person = {} }
+for i = 1, 200 do
+   book.person[i] = { name = "Person "..i, id = i, phone = {
+      { number = "1301234567" },
+      { number = "87654321", type = "WORK" } } }
+end
+local data = pb.encode(book, "tutorial.AddressBook")
+local expected = pb.decode(data, "tutorial.AddressBook")
+
+-- small steps decode
+local task = pb.decode_task(data, "tutorial.AddressBook", 100)
+local steps = 0
+while true do
+   local status, t = task:step()
+   steps = steps + 1
+   if status == "done" then dfs(expected, t) break end
+   assert(status == "suspended")
+end
+assert(steps > #data / 200)
+
+-- small steps encode gives the same bytes
+task = pb.encode_task(book, "tutorial.AddressBook", 7)
+steps = 0
+while true do
+   local status, s = task:step()
+   steps = steps + 1
+   if status == "done" then assert(s == data) break end
+end
+assert(steps > 100)
+
+-- finish() yields between steps inside a coroutine
+local descriptor = pbio.read "descriptor.pb"
+local set = pb.decode(descriptor, "google.protobuf.FileDescriptorSet")
+local co = coroutine.wrap(function()
+   local t = pb.decode_task(descriptor,
+      "google.protobuf.FileDescriptorSet", 256):finish()
+   return "done", pb.encode_task(t, "google.protobuf.FileDescriptorSet", 64):finish()
+end)
+local yields = 0
+while true do
+   local status, s = co()
+   if status == "done" then
+      assert(s == pb.encode(set, "google.protobuf.FileDescriptorSet"))
+      break
+   end
+   yields = yields + 1
+end
+assert(yields > 10)
+
+-- maps, long repeated fields and long strings are split over steps
+pb.loadfile "codegen.pb"
+pb.option "deterministic_maps"
+local function encode_steps(t, ptype, step)
+   local task, steps = pb.encode_task(t, ptype, step), 0
+   while true do
+      local status, s = task:step()
+      steps = steps + 1
+      if status == "done" then
+         assert(s == pb.encode(t, ptype))
+         return steps
+      end
+   end
+end
+local lists = { packed = {}, unpacked = {}, levels = {}, byname = {} }
+for i = 1, 2000 do
+   lists.packed[i], lists.unpacked[i] = i, -i
+   lists.levels[i] = i % 2 == 0 and "HIGH" or "LOW"
+   lists.byname["k"..i] = { i32 = i }
+end
+assert(encode_steps(lists, "codegen.Lists", 10) >= 4 * 2000 / 10)
+assert(encode_steps({ byname = lists.byname }, "codegen.Lists", 10) >= 200)
+local long = { s = ("x"):rep(1024 * 1024), i32 = 1 }
+assert(encode_steps(long, "codegen.Scalars", 16) >= 1024 / 16)
+assert(pb.decode(pb.encode_task(long, "codegen.Scalars", 16):finish(
+   function() end), "codegen.Scalars").s == long.s)
+pb.option "unordered_maps"
+
+-- truncated input
+task = pb.decode_task(data:sub(1, -2), "tutorial.AddressBook")
+assert(not pcall(task.finish, task, function() end))
+
+print "ok"
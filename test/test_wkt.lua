@@ -0,0 +1,122 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+
+pb.loadfile "wkt.pb"
+
+local detail = pb.encode({ name = "x", code = 3 }, "wkt.Detail")
+local generic = {
+   at = { seconds = 1500000000, nanos = 500000000 },
+   took = { seconds = -1, nanos = -500000000 },
+   count = { value = 42 }, label = { value = "hi" }, flag = {},
+   ratio = { value = 0.5 },
+   detail = { type_url = "type.googleapis.com/wkt.Detail", value = detail },
+   times = { { seconds = 1 }, { nanos = 1 } },
+   timeouts = { a = { seconds = 2 } },
+}
+local data = pb.encode(generic, "wkt.Event")
+
+-- off by default, the generic tables
+local t = pb.decode(data, "wkt.Event")
+assert(t.at.seconds == 1500000000 and t.count.value == 42)
+
+pb.option "enable_well_known_types"
+
+local function time(v, seconds, nanos)
+   return v == seconds * 1000000000 + nanos
+end
+
+local function check(e)
+   assert(time(e.at, 1500000000, 500000000))
+   assert(time(e.took, -1, -500000000))
+   assert(e.count == 42 and e.label == "hi" and e.flag == false)
+   assert(e.ratio == 0.5)
+   assert(time(e.times[1], 1, 0) and time(e.times[2], 0, 1))
+   assert(time(e.timeouts.a, 2, 0))
+   assert(e.detail.type_url == "type.googleapis.com/wkt.Detail")
+   assert(rawget(e.detail, "message") == nil) -- not decoded yet
+   assert(e.detail.message.name == "x" and e.detail.message.code == 3)
+end
+
+check(pb.decode(data, "wkt.Event"))
+local p = pb.parser "wkt.Event"
+for i = 1, #data do p:feed(data:sub(i, i)) end
+check(select(2, p:feed()))
+
+-- plain values encode to the same fields
+local e = {
+   at = 1500000000500000000, took = -1500000000, count = 42, label = "hi",
+   flag = false, ratio = 0.5, times = { 1000000000, 1 },
+   timeouts = { a = 2000000000 },
+   detail = { type_url = "type.googleapis.com/wkt.Detail",
+              message = { name = "x", code = 3 } },
+}
+check(pb.decode(pb.encode(e, "wkt.Event"), "wkt.Event"))
+local task = pb.encode_task(e, "wkt.Event", 1)
+check(pb.decode(task:finish(function() end), "wkt.Event"))
+local plain = pb.encode(e, "wkt.Event")
+pb.option "disable_well_known_types"
+t = pb.decode(plain, "wkt.Event")
+assert(t.at.seconds == 1500000000 and t.at.nanos == 500000000)
+assert(t.took.seconds == -1 and t.took.nanos == -500000000)
+assert((t.times[2].seconds or 0) == 0 and t.times[2].nanos == 1)
+assert(t.flag and not t.flag.value)
+assert(pb.decode(t.detail.value, "wkt.Detail").code == 3)
+pb.option "enable_well_known_types"
+
+-- decoded times keep every nanosecond and round trip exactly, with
+-- 64 bit integers
+if math.type then
+   e = pb.decode(pb.encode({ at = { seconds = 1700000000, nanos = 123456789 },
+      took = { seconds = -2, nanos = -1 } }, "wkt.Event"), "wkt.Event")
+   assert(e.at == 1700000000123456789 and e.took == -2000000001)
+   assert(math.type(e.at) == "integer")
+   e = pb.decode(pb.encode(e, "wkt.Event"), "wkt.Event")
+   assert(e.at == 1700000000123456789 and e.took == -2000000001)
+   local s = pb.encode(e, "wkt.Event")
+   pb.option "disable_well_known_types"
+   t = pb.decode(s, "wkt.Event")
+   assert(t.at.seconds == 1700000000 and t.at.nanos == 123456789)
+   assert(t.took.seconds == -2 and t.took.nanos == -1)
+   pb.option "enable_well_known_types"
+end
+
+-- fractions of nanoseconds round to valid nanos, with carries
+local function raw(v, name)
+   local s = pb.encode({ [name] = v }, "wkt.Event")
+   pb.option "disable_well_known_types"
+   local d = pb.decode(s, "wkt.Event")
+   pb.option "enable_well_known_types"
+   return (d[name].seconds or 0), (d[name].nanos or 0)
+end
+local sec, nsec = raw(-999999999.9, "took")
+assert(sec == -1 and nsec == 0)
+sec, nsec = raw(-1999999999.6, "took")
+assert(sec == -2 and nsec == 0)
+sec, nsec = raw(-1000000000.4, "took")
+assert(sec == -1 and nsec == 0)
+sec, nsec = raw(-1500000000, "took")
+assert(sec == -1 and nsec == -500000000)
+sec, nsec = raw(2999999999.7, "at")
+assert(sec == 3 and nsec == 0)
+sec, nsec = raw(-1, "at")
+assert(sec == -1 and nsec == 999999999)
+
+-- an Any not read is written back as it came
+local any = pb.decode(data, "wkt.Event").detail
+assert(pb.decode(pb.encode({ detail = any }, "wkt.Event"), "wkt.Event")
+   .detail.value == detail)
+any.message.code = 4
+any = pb.decode(pb.encode({ detail = any }, "wkt.Event"), "wkt.Event").detail
+assert(any.message.code == 4)
+any = pb.decode(pb.encode({ detail = { type_url = "x/no.Such",
+   value = "" } }, "wkt.Event"), "wkt.Event").detail
+assert(not pcall(function() return any.message end))
+
+-- tables are still accepted
+t = pb.decode(pb.encode({ at = { seconds = 3 }, count = { value = 1 } },
+   "wkt.Event"), "wkt.Event")
+assert(time(t.at, 3, 0) and t.count == 1)
+
+pb.option "disable_well_known_types"
+print "ok"
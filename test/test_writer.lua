@@ -0,0 +1,64 @@
+package.path = "../?.lua;"..package.path
+package.cpath = "../?.dll;../?.so;"..package.cpath
+local pb = require "pb"
+local pbio = require "pb.io"
+local buffer = require "pb.buffer"
+
+local tmp = os.tmpname()
+
+-- small buffers so the writer thread really rotates them
+local w = assert(pbio.writer(tmp, { size = 100, buffers = 2 }))
+local expected = {}
+for i = 1, 1000 do
+   local s = ("record %d;"):format(i)
+   expected[#expected+1] = s
+   assert(w:write(s) == w)
+end
+local big = buffer.chunked(64)
+for i = 1, 50 do big:bytes(("chunk %d;"):format(i)) end
+expected[#expected+1] = big:result()
+assert(w:write(big, "", ("x"):rep(1000)))
+expected[#expected+1] = ("x"):rep(1000)
+assert(w:flush() == w)
+assert(pbio.read(tmp) == table.concat(expected))
+assert(w:write "tail")
+assert(w:close() == true)
+assert(pbio.read(tmp) == table.concat(expected).."tail")
+assert(not pcall(w.write, w, "closed"))
+
+-- file handles and fsync
+local f = assert(io.open(tmp, "wb"))
+f:write "head;"
+w = assert(pbio.writer(f, { fsync = true }))
+assert(w:write("body;"):flush())
+assert(w:close())
+f:write "end"
+f:close()
+assert(pbio.read(tmp) == "head;body;end")
+w = assert(pbio.writer(tmp, { fsync = 16 }))
+for i = 1, 10 do w:write "0123456789" end
+assert(w:close())
+assert(pbio.read(tmp) == ("0123456789"):rep(10))
+
+-- errors come back from flush()/close()
+f = assert(io.open(tmp, "rb"))
+w = assert(pbio.writer(f))
+w:write "can not write"
+local ok, err = w:flush()
+assert(ok == nil and type(err) == "string")
+assert(w:close() == nil)
+f:close()
+assert(pbio.writer("/nonexistent/dir/file") == nil)
+assert(not pcall(pbio.writer, 1.5))
+
+-- a numeric string is a path, not a file descriptor
+w = assert(pbio.writer "1")
+assert(w:write "to a file named 1":close())
+assert(pbio.read "1" == "to a file named 1")
+assert(pbio.writev("1", "again") == 5)
+assert(pbio.read "1" == "again")
+os.remove "1"
+assert(not pcall(pbio.writer, tmp, { buffers = 1 }))
+
+os.remove(tmp)
+print "ok"
@@ -0,0 +1,62 @@
+
+
+google/protobuf/timestamp.protogoogle.protobuf";
+	Timestamp
+seconds (Rseconds
+nanos (RnanosB
+com.google.protobufBTimestampProtoPZ2google.golang.org/protobuf/types/known/timestamppbGPBGoogle.Protobuf.WellKnownTypesbproto3
+
+google/protobuf/duration.protogoogle.protobuf":
+Duration
+seconds (Rseconds
+nanos (RnanosB
+com.google.protobufBDurationProtoPZ1google.golang.org/protobuf/types/known/durationpbGPBGoogle.Protobuf.WellKnownTypesbproto3
+
+google/protobuf/wrappers.protogoogle.protobuf"#
+DoubleValue
+value (Rvalue""
+
+FloatValue
+value (Rvalue""
+
+Int64Value
+value (Rvalue"#
+UInt64Value
+value (Rvalue""
+
+Int32Value
+value (Rvalue"#
+UInt32Value
+value (Rvalue"!
+	BoolValue
+value (Rvalue"#
+StringValue
+value (	Rvalue""
+
+BytesValue
+value (RvalueB
+com.google.protobufBWrappersProtoPZ1google.golang.org/protobuf/types/known/wrapperspbGPBGoogle.Protobuf.WellKnownTypesbproto3
+
+google/protobuf/any.protogoogle.protobuf"6
+Any
+type_url (	RtypeUrl
+value (RvalueBv
+com.google.protobufBAnyProtoPZ,google.golang.org/protobuf/types/known/anypbGPBGoogle.Protobuf.WellKnownTypesbproto3
+
+	wkt.protowktgoogle/protobuf/timestamp.protogoogle/protobuf/duration.protogoogle/protobuf/wrappers.protogoogle/protobuf/any.proto"
+Event*
+at (2.google.protobuf.TimestampRat-
+took (2.google.protobuf.DurationRtook1
+count (2.google.protobuf.Int64ValueRcount2
+label (2.google.protobuf.StringValueRlabel.
+flag (2.google.protobuf.BoolValueRflag2
+ratio (2.google.protobuf.DoubleValueRratio,
+detail (2.google.protobuf.AnyRdetail0
+times (2.google.protobuf.TimestampRtimes4
+timeouts	 (2.wkt.Event.TimeoutsEntryRtimeoutsV
+TimeoutsEntry
+key (	Rkey/
+value (2.google.protobuf.DurationRvalue:8"0
+Detail
+name (	Rname
+code (Rcodebproto3
\ No newline at end of file